@@ -11,6 +11,7 @@ BuildRequires:  pkgconfig(Qt5Gui)
 BuildRequires:  pkgconfig(Qt5DBus)
 BuildRequires:  pkgconfig(Qt5Sql)
 BuildRequires:  pkgconfig(Qt5Network)
+BuildRequires:  pkgconfig(Qt5Concurrent)
 BuildRequires:  pkgconfig(Qt5Contacts)
 BuildRequires:  pkgconfig(Qt5Versit)
 BuildRequires:  pkgconfig(mlite5)
@@ -51,6 +52,12 @@ This package contains unit tests for the CardDAV Buteo sync plugin.
 /opt/tests/buteo/plugins/carddav/cdavtool
 /opt/tests/buteo/plugins/carddav/tests.xml
 /opt/tests/buteo/plugins/carddav/tst_replyparser
+/opt/tests/buteo/plugins/carddav/tst_serverprofiler
+/opt/tests/buteo/plugins/carddav/tst_stallmonitor
+/opt/tests/buteo/plugins/carddav/tst_statebenchmark
+/opt/tests/buteo/plugins/carddav/tst_syncer
+/opt/tests/buteo/plugins/carddav/tst_syncmetrics
+/opt/tests/buteo/plugins/carddav/tst_unsupportedproperties
 /opt/tests/buteo/plugins/carddav/data/replyparser_userprincipal_empty.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_userprincipal_single-well-formed.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_addressbookhome_empty.xml
@@ -60,6 +67,7 @@ This package contains unit tests for the CardDAV Buteo sync plugin.
 /opt/tests/buteo/plugins/carddav/data/replyparser_addressbookinformation_addressbook-plus-contact.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_addressbookinformation_addressbook-calendar-principal.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_addressbookinformation_addressbook-principal-proxy.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_addressbookinformation_bulk-requests.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_empty.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_single-well-formed-add-mod-rem.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_single-well-formed-addition.xml
@@ -78,6 +86,13 @@ This package contains unit tests for the CardDAV Buteo sync plugin.
 /opt/tests/buteo/plugins/carddav/data/replyparser_contactdata_single-contact-multiple-rev.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_contactdata_single-contact-multiple-uid.xml
 /opt/tests/buteo/plugins/carddav/data/replyparser_contactdata_single-contact-multiple-xgender.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_bulkupsync_mixed-results.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_bulkupsync_no-hrefs.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_getcontentlength.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_contactdata_single-escaped.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_doctype.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_mixed-propstats.xml
+/opt/tests/buteo/plugins/carddav/data/replyparser_synctokendelta_mixed-propstats-doctype.xml
 
 %prep
 %setup -q -n %{name}-%{version}
@@ -24,12 +24,17 @@
 #include "syncer_p.h"
 
 #include <LogMacros.h>
+#include <SyncProfile.h>
 
 #include <QRegularExpression>
 #include <QUuid>
 #include <QByteArray>
 #include <QBuffer>
 #include <QTimer>
+#include <QCryptographicHash>
+#include <QUrl>
+
+#include <algorithm>
 
 #include <QContact>
 #include <QContactGuid>
@@ -75,6 +80,51 @@ namespace {
             LOG_DEBUG(dbgout);
         }
     }
+
+    const int HTTP_FORBIDDEN = 403;
+    // HTTP 408 Request Timeout is also reported for requests
+    // which we abort because the server stopped responding.
+    const int HTTP_REQUEST_TIMEOUT = 408;
+    const int HTTP_CONFLICT = 409;
+    const int HTTP_PRECONDITION_FAILED = 412;
+
+    // default watchdog timeouts, in seconds.
+    const int DEFAULT_REQUEST_TIMEOUT = 60;
+    const int DEFAULT_DISCOVERY_TIMEOUT = 120;
+    const int DEFAULT_METADATA_TIMEOUT = 300;
+    const int DEFAULT_FETCH_TIMEOUT = 900;
+    const int DEFAULT_UPSYNC_TIMEOUT = 900;
+    const int DEFAULT_SYNC_TIMEOUT = 1800;
+    const int DEFAULT_REQUEST_RETRIES = 2;
+
+    // a contact which is re-downloaded as modified after being upsynced
+    // this many syncs in a row is quarantined from upsync for some days.
+    const int DEFAULT_UPSYNC_LOOP_THRESHOLD = 3;
+    const int DEFAULT_UPSYNC_QUARANTINE_DAYS = 7;
+
+    // whether to use the CalendarServer bulk-requests extension if the server supports it.
+    const int DEFAULT_BULK_REQUESTS = 1;
+
+    // contacts requested per multiget (zero to request all of them at once), and
+    // multigets in flight per addressbook.  See cdavtool --profile-server.
+    const int DEFAULT_MULTIGET_PAGE_SIZE = 0;
+    const int DEFAULT_MULTIGET_CONCURRENCY = 1;
+
+    int profileValue(Buteo::SyncProfile *profile, const QString &key, int defaultValue)
+    {
+        if (!profile) {
+            return defaultValue;
+        }
+        bool ok = false;
+        int value = profile->key(key).toInt(&ok);
+        return (ok && value >= 0) ? value : defaultValue;
+    }
+
+    // the uri of a contact named in a bulk response, which may be absolute.
+    QString bulkResultHref(const QString &href)
+    {
+        return href.startsWith(QStringLiteral("http"), Qt::CaseInsensitive) ? QUrl(href).path() : href;
+    }
 }
 
 CardDavVCardConverter::CardDavVCardConverter()
@@ -100,10 +150,10 @@ QStringList CardDavVCardConverter::supportedPropertyNames()
     return supportedProperties;
 }
 
-QPair<QContact, QStringList> CardDavVCardConverter::convertVCardToContact(const QString &vcard, bool *ok)
+QPair<QContact, QStringList> CardDavVCardConverter::convertVCardToContact(const QByteArray &vcard, bool *ok)
 {
     m_unsupportedProperties.clear();
-    QVersitReader reader(vcard.toUtf8());
+    QVersitReader reader(vcard);
     reader.startReading();
     reader.waitForFinished();
     QList<QVersitDocument> vdocs = reader.results();
@@ -309,6 +359,116 @@ void CardDavVCardConverter::documentProcessed(const QVersitDocument &, QContact
     m_tempUnsupportedProperties.clear();
 }
 
+namespace {
+    bool propertyNameLessThan(const QVersitProperty &a, const QVersitProperty &b)
+    {
+        return a.name() < b.name();
+    }
+
+    // returns the index of the colon separating the name and parameters
+    // of a vCard property line from its value, skipping quoted parameter values.
+    int propertyValueSeparator(const QByteArray &line)
+    {
+        bool quoted = false;
+        for (int i = 0; i < line.size(); ++i) {
+            if (line.at(i) == '"') {
+                quoted = !quoted;
+            } else if (line.at(i) == ':' && !quoted) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // property names are ASCII, but the rest of the line may not be.
+    QByteArray asciiToUpper(const QByteArray &name)
+    {
+        QByteArray upper(name);
+        for (int i = 0; i < upper.size(); ++i) {
+            if (upper.at(i) >= 'a' && upper.at(i) <= 'z') {
+                upper[i] = upper.at(i) - 'a' + 'A';
+            }
+        }
+        return upper;
+    }
+
+    // appends the canonical form of an unfolded content line.
+    void appendCanonicalLine(const QByteArray &line, QList<QByteArray> *lines)
+    {
+        const int separator = propertyValueSeparator(line);
+        if (separator < 0) {
+            lines->append(line);
+            return;
+        }
+        QList<QByteArray> nameAndParams = line.left(separator).split(';');
+        const QByteArray name = asciiToUpper(nameAndParams.takeFirst());
+        if (name == "REV") {
+            return;
+        }
+        std::sort(nameAndParams.begin(), nameAndParams.end());
+        nameAndParams.prepend(name);
+        QByteArray canonical;
+        Q_FOREACH (const QByteArray &part, nameAndParams) {
+            if (!canonical.isEmpty()) {
+                canonical.append(';');
+            }
+            canonical.append(part);
+        }
+        lines->append(canonical + line.mid(separator));
+    }
+}
+
+QByteArray CardDavVCardConverter::vCardHash(const QString &vcard)
+{
+    return vCardHash(vcard.toUtf8());
+}
+
+QByteArray CardDavVCardConverter::vCardHash(const QByteArray &vcard)
+{
+    // Hash a canonical form of the vCard, so that the hash does not depend
+    // on line folding, or on the order of properties and parameters, which
+    // QVersitWriter does not preserve.  REV is ignored as it is updated by
+    // every local modification, even of details which are not exported.
+    // The UTF-8 bytes are used directly, as downloaded vCards are never
+    // transcoded (see ReplyParser::parseContactData()).
+    QList<QByteArray> lines;
+    QByteArray line;
+    const char *data = vcard.constData();
+    const int size = vcard.size();
+    int i = 0;
+    while (i < size) {
+        const char c = data[i];
+        if (c == '\n' || (c == '\r' && i + 1 < size && data[i + 1] == '\n')) {
+            const int next = (c == '\n') ? i + 1 : i + 2;
+            if (next < size && (data[next] == ' ' || data[next] == '\t')) {
+                i = next + 1; // unfold
+                continue;
+            }
+            if (!line.isEmpty()) {
+                appendCanonicalLine(line, &lines);
+                line.clear();
+            }
+            i = next;
+            continue;
+        }
+        line.append(c);
+        ++i;
+    }
+    if (!line.isEmpty()) {
+        appendCanonicalLine(line, &lines);
+    }
+
+    std::sort(lines.begin(), lines.end());
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (int j = 0; j < lines.size(); ++j) {
+        if (j > 0) {
+            hash.addData("\r\n", 2);
+        }
+        hash.addData(lines.at(j));
+    }
+    return hash.result();
+}
+
 void CardDavVCardConverter::contactProcessed(const QContact &c, QVersitDocument *d)
 {
     // FN is a required field in vCard 3.0 and 4.0.  Add it if it does not exist.
@@ -352,6 +512,12 @@ void CardDavVCardConverter::contactProcessed(const QContact &c, QVersitDocument
             d->addProperty(nProp);
         }
     }
+
+    // export the properties in a canonical order, so that the same contact
+    // always produces the same vCard.
+    QList<QVersitProperty> properties = d->properties();
+    std::stable_sort(properties.begin(), properties.end(), propertyNameLessThan);
+    d->setProperties(properties);
 }
 
 void CardDavVCardConverter::detailProcessed(const QContact &, const QContactDetail &,
@@ -388,9 +554,30 @@ CardDav::CardDav(Syncer *parent,
     , m_discoveryStage(CardDav::DiscoveryStarted)
     , m_addressbooksListOnly(false)
     , m_triedAddressbookPathAsHomeSetUrl(false)
+    , m_remoteAdditionsCount(0)
+    , m_remoteModificationsCount(0)
+    , m_unchangedDownloadsCount(0)
     , m_downsyncRequests(0)
     , m_upsyncRequests(0)
+    , m_phase(CardDav::PhaseIdle)
+    , m_requestTimeout(0)
+    , m_maxRequestRetries(0)
+    , m_phaseDeadlineExpired(false)
+    , m_syncDeadlinePassed(false)
+    , m_upsyncLoopThreshold(DEFAULT_UPSYNC_LOOP_THRESHOLD)
+    , m_upsyncQuarantineDays(DEFAULT_UPSYNC_QUARANTINE_DAYS)
+    , m_bulkRequestsEnabled(DEFAULT_BULK_REQUESTS)
+    , m_multigetPageSize(DEFAULT_MULTIGET_PAGE_SIZE)
+    , m_multigetConcurrency(DEFAULT_MULTIGET_CONCURRENCY)
+    , m_toRemoteOnly(false)
+    , m_estimateOnly(false)
+    , m_estimatedAddressbooks(0)
+    , m_estimatedChangedAddressbooks(0)
+    , m_estimatedRemovals(0)
+    , m_estimatedDownloadBytes(0)
+    , m_estimatedUnknownSizes(0)
 {
+    initialize();
 }
 
 CardDav::CardDav(Syncer *parent,
@@ -406,23 +593,250 @@ CardDav::CardDav(Syncer *parent,
     , m_addressbookPath(addressbookPath)
     , m_discoveryStage(CardDav::DiscoveryStarted)
     , m_addressbooksListOnly(false)
+    , m_triedAddressbookPathAsHomeSetUrl(false)
+    , m_remoteAdditionsCount(0)
+    , m_remoteModificationsCount(0)
+    , m_unchangedDownloadsCount(0)
     , m_downsyncRequests(0)
     , m_upsyncRequests(0)
+    , m_phase(CardDav::PhaseIdle)
+    , m_requestTimeout(0)
+    , m_maxRequestRetries(0)
+    , m_phaseDeadlineExpired(false)
+    , m_syncDeadlinePassed(false)
+    , m_upsyncLoopThreshold(DEFAULT_UPSYNC_LOOP_THRESHOLD)
+    , m_upsyncQuarantineDays(DEFAULT_UPSYNC_QUARANTINE_DAYS)
+    , m_bulkRequestsEnabled(DEFAULT_BULK_REQUESTS)
+    , m_multigetPageSize(DEFAULT_MULTIGET_PAGE_SIZE)
+    , m_multigetConcurrency(DEFAULT_MULTIGET_CONCURRENCY)
+    , m_toRemoteOnly(false)
+    , m_estimateOnly(false)
+    , m_estimatedAddressbooks(0)
+    , m_estimatedChangedAddressbooks(0)
+    , m_estimatedRemovals(0)
+    , m_estimatedDownloadBytes(0)
+    , m_estimatedUnknownSizes(0)
 {
+    initialize();
 }
 
 CardDav::~CardDav()
 {
+    qDeleteAll(m_strategies);
     delete m_converter;
     delete m_parser;
     delete m_request;
 }
 
+void CardDav::initialize()
+{
+    // The watchdog timeouts may be configured via sync profile keys, in seconds.
+    // A request is aborted if no data is transferred within the request timeout,
+    // and the sync fails if any phase takes longer than its deadline, or if the
+    // sync as a whole takes longer than the sync deadline.
+    Buteo::SyncProfile *profile = q->m_syncProfile;
+    m_requestTimeout = profileValue(profile, QStringLiteral("request_timeout"), DEFAULT_REQUEST_TIMEOUT) * 1000;
+    m_maxRequestRetries = profileValue(profile, QStringLiteral("request_retries"), DEFAULT_REQUEST_RETRIES);
+    m_phaseTimeouts.insert(CardDav::PhaseDiscovery, profileValue(profile, QStringLiteral("discovery_timeout"), DEFAULT_DISCOVERY_TIMEOUT) * 1000);
+    m_phaseTimeouts.insert(CardDav::PhaseMetadata, profileValue(profile, QStringLiteral("metadata_timeout"), DEFAULT_METADATA_TIMEOUT) * 1000);
+    m_phaseTimeouts.insert(CardDav::PhaseFetch, profileValue(profile, QStringLiteral("fetch_timeout"), DEFAULT_FETCH_TIMEOUT) * 1000);
+    m_phaseTimeouts.insert(CardDav::PhaseUpsync, profileValue(profile, QStringLiteral("upsync_timeout"), DEFAULT_UPSYNC_TIMEOUT) * 1000);
+    const int syncTimeout = profileValue(profile, QStringLiteral("sync_timeout"), DEFAULT_SYNC_TIMEOUT) * 1000;
+
+    // A threshold of zero disables upsync loop detection.
+    m_upsyncLoopThreshold = profileValue(profile, QStringLiteral("upsync_loop_threshold"), DEFAULT_UPSYNC_LOOP_THRESHOLD);
+    m_upsyncQuarantineDays = profileValue(profile, QStringLiteral("upsync_quarantine_days"), DEFAULT_UPSYNC_QUARANTINE_DAYS);
+    m_bulkRequestsEnabled = profileValue(profile, QStringLiteral("bulk_requests"), DEFAULT_BULK_REQUESTS) != 0;
+    m_multigetPageSize = profileValue(profile, QStringLiteral("multiget_page_size"), DEFAULT_MULTIGET_PAGE_SIZE);
+    m_multigetConcurrency = qMax(1, profileValue(profile, QStringLiteral("multiget_concurrency"), DEFAULT_MULTIGET_CONCURRENCY));
+    m_toRemoteOnly = q->toRemoteOnly();
+
+    m_strategies = SyncStrategy::createStrategies(this, q);
+
+    m_phaseTimer.setSingleShot(true);
+    connect(&m_phaseTimer, SIGNAL(timeout()), this, SLOT(phaseDeadlineExpired()));
+
+    // each phase restarts the phase timer, so the sync deadline runs from the
+    // start of the sync, to bound the total time taken by all of the phases.
+    m_syncTimer.setSingleShot(true);
+    connect(&m_syncTimer, SIGNAL(timeout()), this, SLOT(syncDeadlineExpired()));
+    if (syncTimeout > 0) {
+        m_syncTimer.start(syncTimeout);
+    }
+}
+
 void CardDav::errorOccurred(int httpError)
 {
     emit error(httpError);
 }
 
+void CardDav::enterPhase(CardDav::SyncPhase phase)
+{
+    // phases only ever advance, as addressbooks may be in different
+    // phases at the same time.  The deadline applies to the latest.
+    if (phase != CardDav::PhaseIdle && phase <= m_phase) {
+        return;
+    }
+
+    m_phase = phase;
+    m_phaseTimer.stop();
+    if (phase != CardDav::PhaseIdle && m_syncDeadlinePassed) {
+        // once the requests of this phase have been sent, so that they are aborted too.
+        QTimer::singleShot(0, this, SLOT(syncDeadlineExpired()));
+    }
+    switch (phase) {
+        case CardDav::PhaseDiscovery: q->setPhase(QStringLiteral("discovery")); break;
+        case CardDav::PhaseMetadata:  q->setPhase(QStringLiteral("metadata")); break;
+        case CardDav::PhaseFetch:     q->setPhase(QStringLiteral("fetch")); break;
+        case CardDav::PhaseUpsync:    q->setPhase(QStringLiteral("upsync")); break;
+        default: break; // the Syncer sets its own phases between ours.
+    }
+    const int timeout = m_phaseTimeouts.value(phase);
+    if (timeout > 0) {
+        m_phaseTimer.start(timeout);
+    }
+}
+
+void CardDav::phaseDeadlineExpired()
+{
+    LOG_WARNING(Q_FUNC_INFO << "sync phase" << m_phase << "exceeded its deadline of"
+               << m_phaseTimeouts.value(m_phase) << "ms, aborting"
+               << m_activeReplies.size() << "outstanding requests");
+    abortSync();
+}
+
+void CardDav::syncDeadlineExpired()
+{
+    if (m_phaseDeadlineExpired) {
+        return;
+    }
+    if (m_phase == CardDav::PhaseIdle) {
+        // the Syncer is storing changes, which is not aborted.  The
+        // sync fails when it next needs the server, if it does.
+        LOG_DEBUG(Q_FUNC_INFO << "sync deadline passed between sync phases");
+        m_syncDeadlinePassed = true;
+        return;
+    }
+
+    LOG_WARNING(Q_FUNC_INFO << "sync exceeded its deadline of" << m_syncTimer.interval()
+               << "ms in phase" << m_phase << ", aborting"
+               << m_activeReplies.size() << "outstanding requests");
+    abortSync();
+}
+
+void CardDav::abortSync()
+{
+    m_phaseDeadlineExpired = true;
+    m_phaseTimer.stop();
+    m_syncTimer.stop();
+
+    // abort any outstanding requests, without processing their responses.
+    QSet<QNetworkReply*> replies = m_activeReplies;
+    m_activeReplies.clear();
+    q->m_metrics.add(SyncMetrics::RequestsInFlight, -replies.size());
+    Q_FOREACH (QNetworkReply *reply, replies) {
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+    }
+
+    errorOccurred(HTTP_REQUEST_TIMEOUT);
+}
+
+void CardDav::watchReply(QNetworkReply *reply)
+{
+    m_activeReplies.insert(reply);
+    connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+    connect(reply, SIGNAL(downloadProgress(qint64,qint64)), this, SLOT(replyDownloadProgress(qint64)));
+    q->m_metrics.add(SyncMetrics::RequestsInFlight);
+    q->m_metrics.add(SyncMetrics::RequestsSent);
+    q->m_metrics.add(SyncMetrics::BytesSent, reply->property("requestData").toByteArray().size());
+
+    if (m_requestTimeout <= 0) {
+        return;
+    }
+
+    // abort the request if the server stops sending (or receiving) data.
+    QTimer *inactivityTimer = new QTimer(reply);
+    inactivityTimer->setSingleShot(true);
+    inactivityTimer->setInterval(m_requestTimeout);
+    connect(inactivityTimer, SIGNAL(timeout()), this, SLOT(requestInactivityTimeout()));
+    connect(reply, SIGNAL(downloadProgress(qint64,qint64)), inactivityTimer, SLOT(start()));
+    connect(reply, SIGNAL(uploadProgress(qint64,qint64)), inactivityTimer, SLOT(start()));
+    connect(reply, SIGNAL(finished()), inactivityTimer, SLOT(stop()));
+    inactivityTimer->start();
+}
+
+void CardDav::replyFinished()
+{
+    if (m_activeReplies.remove(qobject_cast<QNetworkReply*>(sender()))) {
+        q->m_metrics.add(SyncMetrics::RequestsInFlight, -1);
+    }
+}
+
+void CardDav::replyDownloadProgress(qint64 bytesReceived)
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    q->m_metrics.add(SyncMetrics::BytesReceived, bytesReceived - reply->property("bytesReceived").toLongLong());
+    reply->setProperty("bytesReceived", bytesReceived);
+}
+
+// the phase of each addressbook is reported by the live sync metrics.
+void CardDav::setAddressbookPhase(const QString &addressbookUrl, const QString &phase)
+{
+    m_addressbookPhases.insert(addressbookUrl, phase);
+    q->publishMetrics();
+}
+
+void CardDav::requestInactivityTimeout()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender()->parent());
+    if (!reply || !reply->isRunning()) {
+        return;
+    }
+
+    LOG_WARNING(Q_FUNC_INFO << "no activity for" << m_requestTimeout << "ms on request to" << reply->url().path() << ", aborting");
+    reply->setProperty("timedOut", true);
+    reply->abort(); // emits finished(), so the response handler will deal with it.
+}
+
+bool CardDav::retryTimedOutRequest(QNetworkReply *reply, const char *responseSlot)
+{
+    if (!reply->property("timedOut").toBool() || m_phaseDeadlineExpired) {
+        return false;
+    }
+
+    const int attempts = reply->property("attempts").toInt();
+    if (attempts >= m_maxRequestRetries) {
+        LOG_WARNING(Q_FUNC_INFO << "request to" << reply->url().path() << "timed out, no retries remaining");
+        return false;
+    }
+
+    QNetworkReply *retry = m_request->resend(reply);
+    if (!retry) {
+        return false;
+    }
+
+    LOG_DEBUG(Q_FUNC_INFO << "retrying timed out request to" << reply->url().path() << "attempt:" << (attempts + 1));
+    Q_FOREACH (const QByteArray &propertyName, reply->dynamicPropertyNames()) {
+        if (propertyName != "timedOut" && propertyName != "requestData" && propertyName != "bytesReceived") {
+            retry->setProperty(propertyName.constData(), reply->property(propertyName.constData()));
+        }
+    }
+    retry->setProperty("attempts", attempts + 1);
+    connect(retry, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
+    connect(retry, SIGNAL(finished()), this, responseSlot);
+    watchReply(retry);
+    return true;
+}
+
+int CardDav::httpErrorCode(QNetworkReply *reply) const
+{
+    if (reply->property("timedOut").toBool()) {
+        return HTTP_REQUEST_TIMEOUT;
+    }
+    return reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+}
+
 void CardDav::determineAddressbooksList()
 {
     m_addressbooksListOnly = true;
@@ -431,6 +845,7 @@ void CardDav::determineAddressbooksList()
 
 void CardDav::determineRemoteAMR()
 {
+    enterPhase(CardDav::PhaseDiscovery);
     if (m_addressbookPath.isEmpty()) {
         // The CardDAV sequence for determining the A/M/R delta is:
         // a)  fetch user information from the principal URL
@@ -449,6 +864,30 @@ void CardDav::determineRemoteAMR()
     }
 }
 
+void CardDav::estimateRemoteChanges()
+{
+    m_estimateOnly = true;
+    m_estimatedAddressbooks = 0;
+    m_estimatedChangedAddressbooks = 0;
+    m_estimatedRemovals = 0;
+    m_estimatedDownloadBytes = 0;
+    m_estimatedUnknownSizes = 0;
+    m_remoteAdditionsCount = 0;
+    m_remoteModificationsCount = 0;
+    determineRemoteAMR();
+}
+
+void CardDav::remoteEstimate(SyncCostEstimate *estimate) const
+{
+    estimate->addressbooks = m_estimatedAddressbooks;
+    estimate->changedAddressbooks = m_estimatedChangedAddressbooks;
+    estimate->remoteAdditions = m_remoteAdditionsCount;
+    estimate->remoteModifications = m_remoteModificationsCount;
+    estimate->remoteRemovals = m_estimatedRemovals;
+    estimate->downloadBytes = m_estimatedDownloadBytes;
+    estimate->unknownSizeResources = m_estimatedUnknownSizes;
+}
+
 void CardDav::fetchUserInformation()
 {
     LOG_DEBUG(Q_FUNC_INFO << "requesting principal urls for user");
@@ -494,6 +933,7 @@ void CardDav::fetchUserInformation()
 
     connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
     connect(reply, SIGNAL(finished()), this, SLOT(userInformationResponse()));
+    watchReply(reply);
 }
 
 void CardDav::sslErrorsOccurred(const QList<QSslError> &errors)
@@ -513,7 +953,10 @@ void CardDav::userInformationResponse()
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (retryTimedOutRequest(reply, SLOT(userInformationResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error() << "(" << httpError << ") to request" << m_serverUrl);
         debugDumpData(QString::fromUtf8(data));
         QUrl oldServerUrl(m_serverUrl);
@@ -606,6 +1049,7 @@ void CardDav::fetchAddressbookUrls(const QString &userPath)
 
     connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
     connect(reply, SIGNAL(finished()), this, SLOT(addressbookUrlsResponse()));
+    watchReply(reply);
 }
 
 void CardDav::addressbookUrlsResponse()
@@ -613,7 +1057,10 @@ void CardDav::addressbookUrlsResponse()
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (retryTimedOutRequest(reply, SLOT(addressbookUrlsResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
                    << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
@@ -635,14 +1082,15 @@ void CardDav::fetchAddressbooksInformation(const QString &addressbooksHomePath)
 {
     LOG_DEBUG(Q_FUNC_INFO << "requesting addressbook sync information");
     QNetworkReply *reply = m_request->addressbooksInformation(m_serverUrl, addressbooksHomePath);
-    reply->setProperty("addressbooksHomePath", addressbooksHomePath);
     if (!reply) {
         emit error();
         return;
     }
 
+    reply->setProperty("addressbooksHomePath", addressbooksHomePath);
     connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
     connect(reply, SIGNAL(finished()), this, SLOT(addressbooksInformationResponse()));
+    watchReply(reply);
 }
 
 void CardDav::addressbooksInformationResponse()
@@ -651,7 +1099,10 @@ void CardDav::addressbooksInformationResponse()
     QString addressbooksHomePath = reply->property("addressbooksHomePath").toString();
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (retryTimedOutRequest(reply, SLOT(addressbooksInformationResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
                    << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
@@ -687,6 +1138,7 @@ void CardDav::addressbooksInformationResponse()
                 paths.append(it->url);
             }
         }
+        enterPhase(CardDav::PhaseIdle);
         emit addressbooksList(paths);
     } else {
         downsyncAddressbookContent(infos);
@@ -695,7 +1147,18 @@ void CardDav::addressbooksInformationResponse()
 
 void CardDav::downsyncAddressbookContent(const QList<ReplyParser::AddressBookInformation> &infos)
 {
-    // for addressbooks which support sync-token syncing, use that style.
+    m_estimatedAddressbooks += infos.size();
+
+    // the state of addressbooks which have been removed from the server is no longer needed.
+    // No addressbooks are reported while the given path is retried as the home set url.
+    if (!infos.isEmpty()) {
+        QSet<QString> addressbookUrls;
+        Q_FOREACH (const ReplyParser::AddressBookInformation &info, infos) {
+            addressbookUrls.insert(info.url);
+        }
+        q->forgetRemovedAddressbooks(addressbookUrls);
+    }
+
     for (int i = 0; i < infos.size(); ++i) {
         // set a default addressbook if we haven't seen one yet.
         // we will store newly added local contacts to that addressbook.
@@ -703,59 +1166,18 @@ void CardDav::downsyncAddressbookContent(const QList<ReplyParser::AddressBookInf
             q->m_defaultAddressbook = infos[i].url;
         }
 
-        if (infos[i].syncToken.isEmpty() && infos[i].ctag.isEmpty()) {
-            // we cannot use either sync-token or ctag for this addressbook.
-            // we need to manually calculate the complete delta.
-            LOG_DEBUG("No sync-token or ctag given for addressbook:" << infos[i].url << ", manual delta detection required");
-            q->m_addressbookCtags[infos[i].url] = infos[i].ctag; // ctag is empty :. we will use manual detection.
-            fetchContactMetadata(infos[i].url);
-        } else if (infos[i].syncToken.isEmpty()) {
-            // we cannot use sync-token for this addressbook, but instead ctag.
-            const QString existingCtag(q->m_addressbookCtags[infos[i].url]); // from OOB
-            if (existingCtag.isEmpty()) {
-                // first time sync
-                q->m_addressbookCtags[infos[i].url] = infos[i].ctag; // insert
-                // now do etag request, the delta will be all remote additions
-                fetchContactMetadata(infos[i].url);
-            } else if (existingCtag != infos[i].ctag) {
-                // changes have occurred since last sync
-                q->m_addressbookCtags[infos[i].url] = infos[i].ctag; // update
-                // perform etag request and then manually calculate deltas.
-                fetchContactMetadata(infos[i].url);
-            } else {
-                // no changes have occurred in this addressbook since last sync
-                LOG_DEBUG(Q_FUNC_INFO << "no changes since last sync for"
-                         << infos[i].url << "from account" << q->m_accountId);
-                m_downsyncRequests += 1;
-                QTimer::singleShot(0, this, SLOT(downsyncComplete()));
-            }
-        } else {
-            // the server supports webdav-sync for this addressbook.
-            const QString existingSyncToken(q->m_addressbookSyncTokens[infos[i].url]); // from OOB
-            // store the ctag anyway just in case the server has
-            // forgotten the syncToken we cached from last time.
-            if (!infos[i].ctag.isEmpty()) {
-                q->m_addressbookCtags[infos[i].url] = infos[i].ctag;
-            }
-            // attempt to perform synctoken sync
-            if (existingSyncToken.isEmpty()) {
-                // first time sync
-                q->m_addressbookSyncTokens[infos[i].url] = infos[i].syncToken; // insert
-                // perform slow sync / full report
-                fetchContactMetadata(infos[i].url);
-            } else if (existingSyncToken != infos[i].syncToken) {
-                // changes have occurred since last sync.
-                q->m_addressbookSyncTokens[infos[i].url] = infos[i].syncToken; // update
-                // perform immediate delta sync, by passing the old sync token to the server.
-                fetchImmediateDelta(infos[i].url, existingSyncToken);
-            } else {
-                // no changes have occurred in this addressbook since last sync
-                LOG_DEBUG(Q_FUNC_INFO << "no changes since last sync for"
-                         << infos[i].url << "from account" << q->m_accountId);
-                m_downsyncRequests += 1;
-                QTimer::singleShot(0, this, SLOT(downsyncComplete()));
-            }
+        // remember whether we can upsync to this addressbook with bulk requests.
+        if (m_bulkRequestsEnabled && infos[i].bulkMaxResources > 0) {
+            LOG_DEBUG(Q_FUNC_INFO << "addressbook" << infos[i].url << "supports bulk requests of up to"
+                     << infos[i].bulkMaxResources << "resources and" << infos[i].bulkMaxBytes << "bytes");
+            m_bulkRequestLimits.insert(infos[i].url, qMakePair(infos[i].bulkMaxResources, infos[i].bulkMaxBytes));
         }
+
+        // pick the way of determining the remote changes, based on what
+        // the server supports and how well each way has fared previously.
+        SyncStrategy *strategy = SyncStrategy::select(m_strategies, infos[i], &q->m_strategyStatistics[infos[i].url]);
+        LOG_DEBUG(Q_FUNC_INFO << "using" << strategy->name() << "strategy for addressbook" << infos[i].url);
+        strategy->start(infos[i]);
     }
 }
 
@@ -764,7 +1186,14 @@ void CardDav::fetchImmediateDelta(const QString &addressbookUrl, const QString &
     LOG_DEBUG(Q_FUNC_INFO
              << "requesting immediate delta for addressbook" << addressbookUrl
              << "with sync token" << syncToken);
+    setAddressbookPhase(addressbookUrl, QStringLiteral("delta"));
+
+    if (!q->ensureShardLoaded(addressbookUrl)) {
+        emit error();
+        return;
+    }
 
+    enterPhase(CardDav::PhaseMetadata);
     QNetworkReply *reply = m_request->syncTokenDelta(m_serverUrl, addressbookUrl, syncToken);
     if (!reply) {
         emit error();
@@ -775,6 +1204,7 @@ void CardDav::fetchImmediateDelta(const QString &addressbookUrl, const QString &
     reply->setProperty("addressbookUrl", addressbookUrl);
     connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
     connect(reply, SIGNAL(finished()), this, SLOT(immediateDeltaResponse()));
+    watchReply(reply);
 }
 
 void CardDav::immediateDeltaResponse()
@@ -783,15 +1213,26 @@ void CardDav::immediateDeltaResponse()
     QString addressbookUrl = reply->property("addressbookUrl").toString();
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
+        if (retryTimedOutRequest(reply, SLOT(immediateDeltaResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
-                   << "(" << reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() << ")");
+                   << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
+        if (httpError == HTTP_REQUEST_TIMEOUT) {
+            // the server has stalled, a full report would fare no better.
+            errorOccurred(httpError);
+            return;
+        }
         // The server is allowed to forget the syncToken by the
         // carddav protocol.  Try a full report sync just in case.
-        fetchContactMetadata(addressbookUrl);
+        recordStrategyOutcome(addressbookUrl, SyncStrategy::SyncCollection, false);
+        fallBackToContactMetadata(addressbookUrl);
         return;
     }
 
+    recordStrategyOutcome(addressbookUrl, SyncStrategy::SyncCollection, true);
     QString newSyncToken;
     QList<ReplyParser::ContactInformation> infos = m_parser->parseSyncTokenDelta(data, &newSyncToken);
     q->m_addressbookSyncTokens[addressbookUrl] = newSyncToken;
@@ -801,6 +1242,12 @@ void CardDav::immediateDeltaResponse()
 void CardDav::fetchContactMetadata(const QString &addressbookUrl)
 {
     LOG_DEBUG(Q_FUNC_INFO << "requesting contact metadata for addressbook" << addressbookUrl);
+    setAddressbookPhase(addressbookUrl, QStringLiteral("metadata"));
+    if (!q->ensureShardLoaded(addressbookUrl)) {
+        emit error();
+        return;
+    }
+    enterPhase(CardDav::PhaseMetadata);
     QNetworkReply *reply = m_request->contactEtags(m_serverUrl, addressbookUrl);
     if (!reply) {
         emit error();
@@ -811,6 +1258,16 @@ void CardDav::fetchContactMetadata(const QString &addressbookUrl)
     reply->setProperty("addressbookUrl", addressbookUrl);
     connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
     connect(reply, SIGNAL(finished()), this, SLOT(contactMetadataResponse()));
+    watchReply(reply);
+}
+
+// the request which failed has already counted the addressbook in
+// m_downsyncRequests, and fetchContactMetadata() counts it again, so
+// it is uncounted first.  Otherwise the count never reaches zero.
+void CardDav::fallBackToContactMetadata(const QString &addressbookUrl)
+{
+    m_downsyncRequests -= 1;
+    fetchContactMetadata(addressbookUrl);
 }
 
 void CardDav::contactMetadataResponse()
@@ -819,7 +1276,10 @@ void CardDav::contactMetadataResponse()
     QString addressbookUrl = reply->property("addressbookUrl").toString();
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (retryTimedOutRequest(reply, SLOT(contactMetadataResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
                    << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
@@ -831,8 +1291,142 @@ void CardDav::contactMetadataResponse()
     fetchContacts(addressbookUrl, infos);
 }
 
+void CardDav::fetchAllContacts(const QString &addressbookUrl)
+{
+    LOG_DEBUG(Q_FUNC_INFO << "requesting all contacts from addressbook" << addressbookUrl);
+    setAddressbookPhase(addressbookUrl, QStringLiteral("query"));
+    if (!q->ensureShardLoaded(addressbookUrl)) {
+        emit error();
+        return;
+    }
+    enterPhase(CardDav::PhaseFetch);
+    QNetworkReply *reply = m_request->addressbookQuery(m_serverUrl, addressbookUrl);
+    if (!reply) {
+        emit error();
+        return;
+    }
+
+    m_downsyncRequests += 1; // when this reaches zero, we've finished all addressbook deltas
+    reply->setProperty("addressbookUrl", addressbookUrl);
+    connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
+    connect(reply, SIGNAL(finished()), this, SLOT(allContactsResponse()));
+    watchReply(reply);
+}
+
+void CardDav::allContactsResponse()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    QString addressbookUrl = reply->property("addressbookUrl").toString();
+    QByteArray data = reply->readAll();
+    bool truncated = false;
+    if (reply->error() != QNetworkReply::NoError) {
+        if (retryTimedOutRequest(reply, SLOT(allContactsResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
+        LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
+                   << "(" << httpError << ")");
+        debugDumpData(QString::fromUtf8(data));
+        if (httpError == HTTP_REQUEST_TIMEOUT) {
+            // the server has stalled, an etag listing would fare no better.
+            errorOccurred(httpError);
+            return;
+        }
+    } else {
+        // the server may limit the number of results (RFC 6352 section 8.6.1),
+        // in which case the status of the addressbook itself is 507.
+        const QList<ReplyParser::ResourceInformation> resources = ReplyParser::parseMultistatus(data);
+        Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
+            if (resource.status.contains(QStringLiteral(" 507 "))) {
+                LOG_WARNING(Q_FUNC_INFO << "server truncated the contacts of addressbook" << addressbookUrl);
+                truncated = true;
+                break;
+            }
+        }
+    }
+
+    if (reply->error() != QNetworkReply::NoError || truncated) {
+        // fall back to listing the etags and fetching the contacts in batches.
+        recordStrategyOutcome(addressbookUrl, SyncStrategy::AddressbookQuery, false);
+        fallBackToContactMetadata(addressbookUrl);
+        return;
+    }
+
+    recordStrategyOutcome(addressbookUrl, SyncStrategy::AddressbookQuery, true);
+
+    // every contact is an addition, as we have no state for this addressbook.
+    QMap<QString, ReplyParser::FullContactInformation> addMods = m_parser->parseContactData(data, addressbookUrl);
+    for (QMap<QString, ReplyParser::FullContactInformation>::const_iterator it = addMods.constBegin();
+            it != addMods.constEnd(); ++it) {
+        ReplyParser::ContactInformation info;
+        info.modType = ReplyParser::ContactInformation::Addition;
+        info.uri = it.key();
+        info.etag = it.value().etag;
+        q->m_serverAdditionIndices[addressbookUrl].insert(info.uri, q->m_serverAdditions[addressbookUrl].size());
+        q->m_serverAdditions[addressbookUrl].append(info);
+    }
+    LOG_DEBUG(Q_FUNC_INFO << "fetched" << addMods.size() << "contacts from addressbook" << addressbookUrl);
+
+    storeContactData(addressbookUrl, &addMods);
+    contactAddModsComplete(addressbookUrl);
+}
+
 void CardDav::fetchContacts(const QString &addressbookUrl, const QList<ReplyParser::ContactInformation> &amrInfo)
 {
+    if (m_toRemoteOnly) {
+        // nothing is downloaded in syncs to the remote side only.  Contacts which
+        // were modified or removed remotely are remembered, so that local changes
+        // to them overwrite the remote modifications rather than failing the
+        // If-Match precondition, and re-create removed contacts with If-None-Match,
+        // see upsyncUpdates().  The stored etags are left as they are, so that the
+        // remote changes are still downloaded by a later two-way sync.
+        int conflicts = 0;
+        Q_FOREACH (const ReplyParser::ContactInformation &info, amrInfo) {
+            if (info.modType == ReplyParser::ContactInformation::Modification) {
+                m_remoteConflictEtags.insert(info.guid, info.etag);
+                conflicts += 1;
+            } else if (info.modType == ReplyParser::ContactInformation::Deletion) {
+                m_remoteConflictEtags.insert(info.guid, QString());
+                conflicts += 1;
+            }
+        }
+        LOG_DEBUG(Q_FUNC_INFO << "not downloading" << amrInfo.size() << "remote changes to addressbook" << addressbookUrl
+                 << "in to-remote sync," << conflicts << "of which may conflict with local changes");
+        QTimer::singleShot(0, this, SLOT(downsyncComplete()));
+        return;
+    }
+
+    if (m_estimateOnly) {
+        // tally up the delta rather than fetching it.  The content length
+        // is only an approximation of the size of the multiget response.
+        bool changed = false;
+        Q_FOREACH (const ReplyParser::ContactInformation &info, amrInfo) {
+            if (info.modType == ReplyParser::ContactInformation::Addition
+                    || info.modType == ReplyParser::ContactInformation::Modification) {
+                if (info.modType == ReplyParser::ContactInformation::Addition) {
+                    m_remoteAdditionsCount += 1;
+                } else {
+                    m_remoteModificationsCount += 1;
+                }
+                if (info.contentLength >= 0) {
+                    m_estimatedDownloadBytes += info.contentLength;
+                } else {
+                    m_estimatedUnknownSizes += 1;
+                }
+                changed = true;
+            } else if (info.modType == ReplyParser::ContactInformation::Deletion) {
+                m_estimatedRemovals += 1;
+                changed = true;
+            }
+        }
+        if (changed) {
+            m_estimatedChangedAddressbooks += 1;
+        }
+        LOG_DEBUG(Q_FUNC_INFO << "estimated" << amrInfo.size() << "remote changes for addressbook" << addressbookUrl);
+        QTimer::singleShot(0, this, SLOT(downsyncComplete()));
+        return;
+    }
+
     LOG_DEBUG(Q_FUNC_INFO << "requesting full contact information from addressbook" << addressbookUrl);
 
     // split into A/M/R request sets
@@ -864,10 +1458,27 @@ void CardDav::fetchContacts(const QString &addressbookUrl, const QList<ReplyPars
         LOG_DEBUG(Q_FUNC_INFO << "no further data to fetch");
         contactAddModsComplete(addressbookUrl);
     } else {
-        // fetch the full contact data for additions/modifications.
+        // fetch the full contact data for additions/modifications,
+        // in pages if the server is slow to respond to large multigets.
         LOG_DEBUG(Q_FUNC_INFO << "fetching vcard data for" << contactUris.size() << "contacts");
-        QNetworkReply *reply = m_request->contactMultiget(m_serverUrl, addressbookUrl, contactUris);
+        enterPhase(CardDav::PhaseFetch);
+        setAddressbookPhase(addressbookUrl, QStringLiteral("fetch"));
+        const int pageSize = m_multigetPageSize > 0 ? m_multigetPageSize : contactUris.size();
+        for (int i = 0; i < contactUris.size(); i += pageSize) {
+            m_pendingMultigets[addressbookUrl].append(contactUris.mid(i, pageSize));
+        }
+        sendPendingMultigets(addressbookUrl);
+    }
+}
+
+void CardDav::sendPendingMultigets(const QString &addressbookUrl)
+{
+    QList<QStringList> &pages(m_pendingMultigets[addressbookUrl]);
+    while (m_activeMultigets.value(addressbookUrl) < m_multigetConcurrency && !pages.isEmpty()) {
+        QNetworkReply *reply = m_request->contactMultiget(m_serverUrl, addressbookUrl, pages.takeFirst());
         if (!reply) {
+            m_pendingMultigets.remove(addressbookUrl);
+            m_activeMultigets.remove(addressbookUrl);
             emit error();
             return;
         }
@@ -875,6 +1486,8 @@ void CardDav::fetchContacts(const QString &addressbookUrl, const QList<ReplyPars
         reply->setProperty("addressbookUrl", addressbookUrl);
         connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
         connect(reply, SIGNAL(finished()), this, SLOT(contactsResponse()));
+        watchReply(reply);
+        m_activeMultigets[addressbookUrl] += 1;
     }
 }
 
@@ -882,72 +1495,106 @@ void CardDav::contactsResponse()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
     QString addressbookUrl = reply->property("addressbookUrl").toString();
+    if (!m_activeMultigets.contains(addressbookUrl)) {
+        // another page of this addressbook has already failed.
+        return;
+    }
+
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        if (retryTimedOutRequest(reply, SLOT(contactsResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
                    << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
+        m_pendingMultigets.remove(addressbookUrl);
+        m_activeMultigets.remove(addressbookUrl);
         errorOccurred(httpError);
         return;
     }
 
-    QList<QContact> added;
-    QList<QContact> modified;
+    QMap<QString, ReplyParser::FullContactInformation> addMods = m_parser->parseContactData(data, addressbookUrl);
+    storeContactData(addressbookUrl, &addMods);
+
+    m_activeMultigets[addressbookUrl] -= 1;
+    if (m_activeMultigets.value(addressbookUrl) > 0 || !m_pendingMultigets.value(addressbookUrl).isEmpty()) {
+        sendPendingMultigets(addressbookUrl);
+        return;
+    }
+    m_pendingMultigets.remove(addressbookUrl);
+    m_activeMultigets.remove(addressbookUrl);
+
+    // now handle removals
+    contactAddModsComplete(addressbookUrl);
+}
 
+void CardDav::storeContactData(const QString &addressbookUrl, QMap<QString, ReplyParser::FullContactInformation> *addMods)
+{
     // fill out added/modified.  Also keep our addressbookContactGuids state up-to-date.
     // The addMods map is a map from server contact uri to <contact/unsupportedProperties/etag>.
-    QMap<QString, ReplyParser::FullContactInformation> addMods = m_parser->parseContactData(data, addressbookUrl);
-    QMap<QString, ReplyParser::FullContactInformation>::const_iterator it = addMods.constBegin();
-    for ( ; it != addMods.constEnd(); ++it) {
+    // Each contact is modified in place (e.g. to set its id) before any copy of it is taken,
+    // so that the copies appended to the AMR and to m_serverAddModsByUid share the same data.
+    QMap<QString, ReplyParser::FullContactInformation>::iterator it = addMods->begin();
+    for ( ; it != addMods->end(); ++it) {
         if (q->m_serverAdditionIndices[addressbookUrl].contains(it.key())) {
-            QContact c = it.value().contact;
+            QContact &c(it.value().contact);
             QString guid = c.detail<QContactGuid>().guid();
             q->m_serverAdditions[addressbookUrl][q->m_serverAdditionIndices[addressbookUrl].value(it.key())].guid = guid;
             q->m_contactEtags[guid] = it.value().etag;
             q->m_contactUris[guid] = it.key();
-            q->m_contactUnsupportedProperties[guid] = it.value().unsupportedProperties;
+            q->m_contactUnsupportedProperties.insert(guid, it.value().unsupportedProperties);
+            q->m_contactVCardHashes.insert(guid, it.value().vcardHash);
             // Note: for additions, q->m_contactUids will have been filled out by the reply parser.
-            q->m_addressbookContactGuids[addressbookUrl].append(guid);
+            q->addAddressbookGuid(addressbookUrl, guid);
             // Check to see if this server-side addition is actually just
             // a reported previously-upsynced local-side addition.
             if (q->m_contactIds.contains(guid)) {
-                QContact previouslyUpsynced = c;
-                previouslyUpsynced.setId(QContactId::fromString(q->m_contactIds[guid]));
-                added.append(previouslyUpsynced);
-            } else {
-                // pure server-side addition.
-                added.append(c);
+                c.setId(QContactId::fromString(q->m_contactIds[guid]));
             }
+            m_remoteAddMods.append(c);
+            m_remoteAdditionsCount += 1;
             q->m_serverAddModsByUid.insert(q->m_contactUids[guid], qMakePair(addressbookUrl, c));
         } else if (q->m_serverModificationIndices[addressbookUrl].contains(it.key())) {
-            QContact c = it.value().contact;
+            QContact &c(it.value().contact);
             QString guid = c.detail<QContactGuid>().guid();
-            q->m_contactUnsupportedProperties[guid] = it.value().unsupportedProperties;
+            if (it.value().unchanged) {
+                // only the etag has changed, so there is nothing to store locally.
+                q->m_contactEtags[guid] = it.value().etag;
+                m_unchangedDownloadsCount += 1;
+                continue;
+            }
+            q->m_contactUnsupportedProperties.insert(guid, it.value().unsupportedProperties);
+            q->m_contactVCardHashes.insert(guid, it.value().vcardHash);
             q->m_contactEtags[guid] = it.value().etag;
+            if (q->m_lastUpsyncedGuids.contains(guid)) {
+                // we upsynced this contact last sync, and the server now reports it as
+                // modified: it may be bouncing between the device and the server.
+                q->m_contactUpsyncLoops[guid] += 1;
+                q->m_roundTripGuids.insert(guid);
+                LOG_DEBUG(Q_FUNC_INFO << "contact" << guid << "modified remotely after upsync"
+                         << q->m_contactUpsyncLoops[guid] << "syncs in a row");
+            }
             if (!q->m_contactIds.contains(guid)) {
                 LOG_WARNING(Q_FUNC_INFO << "modified contact has no id");
             } else {
                 c.setId(QContactId::fromString(q->m_contactIds[guid]));
             }
-            modified.append(c);
+            m_remoteAddMods.append(c);
+            m_remoteModificationsCount += 1;
             q->m_serverAddModsByUid.insert(q->m_contactUids[guid], qMakePair(addressbookUrl, c));
         } else {
             LOG_WARNING(Q_FUNC_INFO << "ignoring unknown addition/modification:" << it.key());
         }
     }
-
-    // coalesce the added/modified contacts from this addressbook into the complete AMR
-    m_remoteAdditions.append(added);
-    m_remoteModifications.append(modified);
-
-    // now handle removals
-    contactAddModsComplete(addressbookUrl);
 }
 
 void CardDav::contactAddModsComplete(const QString &addressbookUrl)
 {
-    QList<QContact> removed;
+    if (m_phaseDeadlineExpired) {
+        return;
+    }
 
     // fill out removed set, and remove any state data associated with removed contacts
     for (int i = 0; i < q->m_serverDeletions[addressbookUrl].size(); ++i) {
@@ -962,16 +1609,18 @@ void CardDav::contactAddModsComplete(const QString &addressbookUrl)
         }
 
         // create the contact to remove
-        QContact doomed;
-        QContactGuid cguid;
-        cguid.setGuid(guid);
-        doomed.saveDetail(&cguid);
-        if (!q->m_contactIds.contains(guid)) {
+        if (q->m_contactIds.contains(guid)) {
+            QContact doomed;
+            QContactGuid cguid;
+            cguid.setGuid(guid);
+            doomed.saveDetail(&cguid);
+            doomed.setId(QContactId::fromString(q->m_contactIds[guid]));
+            m_remoteRemovals.append(doomed);
+        } else {
+            // cannot remove it if we don't know the id, but the
+            // stale state data is removed regardless.
             LOG_WARNING(Q_FUNC_INFO << "removed contact has no id");
-            continue; // cannot remove it if we don't know the id
         }
-        doomed.setId(QContactId::fromString(q->m_contactIds[guid]));
-        removed.append(doomed);
 
         // update the state data
         q->m_contactUids.remove(guid);
@@ -979,11 +1628,10 @@ void CardDav::contactAddModsComplete(const QString &addressbookUrl)
         q->m_contactEtags.remove(guid);
         q->m_contactIds.remove(guid);
         q->m_contactUnsupportedProperties.remove(guid);
-        q->m_addressbookContactGuids[addressbookUrl].removeOne(guid);
+        q->m_contactVCardHashes.remove(guid);
+        q->removeAddressbookGuid(addressbookUrl, guid);
     }
-
-    // coalesce the removed contacts from this addressbook into the complete AMR
-    m_remoteRemovals.append(removed);
+    setAddressbookPhase(addressbookUrl, QStringLiteral("downsynced"));
 
     // downsync complete for this addressbook.
     // we use a singleshot to ensure that the m_deltaRequests count isn't
@@ -992,21 +1640,54 @@ void CardDav::contactAddModsComplete(const QString &addressbookUrl)
     QTimer::singleShot(0, this, SLOT(downsyncComplete()));
 }
 
+void CardDav::recordStrategyOutcome(const QString &addressbookUrl, SyncStrategy::Type strategy, bool succeeded)
+{
+    if (!succeeded) {
+        LOG_DEBUG(Q_FUNC_INFO << "strategy" << strategy << "failed for addressbook" << addressbookUrl);
+    }
+    SyncStrategy::recordOutcome(&q->m_strategyStatistics[addressbookUrl], strategy, succeeded);
+}
+
 void CardDav::downsyncComplete()
 {
     // downsync complete for this addressbook
     // if this was the last outstanding addressbook, we're finished.
+    if (m_phaseDeadlineExpired) {
+        return;
+    }
     m_downsyncRequests -= 1;
     if (m_downsyncRequests == 0) {
+        enterPhase(CardDav::PhaseIdle);
+        if (m_estimateOnly) {
+            LOG_DEBUG(Q_FUNC_INFO
+                     << "estimate complete with total AMR:"
+                     << m_remoteAdditionsCount << ","
+                     << m_remoteModificationsCount << ","
+                     << m_estimatedRemovals);
+            emit remoteEstimateAvailable();
+            return;
+        }
         LOG_DEBUG(Q_FUNC_INFO
                  << "downsync complete with total AMR:"
-                 << m_remoteAdditions.size() << ","
-                 << m_remoteModifications.size() << ","
-                 << m_remoteRemovals.size());
-        emit remoteChanges(m_remoteAdditions, m_remoteModifications, m_remoteRemovals);
+                 << m_remoteAdditionsCount << ","
+                 << m_remoteModificationsCount << ","
+                 << m_remoteRemovals.size()
+                 << "and" << m_unchangedDownloadsCount << "unchanged contacts");
+        emit remoteChangesAvailable();
     }
 }
 
+void CardDav::takeRemoteChanges(QList<QContact> *addMods, QList<QContact> *removed)
+{
+    addMods->clear();
+    removed->clear();
+    addMods->swap(m_remoteAddMods);
+    removed->swap(m_remoteRemovals);
+    m_remoteAdditionsCount = 0;
+    m_remoteModificationsCount = 0;
+    m_unchangedDownloadsCount = 0;
+}
+
 static QString transformIntoAddressbookSpecificGuid(const QString &guidstr, int accountId, const QString &addressbookUrl)
 {
     QString retn;
@@ -1052,9 +1733,24 @@ void CardDav::upsyncUpdates(const QString &addressbookUrl, const QList<QContact>
     LOG_DEBUG(Q_FUNC_INFO
              << "upsyncing updates to addressbook:" << addressbookUrl
              << ":" << added.count() << modified.count() << removed.count());
+    setAddressbookPhase(addressbookUrl, QStringLiteral("upsync"));
+
+    if (!q->ensureShardLoaded(addressbookUrl)) {
+        emit error();
+        return;
+    }
 
     bool hadNonSpuriousChanges = false;
     int spuriousModifications = 0;
+    int quarantinedModifications = 0;
+    int unchangedModifications = 0;
+    int conflictingModifications = 0;
+    enterPhase(CardDav::PhaseUpsync);
+
+    // if the server supports it, additions and modifications are
+    // uploaded in batches rather than with one PUT per contact.
+    const bool bulkUpsync = m_bulkRequestLimits.contains(addressbookUrl);
+    QVariantList bulkItems;
 
     // put local additions
     for (int i = 0; i < added.size(); ++i) {
@@ -1074,18 +1770,13 @@ void CardDav::upsyncUpdates(const QString &addressbookUrl, const QList<QContact>
         // generate a vcard
         QString vcard = m_converter->convertContactToVCard(c, QStringList());
         // upload
-        QNetworkReply *reply = m_request->upsyncAddMod(m_serverUrl, uri, QString(), vcard);
-        if (!reply) {
+        hadNonSpuriousChanges = true;
+        if (bulkUpsync) {
+            bulkItems.append(bulkUpsyncItem(guid, uri, QString(), vcard, true));
+        } else if (!upsyncContact(addressbookUrl, guid, uri, QString(), vcard, true)) {
             emit error();
             return;
         }
-
-        m_upsyncRequests += 1;
-        hadNonSpuriousChanges = true;
-        reply->setProperty("addressbookUrl", addressbookUrl);
-        reply->setProperty("contactGuid", guid);
-        connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
-        connect(reply, SIGNAL(finished()), this, SLOT(upsyncResponse()));
     }
 
     // put local modifications
@@ -1131,23 +1822,60 @@ void CardDav::upsyncUpdates(const QString &addressbookUrl, const QList<QContact>
             }
         }
         // otherwise, convert to vcard and upsync to remote server.
-        QString vcard = m_converter->convertContactToVCard(c, q->m_contactUnsupportedProperties[guidstr]);
+        QString vcard = m_converter->convertContactToVCard(c, q->m_contactUnsupportedProperties.value(guidstr));
+        // unless the contact keeps bouncing between the device and the server,
+        // in which case we stop upsyncing it for a while.
+        if (!q->m_quarantinedContacts.contains(guidstr)
+                && m_upsyncLoopThreshold > 0
+                && q->m_contactUpsyncLoops.value(guidstr) >= m_upsyncLoopThreshold) {
+            LOG_WARNING(Q_FUNC_INFO << "contact" << guidstr << "was modified remotely after each of the last"
+                       << q->m_contactUpsyncLoops.value(guidstr) << "upsyncs, quarantining it for"
+                       << m_upsyncQuarantineDays << "days");
+            logUpsyncLoop(uidstr, vcard);
+            q->m_quarantinedContacts.insert(guidstr, QDateTime::currentDateTimeUtc().addDays(m_upsyncQuarantineDays));
+        }
+        if (q->m_quarantinedContacts.contains(guidstr)) {
+            // the edit is upsynced once the quarantine expires, see Syncer::releaseQuarantinedEdits().
+            LOG_DEBUG(Q_FUNC_INFO << "not upsyncing change to quarantined contact:" << guidstr);
+            q->m_quarantinedEdits.insert(guidstr);
+            quarantinedModifications += 1;
+            continue;
+        }
+        // the change may have only affected details which are not exported,
+        // in which case the server already has this vCard.
+        const QByteArray vcardHash = CardDavVCardConverter::vCardHash(vcard);
+        if (q->m_contactVCardHashes.value(guidstr) == vcardHash) {
+            LOG_DEBUG(Q_FUNC_INFO << "not upsyncing unchanged vCard for contact:" << guidstr);
+            unchangedModifications += 1;
+            continue;
+        }
         // upload
-        QNetworkReply *reply = m_request->upsyncAddMod(m_serverUrl,
-                q->m_contactUris[guidstr],
-                q->m_contactEtags[guidstr],
-                vcard);
-        if (!reply) {
+        hadNonSpuriousChanges = true;
+        const bool removedRemotely = m_remoteConflictEtags.contains(guidstr)
+                && m_remoteConflictEtags.value(guidstr).isEmpty();
+        if (m_remoteConflictEtags.contains(guidstr)) {
+            LOG_DEBUG(Q_FUNC_INFO << (removedRemotely ? "re-creating remotely removed contact:" : "overwriting remote changes to contact:")
+                     << guidstr);
+            conflictingModifications += 1;
+        }
+        if (removedRemotely) {
+            // without a precondition the upload would also replace any contact
+            // created at the uri since, so the contact is only re-created.
+            if (!upsyncContact(addressbookUrl, guidstr, q->m_contactUris[guidstr], QString(), vcard, true)) {
+                emit error();
+                return;
+            }
+        } else if (bulkUpsync) {
+            bulkItems.append(bulkUpsyncItem(guidstr, q->m_contactUris[guidstr], upsyncEtag(guidstr), vcard, false));
+        } else if (!upsyncContact(addressbookUrl, guidstr, q->m_contactUris[guidstr], upsyncEtag(guidstr), vcard, false)) {
             emit error();
             return;
         }
+    }
 
-        m_upsyncRequests += 1;
-        hadNonSpuriousChanges = true;
-        reply->setProperty("addressbookUrl", addressbookUrl);
-        reply->setProperty("contactGuid", guidstr);
-        connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
-        connect(reply, SIGNAL(finished()), this, SLOT(upsyncResponse()));
+    if (!bulkItems.isEmpty() && !bulkUpsyncContacts(addressbookUrl, bulkItems)) {
+        emit error();
+        return;
     }
 
     // delete local removals
@@ -1166,26 +1894,34 @@ void CardDav::upsyncUpdates(const QString &addressbookUrl, const QList<QContact>
                 continue; // TODO: this is actually an error.
             }
         }
-        QNetworkReply *reply = m_request->upsyncDeletion(m_serverUrl,
-                q->m_contactUris[guidstr],
-                q->m_contactEtags[guidstr]);
-        if (!reply) {
+        // the contact may already have been removed remotely, see fetchContacts().
+        const bool removedRemotely = m_remoteConflictEtags.contains(guidstr)
+                && m_remoteConflictEtags.value(guidstr).isEmpty();
+        QNetworkReply *reply = removedRemotely
+                ? 0
+                : m_request->upsyncDeletion(m_serverUrl, q->m_contactUris[guidstr], upsyncEtag(guidstr));
+        if (!removedRemotely && !reply) {
             emit error();
             return;
         }
 
         // clear state data for this (deleted) contact
+        q->m_contactVCardHashes.remove(guidstr);
         q->m_contactEtags.remove(guidstr);
         q->m_contactUris.remove(guidstr);
         q->m_contactIds.remove(guidstr);
         q->m_contactUids.remove(guidstr);
-        q->m_addressbookContactGuids[addressbookUrl].removeOne(guidstr);
+        q->removeAddressbookGuid(addressbookUrl, guidstr);
+        if (removedRemotely) {
+            continue;
+        }
 
         m_upsyncRequests += 1;
         hadNonSpuriousChanges = true;
         reply->setProperty("addressbookUrl", addressbookUrl);
         connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
         connect(reply, SIGNAL(finished()), this, SLOT(upsyncResponse()));
+        watchReply(reply);
     }
 
     if (!hadNonSpuriousChanges || (added.size() == 0 && modified.size() == 0 && removed.size() == 0)) {
@@ -1196,7 +1932,292 @@ void CardDav::upsyncUpdates(const QString &addressbookUrl, const QList<QContact>
         QTimer::singleShot(0, this, SLOT(upsyncComplete()));
     }
 
-    LOG_DEBUG(Q_FUNC_INFO << "ignored" << spuriousModifications << "spurious updates to addressbook:" << addressbookUrl);
+    LOG_DEBUG(Q_FUNC_INFO << "ignored" << spuriousModifications << "spurious updates,"
+             << unchangedModifications << "updates with unchanged vCards and"
+             << quarantinedModifications << "updates to quarantined contacts in addressbook:" << addressbookUrl);
+    if (conflictingModifications > 0) {
+        LOG_WARNING(Q_FUNC_INFO << conflictingModifications << "local changes overwrote remote changes to addressbook:" << addressbookUrl
+                   << "in to-remote sync");
+    }
+}
+
+// the etag to use as the precondition of an upload or removal: the remote etag,
+// if the contact was modified remotely during a to-remote sync (so that the local
+// change overwrites it), or otherwise the etag from the last sync.  Contacts
+// removed remotely are re-created instead, see upsyncUpdates().
+QString CardDav::upsyncEtag(const QString &guid) const
+{
+    QMap<QString, QString>::const_iterator it = m_remoteConflictEtags.constFind(guid);
+    return it != m_remoteConflictEtags.constEnd() ? it.value() : q->m_contactEtags.value(guid);
+}
+
+bool CardDav::upsyncContact(const QString &addressbookUrl, const QString &guid, const QString &uri, const QString &etag, const QString &vcard, bool addition, bool bulkRetry)
+{
+    QNetworkReply *reply = addition
+            ? m_request->upsyncAddition(m_serverUrl, uri, vcard)
+            : m_request->upsyncAddMod(m_serverUrl, uri, etag, vcard);
+    if (!reply) {
+        return false;
+    }
+
+    m_upsyncRequests += 1;
+    reply->setProperty("addressbookUrl", addressbookUrl);
+    reply->setProperty("contactGuid", guid);
+    reply->setProperty("contactUri", uri);
+    reply->setProperty("addition", addition);
+    reply->setProperty("bulkRetry", bulkRetry);
+    reply->setProperty("vcardHash", CardDavVCardConverter::vCardHash(vcard));
+    connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
+    connect(reply, SIGNAL(finished()), this, SLOT(upsyncResponse()));
+    watchReply(reply);
+    return true;
+}
+
+QVariantMap CardDav::bulkUpsyncItem(const QString &guid, const QString &uri, const QString &etag, const QString &vcard, bool addition) const
+{
+    QVariantMap item;
+    item.insert(QStringLiteral("guid"), guid);
+    item.insert(QStringLiteral("uri"), uri);
+    item.insert(QStringLiteral("etag"), etag);
+    item.insert(QStringLiteral("vcard"), vcard);
+    item.insert(QStringLiteral("addition"), addition);
+    return item;
+}
+
+bool CardDav::bulkUpsyncContacts(const QString &addressbookUrl, const QVariantList &items)
+{
+    // split the items into batches within the limits advertised by the server.
+    // The size of a request is that of its body, including the escaping of each vCard.
+    const int maxResources = m_bulkRequestLimits.value(addressbookUrl).first;
+    const int maxBytes = m_bulkRequestLimits.value(addressbookUrl).second;
+    const int requestBytes = RequestGenerator::bulkRequest(QString()).toUtf8().size();
+    int start = 0;
+    while (start < items.size()) {
+        QStringList uris, etags, vcards;
+        QVariantList batch;
+        int batchBytes = requestBytes;
+        for (int i = start; i < items.size() && batch.size() < maxResources; ++i) {
+            const QVariantMap item = items[i].toMap();
+            // additions have no uri in a bulk request: the server assigns it.
+            const QString uri = item.value(QStringLiteral("addition")).toBool() ? QString() : item.value(QStringLiteral("uri")).toString();
+            const QString etag = item.value(QStringLiteral("etag")).toString();
+            const QString vcard = item.value(QStringLiteral("vcard")).toString();
+            const int itemBytes = RequestGenerator::bulkResource(uri, etag, vcard).toUtf8().size();
+            if (maxBytes > 0 && !batch.isEmpty() && batchBytes + itemBytes > maxBytes) {
+                break;
+            }
+            uris.append(uri);
+            etags.append(etag);
+            vcards.append(vcard);
+            batch.append(item);
+            batchBytes += itemBytes;
+        }
+        start += batch.size();
+
+        LOG_DEBUG(Q_FUNC_INFO << "upsyncing" << batch.size() << "contacts to addressbook" << addressbookUrl
+                 << "in a bulk request of" << batchBytes << "bytes");
+        QNetworkReply *reply = m_request->upsyncBulk(m_serverUrl, addressbookUrl, uris, etags, vcards);
+        if (!reply) {
+            return false;
+        }
+
+        m_upsyncRequests += 1;
+        reply->setProperty("addressbookUrl", addressbookUrl);
+        reply->setProperty("bulkItems", batch);
+        connect(reply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
+        connect(reply, SIGNAL(finished()), this, SLOT(bulkUpsyncResponse()));
+        watchReply(reply);
+    }
+    return true;
+}
+
+void CardDav::bulkUpsyncResponse()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    const QString addressbookUrl = reply->property("addressbookUrl").toString();
+    const QVariantList items = reply->property("bulkItems").toList();
+    QByteArray data = reply->readAll();
+    QVariantList failedItems;
+    QVariantList retriedItems; // additions which the bulk request may have created
+    if (reply->error() != QNetworkReply::NoError) {
+        // Note: upsync requests are not retried, as they may already have been applied.
+        int httpError = httpErrorCode(reply);
+        LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
+                   << "(" << httpError << ")");
+        debugDumpData(QString::fromUtf8(data));
+        if (httpError == 401 || httpError == HTTP_REQUEST_TIMEOUT) {
+            errorOccurred(httpError);
+            return;
+        }
+        // the server does not accept our bulk requests after all.
+        // Upsync the contacts individually instead.
+        LOG_WARNING(Q_FUNC_INFO << "bulk request failed, falling back to individual requests for addressbook" << addressbookUrl);
+        m_bulkRequestLimits.remove(addressbookUrl);
+        failedItems = items;
+    } else {
+        // the results of modifications are matched by their href.  The server
+        // returns the results in request order, so the remaining results are
+        // matched to the additions by their position, unless the results of
+        // the modifications show otherwise.
+        const QList<ReplyParser::ResourceInformation> results = ReplyParser::parseMultistatus(data);
+        QHash<QString, int> modificationIndices; // uri -> item index
+        QList<int> additionIndices;
+        for (int i = 0; i < items.size(); ++i) {
+            const QVariantMap item = items[i].toMap();
+            if (item.value(QStringLiteral("addition")).toBool()) {
+                additionIndices.append(i);
+            } else {
+                modificationIndices.insert(item.value(QStringLiteral("uri")).toString(), i);
+            }
+        }
+        QHash<int, int> itemResults; // item index -> result index
+        QList<int> additionResults;
+        bool requestOrder = results.size() == items.size();
+        for (int r = 0; r < results.size(); ++r) {
+            const QString href = bulkResultHref(results[r].href);
+            if (!href.isEmpty() && modificationIndices.contains(href)) {
+                const int i = modificationIndices.value(href);
+                itemResults.insert(i, r);
+                requestOrder &= i == r;
+            } else {
+                additionResults.append(r);
+            }
+        }
+        static const QRegularExpression Http2xxOk(QStringLiteral("^HTTP/\\S+\\s+2[0-9][0-9]"));
+        bool additionsFailed = !additionResults.isEmpty();
+        bool additionsSucceeded = true;
+        Q_FOREACH (int r, additionResults) {
+            const bool failed = !results[r].status.isEmpty() && !results[r].status.contains(Http2xxOk);
+            additionsFailed &= failed;
+            additionsSucceeded &= !failed;
+        }
+        // if every addition failed, none was created, and all can be retried.
+        const bool matchAdditions = (additionResults.size() == additionIndices.size()
+                && (additionIndices.size() == 1 || requestOrder))
+                || (additionsFailed && additionResults.size() == additionIndices.size());
+        if (matchAdditions) {
+            for (int k = 0; k < additionIndices.size(); ++k) {
+                itemResults.insert(additionIndices[k], additionResults[k]);
+            }
+        } else if (!additionIndices.isEmpty()) {
+            LOG_WARNING(Q_FUNC_INFO << "bulk response has" << results.size() << "results for" << items.size()
+                       << "resources, not in request order: the results of additions cannot be matched");
+            debugDumpData(QString::fromUtf8(data));
+        }
+
+        // if every addition was created, the unmatched results do not matter.
+        // Otherwise it is not known which were created, so each is retried
+        // individually at its own fresh uri, see upsyncResponse().
+        const bool retryAdditions = !matchAdditions
+                && (!additionsSucceeded || additionResults.size() != additionIndices.size());
+
+        for (int i = 0; i < items.size(); ++i) {
+            const QVariantMap item = items[i].toMap();
+            const QString guid = item.value(QStringLiteral("guid")).toString();
+            const bool addition = item.value(QStringLiteral("addition")).toBool();
+            if (addition && retryAdditions) {
+                LOG_WARNING(Q_FUNC_INFO << "outcome of bulk upsync of" << guid << "is unknown, retrying with an individual request");
+                retriedItems.append(item);
+                continue;
+            }
+            if (addition && !matchAdditions) {
+                // the server chose the uri, which isn't known.  The contact was
+                // created, so it is reported as an addition when the server next lists
+                // it, and is then matched by its UID, see ReplyParser::parseContactData().
+                q->m_contactUris.remove(guid);
+                q->m_contactEtags.remove(guid);
+                q->m_upsyncedGuids.insert(guid);
+                q->m_contactVCardHashes.insert(guid, CardDavVCardConverter::vCardHash(item.value(QStringLiteral("vcard")).toString()));
+                continue;
+            }
+            if (!itemResults.contains(i)) {
+                LOG_WARNING(Q_FUNC_INFO << "no result for bulk upsync of" << guid << ", falling back to an individual request");
+                failedItems.append(item);
+                continue;
+            }
+            const ReplyParser::ResourceInformation &result(results[itemResults.value(i)]);
+            if (!result.status.isEmpty() && !result.status.contains(Http2xxOk)) {
+                LOG_WARNING(Q_FUNC_INFO << "bulk upsync of" << guid << "failed with status" << result.status);
+                failedItems.append(item);
+                continue;
+            }
+            if (addition && result.href.isEmpty()) {
+                // as above, the contact is matched by its UID when the server next lists it.
+                LOG_DEBUG(Q_FUNC_INFO << "uri of bulk upsynced addition" << guid << "is unknown until the next sync");
+                q->m_contactUris.remove(guid);
+                q->m_contactEtags.remove(guid);
+            } else {
+                if (addition) {
+                    q->m_contactUris[guid] = bulkResultHref(result.href);
+                }
+                if (!result.etag.isEmpty()) {
+                    q->m_contactEtags[guid] = result.etag;
+                } else {
+                    LOG_WARNING("No updated etag provided for" << guid << ": will be reported as spurious remote modification next sync");
+                }
+            }
+            q->m_upsyncedGuids.insert(guid);
+            q->m_contactVCardHashes.insert(guid, CardDavVCardConverter::vCardHash(item.value(QStringLiteral("vcard")).toString()));
+        }
+    }
+
+    Q_FOREACH (const QVariant &v, failedItems) {
+        const QVariantMap item = v.toMap();
+        if (!upsyncContact(addressbookUrl,
+                           item.value(QStringLiteral("guid")).toString(),
+                           item.value(QStringLiteral("uri")).toString(),
+                           item.value(QStringLiteral("etag")).toString(),
+                           item.value(QStringLiteral("vcard")).toString(),
+                           item.value(QStringLiteral("addition")).toBool())) {
+            emit error();
+            return;
+        }
+    }
+    Q_FOREACH (const QVariant &v, retriedItems) {
+        const QVariantMap item = v.toMap();
+        if (!upsyncContact(addressbookUrl,
+                           item.value(QStringLiteral("guid")).toString(),
+                           item.value(QStringLiteral("uri")).toString(),
+                           QString(),
+                           item.value(QStringLiteral("vcard")).toString(),
+                           true, true)) {
+            emit error();
+            return;
+        }
+    }
+
+    // this bulk request is complete.
+    upsyncComplete();
+}
+
+void CardDav::logUpsyncLoop(const QString &uid, const QString &vcard)
+{
+    // log the lines which differ between the vCard we would upload and the
+    // contact as it was last downloaded, which will show which property
+    // does not survive the round trip.
+    const QList<QPair<QString, QContact> > &addressbookContacts(q->m_serverAddModsByUid.values(uid));
+    if (addressbookContacts.isEmpty()) {
+        LOG_WARNING(Q_FUNC_INFO << "no downsynced version available, local vCard:");
+        debugDumpData(vcard);
+        return;
+    }
+
+    const QStringList localLines = vcard.split(QRegularExpression(QStringLiteral("\\r?\\n")), QString::SkipEmptyParts);
+    for (int i = 0; i < addressbookContacts.size(); ++i) {
+        const QString remoteVCard = m_converter->convertContactToVCard(addressbookContacts[i].second, QStringList());
+        const QStringList remoteLines = remoteVCard.split(QRegularExpression(QStringLiteral("\\r?\\n")), QString::SkipEmptyParts);
+        LOG_WARNING(Q_FUNC_INFO << "differences from downsynced version in addressbook" << addressbookContacts[i].first << ":");
+        Q_FOREACH (const QString &line, localLines) {
+            if (!remoteLines.contains(line)) {
+                LOG_WARNING("  +" << line);
+            }
+        }
+        Q_FOREACH (const QString &line, remoteLines) {
+            if (!localLines.contains(line)) {
+                LOG_WARNING("  -" << line);
+            }
+        }
+    }
 }
 
 void CardDav::upsyncResponse()
@@ -1205,11 +2226,38 @@ void CardDav::upsyncResponse()
     QString guid = reply->property("contactGuid").toString();
     QByteArray data = reply->readAll();
     if (reply->error() != QNetworkReply::NoError) {
-        int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        // Additions are uploaded with If-None-Match: *, so can safely be retried.
+        // Other upsync requests are not retried, as they may already have been applied.
+        const bool addition = reply->property("addition").toBool();
+        if (addition && retryTimedOutRequest(reply, SLOT(upsyncResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
         LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
                    << "(" << httpError << ")");
         debugDumpData(QString::fromUtf8(data));
-        if (httpError == 405) {
+        if (addition && httpError == HTTP_PRECONDITION_FAILED && reply->property("attempts").toInt() > 0) {
+            // the contact exists, so an earlier attempt whose response was lost
+            // must have created it: its uri is derived from a fresh uuid.
+            LOG_DEBUG(Q_FUNC_INFO << "contact" << guid << "was created by an earlier attempt, fetching its etag");
+            if (!confirmAddition(reply)) {
+                errorOccurred(httpError);
+            }
+            return;
+        } else if (addition && reply->property("bulkRetry").toBool()
+                   && (httpError == HTTP_FORBIDDEN || httpError == HTTP_CONFLICT)) {
+            // the server refuses a second contact with the same UID (the
+            // CardDAV no-uid-conflict precondition), so the bulk request must
+            // have created it at a uri chosen by the server.  It is matched
+            // by its UID when the server next lists it.
+            LOG_DEBUG(Q_FUNC_INFO << "contact" << guid << "was created by the bulk request, its uri is unknown until the next sync");
+            q->m_contactUris.remove(guid);
+            q->m_contactEtags.remove(guid);
+            q->m_upsyncedGuids.insert(guid);
+            q->m_contactVCardHashes.insert(guid, reply->property("vcardHash").toByteArray());
+            upsyncComplete();
+            return;
+        } else if (httpError == 405) {
             // MethodNotAllowed error.  Most likely the server has restricted
             // new writes to the collection (e.g., read-only or update-only).
             // We should not abort the sync if we receive this error.
@@ -1232,6 +2280,11 @@ void CardDav::upsyncResponse()
             }
         }
 
+        if (reply->error() == QNetworkReply::NoError) {
+            q->m_upsyncedGuids.insert(guid);
+            q->m_contactVCardHashes.insert(guid, reply->property("vcardHash").toByteArray());
+        }
+
         if (!etag.isEmpty()) {
             LOG_DEBUG("Got updated etag for" << guid << ":" << etag);
             q->m_contactEtags[guid] = etag;
@@ -1247,12 +2300,71 @@ void CardDav::upsyncResponse()
     upsyncComplete();
 }
 
+bool CardDav::confirmAddition(QNetworkReply *reply)
+{
+    QNetworkReply *etagReply = m_request->contactEtag(m_serverUrl, reply->property("contactUri").toString());
+    if (!etagReply) {
+        return false;
+    }
+
+    // the upsync request remains outstanding until the etag has been fetched.
+    etagReply->setProperty("addressbookUrl", reply->property("addressbookUrl"));
+    etagReply->setProperty("contactGuid", reply->property("contactGuid"));
+    etagReply->setProperty("vcardHash", reply->property("vcardHash"));
+    connect(etagReply, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrorsOccurred(QList<QSslError>)));
+    connect(etagReply, SIGNAL(finished()), this, SLOT(additionEtagResponse()));
+    watchReply(etagReply);
+    return true;
+}
+
+void CardDav::additionEtagResponse()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    QString guid = reply->property("contactGuid").toString();
+    QByteArray data = reply->readAll();
+    if (reply->error() != QNetworkReply::NoError) {
+        if (retryTimedOutRequest(reply, SLOT(additionEtagResponse()))) {
+            return;
+        }
+        int httpError = httpErrorCode(reply);
+        LOG_WARNING(Q_FUNC_INFO << "error:" << reply->error()
+                   << "(" << httpError << ")");
+        debugDumpData(QString::fromUtf8(data));
+        errorOccurred(httpError);
+        return;
+    }
+
+    QString etag;
+    const QList<ReplyParser::ResourceInformation> resources = ReplyParser::parseMultistatus(data);
+    Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
+        if (!resource.etag.isEmpty()) {
+            etag = resource.etag;
+            break;
+        }
+    }
+
+    // the addition succeeded either way, so if the etag is missing
+    // it will be reported as a spurious remote modification next sync.
+    LOG_DEBUG("Confirmed addition of" << guid << "with etag:" << etag);
+    q->m_upsyncedGuids.insert(guid);
+    q->m_contactVCardHashes.insert(guid, reply->property("vcardHash").toByteArray());
+    if (!etag.isEmpty()) {
+        q->m_contactEtags[guid] = etag;
+    }
+
+    upsyncComplete();
+}
+
 void CardDav::upsyncComplete()
 {
+    if (m_phaseDeadlineExpired) {
+        return;
+    }
     m_upsyncRequests -= 1;
     if (m_upsyncRequests == 0) {
         // finished upsyncing all data for all addressbooks.
         LOG_DEBUG(Q_FUNC_INFO << "upsync complete");
+        enterPhase(CardDav::PhaseIdle);
         emit upsyncCompleted();
     }
 }
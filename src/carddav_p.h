@@ -25,6 +25,7 @@
 
 #include "requestgenerator_p.h"
 #include "replyparser_p.h"
+#include "syncstrategy_p.h"
 
 #include <QObject>
 #include <QMultiMap>
@@ -33,6 +34,8 @@
 #include <QString>
 #include <QSet>
 #include <QSslError>
+#include <QTimer>
+#include <QVariant>
 
 #include <QContact>
 #include <QVersitContactImporterPropertyHandlerV2>
@@ -42,6 +45,7 @@ QTCONTACTS_USE_NAMESPACE
 QTVERSIT_USE_NAMESPACE
 
 class Syncer;
+class SyncCostEstimate;
 class CardDavVCardConverter;
 class CardDav : public QObject
 {
@@ -62,16 +66,35 @@ public:
     void determineAddressbooksList(); // for cdavtool.
 
     void determineRemoteAMR();
+
+    // performs only the discovery and metadata steps of determineRemoteAMR(),
+    // and emits remoteEstimateAvailable() instead of fetching any contacts.
+    void estimateRemoteChanges();
+    void remoteEstimate(SyncCostEstimate *estimate) const;
     void upsyncUpdates(const QString &addressbookUrl,
                        const QList<QContact> &added,
                        const QList<QContact> &modified,
                        const QList<QContact> &removed);
 
+    // transfers ownership of the downsynced remote changes to the caller.
+    void takeRemoteChanges(QList<QContact> *addMods, QList<QContact> *removed);
+
+    // addressbookUrl -> the step of the sync it has reached, for the live sync metrics.
+    QMap<QString, QString> addressbookPhases() const { return m_addressbookPhases; }
+
+    // the phases of a sync, each of which may have a deadline.
+    enum SyncPhase {
+        PhaseIdle = 0,
+        PhaseDiscovery,
+        PhaseMetadata,
+        PhaseFetch,
+        PhaseUpsync
+    };
+
 Q_SIGNALS:
     void error(int errorCode = 0);
-    void remoteChanges(const QList<QContact> &added,
-                       const QList<QContact> &modified,
-                       const QList<QContact> &removed);
+    void remoteChangesAvailable();
+    void remoteEstimateAvailable();
     void upsyncCompleted();
     void addressbooksList(const QStringList &paths);
 
@@ -82,6 +105,8 @@ private:
     void downsyncAddressbookContent(const QList<ReplyParser::AddressBookInformation> &infos);
     void fetchImmediateDelta(const QString &addressbookUrl, const QString &syncToken);
     void fetchContactMetadata(const QString &addressbookUrl);
+    void fallBackToContactMetadata(const QString &addressbookUrl);
+    void fetchAllContacts(const QString &addressbookUrl);
     void fetchContacts(const QString &addressbookUrl, const QList<ReplyParser::ContactInformation> &amrInfo);
 
 private Q_SLOTS:
@@ -91,14 +116,38 @@ private Q_SLOTS:
     void addressbooksInformationResponse();
     void immediateDeltaResponse();
     void contactMetadataResponse();
+    void allContactsResponse();
     void contactsResponse();
     void downsyncComplete();
     void upsyncResponse();
+    void additionEtagResponse();
+    void bulkUpsyncResponse();
     void upsyncComplete();
     void errorOccurred(int httpError);
+    void requestInactivityTimeout();
+    void replyFinished();
+    void replyDownloadProgress(qint64 bytesReceived);
+    void phaseDeadlineExpired();
+    void syncDeadlineExpired();
 
 private:
+    void initialize();
+    void storeContactData(const QString &addressbookUrl, QMap<QString, ReplyParser::FullContactInformation> *addMods);
+    QString upsyncEtag(const QString &guid) const;
+    void sendPendingMultigets(const QString &addressbookUrl);
+    void setAddressbookPhase(const QString &addressbookUrl, const QString &phase);
     void contactAddModsComplete(const QString &addressbookUrl);
+    void recordStrategyOutcome(const QString &addressbookUrl, SyncStrategy::Type strategy, bool succeeded);
+    void watchReply(QNetworkReply *reply);
+    bool retryTimedOutRequest(QNetworkReply *reply, const char *responseSlot);
+    int httpErrorCode(QNetworkReply *reply) const;
+    void enterPhase(SyncPhase phase);
+    void abortSync();
+    void logUpsyncLoop(const QString &uid, const QString &vcard);
+    bool upsyncContact(const QString &addressbookUrl, const QString &guid, const QString &uri, const QString &etag, const QString &vcard, bool addition, bool bulkRetry = false);
+    bool confirmAddition(QNetworkReply *reply);
+    QVariantMap bulkUpsyncItem(const QString &guid, const QString &uri, const QString &etag, const QString &vcard, bool addition) const;
+    bool bulkUpsyncContacts(const QString &addressbookUrl, const QVariantList &items);
 
     enum DiscoveryStage {
         DiscoveryStarted = 0,
@@ -106,6 +155,7 @@ private:
         DiscoveryTryRoot
     };
 
+    friend class SyncStrategy;
     Syncer *q;
     CardDavVCardConverter *m_converter;
     RequestGenerator *m_request;
@@ -116,11 +166,52 @@ private:
     bool m_addressbooksListOnly;
     bool m_triedAddressbookPathAsHomeSetUrl;
 
-    QList<QContact> m_remoteAdditions;
-    QList<QContact> m_remoteModifications;
+    QList<QContact> m_remoteAddMods; // additions and modifications from all addressbooks
     QList<QContact> m_remoteRemovals;
+    int m_remoteAdditionsCount;
+    int m_remoteModificationsCount;
+    int m_unchangedDownloadsCount; // downloaded contacts whose vCard was unchanged
     int m_downsyncRequests;
     int m_upsyncRequests;
+    QList<SyncStrategy*> m_strategies; // in order of preference, see downsyncAddressbookContent()
+
+    // watchdog timeouts, in milliseconds.  Zero disables the timeout.
+    QSet<QNetworkReply*> m_activeReplies;
+    QMap<int, int> m_phaseTimeouts; // SyncPhase -> deadline
+    QTimer m_phaseTimer;
+    QTimer m_syncTimer;             // the deadline of the sync as a whole
+    SyncPhase m_phase;
+    QMap<QString, QString> m_addressbookPhases; // addressbookUrl -> phase, see setAddressbookPhase()
+    int m_requestTimeout;
+    int m_maxRequestRetries;
+    bool m_phaseDeadlineExpired;    // of a phase or of the sync, see abortSync()
+    bool m_syncDeadlinePassed;      // between phases, see syncDeadlineExpired()
+
+    // upsync loop detection, see upsyncUpdates().
+    int m_upsyncLoopThreshold;
+    int m_upsyncQuarantineDays;
+
+    // CalendarServer bulk-requests support.
+    bool m_bulkRequestsEnabled;
+    QMap<QString, QPair<int, int> > m_bulkRequestLimits; // addressbookUrl -> <max resources, max bytes>
+
+    // multiget paging, see fetchContacts().
+    int m_multigetPageSize;    // zero to request all contacts in one multiget
+    int m_multigetConcurrency;
+    QMap<QString, QList<QStringList> > m_pendingMultigets; // addressbookUrl -> pages of contact uris yet to be requested
+    QMap<QString, int> m_activeMultigets;                  // addressbookUrl -> multigets in flight
+
+    // syncs to the remote side only, as determined by the sync profile direction.
+    bool m_toRemoteOnly;
+    QMap<QString, QString> m_remoteConflictEtags; // contact guid -> remote etag (empty if removed), see fetchContacts()
+
+    // sync cost estimation, see estimateRemoteChanges().
+    bool m_estimateOnly;
+    int m_estimatedAddressbooks;
+    int m_estimatedChangedAddressbooks;
+    int m_estimatedRemovals;
+    qint64 m_estimatedDownloadBytes;
+    int m_estimatedUnknownSizes;
 };
 
 class CardDavVCardConverter : public QVersitContactImporterPropertyHandlerV2,
@@ -143,8 +234,10 @@ public:
                          QList<QVersitProperty> *toBeRemoved, QList<QVersitProperty> *toBeAdded);
 
     // API exposed to clients
-    QPair<QContact, QStringList> convertVCardToContact(const QString &vcard, bool *ok);
+    QPair<QContact, QStringList> convertVCardToContact(const QByteArray &vcard, bool *ok);
     QString convertContactToVCard(const QContact &c, const QStringList &unsupportedProperties);
+    static QByteArray vCardHash(const QString &vcard);
+    static QByteArray vCardHash(const QByteArray &vcard);
 
 private:
     static QStringList supportedPropertyNames();
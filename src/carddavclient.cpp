@@ -28,6 +28,8 @@
 #include <ProfileEngineDefs.h>
 #include <ProfileManager.h>
 
+#include <QEventLoop>
+
 extern "C" CardDavClient* createPlugin(const QString& aPluginName,
                                        const Buteo::SyncProfile& aProfile,
                                        Buteo::PluginCbInterface *aCbInterface)
@@ -48,6 +50,7 @@ CardDavClient::CardDavClient(const QString& aPluginName,
     , m_accountId(0)
 {
     FUNCTION_CALL_TRACE;
+    m_startupTimer.start();
 }
 
 CardDavClient::~CardDavClient()
@@ -80,12 +83,23 @@ bool CardDavClient::init()
     m_conflictResPolicy = iProfile.conflictResolutionPolicy();
     if (!m_syncer) {
         m_syncer = new Syncer(this, &iProfile);
+        m_syncer->setStartupTimer(m_startupTimer);
         connect(m_syncer, SIGNAL(syncSucceeded()),
                 this, SLOT(syncSucceeded()));
         connect(m_syncer, SIGNAL(syncFailed()),
                 this, SLOT(syncFailed()));
     }
 
+    // resume the purges of removed accounts which were interrupted.
+    // They run alongside the sync, and are interrupted again if the plugin is unloaded first.
+    Q_FOREACH (int accountId, Syncer::pendingPurges()) {
+        if (accountId != m_accountId) {
+            LOG_DEBUG("Resuming purge of removed account" << accountId);
+            m_syncer->purgeAccount(accountId);
+        }
+    }
+
+    LOG_DEBUG("CardDAV plugin initialised" << m_startupTimer.elapsed() << "ms after plugin creation");
     return true;
 }
 
@@ -101,6 +115,7 @@ bool CardDavClient::startSync()
 {
     FUNCTION_CALL_TRACE;
     if (m_accountId == 0) return false;
+    LOG_DEBUG("Starting CardDAV sync" << m_startupTimer.elapsed() << "ms after plugin creation");
     m_syncer->startSync(m_accountId);
     return true;
 }
@@ -115,6 +130,13 @@ void CardDavClient::syncFailed()
     syncFinished(Buteo::SyncResults::INTERNAL_ERROR, QString());
 }
 
+void CardDavClient::purgeProgress(int accountId, int removedCount, int totalCount)
+{
+    LOG_DEBUG("Purged" << removedCount << "of" << totalCount << "contacts from account" << accountId);
+    emit transferProgress(getProfileName(), Sync::LOCAL_DATABASE, Sync::ITEM_DELETED,
+                          QStringLiteral("text/vcard"), removedCount);
+}
+
 void CardDavClient::abortSync(Sync::SyncStatus aStatus)
 {
     FUNCTION_CALL_TRACE;
@@ -166,7 +188,17 @@ bool CardDavClient::cleanUp()
     }
 
     if (!m_syncer) m_syncer = new Syncer(this, &iProfile);
+    connect(m_syncer, SIGNAL(purgeProgress(int,int,int)),
+            this, SLOT(purgeProgress(int,int,int)));
+
+    // the purge runs from the event loop, which is run here until it has finished.
+    QEventLoop loop;
+    connect(m_syncer, SIGNAL(purgeFinished(int,bool)),
+            &loop, SLOT(quit()));
     m_syncer->purgeAccount(m_accountId);
+    while (m_syncer->isPurging(m_accountId)) {
+        loop.exec();
+    }
     delete m_syncer;
     m_syncer = 0;
 
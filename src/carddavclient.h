@@ -30,6 +30,7 @@
 
 #include <QString>
 #include <QObject>
+#include <QElapsedTimer>
 
 class Syncer;
 class Q_DECL_EXPORT CardDavClient : public Buteo::ClientPlugin
@@ -55,6 +56,7 @@ public Q_SLOTS:
 private Q_SLOTS:
     void syncSucceeded();
     void syncFailed();
+    void purgeProgress(int accountId, int removedCount, int totalCount);
 
 private:
     void abort(Sync::SyncStatus aStatus = Sync::SYNC_ABORTED);
@@ -69,6 +71,7 @@ private:
 
     Syncer*                     m_syncer;
     int                         m_accountId;
+    QElapsedTimer               m_startupTimer;
 };
 
 /*! \brief Creates CardDav client plugin
@@ -29,8 +29,20 @@
 #include <QString>
 #include <QList>
 #include <QXmlStreamReader>
+#include <QIODevice>
 #include <QByteArray>
 #include <QRegularExpression>
+#include <QHash>
+#include <QMultiHash>
+#include <QTextCodec>
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <QContactGuid>
 
@@ -57,6 +69,577 @@ namespace {
         }
     }
 
+    void debugDumpData(const QByteArray &data)
+    {
+        // avoid transcoding large responses unless they will be logged.
+        if (Buteo::Logger::instance()->getLogLevel() < 7) {
+            return;
+        }
+        debugDumpData(QString::fromUtf8(data));
+    }
+
+    // whether a status line such as "HTTP/1.1 200 OK" reports success.
+    bool isSuccessStatus(const QString &status)
+    {
+        return status.trimmed().section(QLatin1Char(' '), 1, 1, QString::SectionSkipEmpty).startsWith(QLatin1Char('2'));
+    }
+
+    // The parts of each response in a multistatus response which we use.
+    // When scanned, these refer to the data of the response buffer wherever
+    // possible, so must not outlive it.
+    struct MultistatusResponse {
+        MultistatusResponse() : contentLength(-1) {}
+        QByteArray href;        // percent-encoded
+        QByteArray etag;
+        QByteArray status;      // of the propstat if given, otherwise of the response
+        QByteArray addressData;
+        qint64 contentLength;   // -1 if not reported by the server
+    };
+
+    // The properties of a propstat element, which are only used if its
+    // status reports success: servers report the properties which they
+    // could not return in a separate propstat (e.g. an empty getetag
+    // element with a 404 status), which must not replace the values
+    // reported in the successful propstat.
+    struct PropstatValues {
+        PropstatValues() : contentLength(-1), hasEtag(false), hasContentLength(false), hasAddressData(false) {}
+        QByteArray etag;
+        QByteArray addressData;
+        QByteArray status;
+        qint64 contentLength;
+        bool hasEtag;
+        bool hasContentLength;
+        bool hasAddressData;
+    };
+
+    void finishPropstat(const PropstatValues &propstat, MultistatusResponse *response)
+    {
+        // a propstat without a status is treated as successful.
+        const bool success = propstat.status.isEmpty() || isSuccessStatus(QString::fromUtf8(propstat.status));
+        if (!propstat.status.isEmpty()
+                && (response->status.isEmpty()
+                    || (success && !isSuccessStatus(QString::fromUtf8(response->status))))) {
+            response->status = propstat.status;
+        }
+        if (!success) {
+            return;
+        }
+        if (propstat.hasEtag) {
+            response->etag = propstat.etag;
+        }
+        if (propstat.hasContentLength) {
+            response->contentLength = propstat.contentLength;
+        }
+        if (propstat.hasAddressData) {
+            response->addressData = propstat.addressData;
+        }
+    }
+
+    qint64 parseContentLength(const QByteArray &text)
+    {
+        bool isNumber = false;
+        const qint64 contentLength = text.trimmed().toLongLong(&isNumber);
+        return isNumber ? contentLength : -1;
+    }
+
+    const int UTF8_MIB_ENUM = 106;
+
+    bool startsWithAt(const QByteArray &data, int pos, const char *str, int len)
+    {
+        return pos + len <= data.size() && qstrncmp(data.constData() + pos, str, len) == 0;
+    }
+
+
+    // decodes the predefined entities and the character references in XML character data.
+    QByteArray decodeEntities(const QByteArray &text)
+    {
+        QByteArray decoded;
+        decoded.reserve(text.size());
+        int i = 0;
+        while (i < text.size()) {
+            const int amp = text.indexOf('&', i);
+            if (amp < 0) {
+                decoded.append(text.constData() + i, text.size() - i);
+                break;
+            }
+            decoded.append(text.constData() + i, amp - i);
+            const int semicolon = text.indexOf(';', amp);
+            if (semicolon < 0) {
+                decoded.append(text.constData() + amp, text.size() - amp);
+                break;
+            }
+            const QByteArray entity = text.mid(amp + 1, semicolon - amp - 1);
+            bool ok = true;
+            uint codePoint = 0;
+            if (entity == "lt") {
+                decoded.append('<');
+            } else if (entity == "gt") {
+                decoded.append('>');
+            } else if (entity == "amp") {
+                decoded.append('&');
+            } else if (entity == "quot") {
+                decoded.append('"');
+            } else if (entity == "apos") {
+                decoded.append('\'');
+            } else if (entity.startsWith("#x")) {
+                codePoint = entity.mid(2).toUInt(&ok, 16);
+            } else if (entity.startsWith('#')) {
+                codePoint = entity.mid(1).toUInt(&ok, 10);
+            } else {
+                ok = false;
+            }
+            if (ok && codePoint) {
+                decoded.append(QString::fromUcs4(&codePoint, 1).toUtf8());
+            } else if (!ok) {
+                // not a reference we know; keep it verbatim.
+                decoded.append(text.constData() + amp, semicolon + 1 - amp);
+            }
+            i = semicolon + 1;
+        }
+        return decoded;
+    }
+
+    // Returns the index of the first '<' in data[from, size), or -1, and sets
+    // hasEntity if an '&' precedes it.  Character data (vCards in particular)
+    // is long and rarely contains either, so where SSE2 or NEON is available
+    // this looks at 16 bytes at a time.
+    int findMarkup(const char *data, int from, int size, bool *hasEntity)
+    {
+        int i = from;
+        bool entity = false;
+#if defined(__SSE2__)
+        const __m128i lt = _mm_set1_epi8('<');
+        const __m128i amp = _mm_set1_epi8('&');
+        for ( ; i + 16 <= size; i += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            const int ltMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lt));
+            const int ampMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, amp));
+            if (ltMask) {
+                const int offset = __builtin_ctz(ltMask);
+                entity = entity || (ampMask & ((1 << offset) - 1));
+                if (hasEntity) {
+                    *hasEntity = entity;
+                }
+                return i + offset;
+            }
+            entity = entity || ampMask;
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        const uint8x16_t lt = vdupq_n_u8('<');
+        const uint8x16_t amp = vdupq_n_u8('&');
+        for ( ; i + 16 <= size; i += 16) {
+            const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(data + i));
+            const uint8x16_t ltMatch = vceqq_u8(chunk, lt);
+            const uint8x16_t ampMatch = vceqq_u8(chunk, amp);
+            if (vmaxvq_u8(ltMatch)) {
+                // narrow each byte of the comparison results to a nibble, to find the offset.
+                const quint64 ltMask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(ltMatch), 4)), 0);
+                const quint64 ampMask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(ampMatch), 4)), 0);
+                const int offset = __builtin_ctzll(ltMask) / 4;
+                entity = entity || (ampMask & ((Q_UINT64_C(1) << (offset * 4)) - 1));
+                if (hasEntity) {
+                    *hasEntity = entity;
+                }
+                return i + offset;
+            }
+            entity = entity || vmaxvq_u8(ampMatch);
+        }
+#endif
+        for ( ; i < size; ++i) {
+            if (data[i] == '<') {
+                if (hasEntity) {
+                    *hasEntity = entity;
+                }
+                return i;
+            }
+            entity = entity || data[i] == '&';
+        }
+        if (hasEntity) {
+            *hasEntity = entity;
+        }
+        return -1;
+    }
+
+    // returns the index of the next markup at or after pos, or -1.
+    int nextMarkup(const QByteArray &data, int pos)
+    {
+        return findMarkup(data.constData(), pos, data.size(), Q_NULLPTR);
+    }
+
+    // Reads the character data of an element, starting after its start tag,
+    // up to its end tag.  Entities are only decoded if the data contains any,
+    // and otherwise the returned data refers to the response buffer rather
+    // than copying it.  Returns false if the element has child elements.
+    bool readCharacterData(const QByteArray &data, int pos, QByteArray *text, int *end)
+    {
+        bool appended = false;
+        while (true) {
+            bool hasEntity = false;
+            const int markup = findMarkup(data.constData(), pos, data.size(), &hasEntity);
+            if (markup < 0) {
+                return false;
+            }
+            const QByteArray segment = QByteArray::fromRawData(data.constData() + pos, markup - pos);
+            const QByteArray segmentText = hasEntity ? decodeEntities(segment) : segment;
+            if (!segmentText.isEmpty()) {
+                if (appended) {
+                    text->append(segmentText);
+                } else {
+                    *text = segmentText;
+                    appended = true;
+                }
+            }
+
+            if (startsWithAt(data, markup, "<![CDATA[", 9)) {
+                const int cdataEnd = data.indexOf("]]>", markup + 9);
+                if (cdataEnd < 0) {
+                    return false;
+                }
+                const QByteArray cdata = QByteArray::fromRawData(data.constData() + markup + 9, cdataEnd - markup - 9);
+                if (appended) {
+                    text->append(cdata);
+                } else {
+                    *text = cdata;
+                    appended = true;
+                }
+                pos = cdataEnd + 3;
+            } else if (startsWithAt(data, markup, "<!--", 4)) {
+                const int commentEnd = data.indexOf("-->", markup + 4);
+                if (commentEnd < 0) {
+                    return false;
+                }
+                pos = commentEnd + 3;
+            } else if (startsWithAt(data, markup, "</", 2)) {
+                *end = markup;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    }
+
+    // Reads the tag starting at data[pos] == '<', returning the local name (without
+    // any namespace prefix) and the index following the tag.
+    bool readTag(const QByteArray &data, int pos, QByteArray *localName, bool *endTag, bool *emptyElement, int *tagEnd)
+    {
+        const char *d = data.constData();
+        const int size = data.size();
+        int i = pos + 1;
+        *endTag = (i < size && d[i] == '/');
+        if (*endTag) {
+            ++i;
+        }
+        int nameStart = i;
+        while (i < size && d[i] != '>' && d[i] != '/'
+                && d[i] != ' ' && d[i] != '\t' && d[i] != '\r' && d[i] != '\n') {
+            if (d[i] == ':') {
+                nameStart = i + 1;
+            }
+            ++i;
+        }
+        *localName = QByteArray::fromRawData(d + nameStart, i - nameStart);
+
+        // skip any attributes.
+        char quote = 0;
+        for ( ; i < size; ++i) {
+            if (quote) {
+                if (d[i] == quote) {
+                    quote = 0;
+                }
+            } else if (d[i] == '"' || d[i] == '\'') {
+                quote = d[i];
+            } else if (d[i] == '>') {
+                *emptyElement = d[i - 1] == '/';
+                *tagEnd = i + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Scans a multistatus response for the elements we use, without building
+    // a document tree and without transcoding the data, which must be UTF-8.
+    // Anything unexpected (e.g. a DOCTYPE, which may declare entities, or
+    // child elements where we expect text) is reported as a failure, so that
+    // the caller can fall back to QXmlStreamReader.
+    QList<MultistatusResponse> scanMultistatus(const QByteArray &data, QByteArray *syncToken, bool *ok)
+    {
+        QList<MultistatusResponse> responses;
+        MultistatusResponse current;
+        PropstatValues propstat;
+        QByteArray responseStatus;
+        bool inResponse = false;
+        bool inPropstat = false;
+        *ok = false;
+
+        int pos = 0;
+        while ((pos = nextMarkup(data, pos)) >= 0) {
+            if (startsWithAt(data, pos, "<?", 2) || startsWithAt(data, pos, "<!--", 4)) {
+                const bool comment = data.at(pos + 1) == '!';
+                const int end = data.indexOf(comment ? "-->" : "?>", pos + 2);
+                if (end < 0) {
+                    return responses;
+                }
+                pos = end + (comment ? 3 : 2);
+                continue;
+            } else if (startsWithAt(data, pos, "<!", 2)) {
+                return responses;
+            }
+
+            QByteArray name;
+            bool endTag = false, emptyElement = false;
+            if (!readTag(data, pos, &name, &endTag, &emptyElement, &pos)) {
+                return responses;
+            }
+
+            if (endTag) {
+                if (name == "response" && inResponse) {
+                    if (current.status.isEmpty()) {
+                        current.status = responseStatus;
+                    }
+                    responses.append(current);
+                    inResponse = false;
+                } else if (name == "propstat" && inPropstat) {
+                    finishPropstat(propstat, &current);
+                    inPropstat = false;
+                }
+                continue;
+            }
+
+            if (name == "response") {
+                current = MultistatusResponse();
+                responseStatus.clear();
+                inPropstat = false;
+                inResponse = !emptyElement;
+                if (emptyElement) {
+                    responses.append(current);
+                }
+                continue;
+            } else if (name == "propstat") {
+                inPropstat = inResponse && !emptyElement;
+                propstat = PropstatValues();
+                continue;
+            } else if (name != "href" && name != "getetag" && name != "getcontentlength"
+                    && name != "status" && name != "address-data" && name != "sync-token") {
+                continue;
+            }
+
+            QByteArray text;
+            if (!emptyElement && !readCharacterData(data, pos, &text, &pos)) {
+                return responses;
+            }
+            if (!inResponse) {
+                if (name == "sync-token" && syncToken) {
+                    *syncToken = QByteArray(text.constData(), text.size());
+                }
+            } else if (name == "href") {
+                if (!inPropstat && current.href.isEmpty()) {
+                    current.href = text;
+                }
+            } else if (name == "getetag") {
+                if (inPropstat) {
+                    propstat.etag = text;
+                    propstat.hasEtag = true;
+                } else {
+                    current.etag = text;
+                }
+            } else if (name == "getcontentlength") {
+                if (inPropstat) {
+                    propstat.contentLength = parseContentLength(text);
+                    propstat.hasContentLength = true;
+                } else {
+                    current.contentLength = parseContentLength(text);
+                }
+            } else if (name == "status") {
+                if (inPropstat) {
+                    propstat.status = text;
+                } else {
+                    responseStatus = text;
+                }
+            } else if (name == "address-data") {
+                if (inPropstat) {
+                    propstat.addressData = text;
+                    propstat.hasAddressData = true;
+                } else {
+                    current.addressData = text;
+                }
+            }
+        }
+
+        *ok = !inResponse;
+        return responses;
+    }
+
+    // returns the encoding given in the XML declaration, if any.
+    QByteArray declaredEncoding(const QByteArray &data)
+    {
+        if (!data.startsWith("<?xml")) {
+            return QByteArray();
+        }
+        const int declarationEnd = data.indexOf("?>");
+        if (declarationEnd < 0) {
+            return QByteArray();
+        }
+        const QByteArray declaration = QByteArray::fromRawData(data.constData(), declarationEnd);
+        int i = declaration.indexOf("encoding");
+        if (i < 0 || (i = declaration.indexOf('=', i)) < 0) {
+            return QByteArray();
+        }
+        do {
+            ++i;
+        } while (i < declaration.size() && (declaration.at(i) == ' ' || declaration.at(i) == '\t'));
+        if (i >= declaration.size() || (declaration.at(i) != '"' && declaration.at(i) != '\'')) {
+            return QByteArray();
+        }
+        const int valueEnd = declaration.indexOf(declaration.at(i), i + 1);
+        if (valueEnd < 0) {
+            return QByteArray();
+        }
+        return declaration.mid(i + 1, valueEnd - i - 1).toLower();
+    }
+
+    // Reads each response element of a multistatus document as it is
+    // encountered, with QXmlStreamReader.  This is the reference for
+    // scanMultistatus(), and is used for anything that it cannot handle.
+    QList<MultistatusResponse> streamMultistatus(QXmlStreamReader &reader, QByteArray *syncToken)
+    {
+        QList<MultistatusResponse> responses;
+        MultistatusResponse current;
+        PropstatValues propstat;
+        QByteArray responseStatus;
+        bool inResponse = false;
+        bool inPropstat = false;
+
+        while (!reader.atEnd() && !reader.hasError()) {
+            const QXmlStreamReader::TokenType token = reader.readNext();
+            if (token == QXmlStreamReader::StartElement) {
+                const QStringRef name = reader.name();
+                if (name == QLatin1String("response")) {
+                    inResponse = true;
+                    current = MultistatusResponse();
+                    responseStatus.clear();
+                    inPropstat = false;
+                } else if (!inResponse) {
+                    if (name == QLatin1String("sync-token") && syncToken) {
+                        *syncToken = reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8();
+                    }
+                } else if (name == QLatin1String("propstat")) {
+                    inPropstat = true;
+                    propstat = PropstatValues();
+                } else if (name == QLatin1String("href") && !inPropstat && current.href.isEmpty()) {
+                    current.href = reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8();
+                } else if (name == QLatin1String("getetag")) {
+                    const QByteArray etag = reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8();
+                    if (inPropstat) {
+                        propstat.etag = etag;
+                        propstat.hasEtag = true;
+                    } else {
+                        current.etag = etag;
+                    }
+                } else if (name == QLatin1String("getcontentlength")) {
+                    const qint64 contentLength = parseContentLength(reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8());
+                    if (inPropstat) {
+                        propstat.contentLength = contentLength;
+                        propstat.hasContentLength = true;
+                    } else {
+                        current.contentLength = contentLength;
+                    }
+                } else if (name == QLatin1String("status")) {
+                    const QByteArray status = reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8();
+                    if (inPropstat) {
+                        propstat.status = status;
+                    } else {
+                        responseStatus = status;
+                    }
+                } else if (name == QLatin1String("address-data")) {
+                    const QByteArray addressData = reader.readElementText(QXmlStreamReader::IncludeChildElements).toUtf8();
+                    if (inPropstat) {
+                        propstat.addressData = addressData;
+                        propstat.hasAddressData = true;
+                    } else {
+                        current.addressData = addressData;
+                    }
+                }
+            } else if (token == QXmlStreamReader::EndElement) {
+                const QStringRef name = reader.name();
+                if (name == QLatin1String("propstat") && inPropstat) {
+                    finishPropstat(propstat, &current);
+                    inPropstat = false;
+                } else if (name == QLatin1String("response") && inResponse) {
+                    inResponse = false;
+                    if (current.status.isEmpty()) {
+                        current.status = responseStatus;
+                    }
+                    responses.append(current);
+                }
+            }
+        }
+
+        if (reader.hasError()) {
+            LOG_WARNING(Q_FUNC_INFO << "error parsing multistatus response:" << reader.errorString()
+                       << "after" << responses.size() << "responses");
+        }
+
+        return responses;
+    }
+
+    // Reads the responses of a multistatus document, scanning it directly if
+    // possible.  The returned data refer to *buffer, which is set to the
+    // document as UTF-8 (usually sharing the data of the given document).
+    QList<MultistatusResponse> readMultistatus(const QByteArray &data, QByteArray *buffer, QByteArray *syncToken)
+    {
+        // servers send UTF-8 in practice; anything else is converted first.
+        *buffer = data;
+        QTextCodec *codec = QTextCodec::codecForUtfText(data, Q_NULLPTR);
+        const QByteArray encoding = declaredEncoding(data);
+        if (!codec && !encoding.isEmpty() && encoding != "utf-8" && encoding != "us-ascii") {
+            codec = QTextCodec::codecForName(encoding);
+        }
+        if (codec && codec->mibEnum() != UTF8_MIB_ENUM) {
+            LOG_DEBUG(Q_FUNC_INFO << "converting multistatus response from" << codec->name());
+            *buffer = codec->toUnicode(data).toUtf8();
+        }
+
+        bool scanned = false;
+        QList<MultistatusResponse> responses = scanMultistatus(*buffer, syncToken, &scanned);
+        if (!scanned) {
+            LOG_DEBUG(Q_FUNC_INFO << "unexpected markup after" << responses.size()
+                      << "responses, parsing with QXmlStreamReader instead");
+            if (syncToken) {
+                syncToken->clear();
+            }
+            QXmlStreamReader reader(data);
+            responses = streamMultistatus(reader, syncToken);
+        }
+        return responses;
+    }
+
+    QList<ReplyParser::ResourceInformation> resourceInformation(const QList<MultistatusResponse> &responses)
+    {
+        QList<ReplyParser::ResourceInformation> resources;
+        resources.reserve(responses.size());
+        Q_FOREACH (const MultistatusResponse &response, responses) {
+            ReplyParser::ResourceInformation resource;
+            resource.href = QUrl::fromPercentEncoding(response.href);
+            resource.etag = QString::fromUtf8(response.etag);
+            resource.status = QString::fromUtf8(response.status);
+            resource.contentLength = response.contentLength;
+            resources.append(resource);
+        }
+        return resources;
+    }
+
+    // value -> key.  If several keys share a value, the last of them is used.
+    QHash<QString, QString> invertedMap(const QMap<QString, QString> &map)
+    {
+        QHash<QString, QString> inverted;
+        inverted.reserve(map.size());
+        for (QMap<QString, QString>::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+            inverted.insert(it.value(), it.key());
+        }
+        return inverted;
+    }
+
     QVariantMap elementToVMap(QXmlStreamReader &reader)
     {
         QVariantMap element;
@@ -241,6 +824,10 @@ QList<ReplyParser::AddressBookInformation> ReplyParser::parseAddressbookInformat
                         <d:displayname>My Address Book</d:displayname>
                         <cs:getctag>3145</cs:getctag>
                         <d:sync-token>http://sabredav.org/ns/sync-token/3145</d:sync-token>
+                        <cs:bulk-requests>
+                            <cs:simple><cs:max-resources>100</cs:max-resources><cs:max-bytes>1000000</cs:max-bytes></cs:simple>
+                            <cs:crud><cs:max-resources>100</cs:max-resources><cs:max-bytes>1000000</cs:max-bytes></cs:crud>
+                        </cs:bulk-requests>
                     </d:prop>
                     <d:status>HTTP/1.1 200 OK</d:status>
                 </d:propstat>
@@ -296,9 +883,27 @@ QList<ReplyParser::AddressBookInformation> ReplyParser::parseAddressbookInformat
         ResourceStatus addressbookResourceSpecified = StatusUnknown; // valid values are Unknown/True/False
         ResourceStatus resourcetypeStatus = StatusUnknown;  // valid values are Unknown/2xxOk/NotOk
         ResourceStatus otherPropertyStatus = StatusUnknown; // valid values are Unknown/2xxOk/NotOk
+        // most servers don't support bulk-requests, and report it with a 404 status
+        // in its own propstat, which must not affect our inference of the resource type.
+        for (int i = propstats.size() - 1; i >= 0; --i) {
+            const QVariantMap propstat = propstats[i].toMap();
+            const QStringList propKeys = propstat.value("prop").toMap().keys();
+            if (propKeys.contains(QStringLiteral("bulk-requests"))
+                    && (propKeys.size() == 1 || (propKeys.size() == 2 && propKeys.contains(QStringLiteral("@text"))))
+                    && !propstat.value("status").toMap().value("@text").toString().contains(QRegularExpression("2[0-9][0-9]"))) {
+                propstats.removeAt(i);
+            }
+        }
+
         Q_FOREACH (const QVariant &vpropstat, propstats) {
             QVariantMap propstat = vpropstat.toMap();
             const QVariantMap &prop(propstat.value("prop").toMap());
+            if (prop.contains("bulk-requests")) {
+                // we only use the crud form of bulk requests, as we also upsync modifications.
+                const QVariantMap crud = prop.value("bulk-requests").toMap().value("crud").toMap();
+                currInfo.bulkMaxResources = crud.value("max-resources").toMap().value("@text").toString().toInt();
+                currInfo.bulkMaxBytes = crud.value("max-bytes").toMap().value("@text").toString().toInt();
+            }
             if (prop.contains("getctag")) {
                 currInfo.ctag = prop.value("getctag").toMap().value("@text").toString();
             }
@@ -450,38 +1055,15 @@ QList<ReplyParser::ContactInformation> ReplyParser::parseSyncTokenDelta(const QB
     */
     debugDumpData(QString::fromUtf8(syncTokenDeltaResponse));
     QList<ReplyParser::ContactInformation> info;
-    QXmlStreamReader reader(syncTokenDeltaResponse);
-    QVariantMap vmap = xmlToVMap(reader);
-    QVariantMap multistatusMap = vmap[QLatin1String("multistatus")].toMap();
-    if (newSyncToken) {
-        *newSyncToken = multistatusMap.value("sync-token").toMap().value("@text").toString();
-    }
-
-    QVariantList responses;
-    if (multistatusMap[QLatin1String("response")].type() == QVariant::List) {
-        // multiple updates in the delta.
-        responses = multistatusMap[QLatin1String("response")].toList();
-    } else {
-        // only one update in the delta.
-        QVariantMap response = multistatusMap[QLatin1String("response")].toMap();
-        responses << response;
-    }
-
-    Q_FOREACH (const QVariant &rv, responses) {
-        QVariantMap rmap = rv.toMap();
+    const QList<ReplyParser::ResourceInformation> resources = parseMultistatus(syncTokenDeltaResponse, newSyncToken);
+    const QHash<QString, QString> uriToGuid = invertedMap(q->m_contactUris);
+    Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
         ReplyParser::ContactInformation currInfo;
-        currInfo.uri = QUrl::fromPercentEncoding(rmap.value("href").toMap().value("@text").toString().toUtf8());
-        currInfo.etag = rmap.value("propstat").toMap().value("prop").toMap().value("getetag").toMap().value("@text").toString();
-        QMap<QString, QString>::const_iterator it = q->m_contactUris.constBegin();
-        for ( ; it != q->m_contactUris.constEnd(); ++it) {
-            if (it.value() == currInfo.uri) {
-                currInfo.guid = it.key();
-            }
-        }
-        QString status = rmap.value("propstat").toMap().value("status").toMap().value("@text").toString();
-        if (status.isEmpty()) {
-            status = rmap.value("status").toMap().value("@text").toString();
-        }
+        currInfo.uri = resource.href;
+        currInfo.etag = resource.etag;
+        currInfo.contentLength = resource.contentLength;
+        currInfo.guid = uriToGuid.value(currInfo.uri);
+        const QString &status(resource.status);
         if (status.contains(QLatin1String("200 OK"))) {
             if (!currInfo.uri.endsWith(QStringLiteral(".vcf"), Qt::CaseInsensitive)) {
                 // this is probably a response for the addressbook resource,
@@ -536,41 +1118,23 @@ QList<ReplyParser::ContactInformation> ReplyParser::parseContactMetadata(const Q
     */
     debugDumpData(QString::fromUtf8(contactMetadataResponse));
     QList<ReplyParser::ContactInformation> info;
-    QXmlStreamReader reader(contactMetadataResponse);
-    QVariantMap vmap = xmlToVMap(reader);
-    QVariantMap multistatusMap = vmap[QLatin1String("multistatus")].toMap();
-    QVariantList responses;
-    if (multistatusMap[QLatin1String("response")].type() == QVariant::List) {
-        // multiple updates in the delta.
-        responses = multistatusMap[QLatin1String("response")].toList();
-    } else {
-        // only one update in the delta.
-        QVariantMap response = multistatusMap[QLatin1String("response")].toMap();
-        responses << response;
-    }
+    const QList<ReplyParser::ResourceInformation> resources = parseMultistatus(contactMetadataResponse);
+    const QHash<QString, QString> uriToGuid = invertedMap(q->m_contactUris);
 
     QSet<QString> seenUris;
-    Q_FOREACH (const QVariant &rv, responses) {
-        QVariantMap rmap = rv.toMap();
+    Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
         ReplyParser::ContactInformation currInfo;
-        currInfo.uri = QUrl::fromPercentEncoding(rmap.value("href").toMap().value("@text").toString().toUtf8());
-        currInfo.etag = rmap.value("propstat").toMap().value("prop").toMap().value("getetag").toMap().value("@text").toString();
-        QString status = rmap.value("propstat").toMap().value("status").toMap().value("@text").toString();
-        if (status.isEmpty()) {
-            status = rmap.value("status").toMap().value("@text").toString();
-        }
+        currInfo.uri = resource.href;
+        currInfo.etag = resource.etag;
+        currInfo.contentLength = resource.contentLength;
+        const QString &status(resource.status);
         if (!currInfo.uri.endsWith(QStringLiteral(".vcf"), Qt::CaseInsensitive)) {
             // this is probably a response for the addressbook resource,
             // rather than for a contact resource within the addressbook.
             LOG_DEBUG(Q_FUNC_INFO << "ignoring non-contact resource:" << currInfo.uri << currInfo.etag << status);
             continue;
         }
-        QMap<QString, QString>::const_iterator it = q->m_contactUris.constBegin();
-        for ( ; it != q->m_contactUris.constEnd(); ++it) {
-            if (it.value() == currInfo.uri) {
-                currInfo.guid = it.key();
-            }
-        }
+        currInfo.guid = uriToGuid.value(currInfo.uri);
         if (status.contains(QLatin1String("200 OK"))) {
             seenUris.insert(currInfo.uri);
             currInfo.modType = currInfo.guid.isEmpty()
@@ -613,6 +1177,37 @@ QList<ReplyParser::ContactInformation> ReplyParser::parseContactMetadata(const Q
     return info;
 }
 
+QList<ReplyParser::ResourceInformation> ReplyParser::parseMultistatus(const QByteArray &multistatusResponse, QString *syncToken)
+{
+    /* Unlike the other parse functions, this does not build a map of the
+       entire document, but instead reads each response element as it is
+       encountered.  Only the href, getetag, getcontentlength and status elements are used,
+       so it is suitable for very large PROPFIND or REPORT responses.
+       The status from the propstat element is preferred over the status
+       of the response element, if both are given.  If there are several
+       propstat elements (e.g. as getcontentlength is not supported by the
+       server) a successful status is preferred over a failed one.
+    */
+    QByteArray buffer;
+    QByteArray token;
+    const QList<ReplyParser::ResourceInformation> resources = resourceInformation(readMultistatus(multistatusResponse, &buffer, &token));
+    if (syncToken) {
+        *syncToken = QString::fromUtf8(token);
+    }
+    return resources;
+}
+
+QList<ReplyParser::ResourceInformation> ReplyParser::parseMultistatus(QIODevice *multistatusResponse, QString *syncToken)
+{
+    QXmlStreamReader reader(multistatusResponse);
+    QByteArray token;
+    const QList<ReplyParser::ResourceInformation> resources = resourceInformation(streamMultistatus(reader, &token));
+    if (syncToken) {
+        *syncToken = QString::fromUtf8(token);
+    }
+    return resources;
+}
+
 QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData(const QByteArray &contactData, const QString &addressbookUrl) const
 {
     /* We expect a response of the form:
@@ -652,26 +1247,46 @@ QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData
             </d:response>
         </d:multistatus>
     */
-    debugDumpData(QString::fromUtf8(contactData));
-    QXmlStreamReader reader(contactData);
-    QVariantMap vmap = xmlToVMap(reader);
-    QVariantMap multistatusMap = vmap[QLatin1String("multistatus")].toMap();
-    QVariantList responses;
-    if (multistatusMap[QLatin1String("response")].type() == QVariant::List) {
-        // multiple updates in the delta.
-        responses = multistatusMap[QLatin1String("response")].toList();
-    } else {
-        // only one update in the delta.
-        QVariantMap response = multistatusMap[QLatin1String("response")].toMap();
-        responses << response;
+    debugDumpData(contactData);
+
+    // The vCards are handed to the converter as slices of the response
+    // buffer, so that they are neither copied nor transcoded.
+    QByteArray buffer;
+    const QList<MultistatusResponse> responses = readMultistatus(contactData, &buffer, Q_NULLPTR);
+    q->m_metrics.add(SyncMetrics::ContactsParsed, responses.size());
+
+    // index the known contacts by UID, so that each contact is matched in constant time.
+    QMultiHash<QString, QString> uidToGuids;
+    for (QMap<QString, QString>::const_iterator it = q->m_contactUids.constBegin(); it != q->m_contactUids.constEnd(); ++it) {
+        uidToGuids.insert(it.value(), it.key());
     }
+    const QString addressbookGuidPrefix = QStringLiteral("%1:AB:%2:").arg(QString::number(q->m_accountId), addressbookUrl);
+    const QString accountAddressbookGuidPrefix = QStringLiteral("%1:AB:").arg(q->m_accountId);
+    const QString accountGuidPrefix = QStringLiteral("%1:").arg(q->m_accountId);
+    const QHash<QString, QString> uriToGuid = invertedMap(q->m_contactUris);
 
     QMap<QString, ReplyParser::FullContactInformation> uriToContactData;
-    Q_FOREACH (const QVariant &rv, responses) {
-        QVariantMap rmap = rv.toMap();
-        QString uri = QUrl::fromPercentEncoding(rmap.value("href").toMap().value("@text").toString().toUtf8());
-        QString etag = rmap.value("propstat").toMap().value("prop").toMap().value("getetag").toMap().value("@text").toString();
-        QString vcard = rmap.value("propstat").toMap().value("prop").toMap().value("address-data").toMap().value("@text").toString();
+    Q_FOREACH (const MultistatusResponse &response, responses) {
+        const QString uri = QUrl::fromPercentEncoding(response.href);
+        const QString etag = QString::fromUtf8(response.etag);
+        const QByteArray &vcard(response.addressData);
+
+        // if the vCard is unchanged since we last saw it (e.g. the server changed
+        // the etag only) there is no need to convert it or store it locally.
+        const QByteArray vcardHash = CardDavVCardConverter::vCardHash(vcard);
+        const QString knownGuid = uriToGuid.value(uri);
+        if (!knownGuid.isEmpty() && q->m_contactVCardHashes.value(knownGuid) == vcardHash) {
+            LOG_DEBUG("vCard of" << uri << "with guid" << knownGuid << "is unchanged, skipping conversion");
+            QContactGuid guid;
+            guid.setGuid(knownGuid);
+            ReplyParser::FullContactInformation fci;
+            fci.contact.saveDetail(&guid);
+            fci.etag = etag;
+            fci.vcardHash = vcardHash;
+            fci.unchanged = true;
+            uriToContactData.insert(uri, fci);
+            continue;
+        }
 
         // import the data as a vCard
         bool ok = true;
@@ -679,6 +1294,7 @@ QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData
         if (!ok) {
             continue;
         }
+        q->m_metrics.add(SyncMetrics::ContactsConverted);
 
         // fix up various details of the contact.
         QContact importedContact = result.first;
@@ -690,29 +1306,29 @@ QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData
         }
         bool found = false;
         QString migrateGuid;
-        QMap<QString,QString>::const_iterator it = q->m_contactUids.constBegin();
-        for ( ; it != q->m_contactUids.constEnd(); ++it) {
-            // see if the UID exists in our map already
-            if (it.value() == uid) {
-                // check to make sure that it's from the same addressbook by inspecting the guid prefix
-                if (it.key().startsWith(QStringLiteral("%1:AB:%2:").arg(QString::number(q->m_accountId), addressbookUrl))) {
-                    // found existing; use the local-device GUID instead.
-                    LOG_DEBUG("Found identical UID:" << uid << "from this addressbook, guid:" << it.key() << "- using.");
-                    guid.setGuid(it.key());
-                    found = true;
-                    break;
-                } else if (it.key().startsWith(QStringLiteral("%1:AB:").arg(q->m_accountId))) {
-                    // this is a contact with a duplicate UID but from a different addressbook
-                    LOG_DEBUG("Found identical UID:" << uid << "from different addressbook, guid:" << it.key() << "- ignoring.");
-                } else if (it.key().startsWith(QStringLiteral("%1:").arg(q->m_accountId))) {
-                    // this is a contact with a duplicate UID and we don't know which addresbook it's from.
-                    // this can only occur due to package upgrade (i.e., previously we didn't support duplicated UIDs at all).
-                    // in this case we can assume that this UID does identify this contact since otherwise sync would have failed due to duplicates.
-                    LOG_DEBUG("Found identical UID:" << uid << "from unknown addressbook due to old guid format, guid:" << it.key() << "- migrating.");
-                    migrateGuid = it.key();
-                    found = true;
-                    break;
-                }
+        // see if the UID exists in our map already.  The guids are visited
+        // in the order of the map, as the linear search of it used to do.
+        QStringList uidGuids = uidToGuids.values(uid);
+        std::sort(uidGuids.begin(), uidGuids.end());
+        Q_FOREACH (const QString &existingGuid, uidGuids) {
+            // check to make sure that it's from the same addressbook by inspecting the guid prefix
+            if (existingGuid.startsWith(addressbookGuidPrefix)) {
+                // found existing; use the local-device GUID instead.
+                LOG_DEBUG("Found identical UID:" << uid << "from this addressbook, guid:" << existingGuid << "- using.");
+                guid.setGuid(existingGuid);
+                found = true;
+                break;
+            } else if (existingGuid.startsWith(accountAddressbookGuidPrefix)) {
+                // this is a contact with a duplicate UID but from a different addressbook
+                LOG_DEBUG("Found identical UID:" << uid << "from different addressbook, guid:" << existingGuid << "- ignoring.");
+            } else if (existingGuid.startsWith(accountGuidPrefix)) {
+                // this is a contact with a duplicate UID and we don't know which addresbook it's from.
+                // this can only occur due to package upgrade (i.e., previously we didn't support duplicated UIDs at all).
+                // in this case we can assume that this UID does identify this contact since otherwise sync would have failed due to duplicates.
+                LOG_DEBUG("Found identical UID:" << uid << "from unknown addressbook due to old guid format, guid:" << existingGuid << "- migrating.");
+                migrateGuid = existingGuid;
+                found = true;
+                break;
             }
         }
         if (!found) {
@@ -722,10 +1338,13 @@ QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData
             guid.setGuid(QStringLiteral("%1:AB:%2:%3").arg(QString::number(q->m_accountId), addressbookUrl, uid));
             // also set the guid to uid mapping for the server-side addition.
             q->m_contactUids.insert(guid.guid(), uid);
+            uidToGuids.insert(uid, guid.guid());
             LOG_DEBUG("Parsed pure server-addition with guid:" << guid.guid());
         } else if (!migrateGuid.isEmpty()) {
             QString newguid = QStringLiteral("%1:AB:%2:%3").arg(QString::number(q->m_accountId), addressbookUrl, uid);
             q->migrateGuidData(migrateGuid, newguid, addressbookUrl); // migrate all state data for the old guid to the new one.
+            uidToGuids.remove(uid, migrateGuid);
+            uidToGuids.insert(uid, newguid);
             guid.setGuid(newguid);
         }
         importedContact.saveDetail(&guid);
@@ -735,6 +1354,7 @@ QMap<QString, ReplyParser::FullContactInformation> ReplyParser::parseContactData
         fci.contact = importedContact;
         fci.unsupportedProperties = result.second;
         fci.etag = etag;
+        fci.vcardHash = vcardHash;
         uriToContactData.insert(uri, fci);
     }
 
@@ -30,6 +30,8 @@
 
 #include <QContact>
 
+class QIODevice;
+
 QTCONTACTS_USE_NAMESPACE
 
 class CardDavVCardConverter;
@@ -39,10 +41,13 @@ class ReplyParser
 public:
     class AddressBookInformation {
         public:
+        AddressBookInformation() : bulkMaxResources(0), bulkMaxBytes(0) {}
         QString url;
         QString displayName;
         QString ctag;
         QString syncToken;
+        int bulkMaxResources; // zero if CS:bulk-requests is not supported
+        int bulkMaxBytes;     // zero if unlimited
     };
 
     class ContactInformation {
@@ -53,18 +58,31 @@ public:
             Modification,
             Deletion
         };
-        ContactInformation() : modType(Uninitialized) {}
+        ContactInformation() : modType(Uninitialized), contentLength(-1) {}
         ModificationType modType;
         QString uri;
         QString guid; // this is the prefixed form of the UID (accountNumber:UID)
         QString etag;
+        qint64 contentLength; // -1 if not reported by the server
+    };
+
+    class ResourceInformation {
+        public:
+        ResourceInformation() : contentLength(-1) {}
+        QString href; // percent-decoded
+        QString etag;
+        QString status;
+        qint64 contentLength; // -1 if not reported by the server
     };
 
     class FullContactInformation {
         public:
-        QContact contact;
+        FullContactInformation() : unchanged(false) {}
+        QContact contact;   // if unchanged, only the guid is set
         QStringList unsupportedProperties;
         QString etag;
+        QByteArray vcardHash;
+        bool unchanged;     // the vCard matches the one last downloaded or uploaded
     };
 
     enum ResponseType {
@@ -84,6 +102,11 @@ public:
     QList<ContactInformation> parseContactMetadata(const QByteArray &contactMetadataResponse, const QString &addresbookUrl) const;
     QMap<QString, FullContactInformation> parseContactData(const QByteArray &contactData, const QString &addressbookUrl) const;
 
+    // streaming parse of the href, etag and status of each response in a multistatus document.
+    // The byte array overload scans the data directly, unless it contains unexpected markup.
+    static QList<ResourceInformation> parseMultistatus(const QByteArray &multistatusResponse, QString *syncToken = 0);
+    static QList<ResourceInformation> parseMultistatus(QIODevice *multistatusResponse, QString *syncToken = 0);
+
 private:
     Syncer *q;
     mutable CardDavVCardConverter *m_converter;
@@ -91,6 +114,7 @@ private:
 
 Q_DECLARE_METATYPE(ReplyParser::AddressBookInformation)
 Q_DECLARE_METATYPE(ReplyParser::ContactInformation)
+Q_DECLARE_METATYPE(ReplyParser::ResourceInformation)
 Q_DECLARE_METATYPE(ReplyParser::FullContactInformation)
 
 #endif // REPLYPARSER_P_H
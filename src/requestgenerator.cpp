@@ -95,12 +95,16 @@ QNetworkReply *RequestGenerator::generateRequest(const QString &url,
     LOG_DEBUG("generateRequest():"
             << m_accessToken << reqUrl << depth << requestType
             << QString::fromUtf8(requestData));
-    return q->m_qnam.sendCustomRequest(req, requestType.toLatin1(), requestDataBuffer);
+    QNetworkReply *reply = q->networkAccessManager()->sendCustomRequest(req, requestType.toLatin1(), requestDataBuffer);
+    // keep the request body so that the request can be resent if it times out.
+    reply->setProperty("requestData", requestData);
+    return reply;
 }
 
 QNetworkReply *RequestGenerator::generateUpsyncRequest(const QString &url,
                                                        const QString &path,
                                                        const QString &ifMatch,
+                                                       const QString &ifNoneMatch,
                                                        const QString &contentType,
                                                        const QString &requestType,
                                                        const QString &request) const
@@ -131,6 +135,9 @@ QNetworkReply *RequestGenerator::generateUpsyncRequest(const QString &url,
     if (!ifMatch.isEmpty()) {
         req.setRawHeader("If-Match", ifMatch.toUtf8());
     }
+    if (!ifNoneMatch.isEmpty()) {
+        req.setRawHeader("If-None-Match", ifNoneMatch.toUtf8());
+    }
     if (!m_accessToken.isEmpty()) {
         req.setRawHeader("Authorization",
                          QString(QLatin1String("Bearer ")
@@ -145,10 +152,13 @@ QNetworkReply *RequestGenerator::generateUpsyncRequest(const QString &url,
     if (!request.isEmpty()) {
         QBuffer *requestDataBuffer = new QBuffer(q);
         requestDataBuffer->setData(requestData);
-        return q->m_qnam.sendCustomRequest(req, requestType.toLatin1(), requestDataBuffer);
+        QNetworkReply *reply = q->networkAccessManager()->sendCustomRequest(req, requestType.toLatin1(), requestDataBuffer);
+        // keep the request body so that the request can be resent if it times out.
+        reply->setProperty("requestData", requestData);
+        return reply;
     }
 
-    return q->m_qnam.sendCustomRequest(req, requestType.toLatin1());
+    return q->networkAccessManager()->sendCustomRequest(req, requestType.toLatin1());
 }
 
 QNetworkReply *RequestGenerator::currentUserInformation(const QString &serverUrl)
@@ -209,6 +219,7 @@ QNetworkReply *RequestGenerator::addressbooksInformation(const QString &serverUr
              "<d:displayname />"
              "<d:sync-token />"
              "<cs:getctag />"
+             "<cs:bulk-requests />"
           "</d:prop>"
         "</d:propfind>");
 
@@ -234,6 +245,7 @@ QNetworkReply *RequestGenerator::addressbookInformation(const QString &serverUrl
              "<d:displayname />"
              "<d:sync-token />"
              "<cs:getctag />"
+             "<cs:bulk-requests />"
           "</d:prop>"
         "</d:propfind>");
 
@@ -264,6 +276,7 @@ QNetworkReply *RequestGenerator::syncTokenDelta(const QString &serverUrl, const
           "<d:sync-level>1</d:sync-level>"
           "<d:prop>"
             "<d:getetag/>"
+            "<d:getcontentlength/>"
           "</d:prop>"
         "</d:sync-collection>").arg(syncToken.toHtmlEscaped());
 
@@ -286,12 +299,35 @@ QNetworkReply *RequestGenerator::contactEtags(const QString &serverUrl, const QS
         "<d:propfind xmlns:d=\"DAV:\">"
           "<d:prop>"
              "<d:getetag />"
+             "<d:getcontentlength />"
           "</d:prop>"
         "</d:propfind>");
 
     return generateRequest(serverUrl, addressbookPath, QLatin1String("1"), QLatin1String("PROPFIND"), requestStr);
 }
 
+QNetworkReply *RequestGenerator::contactEtag(const QString &serverUrl, const QString &contactPath)
+{
+    if (Q_UNLIKELY(contactPath.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "contact uri empty, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(serverUrl.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "server url empty, aborting");
+        return 0;
+    }
+
+    QString requestStr = QStringLiteral(
+        "<d:propfind xmlns:d=\"DAV:\">"
+          "<d:prop>"
+             "<d:getetag />"
+          "</d:prop>"
+        "</d:propfind>");
+
+    return generateRequest(serverUrl, contactPath, QLatin1String("0"), QLatin1String("PROPFIND"), requestStr);
+}
+
 QNetworkReply *RequestGenerator::contactData(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactEtags)
 {
     if (Q_UNLIKELY(contactEtags.isEmpty())) {
@@ -324,6 +360,31 @@ QNetworkReply *RequestGenerator::contactData(const QString &serverUrl, const QSt
     return generateRequest(serverUrl, addressbookPath, QLatin1String("1"), QLatin1String("REPORT"), requestStr);
 }
 
+QNetworkReply *RequestGenerator::addressbookQuery(const QString &serverUrl, const QString &addressbookPath)
+{
+    if (Q_UNLIKELY(addressbookPath.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "addressbook path empty, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(serverUrl.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "server url empty, aborting");
+        return 0;
+    }
+
+    // an empty filter matches every contact in the addressbook.
+    QString requestStr = QStringLiteral(
+        "<card:addressbook-query xmlns:d=\"DAV:\" xmlns:card=\"urn:ietf:params:xml:ns:carddav\">"
+            "<d:prop>"
+                "<d:getetag />"
+                "<card:address-data />"
+            "</d:prop>"
+            "<card:filter />"
+        "</card:addressbook-query>");
+
+    return generateRequest(serverUrl, addressbookPath, QLatin1String("1"), QLatin1String("REPORT"), requestStr);
+}
+
 QNetworkReply *RequestGenerator::contactMultiget(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactUris)
 {
     if (Q_UNLIKELY(contactUris.isEmpty())) {
@@ -389,7 +450,31 @@ QNetworkReply *RequestGenerator::upsyncAddMod(const QString &serverUrl, const QS
         return 0;
     }
 
-    return generateUpsyncRequest(serverUrl, contactPath, etag,
+    return generateUpsyncRequest(serverUrl, contactPath, etag, QString(),
+                                 QStringLiteral("text/vcard; charset=utf-8"),
+                                 QStringLiteral("PUT"), vcard);
+}
+
+QNetworkReply *RequestGenerator::upsyncAddition(const QString &serverUrl, const QString &contactPath, const QString &vcard)
+{
+    if (Q_UNLIKELY(vcard.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "vcard empty, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(contactPath.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "contact uri empty, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(serverUrl.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "server url empty, aborting");
+        return 0;
+    }
+
+    // only create the resource if it doesn't exist yet, so that
+    // the request can safely be retried if the response is lost.
+    return generateUpsyncRequest(serverUrl, contactPath, QString(), QStringLiteral("*"),
                                  QStringLiteral("text/vcard; charset=utf-8"),
                                  QStringLiteral("PUT"), vcard);
 }
@@ -411,6 +496,83 @@ QNetworkReply *RequestGenerator::upsyncDeletion(const QString &serverUrl, const
         return 0;
     }
 
-    return generateUpsyncRequest(serverUrl, contactPath, etag, QString(),
+    return generateUpsyncRequest(serverUrl, contactPath, etag, QString(), QString(),
                                  QStringLiteral("DELETE"), QString());
 }
+
+QNetworkReply *RequestGenerator::upsyncBulk(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactPaths, const QStringList &etags, const QStringList &vcards)
+{
+    if (Q_UNLIKELY(vcards.isEmpty() || contactPaths.size() != vcards.size() || etags.size() != vcards.size())) {
+        LOG_WARNING(Q_FUNC_INFO << "invalid resource list, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(addressbookPath.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "addressbook path empty, aborting");
+        return 0;
+    }
+
+    if (Q_UNLIKELY(serverUrl.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "server url empty, aborting");
+        return 0;
+    }
+
+    QString resources;
+    for (int i = 0; i < vcards.size(); ++i) {
+        resources.append(bulkResource(contactPaths[i], etags[i], vcards[i]));
+    }
+
+    return generateRequest(serverUrl, addressbookPath, QString(), QLatin1String("POST"), bulkRequest(resources));
+}
+
+// a resource of a CalendarServer bulk-requests "crud" multiput.  Resources
+// without an href are created, with a server-assigned href.
+QString RequestGenerator::bulkResource(const QString &contactPath, const QString &etag, const QString &vcard)
+{
+    QString resource(QStringLiteral("<cs:resource>"));
+    if (!contactPath.isEmpty()) {
+        resource.append(QStringLiteral("<d:href>%1</d:href>").arg(contactPath.toHtmlEscaped()));
+    }
+    if (!etag.isEmpty()) {
+        resource.append(QStringLiteral("<cs:if-match><d:getetag>%1</d:getetag></cs:if-match>").arg(etag.toHtmlEscaped()));
+    }
+    resource.append(QStringLiteral("<d:set><d:prop><card:address-data>%1</card:address-data></d:prop></d:set>").arg(vcard.toHtmlEscaped()));
+    resource.append(QStringLiteral("</cs:resource>"));
+    return resource;
+}
+
+QString RequestGenerator::bulkRequest(const QString &resources)
+{
+    return QStringLiteral(
+        "<cs:multiput xmlns:d=\"DAV:\" xmlns:cs=\"http://calendarserver.org/ns/\" xmlns:card=\"urn:ietf:params:xml:ns:carddav\">"
+            "%1"
+        "</cs:multiput>").arg(resources);
+}
+
+QNetworkReply *RequestGenerator::resend(QNetworkReply *reply)
+{
+    if (Q_UNLIKELY(!reply)) {
+        LOG_WARNING(Q_FUNC_INFO << "no reply to resend, aborting");
+        return 0;
+    }
+
+    // the custom verb is set on the request by sendCustomRequest().
+    QNetworkRequest req(reply->request());
+    const QByteArray requestType = req.attribute(QNetworkRequest::CustomVerbAttribute).toByteArray();
+    if (Q_UNLIKELY(requestType.isEmpty())) {
+        LOG_WARNING(Q_FUNC_INFO << "unknown request type for" << req.url() << ", aborting");
+        return 0;
+    }
+
+    const QByteArray requestData = reply->property("requestData").toByteArray();
+    LOG_DEBUG("resend():" << req.url() << requestType << ":" << requestData.length() << "bytes");
+    if (requestData.isEmpty()) {
+        return q->networkAccessManager()->sendCustomRequest(req, requestType);
+    }
+
+    QBuffer *requestDataBuffer = new QBuffer(q);
+    requestDataBuffer->setData(requestData);
+    QNetworkReply *retry = q->networkAccessManager()->sendCustomRequest(req, requestType, requestDataBuffer);
+    retry->setProperty("requestData", requestData);
+    return retry;
+}
@@ -46,9 +46,18 @@ public:
     QNetworkReply *syncTokenDelta(const QString &serverUrl, const QString &addressbookUrl, const QString &syncToken);
     QNetworkReply *contactEtags(const QString &serverUrl, const QString &addressbookPath);
     QNetworkReply *contactData(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactEtags);
+    QNetworkReply *addressbookQuery(const QString &serverUrl, const QString &addressbookPath);
     QNetworkReply *contactMultiget(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactUris);
+    QNetworkReply *contactEtag(const QString &serverUrl, const QString &contactPath);
+    QNetworkReply *upsyncAddition(const QString &serverUrl, const QString &contactPath, const QString &vcard);
     QNetworkReply *upsyncAddMod(const QString &serverUrl, const QString &contactPath, const QString &etag, const QString &vcard);
     QNetworkReply *upsyncDeletion(const QString &serverUrl, const QString &contactPath, const QString &etag);
+    QNetworkReply *upsyncBulk(const QString &serverUrl, const QString &addressbookPath, const QStringList &contactPaths, const QStringList &etags, const QStringList &vcards);
+    QNetworkReply *resend(QNetworkReply *reply);
+
+    // the parts of the body of an upsyncBulk() request, so that its size can be determined.
+    static QString bulkResource(const QString &contactPath, const QString &etag, const QString &vcard);
+    static QString bulkRequest(const QString &resources);
 
 private:
     QNetworkReply *generateRequest(const QString &url,
@@ -59,6 +68,7 @@ private:
     QNetworkReply *generateUpsyncRequest(const QString &url,
                                          const QString &path,
                                          const QString &ifMatch,
+                                         const QString &ifNoneMatch,
                                          const QString &contentType,
                                          const QString &requestType,
                                          const QString &request) const;
@@ -1,5 +1,5 @@
 QT       -= gui
-QT       += network dbus
+QT       += network dbus concurrent
 
 CONFIG += link_pkgconfig console
 PKGCONFIG += buteosyncfw5 libsignon-qt5 accounts-qt5 libsailfishkeyprovider
@@ -14,7 +14,11 @@ SOURCES += \
     $$PWD/auth.cpp \
     $$PWD/carddav.cpp \
     $$PWD/requestgenerator.cpp \
-    $$PWD/replyparser.cpp
+    $$PWD/replyparser.cpp \
+    $$PWD/syncstrategy.cpp \
+    $$PWD/stallmonitor.cpp \
+    $$PWD/syncmetrics.cpp \
+    $$PWD/unsupportedproperties.cpp
 
 HEADERS += \
     $$PWD/carddavclient.h \
@@ -22,7 +26,11 @@ HEADERS += \
     $$PWD/auth_p.h \
     $$PWD/carddav_p.h \
     $$PWD/requestgenerator_p.h \
-    $$PWD/replyparser_p.h
+    $$PWD/replyparser_p.h \
+    $$PWD/syncstrategy_p.h \
+    $$PWD/stallmonitor_p.h \
+    $$PWD/syncmetrics_p.h \
+    $$PWD/unsupportedproperties_p.h
 
 OTHER_FILES += \
     $$PWD/carddav.xml \
@@ -0,0 +1,150 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "stallmonitor_p.h"
+
+#include <QDataStream>
+#include <QStringList>
+
+#include <LogMacros.h>
+
+namespace {
+    const int HeartbeatInterval = 100; // milliseconds
+}
+
+QDataStream &operator<<(QDataStream &out, const StallStatistics &statistics)
+{
+    return out << statistics.stalls << statistics.totalDuration << statistics.longestDuration;
+}
+
+QDataStream &operator>>(QDataStream &in, StallStatistics &statistics)
+{
+    return in >> statistics.stalls >> statistics.totalDuration >> statistics.longestDuration;
+}
+
+StallMonitor::StallMonitor(QObject *parent)
+    : QObject(parent)
+    , m_duration(0)
+    , m_checkpointed(0)
+    , m_threshold(0)
+{
+    m_heartbeat.setInterval(HeartbeatInterval);
+    connect(&m_heartbeat, SIGNAL(timeout()),
+            this, SLOT(heartbeat()));
+}
+
+void StallMonitor::setThreshold(int milliseconds)
+{
+    m_threshold = milliseconds;
+}
+
+void StallMonitor::start(const QString &phase)
+{
+    m_statistics.clear();
+    m_phase = phase;
+    m_duration = 0;
+    m_sinceStart.start();
+    if (m_threshold > 0) {
+        m_sinceHeartbeat.start();
+        m_checkpointed = 0;
+        m_heartbeat.start();
+    }
+}
+
+void StallMonitor::stop()
+{
+    if (m_heartbeat.isActive()) {
+        checkpoint();
+        m_heartbeat.stop();
+    }
+    if (m_sinceStart.isValid()) {
+        m_duration = m_sinceStart.elapsed();
+        m_sinceStart.invalidate();
+    }
+}
+
+void StallMonitor::setPhase(const QString &phase)
+{
+    if (phase == m_phase) {
+        return;
+    }
+    checkpoint();
+    m_phase = phase;
+}
+
+qint64 StallMonitor::elapsed() const
+{
+    return m_sinceStart.isValid() ? m_sinceStart.elapsed() : m_duration;
+}
+
+void StallMonitor::heartbeat()
+{
+    // the event loop should return to us at least once per interval,
+    // anything beyond that is time for which it was blocked, less any
+    // which a checkpoint has already attributed to an earlier phase.
+    const qint64 sinceHeartbeat = m_sinceHeartbeat.restart();
+    record(sinceHeartbeat - qMax<qint64>(HeartbeatInterval, m_checkpointed), m_threshold);
+    m_checkpointed = 0;
+}
+
+void StallMonitor::checkpoint()
+{
+    if (!m_heartbeat.isActive()) {
+        return;
+    }
+
+    // the time since the last heartbeat (or checkpoint) is all attributed,
+    // as the heartbeat interval may not have elapsed before the phase ends.
+    // Unlike a late heartbeat, it can't be told how much of it the event loop
+    // was idle, so the threshold is raised by the interval, see checkpoint().
+    const qint64 sinceHeartbeat = m_sinceHeartbeat.elapsed();
+    record(sinceHeartbeat - m_checkpointed, m_threshold + HeartbeatInterval);
+    m_checkpointed = sinceHeartbeat;
+}
+
+void StallMonitor::record(qint64 stall, qint64 threshold)
+{
+    if (stall < threshold) {
+        return;
+    }
+
+    StallStatistics &statistics(m_statistics[m_phase]);
+    statistics.stalls += 1;
+    statistics.totalDuration += stall;
+    statistics.longestDuration = qMax(statistics.longestDuration, stall);
+    LOG_DEBUG(Q_FUNC_INFO << "event loop stalled for" << stall << "ms during sync phase" << m_phase);
+}
+
+QString StallMonitor::summary() const
+{
+    if (m_statistics.isEmpty()) {
+        return QStringLiteral("no stalls");
+    }
+
+    QStringList phases;
+    for (QMap<QString, StallStatistics>::const_iterator it = m_statistics.constBegin();
+            it != m_statistics.constEnd(); ++it) {
+        phases.append(QStringLiteral("%1: %2 stalls, %3 ms total, %4 ms longest")
+                      .arg(it.key()).arg(it->stalls).arg(it->totalDuration).arg(it->longestDuration));
+    }
+    return phases.join(QStringLiteral("; "));
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+#ifndef STALLMONITOR_P_H
+#define STALLMONITOR_P_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QString>
+#include <QMap>
+
+class QDataStream;
+
+// the event-loop stalls observed during a particular phase of a sync.
+class StallStatistics
+{
+public:
+    StallStatistics() : stalls(0), totalDuration(0), longestDuration(0) {}
+    qint32 stalls;          // number of stalls longer than the threshold
+    qint64 totalDuration;   // milliseconds
+    qint64 longestDuration; // milliseconds
+};
+
+QDataStream &operator<<(QDataStream &out, const StallStatistics &statistics);
+QDataStream &operator>>(QDataStream &in, StallStatistics &statistics);
+
+/*
+ * Detects stalls of the event loop during a sync.
+ *
+ * A heartbeat timer is run while monitoring, and the lag between its
+ * expected and actual firing is the length of time for which the event
+ * loop was blocked.  Every change of phase is also a checkpoint, at which
+ * the time since the last heartbeat or checkpoint is attributed to the
+ * phase which is ending, so that the time spent blocked in synchronous code
+ * is attributed to the phase which performed it, rather than to whichever
+ * phase is active when the event loop next runs.  Durations are accurate
+ * to within the heartbeat interval.
+ */
+class StallMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    StallMonitor(QObject *parent = 0);
+
+    // stalls shorter than the threshold are not recorded; zero disables monitoring.
+    void setThreshold(int milliseconds);
+    int threshold() const { return m_threshold; }
+
+    void start(const QString &phase);
+    void stop();
+    bool isActive() const { return m_heartbeat.isActive(); }
+
+    void setPhase(const QString &phase);
+    QString phase() const { return m_phase; }
+
+    // attributes the time since the last heartbeat or checkpoint to the
+    // current phase, e.g. before the statistics are read mid-phase.  That
+    // time may include up to one heartbeat interval in which the event loop
+    // was idle, so it only counts as a stall if it exceeds the threshold by
+    // an interval, and the stall recorded then includes that idle time.
+    void checkpoint();
+
+    QMap<QString, StallStatistics> statistics() const { return m_statistics; }
+    qint64 elapsed() const; // milliseconds since start()
+    QString summary() const;
+
+private Q_SLOTS:
+    void heartbeat();
+
+private:
+    void record(qint64 stall, qint64 threshold);
+
+    QTimer m_heartbeat;
+    QElapsedTimer m_sinceHeartbeat;
+    qint64 m_checkpointed;           // milliseconds after the last heartbeat already attributed by checkpoint()
+    QElapsedTimer m_sinceStart;
+    qint64 m_duration;               // of the last monitored sync, once stopped
+    int m_threshold;
+    QString m_phase;
+    QMap<QString, StallStatistics> m_statistics; // phase -> stalls during that phase
+};
+
+#endif // STALLMONITOR_P_H
@@ -31,10 +31,21 @@
 #include <QtCore/QUrl>
 #include <QtCore/QUrlQuery>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QDir>
 #include <QtCore/QByteArray>
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
 #include <QtCore/QJsonArray>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
+#include <QtCore/QSaveFile>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QDataStream>
+#include <QtCore/QCryptographicHash>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <algorithm>
 
 #include <QtContacts/QContact>
 #include <QtContacts/QContactManager>
@@ -56,23 +67,115 @@
 
 #define CARDDAV_CONTACTS_SYNCTARGET QLatin1String("carddav")
 static const int HTTP_UNAUTHORIZED_ACCESS = 401;
+static const int HTTP_REQUEST_TIMEOUT = 408;
+static const int PURGE_CHUNK_SIZE = 500;      // contacts removed per transaction
+static const int PURGE_CHUNK_INTERVAL = 50;   // milliseconds between transactions, during which the event loop runs
+static const quint32 SHARD_VERSION = 2; // version 1 did not store vCard hashes
+static const quint32 SHARD_INDEX_VERSION = 1;
+static const quint32 UPSYNC_LOOP_STATE_VERSION = 2; // version 1 did not store quarantined edits
+static const quint32 RECONCILIATION_STATE_VERSION = 1;
+static const quint32 STRATEGY_STATISTICS_VERSION = 1;
+static const quint32 SYNC_STATISTICS_VERSION = 1;
+static const int DEFAULT_RECONCILIATION_INTERVAL = 100; // syncs between reconciliations, zero to disable
+static const int DEFAULT_STALL_THRESHOLD = 200;         // milliseconds, zero to disable stall monitoring
+static const int INSPECT_LARGEST_PROPERTIES = 10;       // unsupported property payloads listed by inspectState()
+static const int DEFAULT_METRICS_INTERFACE = 0;         // whether to serve live sync metrics, see SyncMetricsServer
+static const int METRICS_PUBLISH_INTERVAL = 250;        // milliseconds between unforced publishMetrics()
+enum ShardValue {
+    ShardHasUid = 0x01,
+    ShardHasUri = 0x02,
+    ShardHasEtag = 0x04,
+    ShardHasId = 0x08,
+    ShardHasUnsupportedProperties = 0x10,
+    ShardHasVCardHash = 0x20
+};
 
 Syncer::Syncer(QObject *parent, Buteo::SyncProfile *syncProfile)
     : QObject(parent), QtContactsSqliteExtensions::TwoWayContactSyncAdapter(CARDDAV_CONTACTS_SYNCTARGET)
     , m_syncProfile(syncProfile)
     , m_cardDav(0)
     , m_auth(0)
+    , m_contactManager(0)
+    , m_purgeRemovedCount(0)
+    , m_qnam(0)
     , m_syncAborted(false)
     , m_syncError(false)
+    , m_remoteChangesStored(false)
+    , m_estimateOnly(false)
+    , m_inspectOnly(false)
+    , m_stateDataRead(false)
+    , m_stateCommitPending(false)
+    , m_stateCommitInterrupted(false)
+    , m_reconcileState(false)
+    , m_reconciliationRequired(false)
+    , m_syncsSinceReconciliation(0)
+    , m_legacyStateMigrated(false)
+    , m_stateCorrupt(false)
     , m_accountId(0)
     , m_ignoreSslErrors(false)
 {
+    connect(&m_stateEncodingWatcher, SIGNAL(finished()),
+            this, SLOT(stateDataEncoded()));
+    connect(this, SIGNAL(syncSucceeded()),
+            this, SLOT(reportSyncStatistics()));
+    connect(this, SIGNAL(syncFailed()),
+            this, SLOT(reportSyncStatistics()));
+    connect(this, SIGNAL(syncEstimated(SyncCostEstimate)),
+            this, SLOT(reportSyncStatistics()));
 }
 
 Syncer::~Syncer()
 {
+    m_metricsThread.quit();
+    m_metricsThread.wait();
+    if (m_stateCommitPending) {
+        // the sync was aborted while the state was being encoded.  The local
+        // and remote changes have been made by now, so the state must be stored.
+        LOG_DEBUG(Q_FUNC_INFO << "waiting for the sync state data to be encoded");
+        disconnect(&m_stateEncodingWatcher, 0, this, 0);
+        m_stateEncodingWatcher.waitForFinished();
+        if (!commitStateData()) {
+            LOG_WARNING(Q_FUNC_INFO << "unable to finalise sync state");
+        }
+    }
     delete m_auth;
     delete m_cardDav;
+    delete m_contactManager;
+}
+
+void Syncer::setStartupTimer(const QElapsedTimer &timer)
+{
+    m_startupTimer = timer;
+}
+
+QContactManager *Syncer::contactManager()
+{
+    // only needed for account purge and released quarantines, so avoid opening it for every sync.
+    if (!m_contactManager) {
+        m_contactManager = new QContactManager;
+    }
+    return m_contactManager;
+}
+
+QNetworkAccessManager *Syncer::networkAccessManager()
+{
+    if (!m_qnam) {
+        if (m_startupTimer.isValid()) {
+            LOG_DEBUG(Q_FUNC_INFO << "sending first request" << m_startupTimer.elapsed() << "ms after plugin creation");
+        }
+        m_qnam = new QNetworkAccessManager(this);
+    }
+    return m_qnam;
+}
+
+bool Syncer::fromRemoteOnly() const
+{
+    return m_syncProfile && m_syncProfile->syncDirection() == Buteo::SyncProfile::SYNC_DIRECTION_FROM_REMOTE;
+}
+
+bool Syncer::toRemoteOnly() const
+{
+    return m_syncProfile && m_syncProfile->syncDirection() == Buteo::SyncProfile::SYNC_DIRECTION_TO_REMOTE;
 }
 
 bool Syncer::testAccountProvenance(const QContact &contact, const QString &accountId)
@@ -89,6 +192,29 @@ void Syncer::startSync(int accountId)
 {
     Q_ASSERT(accountId != 0);
     m_accountId = accountId;
+
+    bool thresholdOk = false;
+    const int stallThreshold = m_syncProfile
+            ? m_syncProfile->key(QStringLiteral("stall_threshold")).toInt(&thresholdOk) : 0;
+    m_stallMonitor.setThreshold((thresholdOk && stallThreshold >= 0) ? stallThreshold : DEFAULT_STALL_THRESHOLD);
+    m_stallMonitor.start(QStringLiteral("signin"));
+
+    // the metrics are served from their own thread, so that they can be
+    // read while this thread is busy, e.g. storing contacts.
+    m_metrics.start(accountId);
+    bool metricsOk = false;
+    const int metricsInterface = m_syncProfile
+            ? m_syncProfile->key(QStringLiteral("metrics_interface")).toInt(&metricsOk) : 0;
+    if ((metricsOk ? metricsInterface : DEFAULT_METRICS_INTERFACE) != 0 && !m_metricsThread.isRunning()) {
+        SyncMetricsServer *metricsServer = new SyncMetricsServer(&m_metrics);
+        metricsServer->moveToThread(&m_metricsThread);
+        connect(&m_metricsThread, SIGNAL(finished()), metricsServer, SLOT(deleteLater()));
+        m_metricsThread.start(QThread::LowPriority);
+        QMetaObject::invokeMethod(metricsServer, "listen", Qt::QueuedConnection,
+                                  Q_ARG(QString, SyncMetricsServer::serverName(accountId)));
+    }
+    publishMetrics(true);
+
     m_auth = new Auth(this);
     connect(m_auth, SIGNAL(signInCompleted(QString,QString,QString,QString,QString,bool)),
             this, SLOT(sync(QString,QString,QString,QString,QString,bool)));
@@ -98,6 +224,14 @@ void Syncer::startSync(int accountId)
     m_auth->signIn(accountId);
 }
 
+void Syncer::estimateSync(int accountId)
+{
+    // as startSync(), but only the discovery and metadata requests are
+    // performed, and nothing is stored either locally or remotely.
+    m_estimateOnly = true;
+    startSync(accountId);
+}
+
 void Syncer::signInError()
 {
     emit syncFailed();
@@ -111,6 +245,7 @@ void Syncer::sync(const QString &serverUrl, const QString &addressbookPath, cons
     m_password = password;
     m_accessToken = accessToken;
     m_ignoreSslErrors = ignoreSslErrors;
+    setPhase(QStringLiteral("readstate"));
 
     QDateTime remoteSince;
     if (!initSyncAdapter(QString::number(m_accountId))
@@ -120,6 +255,17 @@ void Syncer::sync(const QString &serverUrl, const QString &addressbookPath, cons
         cardDavError();
         return;
     }
+    m_stateDataRead = true;
+    if (m_stateCommitInterrupted) {
+        // the sync adapter's state may be older than the extra state, which
+        // describes the changes it made, so they would be replayed.  As after
+        // a failed sync which stored remote changes, the next sync is a clean
+        // sync which reconciles the extra state.
+        LOG_WARNING(Q_FUNC_INFO << "the previous sync did not finish storing its state for account" << m_accountId);
+        m_remoteChangesStored = true;
+        cardDavError();
+        return;
+    }
 
     LOG_DEBUG("Sync adapter initialised, determining remote changes since" << remoteSince.toString(Qt::ISODate) << "for account" << m_accountId);
     determineRemoteChanges(remoteSince, QString::number(m_accountId));
@@ -130,16 +276,71 @@ void Syncer::determineRemoteChanges(const QDateTime &, const QString &)
     m_cardDav = m_username.isEmpty()
               ? new CardDav(this, m_serverUrl, m_addressbookPath, m_accessToken)
               : new CardDav(this, m_serverUrl, m_addressbookPath, m_username, m_password);
-    connect(m_cardDav, SIGNAL(remoteChanges(QList<QContact>,QList<QContact>,QList<QContact>)),
-            this, SLOT(continueSync(QList<QContact>,QList<QContact>,QList<QContact>)));
+    connect(m_cardDav, SIGNAL(remoteChangesAvailable()),
+            this, SLOT(continueSync()));
     connect(m_cardDav, SIGNAL(upsyncCompleted()),
             this, SLOT(syncFinished()));
     connect(m_cardDav, SIGNAL(error(int)),
             this, SLOT(cardDavError(int)));
+    if (m_estimateOnly) {
+        connect(m_cardDav, SIGNAL(remoteEstimateAvailable()),
+                this, SLOT(estimateFinished()));
+        m_cardDav->estimateRemoteChanges();
+        return;
+    }
     m_cardDav->determineRemoteAMR();
 }
 
-void Syncer::continueSync(const QList<QContact> &added, const QList<QContact> &modified, const QList<QContact> &removed)
+void Syncer::estimateFinished()
+{
+    if (m_syncAborted || m_syncError) {
+        LOG_WARNING(Q_FUNC_INFO << "sync estimate error or aborted");
+        cardDavError();
+        return;
+    }
+
+    SyncCostEstimate estimate;
+    m_cardDav->remoteEstimate(&estimate);
+    if (fromRemoteOnly()) {
+        LOG_DEBUG(Q_FUNC_INFO << "estimated sync for account" << m_accountId << ":"
+                 << estimate.databaseWrites() << "local writes and"
+                 << estimate.downloadBytes << "bytes to download");
+        emit syncEstimated(estimate);
+        return;
+    }
+    setPhase(QStringLiteral("localdelta"));
+
+    // the sync adapter only determines the local changes once the remote
+    // changes have been stored, so no remote changes are stored instead.
+    // The state data is not stored afterwards, so nothing is recorded.
+    QList<QContact> noRemoteAddMods;
+    if (!storeRemoteChanges(QList<QContact>(), &noRemoteAddMods, QString::number(m_accountId))) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to prepare local change detection for account" << m_accountId);
+        cardDavError();
+        return;
+    }
+
+    // the local delta is determined relative to the last stored remote state,
+    // so some of these changes may turn out to be unchanged or conflicting.
+    QDateTime localSince;
+    QList<QContact> locallyAdded, locallyModified, locallyDeleted;
+    if (!determineLocalDelta(&localSince, &locallyAdded, &locallyModified, &locallyDeleted)) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to determine local changes for account" << m_accountId);
+        cardDavError();
+        return;
+    }
+    estimate.localAdditions = locallyAdded.size();
+    estimate.localModifications = locallyModified.size();
+    estimate.localRemovals = locallyDeleted.size();
+
+    LOG_DEBUG(Q_FUNC_INFO << "estimated sync for account" << m_accountId << ":"
+             << estimate.databaseWrites() << "local writes,"
+             << estimate.uploads() << "uploads and"
+             << estimate.downloadBytes << "bytes to download");
+    emit syncEstimated(estimate);
+}
+
+void Syncer::continueSync()
 {
     if (m_syncAborted || m_syncError) {
         LOG_WARNING(Q_FUNC_INFO << "sync error or aborted");
@@ -147,16 +348,23 @@ void Syncer::continueSync(const QList<QContact> &added, const QList<QContact> &m
         return;
     }
 
-    // store the remote changes locally
-    QList<QContact> addMod = added+modified, del = removed;
-    LOG_DEBUG(Q_FUNC_INFO << "storing remote changes to local device: AMR:"
-             << added.count() << modified.count() << removed.count()
+    // store the remote changes locally.
+    // We take ownership of the lists rather than copying them, so that
+    // no further copies of the downsynced contacts are made before storing.
+    setPhase(QStringLiteral("store"));
+    QList<QContact> addMod, del;
+    m_cardDav->takeRemoteChanges(&addMod, &del);
+    LOG_DEBUG(Q_FUNC_INFO << "storing remote changes to local device: AM, R:"
+             << addMod.count() << del.count()
              << "for account:" << m_accountId);
     if (!storeRemoteChanges(del, &addMod, QString::number(m_accountId))) {
         LOG_WARNING(Q_FUNC_INFO << "unable to store remote changes for account" << m_accountId);
         cardDavError();
         return;
     }
+    m_remoteChangesStored = true;
+    m_metrics.add(SyncMetrics::ContactsStored, addMod.size() + del.size());
+    publishMetrics();
 
     // now update our id mapping in case anything changed.
     // this is necessary especially for added contacts, which previously had no id.
@@ -172,8 +380,42 @@ void Syncer::continueSync(const QList<QContact> &added, const QList<QContact> &m
     }
 
     // continue with the upsync half of the sync process.
+    // The local changes are determined even if they will not be upsynced,
+    // as the sync adapter records the state of the local database as it does so.
+    setPhase(QStringLiteral("localdelta"));
     QDateTime localSince;
     QList<QContact> locallyAdded, locallyModified, locallyDeleted;
+    if (!determineLocalDelta(&localSince, &locallyAdded, &locallyModified, &locallyDeleted)) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to determine local changes for account" << m_accountId);
+        cardDavError();
+        return;
+    }
+
+    // from-remote syncs intentionally do the same work as two-way syncs up to
+    // this point: the local changes must be determined for the sync adapter's
+    // record of the local database to stay consistent, and the unsupported
+    // properties of downloaded contacts are stored for later uploads to
+    // preserve them.  Only the upsync itself is skipped.
+    if (fromRemoteOnly()) {
+        LOG_DEBUG(Q_FUNC_INFO << "skipping upsync of" << locallyAdded.size() << locallyModified.size() << locallyDeleted.size()
+                 << "local changes due to sync profile direction setting");
+        syncFinished();
+        return;
+    }
+
+    if (!releaseQuarantinedEdits(&locallyModified)) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to release quarantined edits for account" << m_accountId);
+        cardDavError();
+        return;
+    }
+    upsyncLocalChanges(localSince, locallyAdded, locallyModified, locallyDeleted, QString::number(m_accountId));
+}
+
+bool Syncer::determineLocalDelta(QDateTime *localSince,
+                                 QList<QContact> *locallyAdded,
+                                 QList<QContact> *locallyModified,
+                                 QList<QContact> *locallyDeleted)
+{
     // Note: we may still upsync these ignorable details+fields, just don't look at them during delta detection.
     // We need to do this, otherwise there can be infinite loops caused due to spurious differences between the
     // in-memory version (QContact) and the exportable version (vCard) resulting in ETag updates server-side.
@@ -186,19 +428,8 @@ void Syncer::continueSync(const QList<QContact> &added, const QList<QContact> &m
     ignorableDetailFields[QContactDetail::TypeAddress] << QContactAddress::FieldSubTypes;         // and ADR subtypes
     ignorableDetailFields[QContactDetail::TypePhoneNumber] << QContactPhoneNumber::FieldSubTypes; // and TEL number subtypes
     ignorableDetailFields[QContactDetail::TypeUrl] << QContactUrl::FieldSubType;                  // and URL subtype
-    if (!determineLocalChanges(&localSince, &locallyAdded, &locallyModified, &locallyDeleted,
-                               QString::number(m_accountId), ignorableDetailTypes, ignorableDetailFields)) {
-        LOG_WARNING(Q_FUNC_INFO << "unable to determine local changes for account" << m_accountId);
-        cardDavError();
-        return;
-    }
-
-    if (!m_syncProfile || m_syncProfile->syncDirection() != Buteo::SyncProfile::SYNC_DIRECTION_FROM_REMOTE) {
-        upsyncLocalChanges(localSince, locallyAdded, locallyModified, locallyDeleted, QString::number(m_accountId));
-    } else {
-        LOG_DEBUG(Q_FUNC_INFO << "skipping upsync due to sync profile direction setting");
-        syncFinished();
-    }
+    return determineLocalChanges(localSince, locallyAdded, locallyModified, locallyDeleted,
+                                 QString::number(m_accountId), ignorableDetailTypes, ignorableDetailFields);
 }
 
 void Syncer::upsyncLocalChanges(const QDateTime &localSince,
@@ -216,7 +447,36 @@ void Syncer::upsyncLocalChanges(const QDateTime &localSince,
     QMap<QString, QList<QContact> > added;
     QMap<QString, QList<QContact> > modified;
     QMap<QString, QList<QContact> > deleted;
+    if (!routeLocalChanges(locallyAdded, locallyModified, locallyDeleted,
+                           &added, &modified, &deleted, &modifiedAddressbookUrls)) {
+        cardDavError();
+        return;
+    }
+
+    // now upsync the changes for each addressbook
+    if (modifiedAddressbookUrls.size()) {
+        Q_FOREACH (const QString &addressbookUrl, modifiedAddressbookUrls) {
+            m_cardDav->upsyncUpdates(addressbookUrl,
+                                     added[addressbookUrl],
+                                     modified[addressbookUrl],
+                                     deleted[addressbookUrl]);
+        }
+    } else {
+        // nothing to upsync.
+        syncFinished();
+    }
+}
 
+// Determines the addressbook to which each local change should be upsynced.
+// Additions are upsynced to the default addressbook.
+bool Syncer::routeLocalChanges(const QList<QContact> &locallyAdded,
+                               const QList<QContact> &locallyModified,
+                               const QList<QContact> &locallyDeleted,
+                               QMap<QString, QList<QContact> > *added,
+                               QMap<QString, QList<QContact> > *modified,
+                               QMap<QString, QList<QContact> > *deleted,
+                               QSet<QString> *modifiedAddressbookUrls)
+{
     QString addedContactsAddressbook = m_defaultAddressbook;
     if (addedContactsAddressbook.isEmpty()) {
         addedContactsAddressbook = m_addressbookCtags.keys().size()
@@ -230,52 +490,72 @@ void Syncer::upsyncLocalChanges(const QDateTime &localSince,
     }
     if (addedContactsAddressbook.isEmpty()) {
         LOG_WARNING(Q_FUNC_INFO << "no known addressbooks, failing");
-        cardDavError();
-        return;
+        return false;
     }
 
     Q_FOREACH (const QContact &a, locallyAdded) {
-        added[addedContactsAddressbook].append(a);
-        modifiedAddressbookUrls.insert(addedContactsAddressbook);
+        (*added)[addedContactsAddressbook].append(a);
+        modifiedAddressbookUrls->insert(addedContactsAddressbook);
     }
+    // the state of the addressbooks which contain modified or deleted
+    // contacts is needed in order to route those changes.
+    QStringList requiredShards;
+    bool requireAllShards = false;
+    Q_FOREACH (const QContact &c, locallyModified + locallyDeleted) {
+        const QString addressbookUrl = addressbookForGuid(c.detail<QContactGuid>().guid());
+        if (addressbookUrl.isEmpty()) {
+            requireAllShards = true;
+        } else if (!requiredShards.contains(addressbookUrl)) {
+            requiredShards.append(addressbookUrl);
+        }
+    }
+    if (!ensureShardsLoaded(requireAllShards ? m_shardIndex.keys() : requiredShards)) {
+        return false;
+    }
+
     Q_FOREACH (const QContact &m, locallyModified) {
         Q_FOREACH (const QString &addressbookUrl, m_addressbookContactGuids.keys()) {
             if (m_addressbookContactGuids[addressbookUrl].contains(m.detail<QContactGuid>().guid())) {
-                modified[addressbookUrl].append(m);
-                modifiedAddressbookUrls.insert(addressbookUrl);
+                (*modified)[addressbookUrl].append(m);
+                modifiedAddressbookUrls->insert(addressbookUrl);
             }
         }
     }
     Q_FOREACH (const QContact &d, locallyDeleted) {
         Q_FOREACH (const QString &addressbookUrl, m_addressbookContactGuids.keys()) {
             if (m_addressbookContactGuids[addressbookUrl].contains(d.detail<QContactGuid>().guid())) {
-                deleted[addressbookUrl].append(d);
-                modifiedAddressbookUrls.insert(addressbookUrl);
+                (*deleted)[addressbookUrl].append(d);
+                modifiedAddressbookUrls->insert(addressbookUrl);
             }
         }
     }
 
-    // now upsync the changes for each addressbook
-    if (modifiedAddressbookUrls.size()) {
-        Q_FOREACH (const QString &addressbookUrl, modifiedAddressbookUrls) {
-            m_cardDav->upsyncUpdates(addressbookUrl,
-                                     added[addressbookUrl],
-                                     modified[addressbookUrl],
-                                     deleted[addressbookUrl]);
-        }
-    } else {
-        // nothing to upsync.
-        syncFinished();
-    }
+    return true;
 }
 
 void Syncer::syncFinished()
 {
     // finished upsync.  Just need to store our state data and we're done.
+    // The per-addressbook state can take a while to encode for large accounts,
+    // so that is done on a worker thread, and stored in stateDataEncoded().
     LOG_DEBUG(Q_FUNC_INFO << "about to store sync state data");
-    if (!storeExtraStateData(m_accountId) || !storeSyncStateData(QString::number(m_accountId))) {
+    setPhase(QStringLiteral("storestate"));
+    ShardSnapshot snapshot;
+    m_pendingStateValues.clear();
+    prepareExtraStateData(&m_pendingStateValues, &snapshot);
+    m_stateCommitPending = true;
+    m_stateEncodingWatcher.setFuture(QtConcurrent::run(&Syncer::encodeShards, snapshot));
+}
+
+void Syncer::stateDataEncoded()
+{
+    if (!commitStateData()) {
+        // the changes have already been stored locally and upsynced, but the
+        // state which records them could not be stored.  cardDavError() marks
+        // the state for reconciliation (or purges it), so that the next sync
+        // matches the local and remote contacts again rather than replaying them.
         LOG_WARNING(Q_FUNC_INFO << "unable to finalise sync state");
-        cardDavError(); // actually in this case we have already stored stuff to local and server...?
+        cardDavError();
         return;
     }
 
@@ -284,37 +564,252 @@ void Syncer::syncFinished()
     emit syncSucceeded();
 }
 
+// The OOB values and the sync adapter's state can't be stored in one
+// transaction, as the engine commits each OOB write separately.  The OOB
+// write therefore also marks the commit as pending, until the sync adapter's
+// state has been stored too.  If the sync stops in between, the next sync
+// finds the mark and reconciles the state instead, see sync().
+bool Syncer::commitStateData()
+{
+    const EncodedShards shards = m_stateEncodingWatcher.result();
+    // including any stalls of the "storestate" phase since prepareExtraStateData().
+    m_pendingStateValues.insert(QStringLiteral("lastSyncStatistics"), encodeSyncStatistics());
+    m_pendingStateValues.insert(QStringLiteral("stateCommitPending"), true);
+    bool stored = storeExtraStateData(m_accountId, m_pendingStateValues, shards)
+            && storeSyncStateData(QString::number(m_accountId));
+    if (stored) {
+        QMap<QString, QVariant> values;
+        values.insert(QStringLiteral("stateCommitPending"), false);
+        if (!d->m_engine->storeOOB(m_oobScope, values)) {
+            // the state is consistent, but the next sync will reconcile it needlessly.
+            LOG_WARNING(Q_FUNC_INFO << "failed to clear the pending state commit for carddav account" << m_accountId);
+        }
+    }
+    m_pendingStateValues.clear();
+    m_stateCommitPending = false;
+    return stored;
+}
+
 void Syncer::cardDavError(int errorCode)
 {
-    LOG_WARNING("CardDAV sync finished with error:" << errorCode <<
-                "purging state data for account:" << m_accountId);
     m_syncError = true;
+    if (m_estimateOnly) {
+        // nothing was stored, so the state data is still valid.
+        LOG_WARNING("CardDAV sync estimate finished with error:" << errorCode << "for account:" << m_accountId);
+        emit syncFailed();
+        return;
+    }
+    if (errorCode == HTTP_REQUEST_TIMEOUT && !m_remoteChangesStored) {
+        // the server stopped responding before we wrote anything locally,
+        // so the existing state data is still valid for the next sync.
+        LOG_WARNING("CardDAV sync timed out, retaining state data for account:" << m_accountId);
+        emit syncFailed();
+        return;
+    }
+
     if (errorCode == HTTP_UNAUTHORIZED_ACCESS) {
         m_auth->setCredentialsNeedUpdate(m_accountId);
     }
+
+    if (m_stateDataRead && !m_stateCorrupt) {
+        // Rather than purging the state and re-downloading every contact,
+        // the stored state is reconciled against an etag listing next sync.
+        // If remote changes were stored locally the sync adapter state no
+        // longer matches the local database, so the next sync must be a clean
+        // sync, which pre-populates its state from the local database.  The
+        // sync adapter state is purged first, as marking the reconciliation
+        // also clears any pending state commit, see commitStateData().
+        if (m_remoteChangesStored) {
+            purgeSyncStateData(QString::number(m_accountId));
+        }
+        if (markReconciliationRequired(m_accountId)) {
+            LOG_WARNING("CardDAV sync finished with error:" << errorCode <<
+                        "state data will be reconciled for account:" << m_accountId);
+            emit syncFailed();
+            return;
+        }
+    }
+
+    LOG_WARNING("CardDAV sync finished with error:" << errorCode <<
+                "purging state data for account:" << m_accountId);
     purgeExtraStateData(m_accountId);
     purgeSyncStateData(QString::number(m_accountId));
     emit syncFailed();
 }
 
+// only the reconciliation flag (and the statistics of the failed sync) are
+// stored, as the in-memory state data may describe remote changes which
+// were not stored locally.  The reconciliation supersedes any pending
+// state commit.
+// The OOB scope captured in readExtraStateData() is used, as the sync adapter
+// clears its cached state data (including the scope) if storing the state fails.
+bool Syncer::markReconciliationRequired(int accountId)
+{
+    QMap<QString, QVariant> values;
+    values.insert(QStringLiteral("stateReconciliation"), encodeReconciliationState(true, m_syncsSinceReconciliation));
+    values.insert(QStringLiteral("stateCommitPending"), false);
+    values.insert(QStringLiteral("lastSyncStatistics"), encodeSyncStatistics());
+    if (!d->m_engine->storeOOB(m_oobScope, values)) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to store reconciliation state for carddav account" << accountId);
+        return false;
+    }
+    return true;
+}
+
+void Syncer::setPhase(const QString &phase)
+{
+    m_stallMonitor.setPhase(phase);
+    publishMetrics(true);
+}
+
+// publishes the phases and the sizes of the state maps, which are read by
+// the metrics server thread.  The containers are implicitly shared, so are
+// not copied.  Unless forced, e.g. on a change of the phase of the sync,
+// at most one snapshot is published per METRICS_PUBLISH_INTERVAL.
+void Syncer::publishMetrics(bool force)
+{
+    if (!force && m_metricsPublished.isValid() && m_metricsPublished.elapsed() < METRICS_PUBLISH_INTERVAL) {
+        return;
+    }
+    m_metricsPublished.start();
+
+    SyncMetricsSnapshot *snapshot = new SyncMetricsSnapshot;
+    snapshot->phase = m_stallMonitor.phase();
+    if (m_cardDav) {
+        snapshot->addressbookPhases = m_cardDav->addressbookPhases();
+    }
+    snapshot->stateSizes.insert(QStringLiteral("addressbookContactGuids"), m_addressbookContactGuids.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactUids"), m_contactUids.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactUris"), m_contactUris.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactEtags"), m_contactEtags.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactIds"), m_contactIds.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactUnsupportedProperties"), m_contactUnsupportedProperties.size());
+    snapshot->stateSizes.insert(QStringLiteral("contactVCardHashes"), m_contactVCardHashes.size());
+    snapshot->stateSizes.insert(QStringLiteral("loadedShards"), m_loadedShards.size());
+    m_metrics.publish(snapshot);
+}
+
+void Syncer::reportSyncStatistics()
+{
+    if (!m_stallMonitor.isActive()) {
+        return;
+    }
+
+    m_stallMonitor.stop();
+    if (m_stallMonitor.statistics().isEmpty()) {
+        LOG_DEBUG(Q_FUNC_INFO << "carddav sync with account" << m_accountId << "took"
+                 << m_stallMonitor.elapsed() << "ms without event loop stalls");
+    } else {
+        LOG_WARNING(Q_FUNC_INFO << "carddav sync with account" << m_accountId << "took"
+                   << m_stallMonitor.elapsed() << "ms, event loop stalls:" << m_stallMonitor.summary());
+    }
+}
+
+// the accounts whose purge has not completed, one per line.
+static QString pendingPurgesPath()
+{
+    return QStringLiteral("%1/system/privileged/Contacts/carddav/pendingPurges")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation));
+}
+
+static bool storePendingPurges(const QList<int> &accountIds)
+{
+    if (accountIds.isEmpty()) {
+        return !QFile::exists(pendingPurgesPath()) || QFile::remove(pendingPurgesPath());
+    }
+
+    QByteArray data;
+    Q_FOREACH (int accountId, accountIds) {
+        data += QByteArray::number(accountId) + '\n';
+    }
+    QDir().mkpath(QFileInfo(pendingPurgesPath()).absolutePath());
+    QSaveFile file(pendingPurgesPath());
+    return file.open(QIODevice::WriteOnly) && file.write(data) == data.size() && file.commit();
+}
+
+// Returns the accounts whose purge was interrupted, for which purgeAccount()
+// should be called again.
+QList<int> Syncer::pendingPurges()
+{
+    QList<int> accountIds;
+    QFile file(pendingPurgesPath());
+    if (file.open(QIODevice::ReadOnly)) {
+        Q_FOREACH (const QByteArray &line, file.readAll().split('\n')) {
+            bool ok = false;
+            const int accountId = line.trimmed().toInt(&ok);
+            if (ok && accountId > 0 && !accountIds.contains(accountId)) {
+                accountIds.append(accountId);
+            }
+        }
+    }
+    return accountIds;
+}
+
+bool Syncer::isPurging(int accountId) const
+{
+    return m_purgeQueue.contains(accountId);
+}
+
+// Removes the contacts and the state of the given account.  The contacts are
+// removed in bounded chunks from the event loop, so that other writers to the
+// database are not blocked for the entire purge, and purgeFinished() is emitted
+// once done.  The account is recorded until then, so that if the purge is
+// interrupted it can be resumed, see pendingPurges().
 void Syncer::purgeAccount(int accountId)
 {
-    QContactDetailFilter syncTargetFilter;
-    syncTargetFilter.setDetailType(QContactDetail::TypeSyncTarget, QContactSyncTarget::FieldSyncTarget);
-    syncTargetFilter.setValue(CARDDAV_CONTACTS_SYNCTARGET);
-    QContactDetailFilter guidFilter;
-    guidFilter.setDetailType(QContactDetail::TypeGuid, QContactGuid::FieldGuid);
-    guidFilter.setValue(QStringLiteral("%1:").arg(accountId));
-    guidFilter.setMatchFlags(QContactDetailFilter::MatchStartsWith);
-    QList<QContactId> contactsToRemove = m_contactManager.contactIds(syncTargetFilter & guidFilter);
-
-    // now write the changes to the database.
-    bool success = true;
-    if (contactsToRemove.size()) {
-        success = m_contactManager.removeContacts(contactsToRemove);
-        if (!success) {
+    if (m_purgeQueue.contains(accountId)) {
+        return;
+    }
+
+    QList<int> pending = pendingPurges();
+    if (!pending.contains(accountId)) {
+        pending.append(accountId);
+        if (!storePendingPurges(pending)) {
+            LOG_WARNING(Q_FUNC_INFO << "unable to record the purge of account" << accountId << ", it cannot be resumed");
+        }
+    }
+
+    m_purgeQueue.append(accountId);
+    if (m_purgeQueue.size() == 1) {
+        QTimer::singleShot(0, this, SLOT(purgeNextChunk()));
+    }
+}
+
+void Syncer::purgeNextChunk()
+{
+    if (m_purgeQueue.isEmpty()) {
+        return;
+    }
+
+    const int accountId = m_purgeQueue.first();
+    if (m_purgeRemovedCount == 0 && m_purgeContactIds.isEmpty()) {
+        // after an interrupted purge the remaining contacts still match this filter.
+        QContactDetailFilter syncTargetFilter;
+        syncTargetFilter.setDetailType(QContactDetail::TypeSyncTarget, QContactSyncTarget::FieldSyncTarget);
+        syncTargetFilter.setValue(CARDDAV_CONTACTS_SYNCTARGET);
+        QContactDetailFilter guidFilter;
+        guidFilter.setDetailType(QContactDetail::TypeGuid, QContactGuid::FieldGuid);
+        guidFilter.setValue(QStringLiteral("%1:").arg(accountId));
+        guidFilter.setMatchFlags(QContactDetailFilter::MatchStartsWith);
+        m_purgeContactIds = contactManager()->contactIds(syncTargetFilter & guidFilter);
+    }
+
+    // now write the changes to the database, one transaction per chunk.
+    const int totalCount = m_purgeContactIds.size();
+    if (m_purgeRemovedCount < totalCount) {
+        QList<QContactId> chunk = m_purgeContactIds.mid(m_purgeRemovedCount, PURGE_CHUNK_SIZE);
+        if (!contactManager()->removeContacts(chunk)) {
             LOG_WARNING("Failed to remove stale contacts during purge of account" << accountId
-                       << ":" << m_contactManager.error());
+                       << ":" << contactManager()->error() << "- removed" << m_purgeRemovedCount
+                       << "of" << totalCount << "contacts");
+            finishPurge(false);
+            return;
+        }
+        m_purgeRemovedCount += chunk.size();
+        emit purgeProgress(accountId, m_purgeRemovedCount, totalCount);
+        if (m_purgeRemovedCount < totalCount) {
+            QTimer::singleShot(PURGE_CHUNK_INTERVAL, this, SLOT(purgeNextChunk()));
+            return;
         }
     }
 
@@ -327,59 +822,106 @@ void Syncer::purgeAccount(int accountId)
     // was removed, due to a crash, etc) - in which case the cached value would be wrong.
     QString oobScope = QStringLiteral("%1-%2").arg(CARDDAV_CONTACTS_SYNCTARGET).arg(accountId);
     if (!d->m_engine->removeOOB(oobScope)) {
-        success = false;
         LOG_WARNING(Q_FUNC_INFO << "Error occurred while purging OOB data for removed CardDAV account" << accountId);
+        finishPurge(false);
+        return;
     }
+    UnsupportedPropertiesStore::removeBlobDirectory(accountId);
 
+    LOG_DEBUG(Q_FUNC_INFO << "Purged account" << accountId
+             << "and successfully removed" << m_purgeRemovedCount << "contacts");
+    finishPurge(true);
+}
+
+void Syncer::finishPurge(bool success)
+{
+    const int accountId = m_purgeQueue.takeFirst();
+    m_purgeContactIds.clear();
+    m_purgeRemovedCount = 0;
     if (success) {
-        LOG_DEBUG(Q_FUNC_INFO << "Purged account" << accountId
-                 << "and successfully removed" << contactsToRemove.size() << "contacts");
+        QList<int> pending = pendingPurges();
+        pending.removeAll(accountId);
+        if (!storePendingPurges(pending)) {
+            LOG_WARNING(Q_FUNC_INFO << "unable to record the completed purge of account" << accountId);
+        }
     }
+
+    emit purgeFinished(accountId, success);
+    if (!m_purgeQueue.isEmpty()) {
+        QTimer::singleShot(0, this, SLOT(purgeNextChunk()));
+    }
+}
+
+// returns the OOB key under which the state of the given addressbook is stored.
+// The state of contacts which cannot be associated with any addressbook is
+// stored under the key for the empty addressbook url.
+static QString shardKey(const QString &addressbookUrl)
+{
+    return QStringLiteral("addressbookState:%1").arg(addressbookUrl);
+}
+
+static QByteArray shardHash(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
+template <typename T>
+static qint64 encodedSize(const T &value)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << value;
+    return data.size();
+}
+
+static bool largerPayload(const QPair<QString, qint64> &a, const QPair<QString, qint64> &b)
+{
+    return a.second > b.second;
 }
 
 // this function must be called directly after readSyncStateData()
 bool Syncer::readExtraStateData(int accountId)
 {
+    // The per-contact state is partitioned into one shard per addressbook,
+    // which is only loaded (via ensureShardLoaded()) once it is needed.
+    // Only the small per-addressbook maps and the shard index are read here.
+    clearAllGuidData();
+    m_addressbookCtags.clear();
+    m_addressbookSyncTokens.clear();
+    m_strategyStatistics.clear();
+    m_shardIndex.clear();
+    m_loadedShards.clear();
+    m_shardHashes.clear();
+    m_removedShards.clear();
+    m_legacyStateMigrated = false;
+    m_stateCorrupt = false;
+    m_upsyncedGuids.clear();
+    m_roundTripGuids.clear();
+    m_contactUnsupportedProperties.setBlobDirectory(UnsupportedPropertiesStore::defaultBlobDirectory(accountId));
+    m_oobScope = d->m_stateData[QString::number(accountId)].m_oobScope;
+
     QMap<QString, QVariant> values;
     QStringList keys;
-    keys << QStringLiteral("addressbookContactGuids")
-         << QStringLiteral("addressbookCtags")
+    keys << QStringLiteral("addressbookCtags")
          << QStringLiteral("addressbookSyncTokens")
-         << QStringLiteral("contactUids")
-         << QStringLiteral("contactUris")
-         << QStringLiteral("contactEtags")
-         << QStringLiteral("contactIds")
-         << QStringLiteral("contactUnsupportedProperties");
+         << QStringLiteral("addressbookShardIndex")
+         << QStringLiteral("contactUpsyncLoops")
+         << QStringLiteral("stateReconciliation")
+         << QStringLiteral("stateCommitPending")
+         << QStringLiteral("addressbookStrategies")
+         << legacyExtraStateDataKeys();
     if (!d->m_engine->fetchOOB(d->m_stateData[QString::number(accountId)].m_oobScope, keys, &values)) {
         LOG_WARNING(Q_FUNC_INFO << "failed to read extra data for carddav account" << accountId);
         d->clear(QString::number(accountId));
         return false;
     }
 
-    // m_addressbookContactGuids
-    QVariant acgValue = values.value(QStringLiteral("addressbookContactGuids"));
-    QByteArray acgValueBA = acgValue.toByteArray();
-    QJsonObject acgJsonObj = QJsonDocument::fromBinaryData(acgValueBA).object();
-    QStringList addressbookUrls = acgJsonObj.keys();
-    QMap<QString, QStringList> addressbookUrlToContactGuids;
-    foreach (const QString &url, addressbookUrls) {
-        QVariantList contactGuidsVL = acgJsonObj.value(url).toArray().toVariantList();
-        QStringList contactGuids;
-        foreach (const QVariant &v, contactGuidsVL) {
-            if (!v.toString().isEmpty()) {
-                contactGuids.append(v.toString());
-            }
-        }
-
-        addressbookUrlToContactGuids.insert(url, contactGuids);
-    }
-    m_addressbookContactGuids = addressbookUrlToContactGuids;
-
     // m_addressbookCtags
     QVariant acValue = values.value(QStringLiteral("addressbookCtags"));
     QByteArray acValueBA = acValue.toByteArray();
     QJsonObject acJsonObj = QJsonDocument::fromBinaryData(acValueBA).object();
-    addressbookUrls = acJsonObj.keys();
+    QStringList addressbookUrls = acJsonObj.keys();
     QMap<QString, QString> addressbookUrlToCtag;
     foreach (const QString &url, addressbookUrls) {
         addressbookUrlToCtag.insert(url, acJsonObj.value(url).toString());
@@ -397,16 +939,299 @@ bool Syncer::readExtraStateData(int accountId)
     }
     m_addressbookSyncTokens = addressbookUrlToSyncToken;
 
-    // m_contactUids
-    QVariant cuiValue = values.value(QStringLiteral("contactUids"));
-    QByteArray cuiValueBA = cuiValue.toByteArray();
-    QJsonObject cuiJsonObj = QJsonDocument::fromBinaryData(cuiValueBA).object();
-    QStringList contactGuids = cuiJsonObj.keys();
-    QMap<QString, QString> guidToContactUid;
-    foreach (const QString &guid, contactGuids) {
-        guidToContactUid.insert(guid, cuiJsonObj.value(guid).toString());
+    // m_shardIndex
+    QByteArray siValueBA = values.value(QStringLiteral("addressbookShardIndex")).toByteArray();
+    if (!siValueBA.isEmpty()) {
+        QDataStream in(siValueBA);
+        in.setVersion(QDataStream::Qt_5_0);
+        quint32 version = 0;
+        in >> version >> m_shardIndex;
+        if (version != SHARD_INDEX_VERSION || in.status() != QDataStream::Ok) {
+            LOG_WARNING(Q_FUNC_INFO << "invalid shard index for carddav account" << accountId);
+            d->clear(QString::number(accountId));
+            return false;
+        }
     }
-    m_contactUids = guidToContactUid;
+
+    // m_strategyStatistics
+    QByteArray ssValueBA = values.value(QStringLiteral("addressbookStrategies")).toByteArray();
+    if (!ssValueBA.isEmpty()) {
+        QDataStream in(ssValueBA);
+        in.setVersion(QDataStream::Qt_5_0);
+        quint32 version = 0;
+        in >> version >> m_strategyStatistics;
+        if (version != STRATEGY_STATISTICS_VERSION || in.status() != QDataStream::Ok) {
+            // not fatal: the preferred strategies will simply be tried again.
+            LOG_WARNING(Q_FUNC_INFO << "invalid sync strategy statistics for carddav account" << accountId);
+            m_strategyStatistics.clear();
+        }
+    }
+
+    // upsync loop detection state
+    if (!readUpsyncLoopState(values.value(QStringLiteral("contactUpsyncLoops")).toByteArray())) {
+        // not fatal: at worst a looping contact will be upsynced a few more times.
+        LOG_WARNING(Q_FUNC_INFO << "invalid upsync loop state for carddav account" << accountId);
+    }
+
+    // a sync which stopped while storing its state, see commitStateData().
+    m_stateCommitInterrupted = values.value(QStringLiteral("stateCommitPending")).toBool();
+
+    // reconcile the state with the server if it may be inconsistent, or periodically
+    // to repair any drift which went unnoticed.
+    if (!readReconciliationState(values.value(QStringLiteral("stateReconciliation")).toByteArray())) {
+        LOG_WARNING(Q_FUNC_INFO << "invalid reconciliation state for carddav account" << accountId);
+        m_reconciliationRequired = true;
+    }
+    bool intervalOk = false;
+    int reconciliationInterval = m_syncProfile
+            ? m_syncProfile->key(QStringLiteral("reconciliation_interval")).toInt(&intervalOk) : 0;
+    if (!intervalOk || reconciliationInterval < 0) {
+        reconciliationInterval = DEFAULT_RECONCILIATION_INTERVAL;
+    }
+    // the state is only inspected without a sync, so it is not reconciled.
+    m_reconcileState = !m_inspectOnly
+            && (m_reconciliationRequired
+                || (reconciliationInterval > 0 && m_syncsSinceReconciliation >= reconciliationInterval));
+    if (m_reconcileState) {
+        LOG_DEBUG(Q_FUNC_INFO << "reconciling state data for carddav account" << accountId
+                 << (m_reconciliationRequired ? "after a failed sync" : "periodically"));
+    }
+
+    bool loadAllShards = false;
+    if (values.contains(QStringLiteral("contactUids")) || values.contains(QStringLiteral("addressbookContactGuids"))) {
+        // the state was stored by a previous version, without sharding.
+        // It is all loaded now and will be written back as shards.
+        readLegacyExtraStateData(values);
+        m_legacyStateMigrated = true;
+        m_loadedShards.insert(QString());
+        Q_FOREACH (const QString &url, m_addressbookContactGuids.keys()) {
+            m_loadedShards.insert(url);
+            indexAddressbookGuids(url);
+        }
+        loadAllShards = true;
+    }
+
+    // Contacts with old-form guids (accountId:uid) may be looked up from any
+    // addressbook, and a clean sync needs the ids of all contacts, so in those
+    // cases all shards are needed.  Otherwise we just load the unassigned shard.
+    Q_FOREACH (bool hasLegacyGuids, m_shardIndex) {
+        loadAllShards |= hasLegacyGuids;
+    }
+    loadAllShards |= !d->m_stateData[QString::number(m_accountId)].m_localSince.isValid();
+    loadAllShards |= m_reconcileState;
+    if (!(loadAllShards ? ensureShardsLoaded(m_shardIndex.keys()) : ensureShardLoaded(QString()))) {
+        d->clear(QString::number(accountId));
+        return false;
+    }
+
+    // Finally, if we're doing a "clean sync" we should pre-populate our prevRemote
+    // list with the current state of the local database.
+    // This is to avoid clean-syncs causing contact duplication.
+    if (!d->m_stateData[QString::number(m_accountId)].m_localSince.isValid()) {
+        QList<QContact> prevRemote;
+        if (!fetchLocalContacts(accountId, &prevRemote)) {
+            d->clear(QString::number(accountId));
+            return false;
+        }
+
+        QList<QContactId> exportedIds;
+        foreach (const QContact &c, prevRemote) {
+            exportedIds.append(c.id());
+        }
+        indexLocalContacts(prevRemote);
+
+        // set our state data.
+        d->m_stateData[QString::number(accountId)].m_prevRemote = prevRemote;
+        d->m_stateData[QString::number(accountId)].m_exportedIds = exportedIds;
+    } else if (m_reconcileState && !reconcileContactIds(accountId)) {
+        d->clear(QString::number(accountId));
+        return false;
+    }
+
+    // done.
+    return true;
+}
+
+// fetches the local contacts which come from this account.
+bool Syncer::fetchLocalContacts(int accountId, QList<QContact> *contacts)
+{
+    QDateTime maxTimestamp;
+    QList<QContact> existingContacts;
+    QContactManager::Error error = QContactManager::NoError;
+    if (!d->m_engine->fetchSyncContacts(CARDDAV_CONTACTS_SYNCTARGET,
+                                        QDateTime(),
+                                        QList<QContactId>(),
+                                        &existingContacts,
+                                        0,
+                                        0,
+                                        &maxTimestamp,
+                                        &error)) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to fetch pre-existing contacts for account" << accountId);
+        return false;
+    }
+
+    // filter out any which don't come from this account.
+    contacts->clear();
+    foreach (const QContact &c, existingContacts) {
+        if (c.detail<QContactGuid>().guid().startsWith(QStringLiteral("%1:").arg(accountId))) {
+            contacts->append(c);
+        }
+    }
+    return true;
+}
+
+// Repairs the contact ids in the state data to match the local database,
+// forgetting the state of contacts which no longer exist locally.
+// The uris and etags are reconciled with the server by CardDav, which lists
+// the etags of every addressbook instead of trusting the sync token or ctag.
+bool Syncer::reconcileContactIds(int accountId)
+{
+    QList<QContact> localContacts;
+    if (!fetchLocalContacts(accountId, &localContacts)) {
+        return false;
+    }
+
+    QMap<QString, QString> localIds; // contact guid -> contact id
+    foreach (const QContact &c, localContacts) {
+        localIds.insert(c.detail<QContactGuid>().guid(), c.id().toString());
+    }
+
+    // every shard is loaded for a reconciliation, so every listed guid is indexed.
+    int repairedIds = 0;
+    QMap<QString, QString>::iterator it = m_contactIds.begin();
+    while (it != m_contactIds.end()) {
+        if (!localIds.contains(it.key())) {
+            // the local contact no longer exists.  Its uri is forgotten too, so
+            // that the etag listing reports it as an addition (rather than as
+            // unchanged, or as removed if it is still listed in the addressbook)
+            // and it is stored as a new contact.
+            const QString guid = it.key();
+            const QString addressbookUrl = m_guidAddressbooks.value(guid);
+            if (!addressbookUrl.isEmpty()) {
+                removeAddressbookGuid(addressbookUrl, guid);
+            }
+            m_contactUids.remove(guid);
+            m_contactUris.remove(guid);
+            m_contactEtags.remove(guid);
+            m_contactUnsupportedProperties.remove(guid);
+            m_contactVCardHashes.remove(guid);
+            it = m_contactIds.erase(it);
+            repairedIds += 1;
+        } else {
+            ++it;
+        }
+    }
+    for (QMap<QString, QString>::const_iterator lit = localIds.constBegin(); lit != localIds.constEnd(); ++lit) {
+        if (m_contactIds.value(lit.key()) != lit.value()) {
+            repairedIds += 1;
+        }
+    }
+    indexLocalContacts(localContacts);
+
+    LOG_DEBUG(Q_FUNC_INFO << "repaired" << repairedIds << "contact ids for carddav account" << accountId);
+    return true;
+}
+
+// Local contacts which are unknown to the state data are matched against the
+// downloaded contacts by guid (and thus by UID), so that they are given the id
+// of the existing local contact rather than being added as duplicates.
+void Syncer::indexLocalContacts(const QList<QContact> &contacts)
+{
+    const QString accountGuidPrefix = QStringLiteral("%1:").arg(m_accountId);
+    const QString addressbookGuidPrefix = QStringLiteral("%1:AB:").arg(m_accountId);
+    foreach (const QContact &c, contacts) {
+        const QString guid = c.detail<QContactGuid>().guid();
+        m_contactIds.insert(guid, c.id().toString());
+        if (!guid.startsWith(addressbookGuidPrefix) && !m_contactUids.contains(guid)) {
+            // an old-form guid (accountId:uid) is migrated by the reply parser once
+            // the addressbook of the contact is known, if its UID is known.
+            m_contactUids.insert(guid, guid.mid(accountGuidPrefix.length()));
+        }
+    }
+}
+
+bool Syncer::readReconciliationState(const QByteArray &data)
+{
+    m_reconciliationRequired = false;
+    m_syncsSinceReconciliation = 0;
+    if (data.isEmpty()) {
+        return true;
+    }
+
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 version = 0;
+    qint32 syncsSinceReconciliation = 0;
+    in >> version;
+    if (version != RECONCILIATION_STATE_VERSION) {
+        return false;
+    }
+    in >> m_reconciliationRequired >> syncsSinceReconciliation;
+    if (in.status() != QDataStream::Ok) {
+        m_reconciliationRequired = false;
+        return false;
+    }
+    m_syncsSinceReconciliation = syncsSinceReconciliation;
+    return true;
+}
+
+QByteArray Syncer::encodeReconciliationState(bool reconciliationRequired, int syncsSinceReconciliation)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << RECONCILIATION_STATE_VERSION << reconciliationRequired << qint32(syncsSinceReconciliation);
+    return data;
+}
+
+// the event-loop stalls observed during the sync so far, per phase.
+// These are stored for diagnostic purposes only, and never read back.
+// The current phase is checkpointed first, so that e.g. the time spent
+// preparing the state in which they are stored is included.
+QByteArray Syncer::encodeSyncStatistics()
+{
+    m_stallMonitor.checkpoint();
+
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << SYNC_STATISTICS_VERSION << QDateTime::currentDateTimeUtc() << m_stallMonitor.elapsed()
+        << qint32(m_stallMonitor.threshold()) << m_stallMonitor.statistics();
+    return data;
+}
+
+// reads the per-contact state stored by versions which did not shard it.
+void Syncer::readLegacyExtraStateData(const QMap<QString, QVariant> &values)
+{
+    // m_addressbookContactGuids
+    QVariant acgValue = values.value(QStringLiteral("addressbookContactGuids"));
+    QByteArray acgValueBA = acgValue.toByteArray();
+    QJsonObject acgJsonObj = QJsonDocument::fromBinaryData(acgValueBA).object();
+    QStringList addressbookUrls = acgJsonObj.keys();
+    QMap<QString, QStringList> addressbookUrlToContactGuids;
+    foreach (const QString &url, addressbookUrls) {
+        QVariantList contactGuidsVL = acgJsonObj.value(url).toArray().toVariantList();
+        QStringList contactGuids;
+        foreach (const QVariant &v, contactGuidsVL) {
+            if (!v.toString().isEmpty()) {
+                contactGuids.append(v.toString());
+            }
+        }
+
+        addressbookUrlToContactGuids.insert(url, contactGuids);
+    }
+    m_addressbookContactGuids = addressbookUrlToContactGuids;
+
+    // m_contactUids
+    QVariant cuiValue = values.value(QStringLiteral("contactUids"));
+    QByteArray cuiValueBA = cuiValue.toByteArray();
+    QJsonObject cuiJsonObj = QJsonDocument::fromBinaryData(cuiValueBA).object();
+    QStringList contactGuids = cuiJsonObj.keys();
+    QMap<QString, QString> guidToContactUid;
+    foreach (const QString &guid, contactGuids) {
+        guidToContactUid.insert(guid, cuiJsonObj.value(guid).toString());
+    }
+    m_contactUids = guidToContactUid;
 
     // m_contactUris
     QVariant cuValue = values.value(QStringLiteral("contactUris"));
@@ -443,75 +1268,394 @@ bool Syncer::readExtraStateData(int accountId)
 
     // m_contactUnsupportedProperties
     QVariant cupValue = values.value(QStringLiteral("contactUnsupportedProperties"));
-    QByteArray cupValueBA = cupValue.toByteArray();
-    QJsonObject cupJsonObj = QJsonDocument::fromBinaryData(cupValueBA).object();
-    contactGuids = cupJsonObj.keys();
-    QMap<QString, QStringList> contactGuidToUnsupportedProperties;
-    foreach (const QString &guid, contactGuids) {
-        QVariantList unsupportedPropertiesVL = cupJsonObj.value(guid).toArray().toVariantList();
-        QStringList unsupportedProperties;
-        foreach (const QVariant &v, unsupportedPropertiesVL) {
-            if (!v.toString().isEmpty()) {
-                unsupportedProperties.append(v.toString());
-            }
+    if (!m_contactUnsupportedProperties.fromByteArray(cupValue.toByteArray())) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to read unsupported properties for carddav account" << m_accountId);
+    }
+}
+
+QStringList Syncer::legacyExtraStateDataKeys()
+{
+    QStringList keys;
+    keys << QStringLiteral("addressbookContactGuids")
+         << QStringLiteral("contactUids")
+         << QStringLiteral("contactUris")
+         << QStringLiteral("contactEtags")
+         << QStringLiteral("contactIds")
+         << QStringLiteral("contactUnsupportedProperties");
+    return keys;
+}
+
+bool Syncer::ensureShardLoaded(const QString &addressbookUrl)
+{
+    return ensureShardsLoaded(QStringList(addressbookUrl));
+}
+
+bool Syncer::ensureShardsLoaded(const QStringList &addressbookUrls)
+{
+    QStringList urls;
+    QStringList keys;
+    Q_FOREACH (const QString &url, addressbookUrls) {
+        if (m_loadedShards.contains(url) || urls.contains(url)) {
+            continue;
         }
+        if (m_shardIndex.contains(url)) {
+            urls.append(url);
+            keys.append(shardKey(url));
+        } else {
+            // a new addressbook, for which no state has been stored yet.
+            m_loadedShards.insert(url);
+        }
+    }
 
-        contactGuidToUnsupportedProperties.insert(guid, unsupportedProperties);
+    if (keys.isEmpty()) {
+        return true;
     }
-    m_contactUnsupportedProperties = contactGuidToUnsupportedProperties;
 
-    // Finally, if we're doing a "clean sync" we should pre-populate our prevRemote
-    // list with the current state of the local database.
-    // This is to avoid clean-syncs causing contact duplication.
-    if (!d->m_stateData[QString::number(m_accountId)].m_localSince.isValid()) {
-        QDateTime maxTimestamp;
-        QList<QContact> existingContacts;
-        QContactManager::Error error = QContactManager::NoError;
-        if (!d->m_engine->fetchSyncContacts(CARDDAV_CONTACTS_SYNCTARGET,
-                                            QDateTime(),
-                                            QList<QContactId>(),
-                                            &existingContacts,
-                                            0,
-                                            0,
-                                            &maxTimestamp,
-                                            &error)) {
-            LOG_WARNING(Q_FUNC_INFO << "failed to fetch pre-existing contacts for account" << m_accountId);
-            d->clear(QString::number(accountId));
+    QMap<QString, QVariant> values;
+    if (!d->m_engine->fetchOOB(d->m_stateData[QString::number(m_accountId)].m_oobScope, keys, &values)) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to read addressbook state for carddav account" << m_accountId);
+        return false;
+    }
+
+    // a shard is only marked as loaded once it has been decoded in full,
+    // as otherwise its partial state would be stored as if it were complete.
+    // A shard which is listed in the index but missing or corrupt means that
+    // the state is unusable, so it is purged (see cardDavError()).
+    for (int i = 0; i < urls.size(); ++i) {
+        const QByteArray data = values.value(keys.at(i)).toByteArray();
+        DecodedShard shard;
+        if (!decodeShard(data, &shard) || shard.addressbookUrl != urls.at(i)) {
+            LOG_WARNING(Q_FUNC_INFO << "invalid addressbook state" << keys.at(i) << "for carddav account" << m_accountId);
+            m_stateCorrupt = true;
             return false;
         }
+        mergeShard(shard);
+        m_loadedShards.insert(urls.at(i));
+        m_shardHashes.insert(urls.at(i), shardHash(data));
+    }
 
-        // filter out any which don't come from this account.
-        QList<QContact> prevRemote;
-        QList<QContactId> exportedIds;
-        foreach (const QContact &c, existingContacts) {
-            if (c.detail<QContactGuid>().guid().startsWith(QStringLiteral("%1:").arg(accountId))) {
-                prevRemote.append(c);
-                exportedIds.append(c.id());
-                m_contactIds.insert(c.detail<QContactGuid>().guid(), c.id().toString());
-            }
+    LOG_DEBUG(Q_FUNC_INFO << "loaded" << urls.size() << "of" << m_shardIndex.size()
+             << "addressbook states for carddav account" << m_accountId);
+    return true;
+}
+
+template <typename T>
+static void matchAddressbookUrl(const QString &guid, int prefixLength, const QMap<QString, T> &addressbooks, QString *match)
+{
+    for (typename QMap<QString, T>::const_iterator it = addressbooks.constBegin(); it != addressbooks.constEnd(); ++it) {
+        const QString &url(it.key());
+        if (url.length() > match->length()
+                && guid.length() > prefixLength + url.length()
+                && guid.at(prefixLength + url.length()) == QLatin1Char(':')
+                && guid.midRef(prefixLength, url.length()) == url) {
+            *match = url;
         }
+    }
+}
 
-        // set our state data.
-        d->m_stateData[QString::number(accountId)].m_prevRemote = prevRemote;
-        d->m_stateData[QString::number(accountId)].m_exportedIds = exportedIds;
+QString Syncer::addressbookForGuid(const QString &guid) const
+{
+    // guids are of the form accountId:AB:addressbookUrl:uid, but the
+    // uid may contain colons, so match against the known addressbook urls.
+    const QString prefix = QStringLiteral("%1:AB:").arg(m_accountId);
+    if (!guid.startsWith(prefix)) {
+        return QString(); // old-form guid.
     }
 
-    // done.
+    // the guids listed in the loaded addressbooks are indexed.
+    QHash<QString, QString>::const_iterator it = m_guidAddressbooks.constFind(guid);
+    if (it != m_guidAddressbooks.constEnd()) {
+        return it.value();
+    }
+
+    QString match;
+    matchAddressbookUrl(guid, prefix.length(), m_shardIndex, &match);
+    matchAddressbookUrl(guid, prefix.length(), m_addressbookContactGuids, &match);
+    matchAddressbookUrl(guid, prefix.length(), m_addressbookCtags, &match);
+    matchAddressbookUrl(guid, prefix.length(), m_addressbookSyncTokens, &match);
+    return match;
+}
+
+// adds the guid to the list of contacts in the addressbook.
+// m_addressbookContactGuids must only be modified via these functions,
+// so that m_guidAddressbooks stays up to date.
+void Syncer::addAddressbookGuid(const QString &addressbookUrl, const QString &guid)
+{
+    m_addressbookContactGuids[addressbookUrl].append(guid);
+    m_guidAddressbooks.insert(guid, addressbookUrl);
+}
+
+void Syncer::removeAddressbookGuid(const QString &addressbookUrl, const QString &guid)
+{
+    m_addressbookContactGuids[addressbookUrl].removeOne(guid);
+    QHash<QString, QString>::iterator it = m_guidAddressbooks.find(guid);
+    if (it != m_guidAddressbooks.end() && it.value() == addressbookUrl) {
+        m_guidAddressbooks.erase(it);
+    }
+}
+
+void Syncer::indexAddressbookGuids(const QString &addressbookUrl)
+{
+    Q_FOREACH (const QString &guid, m_addressbookContactGuids.value(addressbookUrl)) {
+        m_guidAddressbooks.insert(guid, addressbookUrl);
+    }
+}
+
+// forgets the state of the addressbooks which are no longer reported by the
+// server.  Their shards are removed when the state is next stored.
+void Syncer::forgetRemovedAddressbooks(const QSet<QString> &addressbookUrls)
+{
+    QSet<QString> removedUrls = m_shardIndex.keys().toSet();
+    removedUrls.unite(m_addressbookCtags.keys().toSet());
+    removedUrls.unite(m_addressbookSyncTokens.keys().toSet());
+    removedUrls.subtract(addressbookUrls);
+    removedUrls.remove(QString()); // the unassigned shard.
+
+    Q_FOREACH (const QString &url, removedUrls) {
+        LOG_DEBUG(Q_FUNC_INFO << "forgetting the state of removed addressbook" << url);
+        Q_FOREACH (const QString &guid, m_addressbookContactGuids.value(url)) {
+            m_contactUids.remove(guid);
+            m_contactUris.remove(guid);
+            m_contactEtags.remove(guid);
+            m_contactIds.remove(guid);
+            m_contactUnsupportedProperties.remove(guid);
+            m_contactVCardHashes.remove(guid);
+            m_guidAddressbooks.remove(guid);
+        }
+        m_addressbookContactGuids.remove(url);
+        m_addressbookCtags.remove(url);
+        m_addressbookSyncTokens.remove(url);
+        m_strategyStatistics.remove(url);
+        m_loadedShards.remove(url);
+        m_shardHashes.remove(url);
+        if (m_shardIndex.remove(url)) {
+            m_removedShards.insert(url);
+        }
+    }
+}
+
+QByteArray Syncer::encodeShard(const ShardSnapshot &snapshot, const QString &addressbookUrl, bool *hasLegacyGuids)
+{
+    const QString guidPrefix = QStringLiteral("%1:AB:").arg(snapshot.accountId);
+    const QStringList guids = snapshot.shardGuids.value(addressbookUrl);
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << SHARD_VERSION << addressbookUrl << snapshot.addressbookContactGuids.value(addressbookUrl) << quint32(guids.size());
+    *hasLegacyGuids = false;
+    Q_FOREACH (const QString &guid, guids) {
+        // record which of the state values exist for this guid, as
+        // some lookups distinguish between empty and missing values.
+        quint8 present = (snapshot.contactUids.contains(guid) ? ShardHasUid : 0)
+                       | (snapshot.contactUris.contains(guid) ? ShardHasUri : 0)
+                       | (snapshot.contactEtags.contains(guid) ? ShardHasEtag : 0)
+                       | (snapshot.contactIds.contains(guid) ? ShardHasId : 0)
+                       | (snapshot.contactUnsupportedProperties.contains(guid) ? ShardHasUnsupportedProperties : 0)
+                       | (snapshot.contactVCardHashes.contains(guid) ? ShardHasVCardHash : 0);
+        out << guid << present
+            << snapshot.contactUids.value(guid) << snapshot.contactUris.value(guid)
+            << snapshot.contactEtags.value(guid) << snapshot.contactIds.value(guid)
+            << snapshot.contactUnsupportedProperties.entries(guid)
+            << snapshot.contactVCardHashes.value(guid);
+        *hasLegacyGuids |= !guid.startsWith(guidPrefix);
+    }
+    return data;
+}
+
+bool Syncer::decodeShard(const QByteArray &data, DecodedShard *shard)
+{
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 version = 0, count = 0;
+    in >> version;
+    if (version != SHARD_VERSION && version != 1) {
+        return false;
+    }
+    in >> shard->addressbookUrl >> shard->addressbookContactGuids >> count;
+
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        QString guid, uid, uri, etag, id;
+        QList<QByteArray> unsupportedProperties;
+        QByteArray vcardHash;
+        quint8 present = 0;
+        in >> guid >> present >> uid >> uri >> etag >> id >> unsupportedProperties;
+        if (version >= 2) {
+            in >> vcardHash;
+        }
+        if (present & ShardHasUid) shard->contactUids.insert(guid, uid);
+        if (present & ShardHasUri) shard->contactUris.insert(guid, uri);
+        if (present & ShardHasEtag) shard->contactEtags.insert(guid, etag);
+        if (present & ShardHasId) shard->contactIds.insert(guid, id);
+        if (present & ShardHasUnsupportedProperties) shard->contactUnsupportedProperties.insert(guid, unsupportedProperties);
+        if (present & ShardHasVCardHash) shard->contactVCardHashes.insert(guid, vcardHash);
+    }
+
+    return in.status() == QDataStream::Ok;
+}
+
+template <typename T>
+static void mergeShardValues(QMap<QString, T> *values, const QMap<QString, T> &shardValues)
+{
+    if (values->isEmpty()) {
+        *values = shardValues; // shares the data rather than copying it.
+        return;
+    }
+    for (typename QMap<QString, T>::const_iterator it = shardValues.constBegin(); it != shardValues.constEnd(); ++it) {
+        values->insert(it.key(), it.value());
+    }
+}
+
+void Syncer::mergeShard(const DecodedShard &shard)
+{
+    if (!shard.addressbookUrl.isEmpty()) {
+        m_addressbookContactGuids.insert(shard.addressbookUrl, shard.addressbookContactGuids);
+        indexAddressbookGuids(shard.addressbookUrl);
+    }
+    mergeShardValues(&m_contactUids, shard.contactUids);
+    mergeShardValues(&m_contactUris, shard.contactUris);
+    mergeShardValues(&m_contactEtags, shard.contactEtags);
+    mergeShardValues(&m_contactIds, shard.contactIds);
+    mergeShardValues(&m_contactVCardHashes, shard.contactVCardHashes);
+    for (QMap<QString, QList<QByteArray> >::const_iterator it = shard.contactUnsupportedProperties.constBegin();
+            it != shard.contactUnsupportedProperties.constEnd(); ++it) {
+        m_contactUnsupportedProperties.insertEntries(it.key(), it.value());
+    }
+}
+
+bool Syncer::readUpsyncLoopState(const QByteArray &data)
+{
+    m_lastUpsyncedGuids.clear();
+    m_contactUpsyncLoops.clear();
+    m_quarantinedContacts.clear();
+    m_quarantinedEdits.clear();
+    if (data.isEmpty()) {
+        return true;
+    }
+
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 version = 0;
+    in >> version;
+    if (version != 1 && version != UPSYNC_LOOP_STATE_VERSION) {
+        return false;
+    }
+    in >> m_lastUpsyncedGuids >> m_contactUpsyncLoops >> m_quarantinedContacts;
+    if (version >= 2) {
+        in >> m_quarantinedEdits;
+    }
+    if (in.status() != QDataStream::Ok) {
+        m_lastUpsyncedGuids.clear();
+        m_contactUpsyncLoops.clear();
+        m_quarantinedContacts.clear();
+        m_quarantinedEdits.clear();
+        return false;
+    }
+
+    // quarantined contacts are given another chance once the quarantine expires,
+    // and any local edits skipped meanwhile are upsynced, see releaseQuarantinedEdits().
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    QMap<QString, QDateTime>::iterator it = m_quarantinedContacts.begin();
+    while (it != m_quarantinedContacts.end()) {
+        if (it.value() <= now) {
+            LOG_DEBUG(Q_FUNC_INFO << "quarantine expired for contact" << it.key());
+            m_contactUpsyncLoops.remove(it.key());
+            it = m_quarantinedContacts.erase(it);
+        } else {
+            ++it;
+        }
+    }
     return true;
 }
 
-// this function must be called directly before storeSyncStateData()
-bool Syncer::storeExtraStateData(int accountId)
+QByteArray Syncer::encodeUpsyncLoopState()
 {
-    // m_addressbookContactGuids
-    QJsonObject acgJsonObj;
-    for (QMap<QString, QStringList>::const_iterator it = m_addressbookContactGuids.constBegin();
-            it != m_addressbookContactGuids.constEnd(); ++it) {
-        acgJsonObj.insert(it.key(), QJsonValue(QJsonArray::fromStringList(it.value())));
+    // a contact only counts as looping if it is modified remotely after every
+    // upsync, so reset the count of any which weren't this time.  Also forget
+    // about contacts which have been deleted.
+    QMap<QString, int>::iterator it = m_contactUpsyncLoops.begin();
+    while (it != m_contactUpsyncLoops.end()) {
+        if (!m_roundTripGuids.contains(it.key()) && !m_quarantinedContacts.contains(it.key())) {
+            it = m_contactUpsyncLoops.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    QMap<QString, QDateTime>::iterator qit = m_quarantinedContacts.begin();
+    while (qit != m_quarantinedContacts.end()) {
+        if (m_loadedShards.contains(addressbookForGuid(qit.key())) && !m_contactUids.contains(qit.key())) {
+            m_contactUpsyncLoops.remove(qit.key());
+            qit = m_quarantinedContacts.erase(qit);
+        } else {
+            ++qit;
+        }
+    }
+    QSet<QString>::iterator eit = m_quarantinedEdits.begin();
+    while (eit != m_quarantinedEdits.end()) {
+        if (m_loadedShards.contains(addressbookForGuid(*eit)) && !m_contactUids.contains(*eit)) {
+            eit = m_quarantinedEdits.erase(eit);
+        } else {
+            ++eit;
+        }
+    }
+    m_lastUpsyncedGuids = m_upsyncedGuids;
+
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << UPSYNC_LOOP_STATE_VERSION << m_lastUpsyncedGuids << m_contactUpsyncLoops << m_quarantinedContacts
+        << m_quarantinedEdits;
+    return data;
+}
+
+// The sync adapter considers local edits to quarantined contacts as synced,
+// even though CardDav::upsyncUpdates() skipped them.  Once the quarantine has
+// expired, the contacts are upsynced as if they had been modified again.
+bool Syncer::releaseQuarantinedEdits(QList<QContact> *locallyModified)
+{
+    // the shards of addressbooks without remote changes have not been
+    // loaded, but are needed to find the contacts whose edits are released.
+    QStringList addressbookUrls;
+    Q_FOREACH (const QString &guid, m_quarantinedEdits) {
+        const QString addressbookUrl = addressbookForGuid(guid);
+        if (!m_quarantinedContacts.contains(guid) && !addressbookUrl.isEmpty()) {
+            addressbookUrls.append(addressbookUrl);
+        }
+    }
+    if (!ensureShardsLoaded(addressbookUrls)) {
+        return false;
+    }
+
+    QList<QContactId> releasedIds;
+    QSet<QString> releasedGuids;
+    Q_FOREACH (const QString &guid, m_quarantinedEdits) {
+        if (!m_quarantinedContacts.contains(guid) && m_contactIds.contains(guid)) {
+            releasedIds.append(QContactId::fromString(m_contactIds.value(guid)));
+            releasedGuids.insert(guid);
+        }
+    }
+    if (releasedIds.isEmpty()) {
+        return true;
+    }
+
+    QSet<QContactId> modifiedIds;
+    Q_FOREACH (const QContact &c, *locallyModified) {
+        modifiedIds.insert(c.id());
+    }
+    Q_FOREACH (const QContact &c, contactManager()->contacts(releasedIds)) {
+        if (!c.id().isNull() && !modifiedIds.contains(c.id())) {
+            LOG_DEBUG(Q_FUNC_INFO << "upsyncing local edits to contact released from quarantine:" << c.id().toString());
+            locallyModified->append(c);
+        }
     }
-    QJsonDocument acgJsonDoc(acgJsonObj);
-    QVariant acgValue(acgJsonDoc.toBinaryData());
+    m_quarantinedEdits.subtract(releasedGuids);
+    return true;
+}
 
+// Prepares the state data for storage at the end of a sync: the small
+// per-account values are encoded directly, while the per-contact state
+// is captured in a snapshot, to be encoded by encodeShards().
+void Syncer::prepareExtraStateData(QMap<QString, QVariant> *extraValues, ShardSnapshot *snapshot)
+{
     // m_addressbookCtags
     QJsonObject acJsonObj;
     for (QMap<QString, QString>::const_iterator it = m_addressbookCtags.constBegin();
@@ -530,67 +1674,151 @@ bool Syncer::storeExtraStateData(int accountId)
     QJsonDocument asJsonDoc(asJsonObj);
     QVariant asValue(asJsonDoc.toBinaryData());
 
-    // m_contactUids
-    QJsonObject cuiJsonObj;
-    for (QMap<QString, QString>::const_iterator it = m_contactUids.constBegin();
-            it != m_contactUids.constEnd(); ++it) {
-        cuiJsonObj.insert(it.key(), QJsonValue(it.value()));
-    }
-    QJsonDocument cuiJsonDoc(cuiJsonObj);
-    QVariant cuiValue(cuiJsonDoc.toBinaryData());
+    QMap<QString, QVariant> &values(*extraValues);
+    values.insert("addressbookCtags", acValue);
+    values.insert("addressbookSyncTokens", asValue);
+    values.insert("contactUpsyncLoops", encodeUpsyncLoopState());
 
-    // m_contactUris
-    QJsonObject cuJsonObj;
-    for (QMap<QString, QString>::const_iterator it = m_contactUris.constBegin();
-            it != m_contactUris.constEnd(); ++it) {
-        cuJsonObj.insert(it.key(), QJsonValue(it.value()));
+    // m_strategyStatistics, without the addressbooks for which no strategy has failed.
+    QMap<QString, QMap<int, SyncStrategyStatistics> >::iterator sit = m_strategyStatistics.begin();
+    while (sit != m_strategyStatistics.end()) {
+        if (sit->isEmpty()) {
+            sit = m_strategyStatistics.erase(sit);
+        } else {
+            ++sit;
+        }
     }
-    QJsonDocument cuJsonDoc(cuJsonObj);
-    QVariant cuValue(cuJsonDoc.toBinaryData());
-
-    // m_contactEtags
-    QJsonObject ceJsonObj;
-    for (QMap<QString, QString>::const_iterator it = m_contactEtags.constBegin();
-            it != m_contactEtags.constEnd(); ++it) {
-        ceJsonObj.insert(it.key(), QJsonValue(it.value()));
+    QByteArray ssValue;
+    QDataStream ssOut(&ssValue, QIODevice::WriteOnly);
+    ssOut.setVersion(QDataStream::Qt_5_0);
+    ssOut << STRATEGY_STATISTICS_VERSION << m_strategyStatistics;
+    values.insert("addressbookStrategies", ssValue);
+    values.insert("stateReconciliation", m_reconcileState
+                  ? encodeReconciliationState(false, 0)
+                  : encodeReconciliationState(false, m_syncsSinceReconciliation + 1));
+
+    // assign the per-contact state to the loaded shards.  Contacts listed
+    // in an addressbook belong to that shard, any others are assigned
+    // according to their guid, or to the unassigned shard.
+    QMap<QString, QStringList> shardGuids;
+    QSet<QString> assignedGuids;
+    Q_FOREACH (const QString &url, m_loadedShards) {
+        Q_FOREACH (const QString &guid, m_addressbookContactGuids.value(url)) {
+            if (!assignedGuids.contains(guid)) {
+                assignedGuids.insert(guid);
+                shardGuids[url].append(guid);
+            }
+        }
+    }
+    QSet<QString> allGuids = m_contactUids.keys().toSet();
+    allGuids.unite(m_contactUris.keys().toSet());
+    allGuids.unite(m_contactEtags.keys().toSet());
+    allGuids.unite(m_contactIds.keys().toSet());
+    allGuids.unite(m_contactUnsupportedProperties.keys().toSet());
+    allGuids.unite(m_contactVCardHashes.keys().toSet());
+    allGuids.subtract(assignedGuids);
+    Q_FOREACH (const QString &guid, allGuids) {
+        const QString url = addressbookForGuid(guid);
+        shardGuids[m_loadedShards.contains(url) ? url : QString()].append(guid);
     }
-    QJsonDocument ceJsonDoc(ceJsonObj);
-    QVariant ceValue(ceJsonDoc.toBinaryData());
 
-    // m_contactIds
-    QJsonObject ciJsonObj;
-    for (QMap<QString, QString>::const_iterator it = m_contactIds.constBegin();
-            it != m_contactIds.constEnd(); ++it) {
-        ciJsonObj.insert(it.key(), QJsonValue(it.value()));
+    // the containers are implicitly shared, so this does not copy the state.
+    snapshot->accountId = m_accountId;
+    snapshot->loadedShards = m_loadedShards;
+    snapshot->shardGuids = shardGuids;
+    snapshot->addressbookContactGuids = m_addressbookContactGuids;
+    snapshot->contactUids = m_contactUids;
+    snapshot->contactUris = m_contactUris;
+    snapshot->contactEtags = m_contactEtags;
+    snapshot->contactIds = m_contactIds;
+    snapshot->contactUnsupportedProperties = m_contactUnsupportedProperties;
+    snapshot->contactVCardHashes = m_contactVCardHashes;
+    snapshot->shardHashes = m_shardHashes;
+    snapshot->shardIndex = m_shardIndex;
+
+    // last, so that the time taken to prepare the state is included.
+    values.insert("lastSyncStatistics", encodeSyncStatistics());
+}
+
+// Encodes the shards of the snapshot.  This is run on a worker thread,
+// so must only access the snapshot.
+EncodedShards Syncer::encodeShards(const ShardSnapshot &snapshot)
+{
+    // only store the shards which have changed since they were loaded.
+    EncodedShards encoded;
+    encoded.shardHashes = snapshot.shardHashes;
+    encoded.shardIndex = snapshot.shardIndex;
+    Q_FOREACH (const QString &url, snapshot.loadedShards) {
+        bool hasLegacyGuids = false;
+        const QByteArray data = encodeShard(snapshot, url, &hasLegacyGuids);
+        const QByteArray hash = shardHash(data);
+        encoded.shardIndex.insert(url, hasLegacyGuids);
+        if (hash != encoded.shardHashes.value(url)) {
+            encoded.values.insert(shardKey(url), data);
+            encoded.shardHashes.insert(url, hash);
+        }
     }
-    QJsonDocument ciJsonDoc(ciJsonObj);
-    QVariant ciValue(ciJsonDoc.toBinaryData());
+    return encoded;
+}
 
-    // m_contactUnsupportedProperties
-    QJsonObject cupJsonObj;
-    for (QMap<QString, QStringList>::const_iterator it = m_contactUnsupportedProperties.constBegin();
-            it != m_contactUnsupportedProperties.constEnd(); ++it) {
-        cupJsonObj.insert(it.key(), QJsonValue(QJsonArray::fromStringList(it.value())));
+// this function must be called directly before storeSyncStateData()
+bool Syncer::storeExtraStateData(int accountId, const QMap<QString, QVariant> &extraValues, const EncodedShards &shards)
+{
+    // everything is stored in one OOB write, so that the shards and their index can't diverge.
+    QMap<QString, QVariant> values(extraValues);
+    for (QMap<QString, QVariant>::const_iterator it = shards.values.constBegin(); it != shards.values.constEnd(); ++it) {
+        values.insert(it.key(), it.value());
+    }
+    QByteArray siValue;
+    QDataStream out(&siValue, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << SHARD_INDEX_VERSION << shards.shardIndex;
+    values.insert("addressbookShardIndex", siValue);
+
+    // the blobs of large unsupported properties are written first,
+    // so that the stored state never refers to a missing blob.
+    if (!m_contactUnsupportedProperties.writePendingBlobs()) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to store unsupported property blobs for carddav account" << accountId);
+        d->clear(QString::number(accountId));
+        return false;
     }
-    QJsonDocument cupJsonDoc(cupJsonObj);
-    QVariant cupValue(cupJsonDoc.toBinaryData());
 
     // store to OOB
-    QMap<QString, QVariant> values;
-    values.insert("addressbookContactGuids", acgValue);
-    values.insert("addressbookCtags", acValue);
-    values.insert("addressbookSyncTokens", asValue);
-    values.insert("contactUids", cuiValue);
-    values.insert("contactUris", cuValue);
-    values.insert("contactEtags", ceValue);
-    values.insert("contactIds", ciValue);
-    values.insert("contactUnsupportedProperties", cupValue);
     if (!d->m_engine->storeOOB(d->m_stateData[QString::number(accountId)].m_oobScope, values)) {
         LOG_WARNING(Q_FUNC_INFO << "failed to store extra state data for carddav account" << accountId);
         d->clear(QString::number(accountId));
         return false;
     }
+    m_shardIndex = shards.shardIndex;
+    m_shardHashes = shards.shardHashes;
+    LOG_DEBUG(Q_FUNC_INFO << "stored" << shards.values.size() << "of" << m_shardIndex.size()
+             << "addressbook states for carddav account" << accountId);
+
+    // the stored index no longer refers to these values, so if they
+    // can't be removed they are merely unused, and the state is consistent.
+    if (!m_removedShards.isEmpty()) {
+        QStringList removedKeys;
+        Q_FOREACH (const QString &url, m_removedShards) {
+            removedKeys << shardKey(url);
+        }
+        if (!d->m_engine->removeOOB(d->m_stateData[QString::number(accountId)].m_oobScope, removedKeys)) {
+            LOG_WARNING(Q_FUNC_INFO << "failed to remove the state of removed addressbooks for carddav account" << accountId);
+        }
+        m_removedShards.clear();
+    }
+
+    if (m_legacyStateMigrated) {
+        if (!d->m_engine->removeOOB(d->m_stateData[QString::number(accountId)].m_oobScope, legacyExtraStateDataKeys())) {
+            LOG_WARNING(Q_FUNC_INFO << "failed to remove legacy extra state data for carddav account" << accountId);
+        }
+        m_legacyStateMigrated = false;
+    }
 
+    // the blobs of properties which were removed are no longer needed,
+    // but we can only tell which are unreferenced if all shards are loaded.
+    if (m_loadedShards.contains(m_shardIndex.keys().toSet())) {
+        m_contactUnsupportedProperties.removeUnreferencedBlobs();
+    }
     return true;
 }
 
@@ -598,17 +1826,186 @@ bool Syncer::storeExtraStateData(int accountId)
 bool Syncer::purgeExtraStateData(int accountId)
 {
     QStringList purgeKeys;
-    purgeKeys << QStringLiteral("addressbookContactGuids") << QStringLiteral("addressbookCtags");
-    purgeKeys << QStringLiteral("addressbookSyncTokens") << QStringLiteral("contactUids");
-    purgeKeys << QStringLiteral("contactUris") << QStringLiteral("contactEtags");
-    purgeKeys << QStringLiteral("contactIds") << QStringLiteral("contactUnsupportedProperties");
-    if (!d->m_engine->removeOOB(d->m_stateData[QString::number(accountId)].m_oobScope, purgeKeys)) {
+    purgeKeys << QStringLiteral("addressbookCtags") << QStringLiteral("addressbookSyncTokens");
+    purgeKeys << QStringLiteral("addressbookShardIndex") << QStringLiteral("contactUpsyncLoops");
+    purgeKeys << QStringLiteral("stateReconciliation") << QStringLiteral("stateCommitPending");
+    purgeKeys << QStringLiteral("addressbookStrategies");
+    purgeKeys << legacyExtraStateDataKeys();
+    Q_FOREACH (const QString &url, m_shardIndex.keys() + m_removedShards.toList()) {
+        purgeKeys << shardKey(url);
+    }
+    // if the state was never read, the scope is derived as in purgeAccount().
+    const QString oobScope = m_oobScope.isEmpty()
+            ? QStringLiteral("%1-%2").arg(CARDDAV_CONTACTS_SYNCTARGET).arg(accountId)
+            : m_oobScope;
+    if (!d->m_engine->removeOOB(oobScope, purgeKeys)) {
         LOG_WARNING(Q_FUNC_INFO << "failed to remove extra state data for carddav account" << accountId);
         return false;
     }
     return true;
 }
 
+qint64 SyncStateReport::storedBytes() const
+{
+    qint64 bytes = 0;
+    Q_FOREACH (qint64 size, oobBytes) {
+        bytes += size;
+    }
+    return bytes;
+}
+
+// Reads the state of the given account, as at the start of a sync, and
+// reports its size and any inconsistencies.  If compact is true, the state
+// of contacts which are not listed in any addressbook is removed, and all
+// of the state is rewritten, but otherwise left as it was stored.
+// No requests are made to the server.
+bool Syncer::inspectState(int accountId, bool compact, SyncStateReport *report)
+{
+    m_accountId = accountId;
+    m_inspectOnly = true;
+    QDateTime remoteSince;
+    if (!initSyncAdapter(QString::number(accountId))
+            || !readSyncStateData(&remoteSince, QString::number(accountId))
+            || !readExtraStateData(accountId)
+            || !ensureShardsLoaded(m_shardIndex.keys())) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to read state data for carddav account" << accountId);
+        return false;
+    }
+    report->lastSync = remoteSince;
+    report->reconciliationRequired = m_reconciliationRequired || m_stateCommitInterrupted;
+
+    // the stored size of each OOB value.
+    QStringList keys;
+    keys << QStringLiteral("addressbookCtags")
+         << QStringLiteral("addressbookSyncTokens")
+         << QStringLiteral("addressbookShardIndex")
+         << QStringLiteral("contactUpsyncLoops")
+         << QStringLiteral("stateReconciliation")
+         << QStringLiteral("addressbookStrategies")
+         << QStringLiteral("lastSyncStatistics")
+         << legacyExtraStateDataKeys();
+    Q_FOREACH (const QString &url, m_shardIndex.keys()) {
+        keys << shardKey(url);
+    }
+    QMap<QString, QVariant> values;
+    if (!d->m_engine->fetchOOB(d->m_stateData[QString::number(accountId)].m_oobScope, keys, &values)) {
+        LOG_WARNING(Q_FUNC_INFO << "failed to read extra data for carddav account" << accountId);
+        return false;
+    }
+    for (QMap<QString, QVariant>::const_iterator it = values.constBegin(); it != values.constEnd(); ++it) {
+        report->oobBytes.insert(it.key(), it.value().toByteArray().size());
+    }
+
+    // the content of each addressbook.  The unassigned shard is not an addressbook.
+    QSet<QString> addressbookUrls = m_shardIndex.keys().toSet();
+    addressbookUrls.unite(m_addressbookContactGuids.keys().toSet());
+    addressbookUrls.unite(m_addressbookCtags.keys().toSet());
+    addressbookUrls.unite(m_addressbookSyncTokens.keys().toSet());
+    addressbookUrls.remove(QString());
+    QStringList sortedUrls = addressbookUrls.toList();
+    std::sort(sortedUrls.begin(), sortedUrls.end());
+    const QString guidPrefix = QStringLiteral("%1:AB:").arg(accountId);
+    QSet<QString> listedGuids;
+    Q_FOREACH (const QString &url, sortedUrls) {
+        SyncStateReport::Addressbook addressbook;
+        addressbook.url = url;
+        const QStringList guids = m_addressbookContactGuids.value(url);
+        addressbook.contacts = guids.size();
+        Q_FOREACH (const QString &guid, guids) {
+            listedGuids.insert(guid);
+            if (!guid.startsWith(guidPrefix)) {
+                addressbook.legacyGuids += 1;
+                report->legacyGuids.append(guid);
+            }
+        }
+        addressbook.storedBytes = report->oobBytes.value(shardKey(url));
+        addressbook.hasCtag = !m_addressbookCtags.value(url).isEmpty();
+        addressbook.hasSyncToken = !m_addressbookSyncTokens.value(url).isEmpty();
+        report->addressbooks.append(addressbook);
+    }
+
+    // the state of contacts which are not listed in any addressbook can never be used.
+    QSet<QString> allGuids = m_contactUids.keys().toSet();
+    allGuids.unite(m_contactUris.keys().toSet());
+    allGuids.unite(m_contactEtags.keys().toSet());
+    allGuids.unite(m_contactIds.keys().toSet());
+    allGuids.unite(m_contactUnsupportedProperties.keys().toSet());
+    allGuids.unite(m_contactVCardHashes.keys().toSet());
+    report->orphanGuids = allGuids.subtract(listedGuids).toList();
+    std::sort(report->orphanGuids.begin(), report->orphanGuids.end());
+
+    // the size of each per-contact map, as it would be encoded.
+    report->mapBytes.insert(QStringLiteral("addressbookContactGuids"), encodedSize(m_addressbookContactGuids));
+    report->mapBytes.insert(QStringLiteral("contactUids"), encodedSize(m_contactUids));
+    report->mapBytes.insert(QStringLiteral("contactUris"), encodedSize(m_contactUris));
+    report->mapBytes.insert(QStringLiteral("contactEtags"), encodedSize(m_contactEtags));
+    report->mapBytes.insert(QStringLiteral("contactIds"), encodedSize(m_contactIds));
+    report->mapBytes.insert(QStringLiteral("contactVCardHashes"), encodedSize(m_contactVCardHashes));
+    qint64 unsupportedBytes = 0;
+    QList<QPair<QString, qint64> > payloads;
+    Q_FOREACH (const QString &guid, m_contactUnsupportedProperties.keys()) {
+        unsupportedBytes += encodedSize(guid) + encodedSize(m_contactUnsupportedProperties.entries(guid));
+        // the payload includes the content of any blobs.
+        qint64 payload = 0;
+        Q_FOREACH (const QString &property, m_contactUnsupportedProperties.value(guid)) {
+            payload += property.toUtf8().size();
+        }
+        payloads.append(qMakePair(guid, payload));
+    }
+    report->mapBytes.insert(QStringLiteral("contactUnsupportedProperties"), unsupportedBytes);
+    std::sort(payloads.begin(), payloads.end(), largerPayload);
+    report->largestUnsupportedProperties = payloads.mid(0, INSPECT_LARGEST_PROPERTIES);
+
+    if (!compact) {
+        return true;
+    }
+
+    if (!d->m_stateData[QString::number(accountId)].m_localSince.isValid()) {
+        // the ids of all local contacts have been added to the state, as for a
+        // clean sync, so it cannot be told which of them are orphaned.
+        LOG_WARNING(Q_FUNC_INFO << "no sync has completed for carddav account" << accountId << ", not compacting");
+        return false;
+    }
+
+    Q_FOREACH (const QString &guid, report->orphanGuids) {
+        m_contactUids.remove(guid);
+        m_contactUris.remove(guid);
+        m_contactEtags.remove(guid);
+        m_contactIds.remove(guid);
+        m_contactUnsupportedProperties.remove(guid);
+        m_contactVCardHashes.remove(guid);
+    }
+
+    // forget the hashes, so that every shard is rewritten.
+    m_shardHashes.clear();
+    QMap<QString, QVariant> extraValues;
+    ShardSnapshot snapshot;
+    prepareExtraStateData(&extraValues, &snapshot);
+    // this is not a sync, so the reconciliation state, the upsync loop state (which
+    // was updated as if a sync had completed) and the statistics of the last sync are kept.
+    extraValues.insert(QStringLiteral("stateReconciliation"),
+                       encodeReconciliationState(m_reconciliationRequired, m_syncsSinceReconciliation));
+    extraValues.insert(QStringLiteral("contactUpsyncLoops"), values.value(QStringLiteral("contactUpsyncLoops")).toByteArray());
+    extraValues.remove(QStringLiteral("lastSyncStatistics"));
+    const EncodedShards shards = encodeShards(snapshot);
+    if (!storeExtraStateData(accountId, extraValues, shards)) {
+        return false;
+    }
+
+    report->compacted = true;
+    report->compactedBytes = report->oobBytes.value(QStringLiteral("lastSyncStatistics"))
+                           + encodedSize(SHARD_INDEX_VERSION) + encodedSize(shards.shardIndex);
+    Q_FOREACH (const QVariant &value, extraValues) {
+        report->compactedBytes += value.toByteArray().size();
+    }
+    Q_FOREACH (const QVariant &value, shards.values) {
+        report->compactedBytes += value.toByteArray().size();
+    }
+    LOG_DEBUG(Q_FUNC_INFO << "compacted state data for carddav account" << accountId << "from"
+             << report->storedBytes() << "to" << report->compactedBytes << "bytes");
+    return true;
+}
+
 // helper function to detect spurious changes
 bool Syncer::significantDifferences(QContact *a, QContact *b) const
 {
@@ -671,11 +2068,14 @@ void Syncer::migrateGuidData(const QString &oldguid, const QString &newguid, con
     m_contactUris.insert(newguid, m_contactUris.take(oldguid));
     m_contactEtags.insert(newguid, m_contactEtags.take(oldguid));
     m_contactIds.insert(newguid, m_contactIds.take(oldguid));
-    m_addressbookContactGuids[addressbookUrl].append(newguid);
-    m_addressbookContactGuids[addressbookUrl].removeOne(oldguid);
+    if (m_contactVCardHashes.contains(oldguid)) {
+        m_contactVCardHashes.insert(newguid, m_contactVCardHashes.take(oldguid));
+    }
+    addAddressbookGuid(addressbookUrl, newguid);
+    removeAddressbookGuid(addressbookUrl, oldguid);
 }
 
-// helper function for the unit test only.
+// helper function to clear the per-contact state data.
 void Syncer::clearAllGuidData()
 {
     m_contactUids.clear();
@@ -683,5 +2083,7 @@ void Syncer::clearAllGuidData()
     m_contactUris.clear();
     m_contactEtags.clear();
     m_contactIds.clear();
+    m_contactVCardHashes.clear();
     m_addressbookContactGuids.clear();
+    m_guidAddressbooks.clear();
 }
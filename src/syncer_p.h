@@ -24,6 +24,10 @@
 #define SYNCER_P_H
 
 #include "replyparser_p.h"
+#include "syncstrategy_p.h"
+#include "stallmonitor_p.h"
+#include "syncmetrics_p.h"
+#include "unsupportedproperties_p.h"
 
 #include <twowaycontactsyncadapter.h>
 
@@ -32,7 +36,12 @@
 #include <QString>
 #include <QList>
 #include <QPair>
+#include <QSet>
+#include <QHash>
 #include <QNetworkAccessManager>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QThread>
 
 #include <QContactManager>
 #include <QContact>
@@ -40,12 +49,119 @@
 QTCONTACTS_USE_NAMESPACE
 
 class tst_replyparser;
+class tst_statebenchmark;
+class tst_syncer;
 
 class Auth;
 class CardDav;
 class RequestGenerator;
 namespace Buteo { class SyncProfile; }
 
+// the approximate cost of a sync, as determined by Syncer::estimateSync().
+// Contacts are not fetched, so the download size is the sum of the content
+// lengths reported by the server, and the local counts are upper bounds.
+class SyncCostEstimate
+{
+public:
+    SyncCostEstimate()
+        : addressbooks(0), changedAddressbooks(0)
+        , remoteAdditions(0), remoteModifications(0), remoteRemovals(0)
+        , downloadBytes(0), unknownSizeResources(0)
+        , localAdditions(0), localModifications(0), localRemovals(0) {}
+
+    int uploads() const { return localAdditions + localModifications + localRemovals; }
+    int databaseWrites() const { return remoteAdditions + remoteModifications + remoteRemovals; }
+
+    int addressbooks;
+    int changedAddressbooks;
+    int remoteAdditions;
+    int remoteModifications;
+    int remoteRemovals;
+    qint64 downloadBytes;       // sum of the reported sizes of the resources to fetch
+    int unknownSizeResources;   // resources to fetch whose size was not reported
+    int localAdditions;
+    int localModifications;
+    int localRemovals;
+};
+
+// the size and health of the stored sync state of an account,
+// as determined by Syncer::inspectState().
+class SyncStateReport
+{
+public:
+    class Addressbook
+    {
+    public:
+        Addressbook() : contacts(0), legacyGuids(0), storedBytes(0), hasCtag(false), hasSyncToken(false) {}
+        QString url;
+        int contacts;        // contacts listed in the addressbook
+        int legacyGuids;     // old-form (accountId:uid) guids awaiting migration
+        qint64 storedBytes;  // size of the stored shard
+        bool hasCtag;
+        bool hasSyncToken;
+    };
+
+    SyncStateReport() : reconciliationRequired(false), compacted(false), compactedBytes(0) {}
+
+    qint64 storedBytes() const;
+
+    QDateTime lastSync;                    // when the ctags and sync tokens were stored
+    QList<Addressbook> addressbooks;
+    QMap<QString, qint64> oobBytes;        // OOB key -> size of the stored value
+    QMap<QString, qint64> mapBytes;        // state map -> size of its encoded content
+    QList<QPair<QString, qint64> > largestUnsupportedProperties; // contact guid -> bytes, largest first
+    QStringList orphanGuids;               // contacts with state which are not listed in any addressbook
+    QStringList legacyGuids;               // old-form guids, in any addressbook
+    bool reconciliationRequired;
+    bool compacted;
+    qint64 compactedBytes;                 // size of the state as rewritten by compaction
+};
+
+// The per-contact state to be stored at the end of a sync.  The containers
+// are implicitly shared with those of the Syncer, so the snapshot is cheap
+// to take, and can be encoded on a worker thread while the Syncer carries on.
+class ShardSnapshot
+{
+public:
+    ShardSnapshot() : accountId(0) {}
+    int accountId;
+    QSet<QString> loadedShards;
+    QMap<QString, QStringList> shardGuids; // addressbookUrl -> guids whose state is stored in its shard
+    QMap<QString, QStringList> addressbookContactGuids;
+    QMap<QString, QString> contactUids;
+    QMap<QString, QString> contactUris;
+    QMap<QString, QString> contactEtags;
+    QMap<QString, QString> contactIds;
+    UnsupportedPropertiesStore contactUnsupportedProperties;
+    QMap<QString, QByteArray> contactVCardHashes;
+    QMap<QString, QByteArray> shardHashes;
+    QMap<QString, bool> shardIndex;
+};
+
+class EncodedShards
+{
+public:
+    QMap<QString, QVariant> values;        // OOB key -> shards which changed since they were loaded or stored
+    QMap<QString, QByteArray> shardHashes; // addressbookUrl -> hash of the shard
+    QMap<QString, bool> shardIndex;        // addressbookUrl -> shard contains old-form guids
+};
+
+// The state of one addressbook as read from its shard.  It is only merged
+// into the state of the Syncer once the whole shard has been decoded, so
+// that a corrupt shard does not leave partial state behind.
+class DecodedShard
+{
+public:
+    QString addressbookUrl;
+    QStringList addressbookContactGuids;
+    QMap<QString, QString> contactUids;
+    QMap<QString, QString> contactUris;
+    QMap<QString, QString> contactEtags;
+    QMap<QString, QString> contactIds;
+    QMap<QString, QList<QByteArray> > contactUnsupportedProperties;
+    QMap<QString, QByteArray> contactVCardHashes;
+};
+
 class Syncer : public QObject, public QtContactsSqliteExtensions::TwoWayContactSyncAdapter
 {
     Q_OBJECT
@@ -55,12 +171,20 @@ public:
    ~Syncer();
 
     void startSync(int accountId);
+    void estimateSync(int accountId);
     void purgeAccount(int accountId);
+    bool isPurging(int accountId) const;
+    static QList<int> pendingPurges();
+    bool inspectState(int accountId, bool compact, SyncStateReport *report);
     void abortSync();
+    void setStartupTimer(const QElapsedTimer &timer);
 
 Q_SIGNALS:
     void syncSucceeded();
     void syncFailed();
+    void syncEstimated(const SyncCostEstimate &estimate);
+    void purgeProgress(int accountId, int removedCount, int totalCount);
+    void purgeFinished(int accountId, bool success);
 
 protected:
     // implementing the TWCSA interface
@@ -75,33 +199,105 @@ protected:
 
 private:
     bool readExtraStateData(int accountId);
-    bool storeExtraStateData(int accountId);
+    void prepareExtraStateData(QMap<QString, QVariant> *extraValues, ShardSnapshot *snapshot);
+    static EncodedShards encodeShards(const ShardSnapshot &snapshot);
+    bool storeExtraStateData(int accountId, const QMap<QString, QVariant> &extraValues, const EncodedShards &shards);
+    bool commitStateData();
     bool purgeExtraStateData(int accountId);
+    void readLegacyExtraStateData(const QMap<QString, QVariant> &values);
+    static QStringList legacyExtraStateDataKeys();
+
+    // the per-contact state is stored in one OOB value per addressbook,
+    // which are only loaded when that addressbook is synced.
+    bool ensureShardLoaded(const QString &addressbookUrl);
+    bool ensureShardsLoaded(const QStringList &addressbookUrls);
+    QString addressbookForGuid(const QString &guid) const;
+    void addAddressbookGuid(const QString &addressbookUrl, const QString &guid);
+    void removeAddressbookGuid(const QString &addressbookUrl, const QString &guid);
+    void indexAddressbookGuids(const QString &addressbookUrl);
+    void forgetRemovedAddressbooks(const QSet<QString> &addressbookUrls);
+    static QByteArray encodeShard(const ShardSnapshot &snapshot, const QString &addressbookUrl, bool *hasLegacyGuids);
+    static bool decodeShard(const QByteArray &data, DecodedShard *shard);
+    void mergeShard(const DecodedShard &shard);
+    bool readUpsyncLoopState(const QByteArray &data);
+    QByteArray encodeUpsyncLoopState();
+    bool releaseQuarantinedEdits(QList<QContact> *locallyModified);
+    bool fetchLocalContacts(int accountId, QList<QContact> *contacts);
+    bool reconcileContactIds(int accountId);
+    void indexLocalContacts(const QList<QContact> &contacts);
+    bool readReconciliationState(const QByteArray &data);
+    static QByteArray encodeReconciliationState(bool reconciliationRequired, int syncsSinceReconciliation);
+    bool markReconciliationRequired(int accountId);
+    QByteArray encodeSyncStatistics();
+    void setPhase(const QString &phase);
+    void publishMetrics(bool force = false);
 
 private Q_SLOTS:
     void sync(const QString &serverUrl, const QString &addressbookPath, const QString &username, const QString &password, const QString &accessToken, bool ignoreSslErrors);
-    void continueSync(const QList<QContact> &added, const QList<QContact> &modified, const QList<QContact> &removed);
+    void continueSync();
     void syncFinished();
+    void stateDataEncoded();
+    void estimateFinished();
     void signInError();
     void cardDavError(int errorCode = 0);
+    void reportSyncStatistics();
+    void purgeNextChunk();
 
 private:
+    void finishPurge(bool success);
     bool significantDifferences(QContact *a, QContact *b) const;
+    bool routeLocalChanges(const QList<QContact> &locallyAdded,
+                           const QList<QContact> &locallyModified,
+                           const QList<QContact> &locallyDeleted,
+                           QMap<QString, QList<QContact> > *added,
+                           QMap<QString, QList<QContact> > *modified,
+                           QMap<QString, QList<QContact> > *deleted,
+                           QSet<QString> *modifiedAddressbookUrls);
+    bool determineLocalDelta(QDateTime *localSince,
+                             QList<QContact> *locallyAdded,
+                             QList<QContact> *locallyModified,
+                             QList<QContact> *locallyDeleted);
     void migrateGuidData(const QString &oldguid, const QString &newguid, const QString &addressbookUrl);
-    void clearAllGuidData(); // used by the unit test only.
+    void clearAllGuidData();
+    QContactManager *contactManager();
+    QNetworkAccessManager *networkAccessManager();
+    bool fromRemoteOnly() const;
+    bool toRemoteOnly() const;
 
 private:
     friend class CardDav;
+    friend class SyncStrategy;
     friend class RequestGenerator;
     friend class ReplyParser;
     friend class tst_replyparser;
+    friend class tst_statebenchmark;
+    friend class tst_syncer;
     Buteo::SyncProfile *m_syncProfile;
     CardDav *m_cardDav;
     Auth *m_auth;
-    QContactManager m_contactManager;
-    QNetworkAccessManager m_qnam;
+    QContactManager *m_contactManager;   // created on demand
+    QList<int> m_purgeQueue;             // accounts to purge, the first of which is being purged
+    QList<QContactId> m_purgeContactIds; // the contacts of the account being purged
+    int m_purgeRemovedCount;
+    QNetworkAccessManager *m_qnam;       // created on demand
+    QElapsedTimer m_startupTimer;        // started on plugin creation
+    StallMonitor m_stallMonitor;         // event-loop stalls during the current sync
+    SyncMetrics m_metrics;               // progress of the current sync, see publishMetrics()
+    QElapsedTimer m_metricsPublished;    // since m_metrics was last published
+    QThread m_metricsThread;             // serves m_metrics over a local socket
     bool m_syncAborted;
     bool m_syncError;
+    bool m_remoteChangesStored;
+    bool m_estimateOnly;                 // see estimateSync()
+    bool m_inspectOnly;                  // see inspectState()
+    bool m_stateDataRead;
+    QString m_oobScope;                  // captured when the state is read, see markReconciliationRequired()
+
+    // the state is encoded on a worker thread at the end of a sync, see syncFinished().
+    QFutureWatcher<EncodedShards> m_stateEncodingWatcher;
+    QMap<QString, QVariant> m_pendingStateValues; // the other OOB values, stored along with the shards
+    bool m_stateCommitPending;
+    bool m_stateCommitInterrupted;       // the previous sync did not finish storing its state, see commitStateData()
 
     // auth related
     int m_accountId;
@@ -120,16 +316,40 @@ private:
     QMap<QString, QList<ReplyParser::ContactInformation> > m_serverModifications; // contacts modified server-side, per addressbook.
     QMap<QString, QList<ReplyParser::ContactInformation> > m_serverDeletions;     // contacts deleted server-side, per addressbook.
     QMultiMap<QString, QPair<QString, QContact> > m_serverAddModsByUid; // uid to <addressbookUrl, QContact>, for duplicate detection.
+    QSet<QString> m_upsyncedGuids;  // contacts upsynced during this sync
+    QSet<QString> m_roundTripGuids; // contacts modified remotely after being upsynced during the previous sync
 
     // loaded from OOB data.
     QMap<QString, QStringList> m_addressbookContactGuids; // addressbookUrl to list of contact guids
+    QHash<QString, QString> m_guidAddressbooks;            // contact guid to the addressbookUrl listing it, see addAddressbookGuid()
     QMap<QString, QString> m_addressbookCtags;
     QMap<QString, QString> m_addressbookSyncTokens;
+    QMap<QString, QMap<int, SyncStrategyStatistics> > m_strategyStatistics; // addressbookUrl -> strategy -> past failures
     QMap<QString, QString> m_contactUids;  // contact guid -> contact UID
     QMap<QString, QString> m_contactUris;  // contact guid -> contact uri
     QMap<QString, QString> m_contactEtags; // contact guid -> contact etag
     QMap<QString, QString> m_contactIds;   // contact guid -> contact id
-    QMap<QString, QStringList> m_contactUnsupportedProperties; // contact guid -> prop strings
+    UnsupportedPropertiesStore m_contactUnsupportedProperties; // contact guid -> prop strings
+    QMap<QString, QByteArray> m_contactVCardHashes; // contact guid -> hash of last uploaded or downloaded vCard
+    QMap<QString, bool> m_shardIndex;         // addressbookUrl -> shard contains old-form guids
+    QSet<QString> m_loadedShards;             // addressbookUrls whose state has been loaded
+    QMap<QString, QByteArray> m_shardHashes;  // addressbookUrl -> hash of the shard as last loaded or stored
+    QSet<QString> m_removedShards;            // addressbookUrls removed from the server, whose shards are removed on store
+    bool m_legacyStateMigrated;
+    bool m_stateCorrupt;                      // a shard could not be decoded, so the state must be purged
+
+    // upsync loop detection: contacts which the server reports as modified
+    // after each upsync are quarantined from upsync, see CardDav::upsyncUpdates().
+    QSet<QString> m_lastUpsyncedGuids;              // contacts upsynced during the previous sync
+    QMap<QString, int> m_contactUpsyncLoops;        // contact guid -> consecutive upsync/downsync round trips
+    QMap<QString, QDateTime> m_quarantinedContacts; // contact guid -> quarantine expiry
+    QSet<QString> m_quarantinedEdits;               // contacts whose local edits were not upsynced due to quarantine
+
+    // drift reconciliation: rather than purging the state after a failed sync,
+    // it is compared against an etag listing of each addressbook, see reconcileContactIds().
+    bool m_reconcileState;           // the state is being reconciled during this sync
+    bool m_reconciliationRequired;   // a previous sync failed
+    int m_syncsSinceReconciliation;
 };
 
 #endif // SYNCER_P_H
@@ -0,0 +1,163 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "syncmetrics_p.h"
+
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QElapsedTimer>
+#include <QStandardPaths>
+
+#include <LogMacros.h>
+
+SyncMetrics::SyncMetrics()
+    : m_snapshot(0)
+    , m_accountId(0)
+    , m_startTime(-1)
+{
+    for (int i = 0; i < CounterCount; ++i) {
+        m_counters[i].store(0);
+    }
+}
+
+SyncMetrics::~SyncMetrics()
+{
+    delete m_snapshot.load();
+}
+
+const char *SyncMetrics::counterName(Counter counter)
+{
+    switch (counter) {
+        case RequestsInFlight:  return "requests_in_flight";
+        case RequestsSent:      return "requests_sent";
+        case BytesSent:         return "bytes_sent";
+        case BytesReceived:     return "bytes_received";
+        case ContactsParsed:    return "contacts_parsed";
+        case ContactsConverted: return "contacts_converted";
+        case ContactsStored:    return "contacts_stored";
+        default:                return "unknown";
+    }
+}
+
+void SyncMetrics::start(int accountId)
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_accountId.store(accountId);
+    m_startTime.store(timer.msecsSinceReference());
+    for (int i = 0; i < CounterCount; ++i) {
+        m_counters[i].store(0);
+    }
+    publish(new SyncMetricsSnapshot);
+}
+
+void SyncMetrics::publish(SyncMetricsSnapshot *snapshot)
+{
+    // if the reader holds the previous snapshot, the pointer is null,
+    // and the reader will delete its snapshot as it cannot put it back.
+    delete m_snapshot.fetchAndStoreOrdered(snapshot);
+}
+
+QByteArray SyncMetrics::report()
+{
+    QElapsedTimer timer;
+    timer.start();
+    const qint64 startTime = m_startTime.load();
+    QByteArray report;
+    report += "account " + QByteArray::number(m_accountId.load()) + '\n';
+    report += "elapsed " + QByteArray::number(startTime >= 0 ? timer.msecsSinceReference() - startTime : 0) + '\n';
+    for (int i = 0; i < CounterCount; ++i) {
+        report += QByteArray(counterName(static_cast<Counter>(i))) + ' '
+                + QByteArray::number(m_counters[i].load()) + '\n';
+    }
+
+    SyncMetricsSnapshot *snapshot = m_snapshot.fetchAndStoreOrdered(0);
+    if (snapshot) {
+        report += "phase " + snapshot->phase.toUtf8() + '\n';
+        for (QMap<QString, QString>::const_iterator it = snapshot->addressbookPhases.constBegin();
+                it != snapshot->addressbookPhases.constEnd(); ++it) {
+            report += "addressbook " + it.key().toUtf8() + ' ' + it.value().toUtf8() + '\n';
+        }
+        for (QMap<QString, int>::const_iterator it = snapshot->stateSizes.constBegin();
+                it != snapshot->stateSizes.constEnd(); ++it) {
+            report += "state " + it.key().toUtf8() + ' ' + QByteArray::number(it.value()) + '\n';
+        }
+        if (!m_snapshot.testAndSetOrdered(0, snapshot)) {
+            delete snapshot; // a newer one has been published.
+        }
+    }
+    return report;
+}
+
+SyncMetricsServer::SyncMetricsServer(SyncMetrics *metrics)
+    : QObject(0)
+    , m_metrics(metrics)
+    , m_server(0)
+{
+}
+
+QString SyncMetricsServer::serverName(int accountId)
+{
+    const QString runtimeDir = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    if (runtimeDir.isEmpty()) {
+        return QString();
+    }
+    return QStringLiteral("%1/carddav-metrics-%2").arg(runtimeDir).arg(accountId);
+}
+
+void SyncMetricsServer::listen(const QString &name)
+{
+    if (name.isEmpty()) {
+        LOG_WARNING(Q_FUNC_INFO << "no runtime directory in which to serve sync metrics");
+        return;
+    }
+
+    m_server = new QLocalServer(this);
+    m_server->setSocketOptions(QLocalServer::UserAccessOption);
+    connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+
+    // a socket may have been left behind by a previous sync which crashed,
+    // but is only removed if nothing is serving it.
+    QLocalSocket socket;
+    socket.connectToServer(name, QIODevice::ReadOnly);
+    if (socket.waitForConnected(0) || socket.state() == QLocalSocket::ConnectingState) {
+        LOG_WARNING(Q_FUNC_INFO << "sync metrics are already being served at" << name);
+        return;
+    }
+    if (socket.error() == QLocalSocket::ConnectionRefusedError) {
+        QLocalServer::removeServer(name);
+    }
+    if (!m_server->listen(name)) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to serve sync metrics at" << name << ":" << m_server->errorString());
+        return;
+    }
+    LOG_DEBUG(Q_FUNC_INFO << "serving sync metrics at" << m_server->fullServerName());
+}
+
+void SyncMetricsServer::newConnection()
+{
+    while (QLocalSocket *socket = m_server->nextPendingConnection()) {
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        socket->write(m_metrics->report());
+        socket->disconnectFromServer(); // once the report has been written.
+    }
+}
@@ -0,0 +1,120 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef SYNCMETRICS_P_H
+#define SYNCMETRICS_P_H
+
+#include <QObject>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QByteArray>
+#include <QString>
+#include <QMap>
+
+class QLocalServer;
+
+// the less frequently changing state of a sync, published as a whole.
+class SyncMetricsSnapshot
+{
+public:
+    QString phase;                            // of the sync as a whole
+    QMap<QString, QString> addressbookPhases; // addressbookUrl -> phase
+    QMap<QString, int> stateSizes;            // state map -> entries
+};
+
+/*
+ * Describes the progress of a running sync, for diagnostic purposes.
+ *
+ * The counters are atomic, and may be updated and read from any thread.
+ * The snapshot is handed between the syncing thread, which publishes it,
+ * and a single reading thread, via an atomic pointer: the reader takes the
+ * snapshot out of the pointer while formatting it, and puts it back unless
+ * a newer one has been published meanwhile.  Neither thread ever waits for
+ * the other.  The start time is published atomically, too.
+ */
+class SyncMetrics
+{
+public:
+    enum Counter {
+        RequestsInFlight = 0,
+        RequestsSent,
+        BytesSent,
+        BytesReceived,
+        ContactsParsed,    // vCards read from multiget responses
+        ContactsConverted, // vCards converted to contacts
+        ContactsStored,    // remote additions, modifications and removals stored locally
+        CounterCount
+    };
+
+    SyncMetrics();
+    ~SyncMetrics();
+
+    void add(Counter counter, qint64 delta = 1) { m_counters[counter].fetchAndAddRelaxed(delta); }
+    qint64 value(Counter counter) const { return m_counters[counter].load(); }
+
+    // called from the syncing thread only.
+    void start(int accountId);
+    void publish(SyncMetricsSnapshot *snapshot); // takes ownership
+
+    // called from the reading thread only.
+    QByteArray report();
+
+private:
+    Q_DISABLE_COPY(SyncMetrics)
+    static const char *counterName(Counter counter);
+
+    QAtomicInteger<qint64> m_counters[CounterCount];
+    QAtomicPointer<SyncMetricsSnapshot> m_snapshot;
+    QAtomicInt m_accountId;
+    QAtomicInteger<qint64> m_startTime; // QElapsedTimer::msecsSinceReference() at start(), or -1
+};
+
+/*
+ * Serves reports of the metrics of a sync over a local socket, from its
+ * own thread, so that they can be read while the syncing thread is busy.
+ * Each connection is sent one report, and then closed.  The socket is
+ * created in the user's runtime directory, and may be read with e.g.
+ * cdavtool --with-account 5 --sync-metrics, or
+ *   socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/carddav-metrics-5
+ */
+class SyncMetricsServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    SyncMetricsServer(SyncMetrics *metrics);
+
+    // the path of the socket, as the runtime directory is private to the user.
+    static QString serverName(int accountId);
+
+public Q_SLOTS:
+    void listen(const QString &name);
+
+private Q_SLOTS:
+    void newConnection();
+
+private:
+    SyncMetrics *m_metrics;
+    QLocalServer *m_server; // created by listen(), in the server thread
+};
+
+#endif // SYNCMETRICS_P_H
@@ -0,0 +1,286 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "syncstrategy_p.h"
+#include "carddav_p.h"
+#include "syncer_p.h"
+
+#include <LogMacros.h>
+
+#include <QTimer>
+
+namespace {
+    // a strategy which fails this many times in a row for an addressbook
+    // is passed over for that addressbook for the given number of syncs.
+    const int MaxStrategyFailures = 3;
+    const int StrategyRetryInterval = 20;
+
+    // In syncs to the remote side only, nothing is downloaded: the etags are
+    // listed only to find the contacts whose local changes would overwrite
+    // remote changes.  The ctag and sync token are left as they are, so that
+    // a later two-way sync still downloads the remote changes.
+    class ConflictScanStrategy : public SyncStrategy
+    {
+    public:
+        ConflictScanStrategy(CardDav *cardDav, Syncer *syncer) : SyncStrategy(cardDav, syncer) {}
+        Type type() const { return ConflictScan; }
+        const char *name() const { return "conflict scan"; }
+        bool isApplicable(const ReplyParser::AddressBookInformation &) const
+        {
+            return toRemoteOnly();
+        }
+        void start(const ReplyParser::AddressBookInformation &info)
+        {
+            fetchContactMetadata(info.url);
+        }
+    };
+
+    // Fetches every contact with a single addressbook-query report, rather
+    // than listing the etags and then fetching the contacts with a multiget.
+    // Only used for the first sync of an addressbook, where every contact
+    // is an addition.
+    class AddressbookQueryStrategy : public SyncStrategy
+    {
+    public:
+        AddressbookQueryStrategy(CardDav *cardDav, Syncer *syncer) : SyncStrategy(cardDav, syncer) {}
+        Type type() const { return AddressbookQuery; }
+        const char *name() const { return "addressbook-query"; }
+        bool isApplicable(const ReplyParser::AddressBookInformation &info) const
+        {
+            return !reconcileState() && !estimateOnly() && !hasState(info.url);
+        }
+        void start(const ReplyParser::AddressBookInformation &info)
+        {
+            if (!info.syncToken.isEmpty()) {
+                addressbookSyncTokens()[info.url] = info.syncToken;
+            }
+            addressbookCtags()[info.url] = info.ctag;
+            fetchAllContacts(info.url);
+        }
+    };
+
+    // RFC 6578 sync-collection reports, for servers which support webdav-sync.
+    class SyncCollectionStrategy : public SyncStrategy
+    {
+    public:
+        SyncCollectionStrategy(CardDav *cardDav, Syncer *syncer) : SyncStrategy(cardDav, syncer) {}
+        Type type() const { return SyncCollection; }
+        const char *name() const { return "sync-collection"; }
+        bool isApplicable(const ReplyParser::AddressBookInformation &info) const
+        {
+            return !reconcileState() && !info.syncToken.isEmpty();
+        }
+        void start(const ReplyParser::AddressBookInformation &info)
+        {
+            const QString existingSyncToken(addressbookSyncTokens().value(info.url)); // from OOB
+            // store the ctag anyway just in case the server has
+            // forgotten the syncToken we cached from last time.
+            if (!info.ctag.isEmpty()) {
+                addressbookCtags()[info.url] = info.ctag;
+            }
+            if (existingSyncToken.isEmpty()) {
+                // first time sync: perform slow sync / full report
+                addressbookSyncTokens()[info.url] = info.syncToken;
+                fetchContactMetadata(info.url);
+            } else if (existingSyncToken != info.syncToken) {
+                // changes have occurred since last sync.  Perform immediate
+                // delta sync, by passing the old sync token to the server.
+                addressbookSyncTokens()[info.url] = info.syncToken;
+                fetchImmediateDelta(info.url, existingSyncToken);
+            } else {
+                reportNoChanges(info.url);
+            }
+        }
+    };
+
+    // compare the ctag with the one from the last sync, and if it has
+    // changed, calculate the delta from an etag listing.
+    class CtagEtagStrategy : public SyncStrategy
+    {
+    public:
+        CtagEtagStrategy(CardDav *cardDav, Syncer *syncer) : SyncStrategy(cardDav, syncer) {}
+        Type type() const { return CtagEtag; }
+        const char *name() const { return "ctag"; }
+        bool isApplicable(const ReplyParser::AddressBookInformation &info) const
+        {
+            return !reconcileState() && !info.ctag.isEmpty();
+        }
+        void start(const ReplyParser::AddressBookInformation &info)
+        {
+            // keep any sync token current, in case sync-collection is used again later.
+            if (!info.syncToken.isEmpty()) {
+                addressbookSyncTokens()[info.url] = info.syncToken;
+            }
+            const QString existingCtag(addressbookCtags().value(info.url)); // from OOB
+            if (existingCtag != info.ctag) {
+                // first time sync, or changes have occurred since last sync.
+                addressbookCtags()[info.url] = info.ctag;
+                fetchContactMetadata(info.url);
+            } else {
+                reportNoChanges(info.url);
+            }
+        }
+    };
+
+    // calculate the delta from an etag listing every time.  This is used for
+    // addressbooks with neither a sync token nor a ctag, and when the stored
+    // state may have drifted from the server, in which case neither can be trusted.
+    class FullScanStrategy : public SyncStrategy
+    {
+    public:
+        FullScanStrategy(CardDav *cardDav, Syncer *syncer) : SyncStrategy(cardDav, syncer) {}
+        Type type() const { return FullScan; }
+        const char *name() const { return "full scan"; }
+        bool isApplicable(const ReplyParser::AddressBookInformation &) const
+        {
+            return true;
+        }
+        void start(const ReplyParser::AddressBookInformation &info)
+        {
+            if (!info.syncToken.isEmpty()) {
+                addressbookSyncTokens()[info.url] = info.syncToken;
+            }
+            addressbookCtags()[info.url] = info.ctag; // if empty, we always use manual detection.
+            fetchContactMetadata(info.url);
+        }
+    };
+}
+
+QDataStream &operator<<(QDataStream &out, const SyncStrategyStatistics &statistics)
+{
+    return out << statistics.failures << statistics.skippedSyncs;
+}
+
+QDataStream &operator>>(QDataStream &in, SyncStrategyStatistics &statistics)
+{
+    return in >> statistics.failures >> statistics.skippedSyncs;
+}
+
+SyncStrategy::SyncStrategy(CardDav *cardDav, Syncer *syncer)
+    : d(cardDav), q(syncer)
+{
+}
+
+SyncStrategy::~SyncStrategy()
+{
+}
+
+QList<SyncStrategy*> SyncStrategy::createStrategies(CardDav *cardDav, Syncer *syncer)
+{
+    QList<SyncStrategy*> strategies;
+    strategies << new ConflictScanStrategy(cardDav, syncer)
+               << new AddressbookQueryStrategy(cardDav, syncer)
+               << new SyncCollectionStrategy(cardDav, syncer)
+               << new CtagEtagStrategy(cardDav, syncer)
+               << new FullScanStrategy(cardDav, syncer);
+    return strategies;
+}
+
+SyncStrategy *SyncStrategy::select(const QList<SyncStrategy*> &strategies,
+                                   const ReplyParser::AddressBookInformation &info,
+                                   QMap<int, SyncStrategyStatistics> *statistics)
+{
+    Q_FOREACH (SyncStrategy *strategy, strategies) {
+        if (!strategy->isApplicable(info)) {
+            continue;
+        }
+        QMap<int, SyncStrategyStatistics>::iterator it = statistics->find(strategy->type());
+        if (it != statistics->end()
+                && it->failures >= MaxStrategyFailures
+                && it->skippedSyncs < StrategyRetryInterval
+                && strategy != strategies.last()) {
+            it->skippedSyncs += 1;
+            LOG_DEBUG(Q_FUNC_INFO << "passing over" << strategy->name() << "for addressbook" << info.url
+                     << "after" << it->failures << "failures");
+            continue;
+        }
+        return strategy;
+    }
+    return strategies.last();
+}
+
+void SyncStrategy::recordOutcome(QMap<int, SyncStrategyStatistics> *statistics, Type type, bool succeeded)
+{
+    if (succeeded) {
+        statistics->remove(type);
+    } else {
+        SyncStrategyStatistics &s((*statistics)[type]);
+        s.failures += 1;
+        s.skippedSyncs = 0;
+    }
+}
+
+void SyncStrategy::fetchImmediateDelta(const QString &addressbookUrl, const QString &syncToken)
+{
+    d->fetchImmediateDelta(addressbookUrl, syncToken);
+}
+
+void SyncStrategy::fetchContactMetadata(const QString &addressbookUrl)
+{
+    d->fetchContactMetadata(addressbookUrl);
+}
+
+void SyncStrategy::fetchAllContacts(const QString &addressbookUrl)
+{
+    d->fetchAllContacts(addressbookUrl);
+}
+
+void SyncStrategy::reportNoChanges(const QString &addressbookUrl)
+{
+    LOG_DEBUG(Q_FUNC_INFO << "no changes since last sync for"
+             << addressbookUrl << "from account" << q->m_accountId);
+    d->m_downsyncRequests += 1;
+    QTimer::singleShot(0, d, SLOT(downsyncComplete()));
+}
+
+bool SyncStrategy::reconcileState() const
+{
+    return q->m_reconcileState;
+}
+
+bool SyncStrategy::estimateOnly() const
+{
+    return d->m_estimateOnly;
+}
+
+bool SyncStrategy::toRemoteOnly() const
+{
+    return d->m_toRemoteOnly;
+}
+
+bool SyncStrategy::hasState(const QString &addressbookUrl) const
+{
+    return q->m_addressbookCtags.contains(addressbookUrl)
+            || q->m_addressbookSyncTokens.contains(addressbookUrl)
+            || q->m_shardIndex.contains(addressbookUrl)
+            || !q->m_addressbookContactGuids.value(addressbookUrl).isEmpty();
+}
+
+QMap<QString, QString> &SyncStrategy::addressbookCtags()
+{
+    return q->m_addressbookCtags;
+}
+
+QMap<QString, QString> &SyncStrategy::addressbookSyncTokens()
+{
+    return q->m_addressbookSyncTokens;
+}
@@ -0,0 +1,108 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef SYNCSTRATEGY_P_H
+#define SYNCSTRATEGY_P_H
+
+#include "replyparser_p.h"
+
+#include <QDataStream>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+class CardDav;
+class Syncer;
+
+// the outcome of past downsyncs of an addressbook with a particular strategy.
+class SyncStrategyStatistics
+{
+public:
+    SyncStrategyStatistics() : failures(0), skippedSyncs(0) {}
+    qint32 failures;     // consecutive failed attempts
+    qint32 skippedSyncs; // syncs for which the strategy was passed over since it last failed
+};
+
+QDataStream &operator<<(QDataStream &out, const SyncStrategyStatistics &statistics);
+QDataStream &operator>>(QDataStream &in, SyncStrategyStatistics &statistics);
+
+/*
+ * A way of determining the remote changes to an addressbook.
+ *
+ * For each addressbook, CardDav starts the most preferred strategy which
+ * is applicable given the addressbook information reported by the server
+ * and the state stored from previous syncs.  A strategy issues its requests
+ * through CardDav, whose response handlers pass the delta on to
+ * CardDav::fetchContacts() as before.
+ *
+ * If a strategy fails (e.g. as the server has forgotten the sync token)
+ * CardDav falls back to a full scan of the addressbook.  A strategy which
+ * has failed repeatedly for an addressbook is passed over for a while.
+ */
+class SyncStrategy
+{
+public:
+    enum Type {
+        AddressbookQuery = 0,
+        SyncCollection,
+        CtagEtag,
+        FullScan,
+        ConflictScan
+    };
+
+    SyncStrategy(CardDav *cardDav, Syncer *syncer);
+    virtual ~SyncStrategy();
+
+    virtual Type type() const = 0;
+    virtual const char *name() const = 0;
+    virtual bool isApplicable(const ReplyParser::AddressBookInformation &info) const = 0;
+    virtual void start(const ReplyParser::AddressBookInformation &info) = 0;
+
+    // the available strategies, in order of preference.
+    static QList<SyncStrategy*> createStrategies(CardDav *cardDav, Syncer *syncer);
+
+    // returns the first applicable strategy which has not been failing for the addressbook.
+    static SyncStrategy *select(const QList<SyncStrategy*> &strategies,
+                                const ReplyParser::AddressBookInformation &info,
+                                QMap<int, SyncStrategyStatistics> *statistics);
+    static void recordOutcome(QMap<int, SyncStrategyStatistics> *statistics, Type type, bool succeeded);
+
+protected:
+    // the steps which strategies are composed of.
+    void fetchImmediateDelta(const QString &addressbookUrl, const QString &syncToken);
+    void fetchContactMetadata(const QString &addressbookUrl);
+    void fetchAllContacts(const QString &addressbookUrl);
+    void reportNoChanges(const QString &addressbookUrl);
+
+    bool reconcileState() const;
+    bool estimateOnly() const;
+    bool toRemoteOnly() const;
+    bool hasState(const QString &addressbookUrl) const;
+    QMap<QString, QString> &addressbookCtags();
+    QMap<QString, QString> &addressbookSyncTokens();
+
+private:
+    CardDav *d;
+    Syncer *q;
+};
+
+#endif // SYNCSTRATEGY_P_H
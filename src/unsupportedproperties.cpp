@@ -0,0 +1,294 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "unsupportedproperties_p.h"
+
+#include <LogMacros.h>
+
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+namespace {
+    const char RawEntry = 'R';
+    const char CompressedEntry = 'Z';
+    const char BlobEntry = 'B';
+
+    // property lines longer than this (in bytes of UTF-8) are compressed.
+    const int CompressionThreshold = 256;
+    // property lines longer than this are stored in an external blob file.
+    const int BlobThreshold = 16 * 1024;
+    // the pool is pruned once at least this many entries have been released.
+    const int PoolPruneThreshold = 1024;
+}
+
+UnsupportedPropertiesStore::UnsupportedPropertiesStore()
+    : m_releasedEntries(0)
+{
+}
+
+QString UnsupportedPropertiesStore::defaultBlobDirectory(int accountId)
+{
+    return QStringLiteral("%1/system/privileged/Contacts/carddav/%2/unsupported")
+            .arg(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation))
+            .arg(accountId);
+}
+
+void UnsupportedPropertiesStore::setBlobDirectory(const QString &path)
+{
+    m_blobDirectory = path;
+}
+
+QStringList UnsupportedPropertiesStore::value(const QString &guid) const
+{
+    QStringList properties;
+    const QList<QByteArray> entries = m_entries.value(guid);
+    Q_FOREACH (const QByteArray &entry, entries) {
+        const QString property = decode(entry);
+        if (!property.isEmpty()) {
+            properties.append(property);
+        }
+    }
+    return properties;
+}
+
+void UnsupportedPropertiesStore::insert(const QString &guid, const QStringList &properties)
+{
+    QList<QByteArray> entries;
+    Q_FOREACH (const QString &property, properties) {
+        if (!property.isEmpty()) {
+            entries.append(intern(encode(property)));
+        }
+    }
+    release(m_entries.value(guid));
+    m_entries.insert(guid, entries);
+}
+
+void UnsupportedPropertiesStore::insertEntries(const QString &guid, const QList<QByteArray> &entries)
+{
+    QList<QByteArray> interned;
+    Q_FOREACH (const QByteArray &entry, entries) {
+        interned.append(intern(entry));
+    }
+    release(m_entries.value(guid));
+    m_entries.insert(guid, interned);
+}
+
+QStringList UnsupportedPropertiesStore::take(const QString &guid)
+{
+    const QStringList properties = value(guid);
+    remove(guid);
+    return properties;
+}
+
+void UnsupportedPropertiesStore::remove(const QString &guid)
+{
+    release(m_entries.take(guid));
+}
+
+void UnsupportedPropertiesStore::clear()
+{
+    m_entries.clear();
+    m_pool.clear();
+    m_releasedEntries = 0;
+    m_pendingBlobs.clear();
+}
+
+QByteArray UnsupportedPropertiesStore::encode(const QString &property)
+{
+    const QByteArray utf8 = property.toUtf8();
+    if (utf8.size() > BlobThreshold && !m_blobDirectory.isEmpty()) {
+        // content-addressed: identical values share a single blob file.
+        const QByteArray hash = QCryptographicHash::hash(utf8, QCryptographicHash::Sha1).toHex();
+        if (!m_pendingBlobs.contains(hash)
+                && !QFile::exists(QStringLiteral("%1/%2").arg(m_blobDirectory, QString::fromLatin1(hash)))) {
+            m_pendingBlobs.insert(hash, qCompress(utf8));
+        }
+        return BlobEntry + hash;
+    }
+
+    if (utf8.size() > CompressionThreshold) {
+        const QByteArray compressed = qCompress(utf8);
+        if (compressed.size() < utf8.size()) {
+            return CompressedEntry + compressed;
+        }
+    }
+
+    return RawEntry + utf8;
+}
+
+QString UnsupportedPropertiesStore::decode(const QByteArray &entry) const
+{
+    if (entry.isEmpty()) {
+        return QString();
+    }
+
+    switch (entry.at(0)) {
+        case RawEntry:
+            return QString::fromUtf8(entry.constData() + 1, entry.size() - 1);
+        case CompressedEntry:
+            return QString::fromUtf8(qUncompress(entry.mid(1)));
+        case BlobEntry: {
+            const QByteArray pending = m_pendingBlobs.value(entry.mid(1));
+            if (!pending.isEmpty()) {
+                return QString::fromUtf8(qUncompress(pending));
+            }
+            const QString blobPath = QStringLiteral("%1/%2").arg(m_blobDirectory, QString::fromLatin1(entry.mid(1)));
+            QFile blob(blobPath);
+            if (!blob.open(QIODevice::ReadOnly)) {
+                LOG_WARNING(Q_FUNC_INFO << "unable to read unsupported property blob" << blobPath);
+                return QString();
+            }
+            return QString::fromUtf8(qUncompress(blob.readAll()));
+        }
+        default:
+            LOG_WARNING(Q_FUNC_INFO << "unknown unsupported property encoding:" << entry.at(0));
+            return QString();
+    }
+}
+
+QByteArray UnsupportedPropertiesStore::intern(const QByteArray &entry)
+{
+    QSet<QByteArray>::const_iterator it = m_pool.constFind(entry);
+    if (it != m_pool.constEnd()) {
+        return *it; // shares the data of the existing entry.
+    }
+    m_pool.insert(entry);
+    return entry;
+}
+
+void UnsupportedPropertiesStore::release(const QList<QByteArray> &entries)
+{
+    // the released entries may still be used by other contacts, so once enough
+    // have been released the pool is rebuilt from the entries which are in use.
+    m_releasedEntries += entries.size();
+    if (m_releasedEntries < PoolPruneThreshold || m_releasedEntries < m_pool.size() / 2) {
+        return;
+    }
+
+    QSet<QByteArray> pool;
+    for (QMap<QString, QList<QByteArray> >::const_iterator it = m_entries.constBegin();
+            it != m_entries.constEnd(); ++it) {
+        Q_FOREACH (const QByteArray &entry, it.value()) {
+            pool.insert(entry);
+        }
+    }
+    m_pool = pool;
+    m_releasedEntries = 0;
+}
+
+bool UnsupportedPropertiesStore::fromByteArray(const QByteArray &data)
+{
+    clear();
+    if (data.isEmpty()) {
+        return true;
+    }
+
+    // a JSON object of contact guid -> array of property strings.
+    const QJsonDocument cupJsonDoc = QJsonDocument::fromBinaryData(data);
+    if (!cupJsonDoc.isObject()) {
+        LOG_WARNING(Q_FUNC_INFO << "invalid unsupported properties data");
+        return false;
+    }
+    const QJsonObject cupJsonObj = cupJsonDoc.object();
+    const QStringList contactGuids = cupJsonObj.keys();
+    Q_FOREACH (const QString &guid, contactGuids) {
+        const QVariantList unsupportedPropertiesVL = cupJsonObj.value(guid).toArray().toVariantList();
+        QStringList unsupportedProperties;
+        Q_FOREACH (const QVariant &v, unsupportedPropertiesVL) {
+            unsupportedProperties.append(v.toString());
+        }
+        insert(guid, unsupportedProperties);
+    }
+    return true;
+}
+
+QSet<QByteArray> UnsupportedPropertiesStore::referencedBlobs() const
+{
+    QSet<QByteArray> referenced;
+    for (QMap<QString, QList<QByteArray> >::const_iterator it = m_entries.constBegin();
+            it != m_entries.constEnd(); ++it) {
+        Q_FOREACH (const QByteArray &entry, it.value()) {
+            if (entry.startsWith(BlobEntry)) {
+                referenced.insert(entry.mid(1));
+            }
+        }
+    }
+    return referenced;
+}
+
+bool UnsupportedPropertiesStore::writePendingBlobs()
+{
+    if (m_pendingBlobs.isEmpty()) {
+        return true;
+    }
+
+    // blobs of properties which were replaced or removed before being stored are never written.
+    const QSet<QByteArray> referenced = referencedBlobs();
+    QHash<QByteArray, QByteArray>::iterator it = m_pendingBlobs.begin();
+    while (it != m_pendingBlobs.end()) {
+        if (!referenced.contains(it.key())) {
+            it = m_pendingBlobs.erase(it);
+            continue;
+        }
+        const QString blobPath = QStringLiteral("%1/%2").arg(m_blobDirectory, QString::fromLatin1(it.key()));
+        QDir().mkpath(m_blobDirectory);
+        QSaveFile blob(blobPath);
+        if (!blob.open(QIODevice::WriteOnly)
+                || blob.write(it.value()) < 0
+                || !blob.commit()) {
+            LOG_WARNING(Q_FUNC_INFO << "unable to write unsupported property blob" << blobPath);
+            return false;
+        }
+        it = m_pendingBlobs.erase(it);
+    }
+    return true;
+}
+
+void UnsupportedPropertiesStore::removeUnreferencedBlobs() const
+{
+    if (m_blobDirectory.isEmpty()) {
+        return;
+    }
+
+    const QSet<QByteArray> referenced = referencedBlobs();
+    QDir blobDir(m_blobDirectory);
+    const QStringList blobs = blobDir.entryList(QDir::Files);
+    Q_FOREACH (const QString &blob, blobs) {
+        if (!referenced.contains(blob.toLatin1())) {
+            blobDir.remove(blob);
+        }
+    }
+}
+
+void UnsupportedPropertiesStore::removeBlobDirectory(int accountId)
+{
+    QDir blobDir(defaultBlobDirectory(accountId));
+    if (blobDir.exists() && !blobDir.removeRecursively()) {
+        LOG_WARNING(Q_FUNC_INFO << "unable to remove unsupported property blobs for account" << accountId);
+    }
+}
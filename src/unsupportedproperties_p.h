@@ -0,0 +1,101 @@
+/*
+ * This file is part of buteo-sync-plugin-carddav package
+ *
+ * Copyright (C) 2014 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Chris Adams <chris.adams@jolla.com>
+ *
+ * This program/library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This program/library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program/library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef UNSUPPORTEDPROPERTIES_P_H
+#define UNSUPPORTEDPROPERTIES_P_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QHash>
+#include <QSet>
+
+class tst_unsupportedproperties;
+
+/*
+ * Stores the vCard property lines which we cannot represent in a QContact,
+ * per contact guid, so that they can be re-added to the vCard on upsync.
+ *
+ * Each line is held as an encoded UTF-8 entry:
+ *   'R' + utf8                  for short lines,
+ *   'Z' + qCompress(utf8)       for longer lines which compress well,
+ *   'B' + sha1 hex of utf8      for very large lines (LOGO, SOUND, KEY, ...)
+ *                               whose content is stored in an external blob
+ *                               file named by its hash.
+ * Blob files are only written by writePendingBlobs(), once the state which
+ * refers to them is stored.
+ * Identical entries are interned, so that lines which are repeated across
+ * many contacts are only held in memory once.
+ */
+class UnsupportedPropertiesStore
+{
+public:
+    UnsupportedPropertiesStore();
+
+    // the directory in which large property blobs are stored.
+    // If not set, large properties are kept inline (compressed).
+    void setBlobDirectory(const QString &path);
+    QString blobDirectory() const { return m_blobDirectory; }
+    static QString defaultBlobDirectory(int accountId);
+
+    bool contains(const QString &guid) const { return m_entries.contains(guid); }
+    QStringList value(const QString &guid) const;
+    void insert(const QString &guid, const QStringList &properties);
+    QStringList take(const QString &guid);
+    void remove(const QString &guid);
+    void clear();
+    int size() const { return m_entries.size(); }
+    QStringList keys() const { return m_entries.keys(); }
+
+    // access to the encoded entries, for storing them alongside other state.
+    QList<QByteArray> entries(const QString &guid) const { return m_entries.value(guid); }
+    void insertEntries(const QString &guid, const QList<QByteArray> &entries);
+
+    // deserialize from the QJsonDocument-based OOB value stored by previous versions.
+    bool fromByteArray(const QByteArray &data);
+
+    // write the blobs of the large properties inserted since the last call,
+    // which are still referenced by a contact.
+    bool writePendingBlobs();
+    // remove blobs which are no longer referenced by any contact.
+    void removeUnreferencedBlobs() const;
+    static void removeBlobDirectory(int accountId);
+
+private:
+    QByteArray encode(const QString &property);
+    QString decode(const QByteArray &entry) const;
+    QByteArray intern(const QByteArray &entry);
+    void release(const QList<QByteArray> &entries);
+    QSet<QByteArray> referencedBlobs() const;
+
+    QString m_blobDirectory;
+    QMap<QString, QList<QByteArray> > m_entries; // contact guid -> encoded property lines
+    QSet<QByteArray> m_pool;                     // interned encoded property lines
+    int m_releasedEntries;                       // entries released since the pool was last pruned
+    QHash<QByteArray, QByteArray> m_pendingBlobs; // blob hash -> compressed content, not yet written
+
+    friend class tst_unsupportedproperties;
+};
+
+#endif // UNSUPPORTEDPROPERTIES_P_H
@@ -90,6 +90,15 @@ private slots:
 
     void parseContactData_data();
     void parseContactData();
+    void parseUnchangedContactData();
+
+    void parseMultistatus_data();
+    void parseMultistatus();
+    void benchmarkParseMultistatus_data();
+    void benchmarkParseMultistatus();
+
+    void vCardHash_data();
+    void vCardHash();
 
 private:
     CardDavVCardConverter m_vcc;
@@ -235,6 +244,23 @@ void tst_replyparser::parseAddressbookInformation_data()
         << QStringLiteral("data/replyparser_addressbookinformation_addressbook-principal-proxy.xml")
         << QString() // in the non-discovery case, the user provides the addressbook-home-set path directly.
         << infos;    // we then don't pass that into the parseAddressbookInformation() function, to avoid incorrect cycle detection.
+
+    infos.clear();
+    ReplyParser::AddressBookInformation a6;
+    a6.url = QStringLiteral("/addressbooks/johndoe/contacts/");
+    a6.displayName = QStringLiteral("My Address Book");
+    a6.ctag = QStringLiteral("3145");
+    a6.bulkMaxResources = 100;
+    a6.bulkMaxBytes = 1000000;
+    ReplyParser::AddressBookInformation a7;
+    a7.url = QStringLiteral("/addressbooks/johndoe/shared/");
+    a7.displayName = QStringLiteral("Shared");
+    a7.ctag = QStringLiteral("2718");
+    infos << a6 << a7;
+    QTest::newRow("addressbook information in response including bulk-requests support")
+        << QStringLiteral("data/replyparser_addressbookinformation_bulk-requests.xml")
+        << QStringLiteral("/addressbooks/johndoe/")
+        << infos;
 }
 
 bool operator==(const ReplyParser::AddressBookInformation& first, const ReplyParser::AddressBookInformation& second)
@@ -242,7 +268,9 @@ bool operator==(const ReplyParser::AddressBookInformation& first, const ReplyPar
     return first.url == second.url
         && first.displayName == second.displayName
         && first.ctag == second.ctag
-        && first.syncToken == second.syncToken;
+        && first.syncToken == second.syncToken
+        && first.bulkMaxResources == second.bulkMaxResources
+        && first.bulkMaxBytes == second.bulkMaxBytes;
 }
 
 void tst_replyparser::parseAddressbookInformation()
@@ -485,6 +513,25 @@ void tst_replyparser::parseContactData_data()
         << QMap<QString, QString>()
         << infos;
 
+    QMap<QString, QString> legacyContactUids;
+    legacyContactUids.insert(QStringLiteral("7357:AB:/addressbooks/janedoe/contacts/:testy-testperson-uid"), QStringLiteral("testy-testperson-uid"));
+    legacyContactUids.insert(QStringLiteral("7357:testy-testperson-uid"), QStringLiteral("testy-testperson-uid"));
+    QTest::newRow("single contact matching an old-form guid and a guid from another addressbook")
+        << QStringLiteral("data/replyparser_contactdata_single-well-formed.xml")
+        << QStringLiteral("/addressbooks/johndoe/contacts/")
+        << legacyContactUids
+        << infos;
+
+    ReplyParser::FullContactInformation escaped = c1;
+    escaped.unsupportedProperties = QStringList() << QStringLiteral("X-UNSUPPORTED-TEST-PROPERTY:7357 & more AB");
+    infos.clear();
+    infos.insert(QStringLiteral("/addressbooks/johndoe/contacts/testy testperson.vcf"), escaped);
+    QTest::newRow("single contact with CDATA and escaped address data")
+        << QStringLiteral("data/replyparser_contactdata_single-escaped.xml")
+        << QStringLiteral("/addressbooks/johndoe/contacts/")
+        << QMap<QString, QString>()
+        << infos;
+
     QContactBirthday cb;
     cb.setDateTime(QDateTime(QDate(1990, 12, 31), QTime(2, 0, 0), Qt::UTC));
     cg.setGuid(QStringLiteral("%1:AB:%2:%3").arg(QString::number(7357),
@@ -718,5 +765,293 @@ void tst_replyparser::parseContactData()
     m_s.clearAllGuidData();
 }
 
+void tst_replyparser::parseUnchangedContactData()
+{
+    QFile f(QStringLiteral("%1/%2").arg(QCoreApplication::applicationDirPath(),
+                                        QStringLiteral("data/replyparser_contactdata_single-well-formed.xml")));
+    if (!f.exists() || !f.open(QIODevice::ReadOnly)) {
+        QFAIL("Data file does not exist or cannot be opened for reading!");
+    }
+    const QByteArray contactDataResponse = f.readAll();
+    const QString addressbookUrl = QStringLiteral("/addressbooks/johndoe/contacts/");
+    const QString uri = QStringLiteral("/addressbooks/johndoe/contacts/testytestperson.vcf");
+
+    m_s.m_accountId = 7357;
+    QMap<QString, ReplyParser::FullContactInformation> contactInfo = m_rp.parseContactData(contactDataResponse, addressbookUrl);
+    QCOMPARE(contactInfo.size(), 1);
+    QVERIFY(!contactInfo[uri].unchanged);
+    const QString guid = contactInfo[uri].contact.detail<QContactGuid>().guid();
+
+    // once the vCard has been seen, the same vCard is reported as unchanged without being converted.
+    m_s.m_contactUris.insert(guid, uri);
+    m_s.m_contactVCardHashes.insert(guid, contactInfo[uri].vcardHash);
+    contactInfo = m_rp.parseContactData(contactDataResponse, addressbookUrl);
+    QCOMPARE(contactInfo.size(), 1);
+    QVERIFY(contactInfo[uri].unchanged);
+    QCOMPARE(contactInfo[uri].etag, QStringLiteral("\"0001-0001\""));
+    QCOMPARE(contactInfo[uri].contact.detail<QContactGuid>().guid(), guid);
+    QVERIFY(contactInfo[uri].contact.detail<QContactName>().isEmpty());
+
+    m_s.m_accountId = 0;
+    m_s.clearAllGuidData();
+}
+
+void tst_replyparser::parseMultistatus_data()
+{
+    QTest::addColumn<QString>("xmlFilename");
+    QTest::addColumn<QString>("expectedSyncToken");
+    QTest::addColumn<QStringList>("expectedHrefs");
+    QTest::addColumn<QStringList>("expectedEtags");
+    QTest::addColumn<QStringList>("expectedStatuses");
+    QTest::addColumn<QList<qint64> >("expectedContentLengths");
+
+    QTest::newRow("empty multistatus response")
+        << QStringLiteral("data/replyparser_synctokendelta_empty.xml")
+        << QString()
+        << QStringList()
+        << QStringList()
+        << QStringList()
+        << QList<qint64>();
+
+    QTest::newRow("well-formed multistatus response with propstat and response status")
+        << QStringLiteral("data/replyparser_synctokendelta_single-well-formed-add-mod-rem.xml")
+        << QStringLiteral("http://sabredav.org/ns/sync/5001")
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/newcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/deletedcard.vcf"))
+        << (QStringList() << QStringLiteral("\"33441-34321\"")
+                          << QStringLiteral("\"33541-34696\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 404 Not Found"))
+        << (QList<qint64>() << -1 << -1 << -1);
+
+    QTest::newRow("multistatus response with content lengths and an unsupported property")
+        << QStringLiteral("data/replyparser_synctokendelta_getcontentlength.xml")
+        << QStringLiteral("http://sabredav.org/ns/sync/5002")
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/newcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/deletedcard.vcf"))
+        << (QStringList() << QStringLiteral("\"33441-34321\"")
+                          << QStringLiteral("\"33541-34696\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 404 Not Found"))
+        << (QList<qint64>() << 512 << -1 << -1);
+
+    QTest::newRow("bulk upsync response with per-resource results")
+        << QStringLiteral("data/replyparser_bulkupsync_mixed-results.xml")
+        << QString()
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/5a1b2c3d.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/conflictingcard.vcf"))
+        << (QStringList() << QStringLiteral("\"10001-1\"")
+                          << QStringLiteral("\"10002-2\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 201 Created")
+                          << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 412 Precondition Failed"))
+        << (QList<qint64>() << -1 << -1 << -1);
+
+    QTest::newRow("bulk upsync response without the href of a created resource")
+        << QStringLiteral("data/replyparser_bulkupsync_no-hrefs.xml")
+        << QString()
+        << (QStringList() << QString()
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf"))
+        << (QStringList() << QStringLiteral("\"10001-1\"")
+                          << QStringLiteral("\"10002-2\""))
+        << (QStringList() << QStringLiteral("HTTP/1.1 201 Created")
+                          << QStringLiteral("HTTP/1.1 200 OK"))
+        << (QList<qint64>() << -1 << -1);
+
+    QTest::newRow("multistatus response with a document type declaration")
+        << QStringLiteral("data/replyparser_synctokendelta_doctype.xml")
+        << QStringLiteral("http://sabredav.org/ns/sync/5003")
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/newcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/deletedcard.vcf"))
+        << (QStringList() << QStringLiteral("\"33441-34321\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 404 Not Found"))
+        << (QList<qint64>() << -1 << -1);
+
+    QTest::newRow("multistatus response with successful and failed propstats")
+        << QStringLiteral("data/replyparser_synctokendelta_mixed-propstats.xml")
+        << QStringLiteral("http://sabredav.org/ns/sync/5004")
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/newcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/forbiddencard.vcf"))
+        << (QStringList() << QStringLiteral("\"33441-34321\"")
+                          << QStringLiteral("\"33541-34696\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 403 Forbidden"))
+        << (QList<qint64>() << 512 << -1 << -1);
+
+    QTest::newRow("multistatus response with successful and failed propstats and a document type declaration")
+        << QStringLiteral("data/replyparser_synctokendelta_mixed-propstats-doctype.xml")
+        << QStringLiteral("http://sabredav.org/ns/sync/5005")
+        << (QStringList() << QStringLiteral("/addressbooks/johndoe/contacts/newcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/updatedcard.vcf")
+                          << QStringLiteral("/addressbooks/johndoe/contacts/forbiddencard.vcf"))
+        << (QStringList() << QStringLiteral("\"33441-34321\"")
+                          << QStringLiteral("\"33541-34696\"")
+                          << QString())
+        << (QStringList() << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 200 OK")
+                          << QStringLiteral("HTTP/1.1 403 Forbidden"))
+        << (QList<qint64>() << 512 << -1 << -1);
+}
+
+void tst_replyparser::parseMultistatus()
+{
+    QFETCH(QString, xmlFilename);
+    QFETCH(QString, expectedSyncToken);
+    QFETCH(QStringList, expectedHrefs);
+    QFETCH(QStringList, expectedEtags);
+    QFETCH(QStringList, expectedStatuses);
+    QFETCH(QList<qint64>, expectedContentLengths);
+
+    QFile f(QStringLiteral("%1/%2").arg(QCoreApplication::applicationDirPath(), xmlFilename));
+    if (!f.exists() || !f.open(QIODevice::ReadOnly)) {
+        QFAIL("Data file does not exist or cannot be opened for reading!");
+    }
+
+    // parse directly from the device, as cdavtool does, and then
+    // from the data, which is scanned rather than read by QXmlStreamReader.
+    for (int pass = 0; pass < 2; ++pass) {
+        QString syncToken;
+        QList<ReplyParser::ResourceInformation> resources;
+        if (pass == 0) {
+            resources = ReplyParser::parseMultistatus(&f, &syncToken);
+        } else {
+            QVERIFY(f.seek(0));
+            resources = ReplyParser::parseMultistatus(f.readAll(), &syncToken);
+        }
+
+        QCOMPARE(syncToken, expectedSyncToken);
+        QCOMPARE(resources.size(), expectedHrefs.size());
+        for (int i = 0; i < resources.size(); ++i) {
+            QCOMPARE(resources[i].href, expectedHrefs[i]);
+            QCOMPARE(resources[i].etag, expectedEtags[i]);
+            QCOMPARE(resources[i].status, expectedStatuses[i]);
+            QCOMPARE(resources[i].contentLength, expectedContentLengths[i]);
+        }
+    }
+}
+
+void tst_replyparser::benchmarkParseMultistatus_data()
+{
+    QTest::addColumn<bool>("scan");
+
+    QTest::newRow("scanned") << true;
+    QTest::newRow("QXmlStreamReader") << false;
+}
+
+void tst_replyparser::benchmarkParseMultistatus()
+{
+    QFETCH(bool, scan);
+
+    // an etag listing of a large addressbook.
+    const int count = 10000;
+    QByteArray listing("<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<d:multistatus xmlns:d=\"DAV:\">\n");
+    for (int i = 0; i < count; ++i) {
+        listing += QStringLiteral(
+                "    <d:response>\n"
+                "        <d:href>/addressbooks/johndoe/contacts/%1-%2.vcf</d:href>\n"
+                "        <d:propstat>\n"
+                "            <d:prop>\n"
+                "                <d:getetag>&quot;%1-%3&quot;</d:getetag>\n"
+                "                <d:getcontentlength>%4</d:getcontentlength>\n"
+                "            </d:prop>\n"
+                "            <d:status>HTTP/1.1 200 OK</d:status>\n"
+                "        </d:propstat>\n"
+                "    </d:response>\n")
+                .arg(i).arg(QStringLiteral("6b0e8a3c-5f7d-4d0e-9a7b-2c1d3e4f5a6b")).arg(i * 7).arg(400 + i % 300)
+                .toUtf8();
+    }
+    listing += "</d:multistatus>\n";
+
+    QList<ReplyParser::ResourceInformation> resources;
+    if (scan) {
+        QBENCHMARK {
+            resources = ReplyParser::parseMultistatus(listing);
+        }
+    } else {
+        QBENCHMARK {
+            QBuffer buffer(&listing);
+            buffer.open(QIODevice::ReadOnly);
+            resources = ReplyParser::parseMultistatus(&buffer);
+        }
+    }
+
+    QCOMPARE(resources.size(), count);
+    QCOMPARE(resources.last().href, QStringLiteral("/addressbooks/johndoe/contacts/%1-%2.vcf")
+            .arg(count - 1).arg(QStringLiteral("6b0e8a3c-5f7d-4d0e-9a7b-2c1d3e4f5a6b")));
+    QCOMPARE(resources.last().etag, QStringLiteral("\"%1-%2\"").arg(count - 1).arg((count - 1) * 7));
+    QCOMPARE(resources.last().contentLength, qint64(400 + (count - 1) % 300));
+    QCOMPARE(resources.last().status, QStringLiteral("HTTP/1.1 200 OK"));
+}
+
+void tst_replyparser::vCardHash_data()
+{
+    QTest::addColumn<QString>("vcard");
+    QTest::addColumn<QString>("otherVCard");
+    QTest::addColumn<bool>("expectedEqual");
+
+    const QString vcard = QStringLiteral(
+            "BEGIN:VCARD\r\n"
+            "VERSION:3.0\r\n"
+            "UID:abc-def-fez-1234546578\r\n"
+            "N:Doe;John;;;\r\n"
+            "FN:John Doe\r\n"
+            "TEL;TYPE=CELL;TYPE=VOICE:+123456789\r\n"
+            "NOTE:A note which is long enough to be folded: 0123456789\r\n"
+            "REV:2014-10-16T09:52:41Z\r\n"
+            "END:VCARD\r\n");
+
+    QTest::newRow("identical")
+        << vcard
+        << vcard
+        << true;
+
+    QTest::newRow("reordered properties and parameters, folded lines and updated REV")
+        << vcard
+        << QStringLiteral(
+            "BEGIN:VCARD\r\n"
+            "VERSION:3.0\r\n"
+            "FN:John Doe\r\n"
+            "N:Doe;John;;;\r\n"
+            "UID:abc-def-fez-1234546578\r\n"
+            "NOTE:A note which is long enough to be\r\n"
+            "  folded: 0123456789\r\n"
+            "TEL;TYPE=VOICE;TYPE=CELL:+123456789\r\n"
+            "REV:2015-01-01T00:00:00Z\r\n"
+            "END:VCARD\r\n")
+        << true;
+
+    QTest::newRow("modified value")
+        << vcard
+        << QString(vcard).replace(QStringLiteral("+123456789"), QStringLiteral("+987654321"))
+        << false;
+
+    QTest::newRow("modified parameter")
+        << vcard
+        << QString(vcard).replace(QStringLiteral("TYPE=CELL"), QStringLiteral("TYPE=HOME"))
+        << false;
+}
+
+void tst_replyparser::vCardHash()
+{
+    QFETCH(QString, vcard);
+    QFETCH(QString, otherVCard);
+    QFETCH(bool, expectedEqual);
+
+    QCOMPARE(CardDavVCardConverter::vCardHash(vcard) == CardDavVCardConverter::vCardHash(otherVCard), expectedEqual);
+}
+
 #include "tst_replyparser.moc"
 QTEST_MAIN(tst_replyparser)
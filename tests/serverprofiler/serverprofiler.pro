@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = tst_serverprofiler
+include($$PWD/../../src/src.pri)
+QT += testlib
+INCLUDEPATH += $$PWD/../../tools/cdavtool
+HEADERS += ../../tools/cdavtool/serverprofiler.h
+SOURCES += ../../tools/cdavtool/serverprofiler.cpp tst_serverprofiler.cpp
+target.path = /opt/tests/buteo/plugins/carddav/
+INSTALLS += target
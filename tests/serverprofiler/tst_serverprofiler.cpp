@@ -0,0 +1,90 @@
+#include <QtTest>
+#include <QObject>
+#include <QString>
+
+#include "serverprofiler.h"
+
+namespace {
+
+// a probe of the given number of resources and concurrent requests.
+ServerProfiler::Result probe(int resources, int requests, qint64 elapsed, bool succeeded = true)
+{
+    ServerProfiler::Result result;
+    result.resources = resources;
+    result.requests = requests;
+    result.elapsed = elapsed;
+    result.succeeded = succeeded;
+    result.httpStatus = succeeded ? 0 : 429;
+    return result;
+}
+
+}
+
+class tst_serverprofiler : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void recommendedPageSize();
+    void recommendedConcurrency();
+    void noSuccessfulProbes();
+
+private:
+    ServerProfiler *profiler();
+};
+
+ServerProfiler *tst_serverprofiler::profiler()
+{
+    return new ServerProfiler(0, QStringLiteral("https://carddav.example.com"),
+                              QStringLiteral("tester"), QStringLiteral("password"), this);
+}
+
+void tst_serverprofiler::recommendedPageSize()
+{
+    // the smallest multiget within 90% of the best throughput is recommended,
+    // rather than the one with the best throughput.
+    ServerProfiler *p = profiler();
+    p->m_multigets << probe(25, 1, 1000)   // 25 resources/s
+                   << probe(50, 1, 1000)   // 50 resources/s
+                   << probe(100, 1, 1850)  // 54 resources/s, the best
+                   << probe(200, 1, 4000); // 50 resources/s
+    QCOMPARE(p->recommendedPageSize(), 50);
+
+    // but not one which is just below the threshold.
+    p->m_multigets[1] = probe(50, 1, 1150); // 43 resources/s
+    QCOMPARE(p->recommendedPageSize(), 100);
+
+    // failed probes are ignored, however fast they failed.
+    p->m_multigets << probe(400, 1, 100, false);
+    QCOMPARE(p->recommendedPageSize(), 100);
+}
+
+void tst_serverprofiler::recommendedConcurrency()
+{
+    ServerProfiler *p = profiler();
+    p->m_fanOuts << probe(100, 1, 2000)        // 50 resources/s
+                 << probe(200, 2, 2000)        // 100 resources/s
+                 << probe(400, 4, 3700)        // 108 resources/s, the best
+                 << probe(600, 6, 500, false); // throttled
+    QCOMPARE(p->recommendedConcurrency(), 2);
+
+    p->m_fanOuts[1] = probe(200, 2, 2400);    // 83 resources/s
+    QCOMPARE(p->recommendedConcurrency(), 4);
+}
+
+void tst_serverprofiler::noSuccessfulProbes()
+{
+    // without a successful multiget, no page size is recommended,
+    // and without a successful fan-out, no concurrency.
+    ServerProfiler *p = profiler();
+    QCOMPARE(p->recommendedPageSize(), 0);
+    QCOMPARE(p->recommendedConcurrency(), 1);
+
+    p->m_multigets << probe(50, 1, 1000, false) << probe(100, 1, 1000, false);
+    p->m_fanOuts << probe(100, 2, 1000, false);
+    QCOMPARE(p->recommendedPageSize(), 0);
+    QCOMPARE(p->recommendedConcurrency(), 1);
+}
+
+#include "tst_serverprofiler.moc"
+QTEST_MAIN(tst_serverprofiler)
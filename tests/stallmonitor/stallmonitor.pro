@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = tst_stallmonitor
+include($$PWD/../../src/src.pri)
+QT += testlib
+SOURCES += tst_stallmonitor.cpp
+target.path = /opt/tests/buteo/plugins/carddav/
+INSTALLS += target
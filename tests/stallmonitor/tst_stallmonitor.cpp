@@ -0,0 +1,105 @@
+#include <QtTest>
+#include <QObject>
+#include <QString>
+#include <QThread>
+
+#include "stallmonitor_p.h"
+
+namespace {
+
+const int Threshold = 200;  // milliseconds
+const int Stall = 500;      // milliseconds
+
+}
+
+class tst_stallmonitor : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void noStalls();
+    void stallWithinPhase();
+    void stallBeforePhaseChange();
+    void checkpoint();
+    void checkpointBelowThreshold();
+};
+
+void tst_stallmonitor::noStalls()
+{
+    StallMonitor monitor;
+    monitor.setThreshold(Threshold);
+    monitor.start(QStringLiteral("first"));
+    QTest::qWait(250);
+    monitor.setPhase(QStringLiteral("second"));
+    QTest::qWait(250);
+    monitor.stop();
+    QVERIFY(monitor.statistics().isEmpty());
+    QVERIFY(monitor.elapsed() >= 500);
+}
+
+void tst_stallmonitor::stallWithinPhase()
+{
+    // the stall is detected by the late heartbeat.
+    StallMonitor monitor;
+    monitor.setThreshold(Threshold);
+    monitor.start(QStringLiteral("first"));
+    QTest::qWait(150);
+    QThread::msleep(Stall);
+    QTest::qWait(150);
+    monitor.stop();
+    QCOMPARE(monitor.statistics().keys(), QStringList() << QStringLiteral("first"));
+    QCOMPARE(monitor.statistics().value(QStringLiteral("first")).stalls, 1);
+    QVERIFY(monitor.statistics().value(QStringLiteral("first")).totalDuration >= Stall - 100);
+}
+
+void tst_stallmonitor::stallBeforePhaseChange()
+{
+    // the whole of the time blocked before the change of phase is attributed to
+    // the phase which ends, and the heartbeat which is then late does not also
+    // attribute it to the next phase.
+    StallMonitor monitor;
+    monitor.setThreshold(Threshold);
+    monitor.start(QStringLiteral("first"));
+    QTest::qWait(150);
+    QThread::msleep(Stall);
+    monitor.setPhase(QStringLiteral("second"));
+    QTest::qWait(250);
+    monitor.stop();
+    QCOMPARE(monitor.statistics().keys(), QStringList() << QStringLiteral("first"));
+    QCOMPARE(monitor.statistics().value(QStringLiteral("first")).stalls, 1);
+    QVERIFY(monitor.statistics().value(QStringLiteral("first")).totalDuration >= Stall);
+}
+
+void tst_stallmonitor::checkpoint()
+{
+    // a checkpoint attributes the time blocked so far, without waiting for the heartbeat.
+    StallMonitor monitor;
+    monitor.setThreshold(Threshold);
+    monitor.start(QStringLiteral("first"));
+    QThread::msleep(Stall);
+    monitor.checkpoint();
+    QCOMPARE(monitor.statistics().value(QStringLiteral("first")).stalls, 1);
+    QVERIFY(monitor.statistics().value(QStringLiteral("first")).totalDuration >= Stall);
+
+    // and only once.
+    QTest::qWait(250);
+    monitor.stop();
+    QCOMPARE(monitor.statistics().value(QStringLiteral("first")).stalls, 1);
+    QVERIFY(monitor.statistics().value(QStringLiteral("first")).totalDuration < 2 * Stall);
+}
+
+void tst_stallmonitor::checkpointBelowThreshold()
+{
+    // up to one heartbeat interval (of 100 ms) of the time attributed by a
+    // checkpoint may have been idle, so it must exceed the threshold by that.
+    StallMonitor monitor;
+    monitor.setThreshold(Threshold);
+    monitor.start(QStringLiteral("first"));
+    QThread::msleep(Threshold + 50);
+    monitor.checkpoint();
+    QVERIFY(monitor.statistics().isEmpty());
+    monitor.stop();
+}
+
+#include "tst_stallmonitor.moc"
+QTEST_MAIN(tst_stallmonitor)
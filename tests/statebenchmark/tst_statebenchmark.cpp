@@ -0,0 +1,286 @@
+#include <QtTest>
+#include <QObject>
+#include <QMap>
+#include <QString>
+#include <QUuid>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#include "syncer_p.h"
+
+#include <QContact>
+#include <QContactGuid>
+
+QTCONTACTS_USE_NAMESPACE
+
+namespace {
+
+const int AccountId = 7357;
+
+QString addressbookUrl(int addressbook)
+{
+    return QStringLiteral("/addressbooks/johndoe/addressbook-%1/").arg(addressbook);
+}
+
+QString contactGuid(const QString &url, int contact)
+{
+    return QStringLiteral("%1:AB:%2:%3").arg(AccountId).arg(url).arg(QStringLiteral("uid-%1").arg(contact));
+}
+
+QByteArray jsonValue(const QMap<QString, QString> &map)
+{
+    QJsonObject object;
+    for (QMap<QString, QString>::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+        object.insert(it.key(), QJsonValue(it.value()));
+    }
+    return QJsonDocument(object).toBinaryData();
+}
+
+QList<QContact> contactsWithGuids(const QStringList &guids)
+{
+    QList<QContact> contacts;
+    Q_FOREACH (const QString &guid, guids) {
+        QContact c;
+        QContactGuid g;
+        g.setGuid(guid);
+        c.saveDetail(&g);
+        contacts.append(c);
+    }
+    return contacts;
+}
+
+}
+
+class tst_statebenchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void loadLegacyState_data() { addScaleRows(); }
+    void loadLegacyState();
+
+    void loadShards_data() { addScaleRows(); }
+    void loadShards();
+
+    void storeState_data() { addScaleRows(); }
+    void storeState();
+
+    void routeLocalChanges_data() { addScaleRows(); }
+    void routeLocalChanges();
+
+    void migrateGuidData_data() { addScaleRows(); }
+    void migrateGuidData();
+
+private:
+    void addScaleRows();
+    static void populateState(Syncer *s, int contacts, int addressbooks);
+    static QMap<QString, QVariant> legacyState(const Syncer &s);
+};
+
+// populates the state of the syncer as it would be at the end of a sync
+// of an account with the given number of contacts, spread evenly across
+// the given number of addressbooks, all of whose state has been loaded.
+void tst_statebenchmark::populateState(Syncer *s, int contacts, int addressbooks)
+{
+    s->m_accountId = AccountId;
+    for (int i = 0; i < addressbooks; ++i) {
+        const QString url = addressbookUrl(i);
+        s->m_addressbookCtags.insert(url, QStringLiteral("ctag-%1").arg(i));
+        s->m_shardIndex.insert(url, false);
+        s->m_loadedShards.insert(url);
+    }
+    for (int i = 0; i < contacts; ++i) {
+        const QString url = addressbookUrl(i % addressbooks);
+        const QString uid = QStringLiteral("uid-%1").arg(i);
+        const QString guid = contactGuid(url, i);
+        s->m_addressbookContactGuids[url].append(guid);
+        s->m_contactUids.insert(guid, uid);
+        s->m_contactUris.insert(guid, QStringLiteral("%1%2.vcf").arg(url, uid));
+        s->m_contactEtags.insert(guid, QStringLiteral("\"%1-%2\"").arg(i).arg(i * 7));
+        s->m_contactIds.insert(guid, QStringLiteral("qtcontacts:org.nemomobile.contacts.sqlite::sql-%1").arg(i + 1));
+        s->m_contactVCardHashes.insert(guid, QCryptographicHash::hash(guid.toUtf8(), QCryptographicHash::Sha1));
+        if (i % 10 == 0) {
+            s->m_contactUnsupportedProperties.insert(guid, QStringList(QStringLiteral("X-SOCIALPROFILE;TYPE=twitter:johndoe")));
+        }
+    }
+}
+
+// the per-contact state of the syncer, as stored by versions which did not shard it.
+QMap<QString, QVariant> tst_statebenchmark::legacyState(const Syncer &s)
+{
+    QJsonObject addressbookContactGuids;
+    for (QMap<QString, QStringList>::const_iterator it = s.m_addressbookContactGuids.constBegin();
+            it != s.m_addressbookContactGuids.constEnd(); ++it) {
+        addressbookContactGuids.insert(it.key(), QJsonArray::fromStringList(it.value()));
+    }
+
+    QMap<QString, QVariant> values;
+    values.insert(QStringLiteral("addressbookContactGuids"), QJsonDocument(addressbookContactGuids).toBinaryData());
+    values.insert(QStringLiteral("contactUids"), jsonValue(s.m_contactUids));
+    values.insert(QStringLiteral("contactUris"), jsonValue(s.m_contactUris));
+    values.insert(QStringLiteral("contactEtags"), jsonValue(s.m_contactEtags));
+    values.insert(QStringLiteral("contactIds"), jsonValue(s.m_contactIds));
+    return values;
+}
+
+void tst_statebenchmark::addScaleRows()
+{
+    QTest::addColumn<int>("contacts");
+    QTest::addColumn<int>("addressbooks");
+
+    QTest::newRow("1k contacts, 1 addressbook") << 1000 << 1;
+    QTest::newRow("10k contacts, 10 addressbooks") << 10000 << 10;
+    QTest::newRow("50k contacts, 10 addressbooks") << 50000 << 10;
+    QTest::newRow("200k contacts, 1 addressbook") << 200000 << 1;
+    QTest::newRow("200k contacts, 50 addressbooks") << 200000 << 50;
+}
+
+void tst_statebenchmark::loadLegacyState()
+{
+    QFETCH(int, contacts);
+    QFETCH(int, addressbooks);
+
+    Syncer s(Q_NULLPTR, Q_NULLPTR);
+    populateState(&s, contacts, addressbooks);
+    const QMap<QString, QVariant> values = legacyState(s);
+
+    QBENCHMARK {
+        s.clearAllGuidData();
+        s.readLegacyExtraStateData(values);
+    }
+
+    QCOMPARE(s.m_contactUris.size(), contacts);
+    QCOMPARE(s.m_addressbookContactGuids.size(), addressbooks);
+}
+
+void tst_statebenchmark::loadShards()
+{
+    QFETCH(int, contacts);
+    QFETCH(int, addressbooks);
+
+    Syncer s(Q_NULLPTR, Q_NULLPTR);
+    populateState(&s, contacts, addressbooks);
+    QMap<QString, QVariant> values;
+    ShardSnapshot snapshot;
+    s.prepareExtraStateData(&values, &snapshot);
+    const EncodedShards shards = Syncer::encodeShards(snapshot);
+    QCOMPARE(shards.values.size(), addressbooks);
+
+    QBENCHMARK {
+        s.clearAllGuidData();
+        for (QMap<QString, QVariant>::const_iterator it = shards.values.constBegin(); it != shards.values.constEnd(); ++it) {
+            DecodedShard shard;
+            QVERIFY(Syncer::decodeShard(it.value().toByteArray(), &shard));
+            s.mergeShard(shard);
+        }
+    }
+
+    QCOMPARE(s.m_contactUris.size(), contacts);
+    QCOMPARE(s.m_contactVCardHashes.size(), contacts);
+    QCOMPARE(s.m_addressbookContactGuids.size(), addressbooks);
+}
+
+void tst_statebenchmark::storeState()
+{
+    QFETCH(int, contacts);
+    QFETCH(int, addressbooks);
+
+    Syncer s(Q_NULLPTR, Q_NULLPTR);
+    populateState(&s, contacts, addressbooks);
+
+    // the shard hashes are not updated, so every shard is encoded each time.
+    EncodedShards shards;
+    QBENCHMARK {
+        QMap<QString, QVariant> values;
+        ShardSnapshot snapshot;
+        s.prepareExtraStateData(&values, &snapshot);
+        shards = Syncer::encodeShards(snapshot);
+    }
+
+    QCOMPARE(shards.values.size(), addressbooks);
+    QCOMPARE(shards.shardIndex.size(), addressbooks);
+}
+
+void tst_statebenchmark::routeLocalChanges()
+{
+    QFETCH(int, contacts);
+    QFETCH(int, addressbooks);
+
+    Syncer s(Q_NULLPTR, Q_NULLPTR);
+    populateState(&s, contacts, addressbooks);
+
+    // a typical sync: a few additions, and changes to about 1% of the contacts.
+    QStringList modifiedGuids, deletedGuids, addedGuids;
+    for (int i = 0; i < contacts; i += 100) {
+        modifiedGuids.append(contactGuid(addressbookUrl(i % addressbooks), i));
+    }
+    for (int i = 50; i < contacts; i += 1000) {
+        deletedGuids.append(contactGuid(addressbookUrl(i % addressbooks), i));
+    }
+    for (int i = 0; i < 10; ++i) {
+        addedGuids.append(QUuid::createUuid().toString());
+    }
+    const QList<QContact> locallyAdded = contactsWithGuids(addedGuids);
+    const QList<QContact> locallyModified = contactsWithGuids(modifiedGuids);
+    const QList<QContact> locallyDeleted = contactsWithGuids(deletedGuids);
+
+    QMap<QString, QList<QContact> > added, modified, deleted;
+    QSet<QString> modifiedAddressbookUrls;
+    QBENCHMARK {
+        added.clear();
+        modified.clear();
+        deleted.clear();
+        modifiedAddressbookUrls.clear();
+        QVERIFY(s.routeLocalChanges(locallyAdded, locallyModified, locallyDeleted,
+                                    &added, &modified, &deleted, &modifiedAddressbookUrls));
+    }
+
+    int routedModifications = 0, routedDeletions = 0;
+    Q_FOREACH (const QList<QContact> &routed, modified) {
+        routedModifications += routed.size();
+    }
+    Q_FOREACH (const QList<QContact> &routed, deleted) {
+        routedDeletions += routed.size();
+    }
+    QCOMPARE(added.value(addressbookUrl(0)).size(), addedGuids.size());
+    QCOMPARE(routedModifications, modifiedGuids.size());
+    QCOMPARE(routedDeletions, deletedGuids.size());
+}
+
+void tst_statebenchmark::migrateGuidData()
+{
+    QFETCH(int, contacts);
+    QFETCH(int, addressbooks);
+
+    Syncer s(Q_NULLPTR, Q_NULLPTR);
+    populateState(&s, contacts, addressbooks);
+
+    // migrating from the old to the new form of guid, for about 1% of the
+    // contacts.  Each iteration migrates them back again, leaving the state
+    // as it was, so each iteration measures two migrations per contact.
+    QList<QPair<QString, QString> > migrations; // new-form guid -> old-form guid
+    for (int i = 0; i < contacts; i += 100) {
+        migrations.append(qMakePair(contactGuid(addressbookUrl(i % addressbooks), i),
+                                    QStringLiteral("%1:uid-%2").arg(AccountId).arg(i)));
+    }
+
+    QBENCHMARK {
+        for (int i = 0; i < migrations.size(); ++i) {
+            const QString url = addressbookUrl((i * 100) % addressbooks);
+            s.migrateGuidData(migrations.at(i).first, migrations.at(i).second, url);
+        }
+        for (int i = 0; i < migrations.size(); ++i) {
+            const QString url = addressbookUrl((i * 100) % addressbooks);
+            s.migrateGuidData(migrations.at(i).second, migrations.at(i).first, url);
+        }
+    }
+
+    QCOMPARE(s.m_contactUris.size(), contacts);
+    QVERIFY(s.m_contactUris.contains(migrations.last().first));
+    QVERIFY(!s.m_contactUris.contains(migrations.last().second));
+}
+
+#include "tst_statebenchmark.moc"
+QTEST_MAIN(tst_statebenchmark)
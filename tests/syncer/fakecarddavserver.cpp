@@ -0,0 +1,462 @@
+#include "fakecarddavserver.h"
+
+#include <QTimer>
+#include <QUrl>
+#include <QRegularExpression>
+#include <QXmlStreamReader>
+
+#include <string.h>
+
+namespace {
+
+QByteArray reasonPhrase(int statusCode)
+{
+    switch (statusCode) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 207: return "Multi-Status";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 412: return "Precondition Failed";
+        default:  return "Unknown";
+    }
+}
+
+QNetworkReply::NetworkError networkError(int statusCode)
+{
+    switch (statusCode) {
+        case 401: return QNetworkReply::AuthenticationRequiredError;
+        case 403: return QNetworkReply::ContentAccessDenied;
+        case 404: return QNetworkReply::ContentNotFoundError;
+        case 405: return QNetworkReply::ContentOperationNotPermittedError;
+        case 409: return QNetworkReply::ContentConflictError;
+        default:  return QNetworkReply::UnknownContentError;
+    }
+}
+
+QString statusLine(int statusCode)
+{
+    return QStringLiteral("HTTP/1.1 %1 %2").arg(statusCode).arg(QString::fromLatin1(reasonPhrase(statusCode)));
+}
+
+QString uidOf(const QString &vcard)
+{
+    static const QRegularExpression uid(QStringLiteral("^UID:(.*)$"), QRegularExpression::MultilineOption);
+    return uid.match(vcard).captured(1).trimmed();
+}
+
+const char *MultistatusStart =
+        "<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
+        "<d:multistatus xmlns:d=\"DAV:\" xmlns:cs=\"http://calendarserver.org/ns/\" xmlns:card=\"urn:ietf:params:xml:ns:carddav\">";
+const char *MultistatusEnd = "</d:multistatus>";
+
+}
+
+FakeCardDavReply::FakeCardDavReply(QNetworkAccessManager::Operation operation, const QNetworkRequest &request,
+                                   int statusCode, const QList<QPair<QByteArray, QByteArray> > &headers,
+                                   const QByteArray &body, int delay, QObject *parent)
+    : QNetworkReply(parent)
+    , m_body(body)
+    , m_offset(0)
+{
+    setRequest(request);
+    setUrl(request.url());
+    setOperation(operation);
+    setAttribute(QNetworkRequest::HttpStatusCodeAttribute, statusCode);
+    setAttribute(QNetworkRequest::HttpReasonPhraseAttribute, reasonPhrase(statusCode));
+    for (int i = 0; i < headers.size(); ++i) {
+        setRawHeader(headers[i].first, headers[i].second);
+    }
+    setHeader(QNetworkRequest::ContentLengthHeader, body.size());
+    if (statusCode >= 400) {
+        setError(networkError(statusCode), QString::fromLatin1(reasonPhrase(statusCode)));
+    }
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    QTimer::singleShot(delay, this, SLOT(respond()));
+}
+
+void FakeCardDavReply::abort()
+{
+    if (isFinished()) {
+        return;
+    }
+    setError(OperationCanceledError, QStringLiteral("Operation canceled"));
+    setFinished(true);
+    emit finished();
+}
+
+bool FakeCardDavReply::isSequential() const
+{
+    return true;
+}
+
+qint64 FakeCardDavReply::bytesAvailable() const
+{
+    return m_body.size() - m_offset + QNetworkReply::bytesAvailable();
+}
+
+qint64 FakeCardDavReply::readData(char *data, qint64 maxSize)
+{
+    const qint64 size = qMin<qint64>(maxSize, m_body.size() - m_offset);
+    if (size <= 0) {
+        return isFinished() ? -1 : 0;
+    }
+    memcpy(data, m_body.constData() + m_offset, size);
+    m_offset += size;
+    return size;
+}
+
+void FakeCardDavReply::respond()
+{
+    if (isFinished()) {
+        return; // aborted
+    }
+    emit metaDataChanged();
+    if (!m_body.isEmpty()) {
+        emit readyRead();
+    }
+    emit downloadProgress(m_body.size(), m_body.size());
+    setFinished(true);
+    emit finished();
+}
+
+FakeCardDavServer::FakeCardDavServer(QObject *parent)
+    : QNetworkAccessManager(parent)
+    , m_ctag(1)
+    , m_etagCounter(0)
+    , m_hrefCounter(0)
+    , m_responseDelay(0)
+    , m_syncTokens(false)
+    , m_bulkMaxResources(0)
+    , m_bulkMaxBytes(0)
+    , m_bulkResponseOrder(RequestOrder)
+    , m_bulkResponseHrefs(true)
+{
+}
+
+QString FakeCardDavServer::addressbookPath()
+{
+    return QStringLiteral("/addressbooks/test/contacts");
+}
+
+QString FakeCardDavServer::addContact(const QString &uid, const QString &vcard)
+{
+    const QString href = QStringLiteral("%1/%2.vcf").arg(addressbookPath(), uid);
+    changed();
+    m_contacts[href].vcard = vcard;
+    m_contacts[href].etag = QStringLiteral("\"%1-%2\"").arg(m_ctag).arg(++m_etagCounter);
+    return href;
+}
+
+void FakeCardDavServer::modifyContact(const QString &href, const QString &vcard)
+{
+    changed();
+    m_contacts[href].vcard = vcard;
+    m_contacts[href].etag = QStringLiteral("\"%1-%2\"").arg(m_ctag).arg(++m_etagCounter);
+}
+
+void FakeCardDavServer::removeContact(const QString &href)
+{
+    changed();
+    m_contacts.remove(href);
+}
+
+QStringList FakeCardDavServer::hrefs() const
+{
+    return m_contacts.keys();
+}
+
+QString FakeCardDavServer::vcard(const QString &href) const
+{
+    return m_contacts.value(href).vcard;
+}
+
+QString FakeCardDavServer::etag(const QString &href) const
+{
+    return m_contacts.value(href).etag;
+}
+
+QString FakeCardDavServer::hrefForUid(const QString &uid) const
+{
+    for (QMap<QString, Contact>::const_iterator it = m_contacts.constBegin(); it != m_contacts.constEnd(); ++it) {
+        if (uidOf(it->vcard) == uid) {
+            return it.key();
+        }
+    }
+    return QString();
+}
+
+void FakeCardDavServer::setSyncTokens(bool syncTokens)
+{
+    m_syncTokens = syncTokens;
+}
+
+void FakeCardDavServer::setResponseDelay(int milliseconds)
+{
+    m_responseDelay = milliseconds;
+}
+
+void FakeCardDavServer::delayNextResponse(const QByteArray &verb, int milliseconds)
+{
+    m_nextResponseDelays.insert(verb, milliseconds);
+}
+
+void FakeCardDavServer::setBulkRequestLimits(int maxResources, int maxBytes)
+{
+    m_bulkMaxResources = maxResources;
+    m_bulkMaxBytes = maxBytes;
+}
+
+void FakeCardDavServer::setBulkResponseOrder(BulkResponseOrder order)
+{
+    m_bulkResponseOrder = order;
+}
+
+void FakeCardDavServer::setBulkResponseHrefs(bool hrefs)
+{
+    m_bulkResponseHrefs = hrefs;
+}
+
+void FakeCardDavServer::setBulkRejectedText(const QString &text)
+{
+    m_bulkRejectedText = text;
+}
+
+QList<FakeCardDavServer::Request> FakeCardDavServer::requests(const QByteArray &verb) const
+{
+    if (verb.isEmpty()) {
+        return m_requests;
+    }
+    QList<Request> matching;
+    Q_FOREACH (const Request &request, m_requests) {
+        if (request.verb == verb) {
+            matching.append(request);
+        }
+    }
+    return matching;
+}
+
+void FakeCardDavServer::clearRequests()
+{
+    m_requests.clear();
+}
+
+void FakeCardDavServer::changed()
+{
+    m_ctag += 1;
+}
+
+QNetworkReply *FakeCardDavServer::createRequest(Operation operation, const QNetworkRequest &request, QIODevice *outgoingData)
+{
+    // the plugin sends every request with sendCustomRequest().
+    Request r;
+    r.verb = request.attribute(QNetworkRequest::CustomVerbAttribute).toByteArray();
+    r.path = request.url().path();
+    if (r.path.endsWith('/')) {
+        r.path.chop(1);
+    }
+    r.request = request;
+    r.body = outgoingData ? outgoingData->readAll() : QByteArray();
+    m_requests.append(r);
+
+    const bool addressbook = r.path == addressbookPath();
+    int statusCode = 404;
+    QList<QPair<QByteArray, QByteArray> > headers;
+    QByteArray body;
+    if (r.verb == "PROPFIND" && addressbook) {
+        statusCode = 207;
+        body = r.body.contains("getctag") ? addressbookInformation() : etagListing();
+    } else if (r.verb == "PROPFIND" && m_contacts.contains(r.path)) {
+        statusCode = 207;
+        body = QByteArray(MultistatusStart)
+             + QStringLiteral("<d:response><d:href>%1</d:href><d:propstat><d:prop><d:getetag>%2</d:getetag></d:prop>"
+                              "<d:status>%3</d:status></d:propstat></d:response>")
+                   .arg(r.path.toHtmlEscaped(), m_contacts[r.path].etag.toHtmlEscaped(), statusLine(200)).toUtf8()
+             + MultistatusEnd;
+    } else if (r.verb == "REPORT" && addressbook && r.body.contains("addressbook-multiget")) {
+        static const QRegularExpression href(QStringLiteral("<d:href>([^<]*)</d:href>"));
+        QStringList hrefs;
+        QRegularExpressionMatchIterator it = href.globalMatch(QString::fromUtf8(r.body));
+        while (it.hasNext()) {
+            const QString escaped = it.next().captured(1).replace(QStringLiteral("&amp;"), QStringLiteral("&"));
+            hrefs.append(QUrl::fromPercentEncoding(escaped.toUtf8()));
+        }
+        statusCode = 207;
+        body = contactData(hrefs);
+    } else if (r.verb == "REPORT" && addressbook && r.body.contains("addressbook-query")) {
+        statusCode = 207;
+        body = contactData(m_contacts.keys());
+    } else if (r.verb == "REPORT" && addressbook) {
+        statusCode = 403; // no sync-collection support
+    } else if (r.verb == "PUT") {
+        QString etag;
+        statusCode = put(r, &etag);
+        if (!etag.isEmpty()) {
+            headers.append(qMakePair(QByteArray("ETag"), etag.toUtf8()));
+        }
+    } else if (r.verb == "DELETE") {
+        statusCode = remove(r);
+    } else if (r.verb == "POST" && addressbook && m_bulkMaxResources > 0) {
+        statusCode = 207;
+        body = bulkUpsync(r.body);
+    } else if (addressbook) {
+        statusCode = 405;
+    }
+
+    if (statusCode == 207) {
+        headers.append(qMakePair(QByteArray("Content-Type"), QByteArray("application/xml; charset=utf-8")));
+    }
+    const int delay = m_nextResponseDelays.contains(r.verb) ? m_nextResponseDelays.take(r.verb) : m_responseDelay;
+    return new FakeCardDavReply(operation, request, statusCode, headers, body, delay, this);
+}
+
+QByteArray FakeCardDavServer::addressbookInformation() const
+{
+    QString properties;
+    if (m_bulkMaxResources > 0) {
+        properties = QStringLiteral("<cs:bulk-requests><cs:crud>"
+                                    "<cs:max-resources>%1</cs:max-resources><cs:max-bytes>%2</cs:max-bytes>"
+                                    "</cs:crud></cs:bulk-requests>").arg(m_bulkMaxResources).arg(m_bulkMaxBytes);
+    }
+    if (m_syncTokens) {
+        properties += QStringLiteral("<d:sync-token>http://carddav.example.com/sync/%1</d:sync-token>").arg(m_ctag);
+    }
+    return QByteArray(MultistatusStart)
+         + QStringLiteral("<d:response><d:href>%1</d:href><d:propstat><d:prop>"
+                          "<d:resourcetype><d:collection /><card:addressbook /></d:resourcetype>"
+                          "<d:displayname>Contacts</d:displayname>"
+                          "<cs:getctag>%2</cs:getctag>%3"
+                          "</d:prop><d:status>%4</d:status></d:propstat></d:response>")
+               .arg(addressbookPath()).arg(m_ctag).arg(properties).arg(statusLine(200)).toUtf8()
+         + MultistatusEnd;
+}
+
+QByteArray FakeCardDavServer::etagListing() const
+{
+    QByteArray listing(MultistatusStart);
+    for (QMap<QString, Contact>::const_iterator it = m_contacts.constBegin(); it != m_contacts.constEnd(); ++it) {
+        listing += QStringLiteral("<d:response><d:href>%1</d:href><d:propstat><d:prop>"
+                                  "<d:getetag>%2</d:getetag><d:getcontentlength>%3</d:getcontentlength>"
+                                  "</d:prop><d:status>%4</d:status></d:propstat></d:response>")
+                       .arg(it.key().toHtmlEscaped(), it->etag.toHtmlEscaped())
+                       .arg(it->vcard.toUtf8().size()).arg(statusLine(200)).toUtf8();
+    }
+    return listing + MultistatusEnd;
+}
+
+QByteArray FakeCardDavServer::contactData(const QStringList &hrefs) const
+{
+    QByteArray data(MultistatusStart);
+    Q_FOREACH (const QString &href, hrefs) {
+        if (!m_contacts.contains(href)) {
+            data += QStringLiteral("<d:response><d:href>%1</d:href><d:status>%2</d:status></d:response>")
+                        .arg(href.toHtmlEscaped(), statusLine(404)).toUtf8();
+            continue;
+        }
+        data += QStringLiteral("<d:response><d:href>%1</d:href><d:propstat><d:prop>"
+                               "<d:getetag>%2</d:getetag><card:address-data>%3</card:address-data>"
+                               "</d:prop><d:status>%4</d:status></d:propstat></d:response>")
+                    .arg(href.toHtmlEscaped(), m_contacts[href].etag.toHtmlEscaped(),
+                         m_contacts[href].vcard.toHtmlEscaped(), statusLine(200)).toUtf8();
+    }
+    return data + MultistatusEnd;
+}
+
+// a CalendarServer "crud" multiput: resources without an href are created
+// at an href chosen by the server.
+QByteArray FakeCardDavServer::bulkUpsync(const QByteArray &body)
+{
+    class Resource
+    {
+    public:
+        QString href;
+        QString ifMatch;
+        QString vcard;
+    };
+
+    QList<Resource> resources;
+    Resource resource;
+    QXmlStreamReader reader(body);
+    while (!reader.atEnd()) {
+        reader.readNext();
+        if (reader.isStartElement()) {
+            if (reader.name() == QLatin1String("resource")) {
+                resource = Resource();
+            } else if (reader.name() == QLatin1String("href")) {
+                resource.href = reader.readElementText();
+            } else if (reader.name() == QLatin1String("getetag")) {
+                resource.ifMatch = reader.readElementText();
+            } else if (reader.name() == QLatin1String("address-data")) {
+                resource.vcard = reader.readElementText();
+            }
+        } else if (reader.isEndElement() && reader.name() == QLatin1String("resource")) {
+            resources.append(resource);
+        }
+    }
+
+    QList<QByteArray> responses;
+    Q_FOREACH (const Resource &r, resources) {
+        const bool created = r.href.isEmpty();
+        const QString href = created
+                ? QStringLiteral("%1/server-%2.vcf").arg(addressbookPath()).arg(++m_hrefCounter)
+                : r.href;
+        const QString hrefElement = (!created || m_bulkResponseHrefs)
+                ? QStringLiteral("<d:href>%1</d:href>").arg(href.toHtmlEscaped())
+                : QString();
+        if (!r.ifMatch.isEmpty() && m_contacts.value(href).etag != r.ifMatch) {
+            responses.append(QStringLiteral("<d:response>%1<d:status>%2</d:status></d:response>")
+                                 .arg(hrefElement, statusLine(412)).toUtf8());
+            continue;
+        }
+        if (created && !m_bulkRejectedText.isEmpty() && r.vcard.contains(m_bulkRejectedText)) {
+            responses.append(QStringLiteral("<d:response>%1<d:status>%2</d:status></d:response>")
+                                 .arg(hrefElement, statusLine(403)).toUtf8());
+            continue;
+        }
+        const int statusCode = m_contacts.contains(href) ? 200 : 201;
+        modifyContact(href, r.vcard);
+        responses.append(QStringLiteral("<d:response>%1<d:propstat><d:prop><d:getetag>%2</d:getetag></d:prop>"
+                                        "<d:status>%3</d:status></d:propstat></d:response>")
+                             .arg(hrefElement, m_contacts[href].etag.toHtmlEscaped(), statusLine(statusCode)).toUtf8());
+    }
+
+    QByteArray multistatus(MultistatusStart);
+    for (int i = 0; i < responses.size(); ++i) {
+        multistatus += responses.at(m_bulkResponseOrder == ReversedOrder ? responses.size() - 1 - i : i);
+    }
+    return multistatus + MultistatusEnd;
+}
+
+int FakeCardDavServer::put(const Request &request, QString *etag)
+{
+    const bool exists = m_contacts.contains(request.path);
+    const QByteArray ifMatch = request.request.rawHeader("If-Match");
+    const QByteArray ifNoneMatch = request.request.rawHeader("If-None-Match");
+    if ((ifNoneMatch == "*" && exists)
+            || (!ifMatch.isEmpty() && (!exists || m_contacts[request.path].etag.toUtf8() != ifMatch))) {
+        return 412;
+    }
+    const QString existing = hrefForUid(uidOf(QString::fromUtf8(request.body)));
+    if (!existing.isEmpty() && existing != request.path) {
+        return 409; // no-uid-conflict
+    }
+    modifyContact(request.path, QString::fromUtf8(request.body));
+    *etag = m_contacts[request.path].etag;
+    return exists ? 204 : 201;
+}
+
+int FakeCardDavServer::remove(const Request &request)
+{
+    if (!m_contacts.contains(request.path)) {
+        return 404;
+    }
+    const QByteArray ifMatch = request.request.rawHeader("If-Match");
+    if (!ifMatch.isEmpty() && m_contacts[request.path].etag.toUtf8() != ifMatch) {
+        return 412;
+    }
+    removeContact(request.path);
+    return 204;
+}
@@ -0,0 +1,131 @@
+#ifndef FAKECARDDAVSERVER_H
+#define FAKECARDDAVSERVER_H
+
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+// A reply from the FakeCardDavServer.  As from the network, the response
+// is delivered once control returns to the event loop.
+class FakeCardDavReply : public QNetworkReply
+{
+    Q_OBJECT
+
+public:
+    FakeCardDavReply(QNetworkAccessManager::Operation operation, const QNetworkRequest &request,
+                     int statusCode, const QList<QPair<QByteArray, QByteArray> > &headers,
+                     const QByteArray &body, int delay, QObject *parent);
+
+    void abort();
+    bool isSequential() const;
+    qint64 bytesAvailable() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+
+private slots:
+    void respond();
+
+private:
+    QByteArray m_body;
+    qint64 m_offset;
+};
+
+// An in-memory CardDAV server with a single addressbook, which answers the
+// requests sent by the plugin through it.  The addressbook advertises a ctag
+// but by default no sync token, so each sync lists the etags if the ctag has changed.
+// As CardDAV requires, a PUT of a contact whose UID is used by another is refused.
+class FakeCardDavServer : public QNetworkAccessManager
+{
+    Q_OBJECT
+
+public:
+    class Request
+    {
+    public:
+        QByteArray verb;
+        QString path;
+        QNetworkRequest request;
+        QByteArray body;
+    };
+
+    enum BulkResponseOrder {
+        RequestOrder = 0,
+        ReversedOrder
+    };
+
+    FakeCardDavServer(QObject *parent = 0);
+
+    static QString addressbookPath();
+
+    // the contacts in the addressbook, by href.
+    QString addContact(const QString &uid, const QString &vcard);
+    void modifyContact(const QString &href, const QString &vcard);
+    void removeContact(const QString &href);
+    QStringList hrefs() const;
+    QString vcard(const QString &href) const;
+    QString etag(const QString &href) const;
+    QString hrefForUid(const QString &uid) const;
+    // the response to a PROPFIND of the etags of the contacts.
+    QByteArray etagListing() const;
+
+    // advertises a sync token, although sync-collection reports are refused.
+    void setSyncTokens(bool syncTokens);
+    // delays each response, as a slow server would.
+    void setResponseDelay(int milliseconds);
+    // delays only the response to the next request with the given verb.  The
+    // request itself is applied immediately, as if the response were lost.
+    void delayNextResponse(const QByteArray &verb, int milliseconds);
+
+    // advertises the CalendarServer bulk-requests extension with the given limits.
+    void setBulkRequestLimits(int maxResources, int maxBytes);
+    void setBulkResponseOrder(BulkResponseOrder order);
+    // whether the responses to bulk requests include the hrefs of created contacts.
+    void setBulkResponseHrefs(bool hrefs);
+    // fails the bulk creation of contacts whose vCard contains the given text.
+    void setBulkRejectedText(const QString &text);
+
+    // the requests received since the last call to clearRequests().
+    QList<Request> requests(const QByteArray &verb = QByteArray()) const;
+    void clearRequests();
+
+protected:
+    QNetworkReply *createRequest(Operation operation, const QNetworkRequest &request, QIODevice *outgoingData);
+
+private:
+    class Contact
+    {
+    public:
+        QString vcard;
+        QString etag;
+    };
+
+    QByteArray addressbookInformation() const;
+    QByteArray contactData(const QStringList &hrefs) const;
+    QByteArray bulkUpsync(const QByteArray &body);
+    int put(const Request &request, QString *etag);
+    int remove(const Request &request);
+    void changed();
+
+    QMap<QString, Contact> m_contacts;
+    QList<Request> m_requests;
+    int m_ctag;
+    int m_etagCounter;
+    int m_hrefCounter;
+    int m_responseDelay;
+    QMap<QByteArray, int> m_nextResponseDelays; // verb -> delay
+    bool m_syncTokens;
+    int m_bulkMaxResources;
+    int m_bulkMaxBytes;
+    BulkResponseOrder m_bulkResponseOrder;
+    bool m_bulkResponseHrefs;
+    QString m_bulkRejectedText;
+};
+
+#endif // FAKECARDDAVSERVER_H
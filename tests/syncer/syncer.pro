@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = tst_syncer
+include($$PWD/../../src/src.pri)
+QT += testlib
+HEADERS += fakecarddavserver.h
+SOURCES += fakecarddavserver.cpp tst_syncer.cpp
+target.path = /opt/tests/buteo/plugins/carddav/
+INSTALLS += target
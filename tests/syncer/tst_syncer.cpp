@@ -0,0 +1,894 @@
+#include <QtTest>
+#include <QObject>
+#include <QString>
+
+#include "syncer_p.h"
+#include "carddav_p.h"
+#include "syncstrategy_p.h"
+#include "replyparser_p.h"
+#include "fakecarddavserver.h"
+
+#include <SyncProfile.h>
+
+#include <QContactManager>
+#include <QContact>
+#include <QContactName>
+#include <QContactPhoneNumber>
+#include <QContactDetailFilter>
+
+QTCONTACTS_USE_NAMESPACE
+
+namespace {
+
+const int AccountId = 7357;
+const int SyncTimeout = 30000; // milliseconds
+
+QString vcard(const QString &uid, const QString &firstName, const QString &phoneNumber)
+{
+    return QStringLiteral("BEGIN:VCARD\r\n"
+                          "VERSION:3.0\r\n"
+                          "UID:%1\r\n"
+                          "N:Tester;%2;;;\r\n"
+                          "FN:%2 Tester\r\n"
+                          "TEL:%3\r\n"
+                          "END:VCARD\r\n").arg(uid, firstName, phoneNumber);
+}
+
+}
+
+class tst_syncer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void fromRemoteSyncThenTwoWaySync();
+    void toRemoteSyncConflicts();
+    void estimateSync();
+    void reconcileRemovedLocalContact();
+    void quarantineUpsyncLoop();
+    void releaseQuarantineWithoutRemoteChanges();
+    void upsyncLoopState();
+    void compactState();
+    void purgeAccount();
+    void resumePurge();
+    void bulkUpsyncLimits();
+    void bulkUpsyncResponseOrder();
+    void bulkUpsyncWithoutHrefs();
+    void bulkUpsyncPartialFailure();
+    void publishMetrics();
+    void syncStatistics();
+    void syncDeadline();
+    void retryTimedOutAddition();
+    void syncTokenFallback();
+    void selectStrategy();
+    void passOverFailingStrategy();
+
+private:
+    bool purge();
+    bool sync(FakeCardDavServer *server, Buteo::SyncProfile *profile = 0);
+    bool estimate(FakeCardDavServer *server, SyncCostEstimate *estimate);
+    QContact localContact(const QString &firstName);
+    QString localPhoneNumber(const QString &firstName);
+    bool setLocalPhoneNumber(const QString &firstName, const QString &phoneNumber);
+    bool addLocalContact(const QString &firstName, const QString &phoneNumber);
+
+    QContactManager m_manager;
+    QList<QContactId> m_localContactIds;
+};
+
+void tst_syncer::init()
+{
+    QVERIFY(purge());
+}
+
+void tst_syncer::cleanup()
+{
+    if (!m_localContactIds.isEmpty()) {
+        m_manager.removeContacts(m_localContactIds);
+        m_localContactIds.clear();
+    }
+    QVERIFY(purge());
+}
+
+// purges the test account, waiting for the purge to finish.
+bool tst_syncer::purge()
+{
+    Syncer syncer(0, 0);
+    QSignalSpy finished(&syncer, SIGNAL(purgeFinished(int,bool)));
+    syncer.purgeAccount(AccountId);
+    return finished.wait(SyncTimeout) && finished.first().at(1).toBool();
+}
+
+// syncs the test account with the given server, as Syncer::startSync()
+// does once the account has been signed in to.
+bool tst_syncer::sync(FakeCardDavServer *server, Buteo::SyncProfile *profile)
+{
+    Syncer syncer(0, profile);
+    syncer.m_qnam = server;
+    syncer.m_accountId = AccountId;
+    QSignalSpy succeeded(&syncer, SIGNAL(syncSucceeded()));
+    QSignalSpy failed(&syncer, SIGNAL(syncFailed()));
+    syncer.sync(QStringLiteral("https://carddav.example.com"), FakeCardDavServer::addressbookPath(),
+                QStringLiteral("tester"), QStringLiteral("password"), QString(), false);
+    QElapsedTimer timer;
+    timer.start();
+    while (succeeded.isEmpty() && failed.isEmpty() && timer.elapsed() < SyncTimeout) {
+        QTest::qWait(50);
+    }
+    return succeeded.count() == 1 && failed.isEmpty();
+}
+
+// as sync(), for Syncer::estimateSync().
+bool tst_syncer::estimate(FakeCardDavServer *server, SyncCostEstimate *estimate)
+{
+    Syncer syncer(0, 0);
+    syncer.m_qnam = server;
+    syncer.m_accountId = AccountId;
+    syncer.m_estimateOnly = true;
+    bool estimated = false;
+    connect(&syncer, &Syncer::syncEstimated, [&estimated, estimate] (const SyncCostEstimate &e) {
+        *estimate = e;
+        estimated = true;
+    });
+    QSignalSpy failed(&syncer, SIGNAL(syncFailed()));
+    syncer.sync(QStringLiteral("https://carddav.example.com"), FakeCardDavServer::addressbookPath(),
+                QStringLiteral("tester"), QStringLiteral("password"), QString(), false);
+    QElapsedTimer timer;
+    timer.start();
+    while (!estimated && failed.isEmpty() && timer.elapsed() < SyncTimeout) {
+        QTest::qWait(50);
+    }
+    return estimated && failed.isEmpty();
+}
+
+QContact tst_syncer::localContact(const QString &firstName)
+{
+    QContactDetailFilter filter;
+    filter.setDetailType(QContactDetail::TypeName, QContactName::FieldFirstName);
+    filter.setValue(firstName);
+    filter.setMatchFlags(QContactFilter::MatchExactly);
+    const QList<QContact> contacts = m_manager.contacts(filter);
+    return contacts.size() == 1 ? contacts.first() : QContact();
+}
+
+QString tst_syncer::localPhoneNumber(const QString &firstName)
+{
+    return localContact(firstName).detail<QContactPhoneNumber>().number();
+}
+
+bool tst_syncer::setLocalPhoneNumber(const QString &firstName, const QString &phoneNumber)
+{
+    QContact contact = localContact(firstName);
+    QContactPhoneNumber number = contact.detail<QContactPhoneNumber>();
+    number.setNumber(phoneNumber);
+    return contact.saveDetail(&number) && m_manager.saveContact(&contact);
+}
+
+// adds a contact which was created on the device, rather than synced.
+bool tst_syncer::addLocalContact(const QString &firstName, const QString &phoneNumber)
+{
+    QContact contact;
+    QContactName name;
+    name.setFirstName(firstName);
+    name.setLastName(QStringLiteral("Tester"));
+    QContactPhoneNumber number;
+    number.setNumber(phoneNumber);
+    if (!contact.saveDetail(&name) || !contact.saveDetail(&number) || !m_manager.saveContact(&contact)) {
+        return false;
+    }
+    m_localContactIds.append(contact.id());
+    return true;
+}
+
+void tst_syncer::fromRemoteSyncThenTwoWaySync()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550001"));
+
+    // the remote changes are downloaded, and nothing is uploaded.
+    server.modifyContact(alice, vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550011")));
+    const QString bob = server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    server.clearRequests();
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setSyncDirection(Buteo::SyncProfile::SYNC_DIRECTION_FROM_REMOTE);
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    QVERIFY(server.requests("DELETE").isEmpty());
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550011"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Bob")), QStringLiteral("5550002"));
+
+    // the next two-way sync uploads the local changes made since, but
+    // not the remote changes which were stored by the one-way sync.
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Bob"), QStringLiteral("5550022")));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("PUT").size(), 1);
+    QCOMPARE(server.requests("PUT").first().path, bob);
+    QVERIFY(server.requests("DELETE").isEmpty());
+    QVERIFY(server.vcard(bob).contains(QStringLiteral("5550022")));
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550011")));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550011"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Bob")), QStringLiteral("5550022"));
+}
+
+void tst_syncer::toRemoteSyncConflicts()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    const QString bob = server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    QVERIFY(sync(&server));
+
+    // the local changes overwrite the remote modification, and re-create
+    // the contact which was removed remotely, but only with If-None-Match.
+    server.modifyContact(alice, vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550111")));
+    server.removeContact(bob);
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Bob"), QStringLiteral("5550022")));
+    server.clearRequests();
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setSyncDirection(Buteo::SyncProfile::SYNC_DIRECTION_TO_REMOTE);
+    QVERIFY(sync(&server, &profile));
+    QCOMPARE(server.requests("PUT").size(), 2);
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("PUT")) {
+        if (request.path == bob) {
+            QCOMPARE(request.request.rawHeader("If-None-Match"), QByteArray("*"));
+            QVERIFY(request.request.rawHeader("If-Match").isEmpty());
+        } else {
+            QCOMPARE(request.path, alice);
+            QVERIFY(!request.request.rawHeader("If-Match").isEmpty());
+        }
+    }
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550011")));
+    QVERIFY(server.vcard(bob).contains(QStringLiteral("5550022")));
+}
+
+void tst_syncer::estimateSync()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the estimate counts the changes on both sides without making any.
+    const QString bobVCard = vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002"));
+    const QString bob = server.addContact(QStringLiteral("bob"), bobVCard);
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    server.clearRequests();
+    SyncCostEstimate estimate;
+    QVERIFY(this->estimate(&server, &estimate));
+    QCOMPARE(estimate.addressbooks, 1);
+    QCOMPARE(estimate.changedAddressbooks, 1);
+    QCOMPARE(estimate.remoteAdditions, 1);
+    QCOMPARE(estimate.remoteModifications, 0);
+    QCOMPARE(estimate.remoteRemovals, 0);
+    QCOMPARE(estimate.downloadBytes, qint64(bobVCard.toUtf8().size()));
+    QCOMPARE(estimate.localAdditions, 0);
+    QCOMPARE(estimate.localModifications, 1);
+    QCOMPARE(estimate.localRemovals, 0);
+    QCOMPARE(server.requests().size(), server.requests("PROPFIND").size());
+    QVERIFY(localContact(QStringLiteral("Bob")).isEmpty());
+
+    // nothing was recorded, so the next sync makes the estimated changes.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("PUT").size(), 1);
+    QCOMPARE(server.requests("PUT").first().path, alice);
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550011")));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Bob")), QStringLiteral("5550002"));
+    QVERIFY(server.vcard(bob) == bobVCard);
+}
+
+void tst_syncer::reconcileRemovedLocalContact()
+{
+    FakeCardDavServer server;
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the state describes a contact which the server has, but which no longer exists locally.
+    const QString addressbookUrl = FakeCardDavServer::addressbookPath();
+    const QString carol = server.addContact(QStringLiteral("carol"), vcard(QStringLiteral("carol"), QStringLiteral("Carol"), QStringLiteral("5550003")));
+    const QString carolGuid = QStringLiteral("%1:AB:%2:carol").arg(AccountId).arg(addressbookUrl);
+    Syncer syncer(0, 0);
+    syncer.m_accountId = AccountId;
+    QDateTime remoteSince;
+    QVERIFY(syncer.initSyncAdapter(QString::number(AccountId)));
+    QVERIFY(syncer.readSyncStateData(&remoteSince, QString::number(AccountId)));
+    QVERIFY(syncer.readExtraStateData(AccountId));
+    QVERIFY(syncer.ensureShardLoaded(addressbookUrl));
+    syncer.addAddressbookGuid(addressbookUrl, carolGuid);
+    syncer.m_contactUids.insert(carolGuid, QStringLiteral("carol"));
+    syncer.m_contactUris.insert(carolGuid, carol);
+    syncer.m_contactEtags.insert(carolGuid, server.etag(carol));
+    syncer.m_contactIds.insert(carolGuid, syncer.m_contactIds.first() + QStringLiteral("0"));
+
+    QVERIFY(syncer.reconcileContactIds(AccountId));
+    QVERIFY(!syncer.m_contactIds.contains(carolGuid));
+    QVERIFY(!syncer.m_contactUris.contains(carolGuid));
+    QVERIFY(!syncer.m_contactEtags.contains(carolGuid));
+    QVERIFY(!syncer.m_addressbookContactGuids.value(addressbookUrl).contains(carolGuid));
+    QCOMPARE(syncer.m_addressbookContactGuids.value(addressbookUrl).size(), 1);
+
+    // so the etag listing reports it as an addition, and it is downloaded again.
+    CardDavVCardConverter converter;
+    ReplyParser parser(&syncer, &converter);
+    const QList<ReplyParser::ContactInformation> infos = parser.parseContactMetadata(server.etagListing(), addressbookUrl);
+    int additions = 0;
+    Q_FOREACH (const ReplyParser::ContactInformation &info, infos) {
+        QVERIFY(info.modType != ReplyParser::ContactInformation::Deletion);
+        if (info.modType == ReplyParser::ContactInformation::Addition) {
+            QCOMPARE(info.uri, carol);
+            additions += 1;
+        }
+    }
+    QCOMPARE(additions, 1);
+}
+
+void tst_syncer::quarantineUpsyncLoop()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setKey(QStringLiteral("upsync_loop_threshold"), QStringLiteral("1"));
+    profile.setKey(QStringLiteral("upsync_quarantine_days"), QStringLiteral("0"));
+    QVERIFY(sync(&server, &profile));
+
+    // the server modifies the contact after it is upsynced, so the next
+    // local edit is not upsynced, but the contact is quarantined.
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(sync(&server, &profile));
+    QCOMPARE(server.requests("PUT").size(), 1);
+    server.modifyContact(alice, server.vcard(alice).replace(QStringLiteral("END:VCARD"), QStringLiteral("NOTE:normalised\r\nEND:VCARD")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550022")));
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(!server.vcard(alice).contains(QStringLiteral("5550022")));
+
+    // once the quarantine expires, the skipped edit is upsynced
+    // even though the contact has not been edited again.
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QCOMPARE(server.requests("PUT").size(), 1);
+    QCOMPARE(server.requests("PUT").first().path, alice);
+    QVERIFY(server.vcard(alice).contains(localPhoneNumber(QStringLiteral("Alice"))));
+
+    // and it is upsynced only once.
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(server.requests("PUT").isEmpty());
+}
+
+void tst_syncer::releaseQuarantineWithoutRemoteChanges()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setKey(QStringLiteral("upsync_loop_threshold"), QStringLiteral("1"));
+    profile.setKey(QStringLiteral("upsync_quarantine_days"), QStringLiteral("0"));
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(sync(&server, &profile));
+    server.modifyContact(alice, server.vcard(alice).replace(QStringLiteral("END:VCARD"), QStringLiteral("NOTE:normalised\r\nEND:VCARD")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550022")));
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(!server.vcard(alice).contains(QStringLiteral("5550022")));
+
+    // the ctag of the addressbook is unchanged, so its contacts are neither
+    // listed nor is its state otherwise needed, but the released edit is upsynced.
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(server.requests("REPORT").isEmpty());
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("PROPFIND")) {
+        QVERIFY(!request.body.contains("getetag"));
+    }
+    QCOMPARE(server.requests("PUT").size(), 1);
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550022")));
+
+    // and the edit is no longer pending.
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QVERIFY(server.requests("PUT").isEmpty());
+}
+
+void tst_syncer::upsyncLoopState()
+{
+    const QString expired = QStringLiteral("7357:AB:/addressbooks/test/contacts:expired");
+    const QString quarantined = QStringLiteral("7357:AB:/addressbooks/test/contacts:quarantined");
+    const QString looping = QStringLiteral("7357:AB:/addressbooks/test/contacts:looping");
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+
+    Syncer syncer(0, 0);
+    syncer.m_upsyncedGuids.insert(looping);
+    syncer.m_roundTripGuids.insert(looping);
+    syncer.m_contactUpsyncLoops.insert(looping, 2);
+    syncer.m_contactUpsyncLoops.insert(expired, 3);
+    syncer.m_contactUpsyncLoops.insert(quarantined, 3);
+    syncer.m_quarantinedContacts.insert(expired, now.addSecs(-60));
+    syncer.m_quarantinedContacts.insert(quarantined, now.addDays(1));
+    syncer.m_quarantinedEdits.insert(expired);
+    syncer.m_quarantinedEdits.insert(quarantined);
+    const QByteArray data = syncer.encodeUpsyncLoopState();
+
+    // an expired quarantine is lifted and its loop count reset, but the
+    // skipped edits are kept until they are upsynced.
+    Syncer reader(0, 0);
+    QVERIFY(reader.readUpsyncLoopState(data));
+    QCOMPARE(reader.m_lastUpsyncedGuids, QSet<QString>() << looping);
+    QCOMPARE(reader.m_contactUpsyncLoops.value(looping), 2);
+    QVERIFY(!reader.m_contactUpsyncLoops.contains(expired));
+    QCOMPARE(reader.m_contactUpsyncLoops.value(quarantined), 3);
+    QCOMPARE(reader.m_quarantinedContacts.keys(), QStringList() << quarantined);
+    QCOMPARE(reader.m_quarantinedEdits, QSet<QString>() << expired << quarantined);
+
+    // the loop counts of contacts which weren't modified remotely after this upsync are reset.
+    QVERIFY(reader.readUpsyncLoopState(reader.encodeUpsyncLoopState()));
+    QVERIFY(!reader.m_contactUpsyncLoops.contains(looping));
+    QVERIFY(reader.m_lastUpsyncedGuids.isEmpty());
+
+    // the previous version without the skipped edits can still be read.
+    QByteArray previous;
+    QDataStream out(&previous, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << quint32(1) << (QSet<QString>() << looping) << syncer.m_contactUpsyncLoops << syncer.m_quarantinedContacts;
+    QVERIFY(reader.readUpsyncLoopState(previous));
+    QCOMPARE(reader.m_lastUpsyncedGuids, QSet<QString>() << looping);
+    QCOMPARE(reader.m_quarantinedContacts.keys(), QStringList() << quarantined);
+    QVERIFY(reader.m_quarantinedEdits.isEmpty());
+}
+
+void tst_syncer::compactState()
+{
+    FakeCardDavServer server;
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("PUT").size(), 1);
+
+    // compaction neither reconciles the state, even if a reconciliation is due,
+    // nor updates the upsync loop state as a sync would.
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setKey(QStringLiteral("reconciliation_interval"), QStringLiteral("1"));
+    SyncStateReport report;
+    {
+        Syncer syncer(0, &profile);
+        QVERIFY(syncer.inspectState(AccountId, true, &report));
+        QVERIFY(report.compacted);
+        QVERIFY(!syncer.m_reconcileState);
+    }
+
+    Syncer syncer(0, 0);
+    syncer.m_accountId = AccountId;
+    QDateTime remoteSince;
+    QVERIFY(syncer.initSyncAdapter(QString::number(AccountId)));
+    QVERIFY(syncer.readSyncStateData(&remoteSince, QString::number(AccountId)));
+    QVERIFY(syncer.readExtraStateData(AccountId));
+    QVERIFY(syncer.ensureShardLoaded(FakeCardDavServer::addressbookPath()));
+    QCOMPARE(syncer.m_lastUpsyncedGuids.size(), 1);
+    QVERIFY(syncer.m_lastUpsyncedGuids.contains(syncer.m_contactUris.key(alice)));
+}
+
+void tst_syncer::purgeAccount()
+{
+    FakeCardDavServer server;
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    QVERIFY(sync(&server));
+    QVERIFY(!localContact(QStringLiteral("Alice")).isEmpty());
+
+    // the contacts are removed from the event loop, with progress reported as they are.
+    Syncer syncer(0, 0);
+    QSignalSpy progress(&syncer, SIGNAL(purgeProgress(int,int,int)));
+    QSignalSpy finished(&syncer, SIGNAL(purgeFinished(int,bool)));
+    syncer.purgeAccount(AccountId);
+    QVERIFY(syncer.isPurging(AccountId));
+    QVERIFY(Syncer::pendingPurges().contains(AccountId));
+    QVERIFY(finished.wait(SyncTimeout));
+    QCOMPARE(finished.first().at(0).toInt(), AccountId);
+    QVERIFY(finished.first().at(1).toBool());
+    QCOMPARE(progress.last().at(1).toInt(), 2);
+    QCOMPARE(progress.last().at(2).toInt(), 2);
+    QVERIFY(!syncer.isPurging(AccountId));
+    QVERIFY(!Syncer::pendingPurges().contains(AccountId));
+    QVERIFY(localContact(QStringLiteral("Alice")).isEmpty());
+    QVERIFY(localContact(QStringLiteral("Bob")).isEmpty());
+
+    // so is the state, so the next sync is a clean sync.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550001"));
+    QVERIFY(server.requests("PUT").isEmpty());
+}
+
+void tst_syncer::resumePurge()
+{
+    FakeCardDavServer server;
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the purge is interrupted before it has removed anything.
+    {
+        Syncer syncer(0, 0);
+        syncer.purgeAccount(AccountId);
+    }
+    QVERIFY(Syncer::pendingPurges().contains(AccountId));
+    QVERIFY(!localContact(QStringLiteral("Alice")).isEmpty());
+
+    // and is resumed later.
+    Syncer syncer(0, 0);
+    QSignalSpy finished(&syncer, SIGNAL(purgeFinished(int,bool)));
+    Q_FOREACH (int accountId, Syncer::pendingPurges()) {
+        syncer.purgeAccount(accountId);
+    }
+    while (syncer.isPurging(AccountId) && finished.wait(SyncTimeout)) {
+    }
+    QVERIFY(!syncer.isPurging(AccountId));
+    QVERIFY(!Syncer::pendingPurges().contains(AccountId));
+    QVERIFY(localContact(QStringLiteral("Alice")).isEmpty());
+}
+
+void tst_syncer::bulkUpsyncLimits()
+{
+    const int maxResources = 2;
+    const int maxBytes = 1024;
+    FakeCardDavServer server;
+    server.setBulkRequestLimits(maxResources, maxBytes);
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    const QString bob = server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    const QString carol = server.addContact(QStringLiteral("carol"), vcard(QStringLiteral("carol"), QStringLiteral("Carol"), QStringLiteral("5550003")));
+    QVERIFY(sync(&server));
+
+    // the local changes are upsynced in bulk requests, each of which
+    // is within the limits of the server, including its XML envelope.
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Bob"), QStringLiteral("5550022")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Carol"), QStringLiteral("5550033")));
+    QVERIFY(addLocalContact(QStringLiteral("Dave"), QStringLiteral("5550004")));
+    QVERIFY(addLocalContact(QStringLiteral("Erin"), QStringLiteral("5550005")));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").size() >= 3);
+    int resources = 0;
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("POST")) {
+        const int count = request.body.count("<cs:resource>");
+        QVERIFY(count <= maxResources);
+        QVERIFY(count == 1 || request.body.size() <= maxBytes);
+        resources += count;
+    }
+    QCOMPARE(resources, 5);
+    QCOMPARE(server.hrefs().size(), 5);
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550011")));
+    QVERIFY(server.vcard(bob).contains(QStringLiteral("5550022")));
+    QVERIFY(server.vcard(carol).contains(QStringLiteral("5550033")));
+
+    // the results were recorded, so the next sync changes nothing.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    QCOMPARE(server.hrefs().size(), 5);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Dave")), QStringLiteral("5550004"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Erin")), QStringLiteral("5550005"));
+}
+
+void tst_syncer::bulkUpsyncResponseOrder()
+{
+    FakeCardDavServer server;
+    server.setBulkRequestLimits(10, 0);
+    server.setBulkResponseOrder(FakeCardDavServer::ReversedOrder);
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    const QString bob = server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    QVERIFY(sync(&server));
+
+    // the results of the modifications are matched by their hrefs, not by their
+    // position, so each contact is given its own etag.
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Bob"), QStringLiteral("5550022")));
+    QVERIFY(addLocalContact(QStringLiteral("Dave"), QStringLiteral("5550004")));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("POST").size(), 1);
+    QVERIFY(server.requests("PUT").isEmpty());
+    QCOMPARE(server.hrefs().size(), 3);
+
+    // so the next sync neither downloads them as remote modifications nor upsyncs
+    // them again, and the addition is matched to the local contact by its UID.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("REPORT")) {
+        QVERIFY(!request.body.contains(alice.toUtf8()));
+        QVERIFY(!request.body.contains(bob.toUtf8()));
+    }
+    QCOMPARE(server.hrefs().size(), 3);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550011"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Bob")), QStringLiteral("5550022"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Dave")), QStringLiteral("5550004"));
+}
+
+void tst_syncer::bulkUpsyncWithoutHrefs()
+{
+    FakeCardDavServer server;
+    server.setBulkRequestLimits(10, 0);
+    server.setBulkResponseHrefs(false);
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the uris chosen by the server aren't reported for the additions.
+    QVERIFY(addLocalContact(QStringLiteral("Dave"), QStringLiteral("5550004")));
+    QVERIFY(addLocalContact(QStringLiteral("Erin"), QStringLiteral("5550005")));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("POST").size(), 1);
+    QCOMPARE(server.hrefs().size(), 3);
+
+    // so they are matched to the local contacts by their UIDs when the
+    // server next lists them, without being duplicated on either side.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    QCOMPARE(server.hrefs().size(), 3);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Dave")), QStringLiteral("5550004"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Erin")), QStringLiteral("5550005"));
+
+    // and the state is stable from then on.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    QVERIFY(server.requests("REPORT").isEmpty());
+}
+
+void tst_syncer::bulkUpsyncPartialFailure()
+{
+    FakeCardDavServer server;
+    server.setBulkRequestLimits(10, 0);
+    server.setBulkResponseOrder(FakeCardDavServer::ReversedOrder);
+    const QString alice = server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the result of the modification shows that the results are not in request
+    // order, and one of the additions failed, so it is not known which addition
+    // was created.  Each is retried individually: the server refuses a second
+    // contact with the UID of the one which was created.
+    QVERIFY(setLocalPhoneNumber(QStringLiteral("Alice"), QStringLiteral("5550011")));
+    QVERIFY(addLocalContact(QStringLiteral("Dave"), QStringLiteral("5550004")));
+    QVERIFY(addLocalContact(QStringLiteral("Erin"), QStringLiteral("5550005")));
+    server.setBulkRejectedText(QStringLiteral("5550005"));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QCOMPARE(server.requests("POST").size(), 1);
+    QCOMPARE(server.requests("PUT").size(), 2);
+    QCOMPARE(server.hrefs().size(), 3);
+    QVERIFY(server.vcard(alice).contains(QStringLiteral("5550011")));
+    QString vcards;
+    Q_FOREACH (const QString &href, server.hrefs()) {
+        vcards += server.vcard(href);
+    }
+    QVERIFY(vcards.contains(QStringLiteral("5550004")));
+    QVERIFY(vcards.contains(QStringLiteral("5550005")));
+
+    // so neither is upsynced again, nor duplicated.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("PUT").isEmpty());
+    QVERIFY(server.requests("POST").isEmpty());
+    QCOMPARE(server.hrefs().size(), 3);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Dave")), QStringLiteral("5550004"));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Erin")), QStringLiteral("5550005"));
+}
+
+void tst_syncer::publishMetrics()
+{
+    Syncer syncer(0, 0);
+    syncer.m_metrics.start(AccountId);
+    syncer.setPhase(QStringLiteral("downsync"));
+    QCOMPARE(syncer.m_metrics.report().count("state contactUids 0\n"), 1);
+
+    // the state sizes are published at most once per interval...
+    syncer.m_contactUids.insert(QStringLiteral("7357:AB:/addressbooks/test/contacts:alice"), QStringLiteral("alice"));
+    syncer.publishMetrics();
+    QCOMPARE(syncer.m_metrics.report().count("state contactUids 0\n"), 1);
+
+    // ...but always on a change of phase.
+    syncer.setPhase(QStringLiteral("upsync"));
+    const QByteArray report = syncer.m_metrics.report();
+    QCOMPARE(report.count("state contactUids 1\n"), 1);
+    QCOMPARE(report.count("phase upsync\n"), 1);
+}
+
+void tst_syncer::syncStatistics()
+{
+    // the statistics include the time blocked in the current phase so far,
+    // e.g. while preparing the state in which they are stored.
+    Syncer syncer(0, 0);
+    syncer.m_stallMonitor.setThreshold(200);
+    syncer.m_stallMonitor.start(QStringLiteral("storestate"));
+    QThread::msleep(500);
+    QDataStream in(syncer.encodeSyncStatistics());
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 version = 0;
+    QDateTime timestamp;
+    qint64 elapsed = 0;
+    qint32 threshold = 0;
+    QMap<QString, StallStatistics> statistics;
+    in >> version >> timestamp >> elapsed >> threshold >> statistics;
+    QCOMPARE(in.status(), QDataStream::Ok);
+    QCOMPARE(threshold, 200);
+    QVERIFY(elapsed >= 500);
+    QCOMPARE(statistics.value(QStringLiteral("storestate")).stalls, 1);
+    QVERIFY(statistics.value(QStringLiteral("storestate")).totalDuration >= 500);
+    syncer.m_stallMonitor.stop();
+}
+
+void tst_syncer::syncDeadline()
+{
+    // each request and each phase is within its own timeout,
+    // but the sync as a whole is not.
+    FakeCardDavServer server;
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    server.setResponseDelay(600);
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setKey(QStringLiteral("sync_timeout"), QStringLiteral("1"));
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY(!sync(&server, &profile));
+    QVERIFY(timer.elapsed() < 5000);
+    QVERIFY(localContact(QStringLiteral("Alice")).isEmpty());
+
+    // the state was retained, and without the deadline the sync completes.
+    profile.setKey(QStringLiteral("sync_timeout"), QStringLiteral("0"));
+    QVERIFY(sync(&server, &profile));
+    QCOMPARE(localPhoneNumber(QStringLiteral("Alice")), QStringLiteral("5550001"));
+}
+
+void tst_syncer::retryTimedOutAddition()
+{
+    FakeCardDavServer server;
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the server creates the contact, but its response arrives after the request
+    // has timed out.  The retry then fails its If-None-Match precondition, so the
+    // addition is confirmed by fetching the etag of the contact instead.
+    QVERIFY(addLocalContact(QStringLiteral("Dave"), QStringLiteral("5550004")));
+    server.delayNextResponse("PUT", 3000);
+    Buteo::SyncProfile profile(QStringLiteral("carddav-test"));
+    profile.setKey(QStringLiteral("request_timeout"), QStringLiteral("1"));
+    server.clearRequests();
+    QVERIFY(sync(&server, &profile));
+    QCOMPARE(server.hrefs().size(), 2);
+    const QList<FakeCardDavServer::Request> puts = server.requests("PUT");
+    QCOMPARE(puts.size(), 2);
+    QCOMPARE(puts.at(1).path, puts.at(0).path);
+    QCOMPARE(puts.at(1).request.rawHeader("If-None-Match"), QByteArray("*"));
+    const QString dave = puts.first().path;
+    QVERIFY(server.vcard(dave).contains(QStringLiteral("5550004")));
+    bool etagFetched = false;
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("PROPFIND")) {
+        etagFetched |= request.path == dave && request.request.rawHeader("Depth") == "0";
+    }
+    QVERIFY(etagFetched);
+
+    // the etag was recorded, so the next sync does not download the
+    // contact as a remote modification, nor upload it again.
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    QVERIFY(server.requests("REPORT").isEmpty());
+    QVERIFY(server.requests("PUT").isEmpty());
+    QCOMPARE(server.hrefs().size(), 2);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Dave")), QStringLiteral("5550004"));
+}
+
+void tst_syncer::syncTokenFallback()
+{
+    FakeCardDavServer server;
+    server.setSyncTokens(true);
+    server.addContact(QStringLiteral("alice"), vcard(QStringLiteral("alice"), QStringLiteral("Alice"), QStringLiteral("5550001")));
+    QVERIFY(sync(&server));
+
+    // the server refuses the sync-collection report, so the delta is determined
+    // from an etag listing instead, and the addressbook is counted only once.
+    const QString bob = server.addContact(QStringLiteral("bob"), vcard(QStringLiteral("bob"), QStringLiteral("Bob"), QStringLiteral("5550002")));
+    server.clearRequests();
+    QVERIFY(sync(&server));
+    int syncCollectionReports = 0;
+    Q_FOREACH (const FakeCardDavServer::Request &request, server.requests("REPORT")) {
+        if (request.body.contains("sync-collection")) {
+            syncCollectionReports += 1;
+        }
+    }
+    QCOMPARE(syncCollectionReports, 1);
+    QCOMPARE(localPhoneNumber(QStringLiteral("Bob")), QStringLiteral("5550002"));
+}
+
+void tst_syncer::selectStrategy()
+{
+    Syncer syncer(0, 0);
+    CardDav cardDav(&syncer, QStringLiteral("https://carddav.example.com"), FakeCardDavServer::addressbookPath(),
+                    QStringLiteral("tester"), QStringLiteral("password"));
+    const QList<SyncStrategy*> strategies = SyncStrategy::createStrategies(&cardDav, &syncer);
+    QMap<int, SyncStrategyStatistics> statistics;
+    ReplyParser::AddressBookInformation info;
+    info.url = FakeCardDavServer::addressbookPath();
+    info.ctag = QStringLiteral("2");
+    info.syncToken = QStringLiteral("http://carddav.example.com/sync/2");
+
+    // the first sync of an addressbook fetches all of its contacts at once.
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::AddressbookQuery);
+
+    // later syncs use the sync token if there is one, or else the ctag.
+    syncer.m_addressbookCtags.insert(info.url, QStringLiteral("1"));
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::SyncCollection);
+    info.syncToken.clear();
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::CtagEtag);
+    info.ctag.clear();
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::FullScan);
+
+    // neither is trusted while the state is being reconciled.
+    info.ctag = QStringLiteral("2");
+    info.syncToken = QStringLiteral("http://carddav.example.com/sync/2");
+    syncer.m_reconcileState = true;
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::FullScan);
+    QVERIFY(statistics.isEmpty());
+    qDeleteAll(strategies);
+}
+
+void tst_syncer::passOverFailingStrategy()
+{
+    Syncer syncer(0, 0);
+    CardDav cardDav(&syncer, QStringLiteral("https://carddav.example.com"), FakeCardDavServer::addressbookPath(),
+                    QStringLiteral("tester"), QStringLiteral("password"));
+    const QList<SyncStrategy*> strategies = SyncStrategy::createStrategies(&cardDav, &syncer);
+    QMap<int, SyncStrategyStatistics> statistics;
+    ReplyParser::AddressBookInformation info;
+    info.url = FakeCardDavServer::addressbookPath();
+    info.ctag = QStringLiteral("2");
+    info.syncToken = QStringLiteral("http://carddav.example.com/sync/2");
+    syncer.m_addressbookCtags.insert(info.url, QStringLiteral("1"));
+
+    // a strategy is still used after two failures in a row...
+    SyncStrategy::recordOutcome(&statistics, SyncStrategy::SyncCollection, false);
+    SyncStrategy::recordOutcome(&statistics, SyncStrategy::SyncCollection, false);
+    QCOMPARE(statistics.value(SyncStrategy::SyncCollection).failures, 2);
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::SyncCollection);
+
+    // ...but after the third it is passed over for twenty syncs.
+    SyncStrategy::recordOutcome(&statistics, SyncStrategy::SyncCollection, false);
+    for (int i = 0; i < 20; ++i) {
+        QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::CtagEtag);
+    }
+    QCOMPARE(statistics.value(SyncStrategy::SyncCollection).skippedSyncs, 20);
+
+    // then it is tried again.  A further failure passes it over again,
+    // while a success clears its failures.
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::SyncCollection);
+    SyncStrategy::recordOutcome(&statistics, SyncStrategy::SyncCollection, false);
+    QCOMPARE(statistics.value(SyncStrategy::SyncCollection).failures, 4);
+    QCOMPARE(statistics.value(SyncStrategy::SyncCollection).skippedSyncs, 0);
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::CtagEtag);
+    SyncStrategy::recordOutcome(&statistics, SyncStrategy::SyncCollection, true);
+    QVERIFY(!statistics.contains(SyncStrategy::SyncCollection));
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::SyncCollection);
+
+    // the full scan is the last resort, so is never passed over.
+    info.ctag.clear();
+    info.syncToken.clear();
+    for (int i = 0; i < 3; ++i) {
+        SyncStrategy::recordOutcome(&statistics, SyncStrategy::FullScan, false);
+    }
+    QCOMPARE(SyncStrategy::select(strategies, info, &statistics)->type(), SyncStrategy::FullScan);
+    QCOMPARE(statistics.value(SyncStrategy::FullScan).skippedSyncs, 0);
+    qDeleteAll(strategies);
+}
+
+#include "tst_syncer.moc"
+QTEST_MAIN(tst_syncer)
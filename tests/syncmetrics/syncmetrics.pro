@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = tst_syncmetrics
+include($$PWD/../../src/src.pri)
+QT += testlib
+SOURCES += tst_syncmetrics.cpp
+target.path = /opt/tests/buteo/plugins/carddav/
+INSTALLS += target
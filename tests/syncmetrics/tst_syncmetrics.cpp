@@ -0,0 +1,154 @@
+#include <QtTest>
+#include <QObject>
+#include <QString>
+#include <QThread>
+#include <QLocalSocket>
+#include <QStandardPaths>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include "syncmetrics_p.h"
+
+namespace {
+
+const int AccountId = 7357;
+
+QByteArray reportLine(const QByteArray &report, const QByteArray &key)
+{
+    Q_FOREACH (const QByteArray &line, report.split('\n')) {
+        if (line.startsWith(key + ' ')) {
+            return line.mid(key.size() + 1);
+        }
+    }
+    return QByteArray();
+}
+
+QByteArray readReport(const QString &name)
+{
+    QLocalSocket socket;
+    socket.connectToServer(name, QIODevice::ReadOnly);
+    if (!socket.waitForConnected(5000)) {
+        return QByteArray();
+    }
+    QByteArray report;
+    while (socket.waitForReadyRead(5000)) {
+        report.append(socket.readAll());
+    }
+    return report + socket.readAll();
+}
+
+}
+
+class tst_syncmetrics : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void report();
+    void concurrentReport();
+    void serverName();
+    void serve();
+};
+
+void tst_syncmetrics::report()
+{
+    SyncMetrics metrics;
+    QCOMPARE(reportLine(metrics.report(), "elapsed"), QByteArray("0"));
+
+    metrics.start(AccountId);
+    metrics.add(SyncMetrics::RequestsSent);
+    metrics.add(SyncMetrics::RequestsSent);
+    metrics.add(SyncMetrics::BytesReceived, 1024);
+    SyncMetricsSnapshot *snapshot = new SyncMetricsSnapshot;
+    snapshot->phase = QStringLiteral("downsync");
+    snapshot->addressbookPhases.insert(QStringLiteral("/addressbooks/test/contacts"), QStringLiteral("fetch"));
+    snapshot->stateSizes.insert(QStringLiteral("contactUids"), 3);
+    metrics.publish(snapshot);
+
+    const QByteArray report = metrics.report();
+    QCOMPARE(reportLine(report, "account"), QByteArray::number(AccountId));
+    QVERIFY(reportLine(report, "elapsed").toLongLong() >= 0);
+    QCOMPARE(reportLine(report, "requests_sent"), QByteArray("2"));
+    QCOMPARE(reportLine(report, "bytes_received"), QByteArray("1024"));
+    QCOMPARE(reportLine(report, "contacts_stored"), QByteArray("0"));
+    QCOMPARE(reportLine(report, "phase"), QByteArray("downsync"));
+    QCOMPARE(reportLine(report, "addressbook"), QByteArray("/addressbooks/test/contacts fetch"));
+    QCOMPARE(reportLine(report, "state"), QByteArray("contactUids 3"));
+
+    // the snapshot is kept for the next report, until a newer one is published.
+    QCOMPARE(reportLine(metrics.report(), "phase"), QByteArray("downsync"));
+    snapshot = new SyncMetricsSnapshot;
+    snapshot->phase = QStringLiteral("upsync");
+    metrics.publish(snapshot);
+    QCOMPARE(reportLine(metrics.report(), "phase"), QByteArray("upsync"));
+    QVERIFY(reportLine(metrics.report(), "addressbook").isEmpty());
+
+    // and the counters are reset when the next sync starts.
+    metrics.start(AccountId);
+    QCOMPARE(reportLine(metrics.report(), "requests_sent"), QByteArray("0"));
+    QCOMPARE(reportLine(metrics.report(), "phase"), QByteArray(""));
+}
+
+void tst_syncmetrics::concurrentReport()
+{
+    // the syncing thread publishes and restarts while another thread reads.
+    SyncMetrics metrics;
+    metrics.start(AccountId);
+    QFuture<QByteArray> reader = QtConcurrent::run(&metrics, &SyncMetrics::report);
+    for (int i = 0; i < 1000; ++i) {
+        if (reader.isFinished()) {
+            QCOMPARE(reportLine(reader.result(), "account"), QByteArray::number(AccountId));
+            reader = QtConcurrent::run(&metrics, &SyncMetrics::report);
+        }
+        SyncMetricsSnapshot *snapshot = new SyncMetricsSnapshot;
+        snapshot->phase = QString::number(i);
+        metrics.publish(snapshot);
+        metrics.add(SyncMetrics::ContactsParsed);
+        if (i % 100 == 0) {
+            metrics.start(AccountId);
+        }
+    }
+    reader.waitForFinished();
+}
+
+void tst_syncmetrics::serverName()
+{
+    // the socket is private to the user, rather than at a predictable path.
+    const QString runtimeDir = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    QVERIFY(!runtimeDir.isEmpty());
+    QCOMPARE(SyncMetricsServer::serverName(AccountId), QStringLiteral("%1/carddav-metrics-%2").arg(runtimeDir).arg(AccountId));
+}
+
+void tst_syncmetrics::serve()
+{
+    SyncMetrics metrics;
+    metrics.start(AccountId);
+    metrics.add(SyncMetrics::ContactsStored, 5);
+
+    const QString name = SyncMetricsServer::serverName(AccountId);
+    QThread thread;
+    SyncMetricsServer *server = new SyncMetricsServer(&metrics);
+    server->moveToThread(&thread);
+    connect(&thread, SIGNAL(finished()), server, SLOT(deleteLater()));
+    thread.start(QThread::LowPriority);
+    QMetaObject::invokeMethod(server, "listen", Qt::QueuedConnection, Q_ARG(QString, name));
+
+    QByteArray report;
+    for (int i = 0; i < 50 && report.isEmpty(); ++i) {
+        QTest::qWait(20);
+        report = readReport(name);
+    }
+    QCOMPARE(reportLine(report, "contacts_stored"), QByteArray("5"));
+
+    // a second server does not take the socket from the first.
+    SyncMetrics otherMetrics;
+    otherMetrics.start(AccountId + 1);
+    SyncMetricsServer otherServer(&otherMetrics);
+    otherServer.listen(name);
+    QCOMPARE(reportLine(readReport(name), "account"), QByteArray::number(AccountId));
+
+    thread.quit();
+    QVERIFY(thread.wait(5000));
+}
+
+#include "tst_syncmetrics.moc"
+QTEST_MAIN(tst_syncmetrics)
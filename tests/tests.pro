@@ -1,5 +1,5 @@
 TEMPLATE=subdirs
-SUBDIRS+=replyparser
+SUBDIRS+=replyparser serverprofiler stallmonitor statebenchmark syncer syncmetrics unsupportedproperties
 
 OTHER_FILES+=tests.xml
 tests_xml.path=/opt/tests/buteo/plugins/carddav/
@@ -0,0 +1,196 @@
+#include <QtTest>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QDir>
+#include <QTemporaryDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#include "unsupportedproperties_p.h"
+
+namespace {
+
+const QString GuidA = QStringLiteral("7357:AB:/addressbooks/test/contacts:a");
+const QString GuidB = QStringLiteral("7357:AB:/addressbooks/test/contacts:b");
+
+// a property line of about the given size, which compresses well.
+QString repetitiveProperty(int size)
+{
+    return QStringLiteral("X-NOTE:") + QString(size, QLatin1Char('a'));
+}
+
+// a property line of about the given size, which compresses poorly.
+QString randomProperty(int size)
+{
+    QString value;
+    qsrand(7357);
+    for (int i = 0; i < size; ++i) {
+        value.append(QLatin1Char('!' + qrand() % 90));
+    }
+    return QStringLiteral("X-KEY:") + value;
+}
+
+}
+
+class tst_unsupportedproperties : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void roundTrip();
+    void interning();
+    void blobs();
+    void unreferencedBlobs();
+    void prunePool();
+    void legacyMigration();
+};
+
+void tst_unsupportedproperties::roundTrip()
+{
+    const QString shortProperty = QStringLiteral("X-SOCIALPROFILE;TYPE=twitter:johndoe");
+    const QString compressible = repetitiveProperty(1024);
+    const QStringList properties = QStringList() << shortProperty << compressible;
+
+    UnsupportedPropertiesStore store;
+    store.insert(GuidA, properties);
+    QCOMPARE(store.value(GuidA), properties);
+    const QList<QByteArray> entries = store.entries(GuidA);
+    QCOMPARE(entries.size(), 2);
+    QCOMPARE(entries.at(0).at(0), 'R');
+    QCOMPARE(entries.at(1).at(0), 'Z');
+    QVERIFY(entries.at(1).size() < compressible.size());
+
+    // the encoded entries are what the shards store.
+    UnsupportedPropertiesStore decoded;
+    decoded.insertEntries(GuidA, entries);
+    QCOMPARE(decoded.value(GuidA), properties);
+
+    // without a blob directory, even very large properties are kept inline.
+    const QString large = repetitiveProperty(64 * 1024);
+    store.insert(GuidB, QStringList() << large);
+    QCOMPARE(store.entries(GuidB).first().at(0), 'Z');
+    QCOMPARE(store.take(GuidB), QStringList() << large);
+    QVERIFY(!store.contains(GuidB));
+    QCOMPARE(store.size(), 1);
+}
+
+void tst_unsupportedproperties::interning()
+{
+    const QString property = QStringLiteral("X-SOCIALPROFILE;TYPE=twitter:johndoe");
+    UnsupportedPropertiesStore store;
+    store.insert(GuidA, QStringList() << property);
+    store.insert(GuidB, QStringList() << property);
+    QCOMPARE(store.entries(GuidA).first().constData(), store.entries(GuidB).first().constData());
+    QCOMPARE(store.m_pool.size(), 1);
+}
+
+void tst_unsupportedproperties::blobs()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString blobDirectory = dir.path() + QStringLiteral("/unsupported");
+    const QString large = randomProperty(64 * 1024);
+
+    UnsupportedPropertiesStore store;
+    store.setBlobDirectory(blobDirectory);
+    store.insert(GuidA, QStringList() << large);
+    const QList<QByteArray> entries = store.entries(GuidA);
+    QCOMPARE(entries.first().at(0), 'B');
+
+    // the blob is only written once the state is stored.
+    QVERIFY(!QDir(blobDirectory).exists());
+    QCOMPARE(store.value(GuidA), QStringList() << large);
+    QVERIFY(store.writePendingBlobs());
+    QCOMPARE(QDir(blobDirectory).entryList(QDir::Files), QStringList() << QString::fromLatin1(entries.first().mid(1)));
+    QVERIFY(store.m_pendingBlobs.isEmpty());
+
+    UnsupportedPropertiesStore decoded;
+    decoded.setBlobDirectory(blobDirectory);
+    decoded.insertEntries(GuidA, entries);
+    QCOMPARE(decoded.value(GuidA), QStringList() << large);
+
+    // identical properties share the blob.
+    decoded.insert(GuidB, QStringList() << large);
+    QCOMPARE(decoded.entries(GuidB), entries);
+    QVERIFY(decoded.m_pendingBlobs.isEmpty());
+}
+
+void tst_unsupportedproperties::unreferencedBlobs()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString first = randomProperty(32 * 1024);
+    const QString second = repetitiveProperty(32 * 1024);
+
+    // the blobs of properties which are replaced before the state is stored are never written.
+    UnsupportedPropertiesStore store;
+    store.setBlobDirectory(dir.path());
+    store.insert(GuidA, QStringList() << first);
+    store.insert(GuidA, QStringList() << second);
+    store.insert(GuidB, QStringList() << first);
+    store.remove(GuidB);
+    QVERIFY(store.writePendingBlobs());
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Files),
+             QStringList() << QString::fromLatin1(store.entries(GuidA).first().mid(1)));
+
+    // and stored blobs are removed once no contact refers to them.
+    store.insert(GuidB, QStringList() << first);
+    QVERIFY(store.writePendingBlobs());
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Files).size(), 2);
+    store.remove(GuidA);
+    store.removeUnreferencedBlobs();
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Files),
+             QStringList() << QString::fromLatin1(store.entries(GuidB).first().mid(1)));
+    QCOMPARE(store.value(GuidB), QStringList() << first);
+}
+
+void tst_unsupportedproperties::prunePool()
+{
+    UnsupportedPropertiesStore store;
+    const QString shared = QStringLiteral("X-SOCIALPROFILE;TYPE=twitter:johndoe");
+    store.insert(GuidA, QStringList() << shared);
+    for (int i = 0; i < 4096; ++i) {
+        store.insert(GuidB, QStringList() << shared << QStringLiteral("X-ID:%1").arg(i));
+    }
+
+    // the entries of replaced properties are not kept in the pool.
+    QVERIFY(store.m_pool.size() < 2048);
+    QCOMPARE(store.value(GuidA), QStringList() << shared);
+    QCOMPARE(store.value(GuidB), QStringList() << shared << QStringLiteral("X-ID:4095"));
+
+    store.clear();
+    QVERIFY(store.m_pool.isEmpty());
+    QCOMPARE(store.size(), 0);
+}
+
+void tst_unsupportedproperties::legacyMigration()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QStringList propertiesA = QStringList() << QStringLiteral("X-SOCIALPROFILE;TYPE=twitter:johndoe")
+                                                  << repetitiveProperty(1024);
+    const QStringList propertiesB = QStringList() << randomProperty(32 * 1024);
+
+    // the unsupported properties were stored as JSON by previous versions.
+    QJsonObject object;
+    object.insert(GuidA, QJsonArray::fromStringList(propertiesA));
+    object.insert(GuidB, QJsonArray::fromStringList(propertiesB));
+    UnsupportedPropertiesStore store;
+    store.setBlobDirectory(dir.path());
+    QVERIFY(store.fromByteArray(QJsonDocument(object).toBinaryData()));
+    QCOMPARE(store.keys(), QStringList() << GuidA << GuidB);
+    QCOMPARE(store.value(GuidA), propertiesA);
+    QCOMPARE(store.value(GuidB), propertiesB);
+    QCOMPARE(store.entries(GuidB).first().at(0), 'B');
+    QVERIFY(QDir(dir.path()).entryList(QDir::Files).isEmpty());
+
+    QVERIFY(store.fromByteArray(QByteArray()));
+    QCOMPARE(store.size(), 0);
+    QVERIFY(!store.fromByteArray(QByteArray("CDUP")));
+    QCOMPARE(store.size(), 0);
+}
+
+#include "tst_unsupportedproperties.moc"
+QTEST_MAIN(tst_unsupportedproperties)
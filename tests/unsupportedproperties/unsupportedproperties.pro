@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = tst_unsupportedproperties
+include($$PWD/../../src/src.pri)
+QT += testlib
+SOURCES += tst_unsupportedproperties.cpp
+target.path = /opt/tests/buteo/plugins/carddav/
+INSTALLS += target
@@ -11,8 +11,8 @@ PKGCONFIG += Qt5Contacts Qt5Versit contactcache-qt5
 
 QMAKE_CXXFLAGS += -fPIE -fvisibility=hidden -fvisibility-inlines-hidden
 
-HEADERS+=worker.h helpers.h
-SOURCES+=worker.cpp helpers.cpp main.cpp
+HEADERS+=worker.h helpers.h serverprofiler.h
+SOURCES+=worker.cpp helpers.cpp serverprofiler.cpp main.cpp
 
 # included from the main carddav plugin
 include($$PWD/../../src/src.pri)
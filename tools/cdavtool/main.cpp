@@ -53,12 +53,19 @@ int main(int argc, char *argv[])
     const QString usage = QStringLiteral(
                "usage:\n"
                "cdavtool --create-account --type carddav|caldav|both --username <user> --password <pass> --host <host> [--calendar-path <cpath>] [--addressbook-path <apath>] [--verbose]\n"
-               "cdavtool --with-account <id> [--clear-remote-calendars|--clear-remote-addressbooks] [--verbose]\n"
+               "cdavtool --with-account <id> [--clear-remote-calendars|--clear-remote-addressbooks|--estimate-sync] [--verbose]\n"
+               "cdavtool --with-account <id> --inspect-state [--compact] [--verbose]\n"
+               "cdavtool --with-account <id> --profile-server [--store] [--verbose]\n"
+               "cdavtool --with-account <id> --sync-metrics\n"
                "cdavtool --delete-account <id> [--verbose]\n"
                "\n"
                "examples:\n"
                "cdavtool --create-account --type both --username testuser --password testpass --host http://8.1.tst.merproject.org/ --verbose\n"
                "cdavtool --with-account 5 --clear-remote-calendars\n"
+               "cdavtool --with-account 5 --estimate-sync\n"
+               "cdavtool --with-account 5 --inspect-state --compact\n"
+               "cdavtool --with-account 5 --profile-server --store\n"
+               "cdavtool --with-account 5 --sync-metrics\n"
                "cdavtool --delete-account 5\n");
 
     QStringList args = app.arguments();
@@ -111,7 +118,7 @@ int main(int argc, char *argv[])
             return RETURN_ERROR;
         }
     } else if (args[1] == QStringLiteral("--with-account")) {
-        if (args.size() != 4) {
+        if (args.size() != 4 && args.size() != 5) {
             printf("%s\n", "Incorrect switches for --with-account");
             printf("%s\n", usage.toLatin1().constData());
             return RETURN_ERROR;
@@ -123,10 +130,25 @@ int main(int argc, char *argv[])
             printf("%s\n", usage.toLatin1().constData());
             return RETURN_ERROR;
         }
+        if (args.size() == 5
+                && !(args[3] == QStringLiteral("--inspect-state") && args[4] == QStringLiteral("--compact"))
+                && !(args[3] == QStringLiteral("--profile-server") && args[4] == QStringLiteral("--store"))) {
+            printf("%s\n", "Invalid switches for --with-account (--compact requires --inspect-state, --store requires --profile-server)");
+            printf("%s\n", usage.toLatin1().constData());
+            return RETURN_ERROR;
+        }
         if (args[3] == QStringLiteral("--clear-remote-calendars")) {
             worker.clearRemoteCalendars(accountId);
         } else if (args[3] == QStringLiteral("--clear-remote-addressbooks")) {
             worker.clearRemoteAddressbooks(accountId);
+        } else if (args[3] == QStringLiteral("--estimate-sync")) {
+            worker.estimateSync(accountId);
+        } else if (args[3] == QStringLiteral("--inspect-state")) {
+            worker.inspectState(accountId, args.size() == 5);
+        } else if (args[3] == QStringLiteral("--profile-server")) {
+            worker.profileServer(accountId, args.size() == 5);
+        } else if (args[3] == QStringLiteral("--sync-metrics")) {
+            worker.readSyncMetrics(accountId);
         } else {
             printf("%s\n", "Invalid switches for --with-account (method)");
             printf("%s\n", usage.toLatin1().constData());
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2016 Jolla Ltd.
+ * Contact: Chris Adams <chris.adams@jollamobile.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "serverprofiler.h"
+#include "requestgenerator_p.h"
+#include "replyparser_p.h"
+
+#include <QXmlStreamReader>
+#include <QtDebug>
+
+#include <algorithm>
+
+namespace {
+    // single requests are repeated, and the median latency reported.
+    const int SampleCount = 3;
+
+    const int MultigetSizes[] = { 1, 10, 100, 1000 };
+    const int MultigetSizeCount = sizeof(MultigetSizes) / sizeof(MultigetSizes[0]);
+
+    // QNetworkAccessManager opens at most six connections per host,
+    // so there is no point in measuring more concurrent requests.
+    const int FanOutLevels[] = { 1, 2, 4, 6 };
+    const int FanOutLevelCount = sizeof(FanOutLevels) / sizeof(FanOutLevels[0]);
+
+    // the requests of a probe are aborted if they take longer than this.
+    const int ProbeTimeout = 120000;
+
+    // the smallest setting which achieves this fraction of the best throughput is recommended.
+    const double RecommendationThreshold = 0.9;
+
+    const int HttpRequestTimeout = 408;
+    const int HttpTooManyRequests = 429;
+    const int HttpServiceUnavailable = 503;
+
+    QString parseSyncToken(const QByteArray &data)
+    {
+        QXmlStreamReader reader(data);
+        while (!reader.atEnd()) {
+            if (reader.readNext() == QXmlStreamReader::StartElement
+                    && reader.name() == QLatin1String("sync-token")
+                    && reader.namespaceUri() == QLatin1String("DAV:")) {
+                return reader.readElementText().trimmed();
+            }
+        }
+        return QString();
+    }
+}
+
+double ServerProfiler::Result::resourcesPerSecond() const
+{
+    return elapsed > 0 ? resources * 1000.0 / elapsed : 0.0;
+}
+
+bool ServerProfiler::Result::throttled() const
+{
+    return httpStatus == HttpTooManyRequests || httpStatus == HttpServiceUnavailable;
+}
+
+ServerProfiler::ServerProfiler(Syncer *syncer, const QString &serverUrl,
+                               const QString &username, const QString &password,
+                               QObject *parent)
+    : QObject(parent)
+    , m_request(new RequestGenerator(syncer, username, password))
+    , m_serverUrl(serverUrl)
+    , m_stage(ServerProfiler::Finished)
+    , m_step(0)
+    , m_pageSize(0)
+    , m_sampleBytes(0)
+    , m_sampleFailed(false)
+{
+    m_probeTimer.setSingleShot(true);
+    m_probeTimer.setInterval(ProbeTimeout);
+    connect(&m_probeTimer, &QTimer::timeout,
+            this, &ServerProfiler::probeTimedOut);
+}
+
+ServerProfiler::~ServerProfiler()
+{
+    delete m_request;
+}
+
+void ServerProfiler::profile(const QString &addressbookPath)
+{
+    m_addressbookPath = addressbookPath;
+    m_syncToken.clear();
+    m_hrefs.clear();
+    m_results.clear();
+    m_multigets.clear();
+    m_fanOuts.clear();
+    m_stage = ServerProfiler::PropfindDepth0;
+    m_step = 0;
+    m_pageSize = 0;
+    nextProbe();
+}
+
+// the smallest multiget which achieves nearly the best throughput, as
+// larger multigets are more likely to time out or to be throttled.
+int ServerProfiler::recommendedPageSize() const
+{
+    double best = 0.0;
+    Q_FOREACH (const Result &result, m_multigets) {
+        if (result.succeeded) {
+            best = qMax(best, result.resourcesPerSecond());
+        }
+    }
+    Q_FOREACH (const Result &result, m_multigets) {
+        if (result.succeeded && result.resourcesPerSecond() >= best * RecommendationThreshold) {
+            return result.resources;
+        }
+    }
+    return 0;
+}
+
+int ServerProfiler::recommendedConcurrency() const
+{
+    double best = 0.0;
+    Q_FOREACH (const Result &result, m_fanOuts) {
+        if (result.succeeded) {
+            best = qMax(best, result.resourcesPerSecond());
+        }
+    }
+    Q_FOREACH (const Result &result, m_fanOuts) {
+        if (result.succeeded && result.resourcesPerSecond() >= best * RecommendationThreshold) {
+            return result.requests;
+        }
+    }
+    return 1;
+}
+
+void ServerProfiler::nextProbe()
+{
+    while (m_stage != ServerProfiler::Finished && !startProbe()) {
+        nextStage();
+    }
+    if (m_stage == ServerProfiler::Finished) {
+        emit finished();
+    }
+}
+
+void ServerProfiler::nextStage()
+{
+    m_stage = static_cast<Stage>(m_stage + 1);
+    m_step = 0;
+}
+
+// starts the probe for the current stage and step, returns false if there is none.
+bool ServerProfiler::startProbe()
+{
+    m_current = Result();
+    m_samples.clear();
+    m_sampleBytes = 0;
+    m_sampleFailed = false;
+
+    switch (m_stage) {
+    case ServerProfiler::PropfindDepth0:
+        if (m_step > 0) {
+            return false;
+        }
+        m_current.name = QStringLiteral("PROPFIND depth 0");
+        break;
+    case ServerProfiler::PropfindDepth1:
+        if (m_step > 0) {
+            return false;
+        }
+        m_current.name = QStringLiteral("PROPFIND depth 1");
+        break;
+    case ServerProfiler::SyncCollection:
+        // the delta since the current sync token, as requested by most syncs.
+        if (m_step > 0 || m_syncToken.isEmpty()) {
+            return false;
+        }
+        m_current.name = QStringLiteral("sync-collection");
+        break;
+    case ServerProfiler::Multiget: {
+        if (m_step >= MultigetSizeCount || m_hrefs.isEmpty()) {
+            return false;
+        }
+        const int pageSize = qMin(MultigetSizes[m_step], m_hrefs.size());
+        if (pageSize == m_pageSize) {
+            return false; // the addressbook is too small for larger multigets.
+        }
+        m_pageSize = pageSize;
+        m_current.name = QStringLiteral("multiget %1").arg(m_pageSize);
+        m_current.resources = m_pageSize;
+        break;
+    }
+    case ServerProfiler::FanOut:
+        if (m_step >= FanOutLevelCount || recommendedPageSize() == 0) {
+            return false;
+        }
+        m_pageSize = recommendedPageSize();
+        m_current.requests = FanOutLevels[m_step];
+        m_current.resources = m_pageSize * m_current.requests;
+        m_current.name = QStringLiteral("%1 x multiget %2").arg(m_current.requests).arg(m_pageSize);
+        break;
+    default:
+        return false;
+    }
+
+    sendRequests();
+    return true;
+}
+
+void ServerProfiler::sendRequests()
+{
+    m_timer.start();
+    for (int i = 0; i < m_current.requests; ++i) {
+        QNetworkReply *reply = Q_NULLPTR;
+        if (m_stage == ServerProfiler::PropfindDepth0) {
+            reply = m_request->addressbookInformation(m_serverUrl, m_addressbookPath);
+        } else if (m_stage == ServerProfiler::PropfindDepth1) {
+            reply = m_request->contactEtags(m_serverUrl, m_addressbookPath);
+        } else if (m_stage == ServerProfiler::SyncCollection) {
+            reply = m_request->syncTokenDelta(m_serverUrl, m_addressbookPath, m_syncToken);
+        } else {
+            // concurrent multigets request different contacts where possible,
+            // so that the server cannot answer them from a cache.
+            QStringList uris;
+            for (int j = 0; j < m_pageSize; ++j) {
+                uris.append(m_hrefs.at((i * m_pageSize + j) % m_hrefs.size()));
+            }
+            reply = m_request->contactMultiget(m_serverUrl, m_addressbookPath, uris);
+        }
+
+        if (!reply) {
+            m_sampleFailed = true;
+            continue;
+        }
+        connect(reply, &QNetworkReply::finished,
+                this, &ServerProfiler::probeFinished);
+        m_outstanding.append(reply);
+    }
+
+    if (m_outstanding.isEmpty()) {
+        sampleFinished();
+        return;
+    }
+    m_probeTimer.start();
+}
+
+void ServerProfiler::probeFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    if (!m_outstanding.removeOne(reply)) {
+        return;
+    }
+
+    const QByteArray data = reply->readAll();
+    m_sampleBytes += data.size();
+    if (reply->error() != QNetworkReply::NoError) {
+        if (!m_sampleFailed) {
+            m_current.httpStatus = reply->property("timedOut").toBool()
+                    ? HttpRequestTimeout
+                    : reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        }
+        m_sampleFailed = true;
+        qWarning() << m_current.name << "failed:" << reply->error() << reply->errorString();
+    } else {
+        if (!m_sampleFailed) {
+            m_current.httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        }
+        if (m_stage == ServerProfiler::PropfindDepth0) {
+            m_syncToken = parseSyncToken(data);
+        } else if (m_stage == ServerProfiler::PropfindDepth1) {
+            m_hrefs.clear();
+            const QList<ReplyParser::ResourceInformation> resources = ReplyParser::parseMultistatus(data);
+            Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
+                // ignore the response for the addressbook collection itself.
+                if (resource.href.endsWith(QStringLiteral(".vcf"))) {
+                    m_hrefs.append(resource.href);
+                }
+            }
+            m_current.resources = m_hrefs.size();
+        }
+    }
+
+    if (m_outstanding.isEmpty()) {
+        sampleFinished();
+    }
+}
+
+void ServerProfiler::probeTimedOut()
+{
+    // abort() emits finished(), so the requests are failed by probeFinished().
+    Q_FOREACH (QNetworkReply *reply, m_outstanding) {
+        reply->setProperty("timedOut", true);
+        reply->abort();
+    }
+}
+
+void ServerProfiler::sampleFinished()
+{
+    m_probeTimer.stop();
+    m_samples.append(m_timer.elapsed());
+    if (!m_sampleFailed && m_samples.size() < SampleCount) {
+        sendRequests();
+        return;
+    }
+
+    std::sort(m_samples.begin(), m_samples.end());
+    m_current.elapsed = m_samples.at(m_samples.size() / 2);
+    m_current.bytes = m_sampleBytes / m_samples.size();
+    m_current.succeeded = !m_sampleFailed;
+    m_results.append(m_current);
+    if (m_stage == ServerProfiler::Multiget) {
+        m_multigets.append(m_current);
+    } else if (m_stage == ServerProfiler::FanOut) {
+        m_fanOuts.append(m_current);
+    }
+
+    if (m_sampleFailed && (m_stage == ServerProfiler::Multiget || m_stage == ServerProfiler::FanOut)) {
+        // larger or more requests would fail too.
+        nextStage();
+    } else {
+        m_step += 1;
+    }
+    nextProbe();
+}
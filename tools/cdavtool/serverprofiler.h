@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2016 Jolla Ltd.
+ * Contact: Chris Adams <chris.adams@jollamobile.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef CDAVTOOL_SERVERPROFILER_H
+#define CDAVTOOL_SERVERPROFILER_H
+
+#include <QNetworkReply>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QList>
+
+class Syncer;
+class RequestGenerator;
+
+// Runs a series of read-only requests against an addressbook, to measure
+// the latency and throughput of the server for the requests which the
+// plugin makes, and to find the multiget size and the number of concurrent
+// requests at which the server starts to fail or throttle them.
+class ServerProfiler : public QObject
+{
+    Q_OBJECT
+
+public:
+    class Result
+    {
+    public:
+        Result() : resources(0), requests(1), httpStatus(0), succeeded(false), elapsed(0), bytes(0) {}
+
+        double resourcesPerSecond() const;
+        bool throttled() const;
+
+        QString name;
+        int resources;   // resources requested in total
+        int requests;    // requests in flight at once
+        int httpStatus;  // of the failed request, if any
+        bool succeeded;
+        qint64 elapsed;  // milliseconds, the median of the samples
+        qint64 bytes;    // response bytes per sample
+    };
+
+    ServerProfiler(Syncer *syncer, const QString &serverUrl,
+                   const QString &username, const QString &password,
+                   QObject *parent = Q_NULLPTR);
+    ~ServerProfiler();
+
+    void profile(const QString &addressbookPath);
+
+    QList<Result> results() const { return m_results; }
+    QString syncToken() const { return m_syncToken; }
+    int resourceCount() const { return m_hrefs.size(); }
+    int recommendedPageSize() const;    // zero if no multiget succeeded
+    int recommendedConcurrency() const;
+
+Q_SIGNALS:
+    void finished();
+
+private Q_SLOTS:
+    void probeFinished();
+    void probeTimedOut();
+
+private:
+    enum Stage {
+        PropfindDepth0 = 0,
+        PropfindDepth1,
+        SyncCollection,
+        Multiget,
+        FanOut,
+        Finished
+    };
+
+    void nextProbe();
+    bool startProbe();
+    void sendRequests();
+    void sampleFinished();
+    void nextStage();
+
+    RequestGenerator *m_request;
+    QString m_serverUrl;
+    QString m_addressbookPath;
+    QString m_syncToken;
+    QStringList m_hrefs;              // contact resources in the addressbook
+    QList<Result> m_results;
+    QList<Result> m_multigets;        // the single multiget probes, in order of size
+    QList<Result> m_fanOuts;          // the concurrent multiget probes, in order of concurrency
+
+    // the current probe
+    Stage m_stage;
+    int m_step;                       // index into the multiget sizes or fan-out levels
+    int m_pageSize;                   // resources per multiget
+    Result m_current;
+    QList<qint64> m_samples;          // elapsed milliseconds
+    qint64 m_sampleBytes;
+    bool m_sampleFailed;
+    QList<QNetworkReply*> m_outstanding;
+    QElapsedTimer m_timer;
+    QTimer m_probeTimer;
+
+    friend class tst_serverprofiler;
+};
+
+#endif // CDAVTOOL_SERVERPROFILER_H
@@ -31,71 +31,25 @@
  */
 
 #include "worker.h"
+#include "replyparser_p.h"
+#include "syncmetrics_p.h"
 
+#include <QLocalSocket>
 #include <QtDebug>
 
 namespace {
-    QVariantMap elementToVMap(QXmlStreamReader &reader)
-    {
-        QVariantMap element;
-
-        // store the attributes of the element
-        QXmlStreamAttributes attrs = reader.attributes();
-        while (attrs.size()) {
-            QXmlStreamAttribute attr = attrs.takeFirst();
-            element.insert(attr.name().toString(), attr.value().toString());
-        }
-
-        while (reader.readNext() != QXmlStreamReader::EndElement) {
-            if (reader.isCharacters()) {
-                // store the text of the element, if any
-                QString elementText = reader.text().toString();
-                if (!elementText.isEmpty()) {
-                    element.insert(QLatin1String("@text"), elementText);
-                }
-            } else if (reader.isStartElement()) {
-                // recurse if necessary.
-                QString subElementName = reader.name().toString();
-                QVariantMap subElement = elementToVMap(reader);
-                if (element.contains(subElementName)) {
-                    // already have an element with this name.
-                    // create a variantlist and append.
-                    QVariant existing = element.value(subElementName);
-                    QVariantList subElementList;
-                    if (existing.type() == QVariant::Map) {
-                        // we need to convert the value into a QVariantList
-                        subElementList << existing.toMap();
-                    } else if (existing.type() == QVariant::List) {
-                        subElementList = existing.toList();
-                    }
-                    subElementList << subElement;
-                    element.insert(subElementName, subElementList);
-                } else {
-                    // first element with this name.  insert as a map.
-                    element.insert(subElementName, subElement);
-                }
-            }
-        }
-
-        return element;
-    }
-
-    QVariantMap xmlToVMap(QXmlStreamReader &reader)
-    {
-        QVariantMap retn;
-        while (!reader.atEnd() && !reader.hasError() && reader.readNextStartElement()) {
-            QString elementName = reader.name().toString();
-            QVariantMap element = elementToVMap(reader);
-            retn.insert(elementName, element);
-        }
-        return retn;
-    }
+    // QNetworkAccessManager opens at most six connections per host,
+    // so there is no benefit in having more deletions in flight.
+    const int MaxConcurrentDeletions = 6;
+    const int MaxDeletionAttempts = 3;
+    const int DeletionProgressInterval = 500;
 }
 
 CDavToolWorker::CDavToolWorker(QObject *parent)
     : QObject(parent)
     , m_carddavSyncer(Q_NULLPTR)
     , m_carddavDiscovery(Q_NULLPTR)
+    , m_serverProfiler(Q_NULLPTR)
     , m_caldavDiscovery(Q_NULLPTR)
     , m_networkManager(new QNetworkAccessManager(this))
     , m_profileManager(new Buteo::ProfileManager)
@@ -106,6 +60,10 @@ CDavToolWorker::CDavToolWorker(QObject *parent)
     , m_operationMode(CDavToolWorker::CreateAccount)
     , m_errorOccurred(false)
     , m_verbose(false)
+    , m_storeSettings(false)
+    , m_activeDeletions(0)
+    , m_completedDeletions(0)
+    , m_failedDeletions(0)
 {
 }
 
@@ -402,6 +360,220 @@ void CDavToolWorker::clearRemoteAddressbooks(int accountId)
     m_session->process(SignOn::SessionData(SignOn::SessionData()), QStringLiteral("password"));
 }
 
+void CDavToolWorker::estimateSync(int accountId)
+{
+    // the syncer signs in and loads the sync state of the account itself.
+    m_operationMode = CDavToolWorker::EstimateSync;
+    m_carddavSyncer = new Syncer(this, Q_NULLPTR);
+    connect(m_carddavSyncer, &Syncer::syncEstimated,
+            this, &CDavToolWorker::gotSyncEstimate);
+    connect(m_carddavSyncer, &Syncer::syncFailed,
+            this, &CDavToolWorker::syncEstimateFailed);
+    m_carddavSyncer->estimateSync(accountId);
+}
+
+void CDavToolWorker::gotSyncEstimate(const SyncCostEstimate &estimate)
+{
+    printf("Addressbooks: %d (%d changed)
+", estimate.addressbooks, estimate.changedAddressbooks);
+    printf("Remote changes to download: %d additions, %d modifications, %d removals
+",
+           estimate.remoteAdditions, estimate.remoteModifications, estimate.remoteRemovals);
+    printf("Bytes to download: %lld (%d resources of unknown size)
+",
+           estimate.downloadBytes, estimate.unknownSizeResources);
+    printf("Local changes to upload (at most): %d additions, %d modifications, %d removals
+",
+           estimate.localAdditions, estimate.localModifications, estimate.localRemovals);
+    printf("Requests to upload: %d, local database writes: %d
+",
+           estimate.uploads(), estimate.databaseWrites());
+    emit done();
+}
+
+void CDavToolWorker::syncEstimateFailed()
+{
+    handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Unable to estimate sync")));
+}
+
+void CDavToolWorker::inspectState(int accountId, bool compact)
+{
+    // the state is read from the local database only, so no sign in is required.
+    m_operationMode = CDavToolWorker::InspectState;
+    m_carddavSyncer = new Syncer(this, Q_NULLPTR);
+    SyncStateReport report;
+    if (!m_carddavSyncer->inspectState(accountId, compact, &report) && report.mapBytes.isEmpty()) {
+        // the state could not be read at all, rather than only not compacted.
+        handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Unable to read sync state")));
+        return;
+    }
+
+    if (report.lastSync.isValid()) {
+        printf("Ctags and sync tokens stored: %s (%lld seconds ago)\n",
+               report.lastSync.toString(Qt::ISODate).toLatin1().constData(),
+               report.lastSync.secsTo(QDateTime::currentDateTimeUtc()));
+    } else {
+        printf("No sync has completed\n");
+    }
+    printf("Reconciliation required: %s\n", report.reconciliationRequired ? "yes" : "no");
+    printf("Stored state: %lld bytes\n", report.storedBytes());
+
+    printf("\nAddressbooks: %d\n", report.addressbooks.size());
+    Q_FOREACH (const SyncStateReport::Addressbook &addressbook, report.addressbooks) {
+        printf("  %s: %d contacts, %d legacy guids, %lld bytes, ctag: %s, sync token: %s\n",
+               addressbook.url.toUtf8().constData(), addressbook.contacts, addressbook.legacyGuids,
+               addressbook.storedBytes, addressbook.hasCtag ? "yes" : "no",
+               addressbook.hasSyncToken ? "yes" : "no");
+    }
+
+    printf("\nStored values:\n");
+    for (QMap<QString, qint64>::const_iterator it = report.oobBytes.constBegin(); it != report.oobBytes.constEnd(); ++it) {
+        printf("  %s: %lld bytes\n", it.key().toUtf8().constData(), it.value());
+    }
+    printf("\nState maps:\n");
+    for (QMap<QString, qint64>::const_iterator it = report.mapBytes.constBegin(); it != report.mapBytes.constEnd(); ++it) {
+        printf("  %s: %lld bytes\n", it.key().toUtf8().constData(), it.value());
+    }
+
+    printf("\nLargest unsupported properties:\n");
+    for (int i = 0; i < report.largestUnsupportedProperties.size(); ++i) {
+        printf("  %s: %lld bytes\n", report.largestUnsupportedProperties[i].first.toUtf8().constData(),
+               report.largestUnsupportedProperties[i].second);
+    }
+
+    printf("\nOrphaned contacts: %d\n", report.orphanGuids.size());
+    printf("Legacy guids awaiting migration: %d\n", report.legacyGuids.size());
+    if (m_verbose) {
+        Q_FOREACH (const QString &guid, report.orphanGuids) {
+            printf("  orphan: %s\n", guid.toUtf8().constData());
+        }
+        Q_FOREACH (const QString &guid, report.legacyGuids) {
+            printf("  legacy: %s\n", guid.toUtf8().constData());
+        }
+    }
+
+    if (compact) {
+        if (!report.compacted) {
+            handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Unable to compact sync state")));
+            return;
+        }
+        printf("\nCompacted state: %lld bytes (was %lld bytes)\n", report.compactedBytes, report.storedBytes());
+    }
+
+    // done() must not be emitted before the event loop is running.
+    QTimer::singleShot(0, this, SIGNAL(done()));
+}
+
+void CDavToolWorker::readSyncMetrics(int accountId)
+{
+    // the metrics are only served while a sync of the account is running,
+    // and only if the metrics_interface key of its sync profile is set to 1.
+    m_operationMode = CDavToolWorker::ReadSyncMetrics;
+    QLocalSocket socket;
+    socket.connectToServer(SyncMetricsServer::serverName(accountId), QIODevice::ReadOnly);
+    if (!socket.waitForConnected(5000)) {
+        handleError(SignOn::Error(SignOn::Error::Unknown,
+                                  QStringLiteral("No sync of the account is running: %1").arg(socket.errorString())));
+        return;
+    }
+
+    // the server writes a single report and then closes the connection.
+    QByteArray report;
+    while (socket.waitForReadyRead(5000)) {
+        report.append(socket.readAll());
+    }
+    report.append(socket.readAll());
+    printf("%s", report.constData());
+
+    // done() must not be emitted before the event loop is running.
+    QTimer::singleShot(0, this, SIGNAL(done()));
+}
+
+void CDavToolWorker::profileServer(int accountId, bool storeSettings)
+{
+    m_operationMode = CDavToolWorker::ProfileServer;
+    m_storeSettings = storeSettings;
+    m_account = Accounts::Account::fromId(m_accountManager, accountId, this);
+    if (!m_account) {
+        handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("No such account")));
+        return;
+    }
+
+    // get username + password...
+    m_identity = SignOn::Identity::existingIdentity(m_account->value(QStringLiteral("CredentialsId")).toInt(), this);
+    m_session = m_identity->createSession(QStringLiteral("password"));
+    connect(m_session, SIGNAL(response(SignOn::SessionData)),
+            this, SLOT(gotCredentials(SignOn::SessionData)), Qt::UniqueConnection);
+    connect(m_session, SIGNAL(error(SignOn::Error)),
+            this, SLOT(handleError(SignOn::Error)), Qt::UniqueConnection);
+    m_session->process(SignOn::SessionData(SignOn::SessionData()), QStringLiteral("password"));
+}
+
+void CDavToolWorker::serverProfiled()
+{
+    const QList<ServerProfiler::Result> results = m_serverProfiler->results();
+    printf("%-24s %10s %8s %12s %12s %6s\n", "Request", "Resources", "Latency", "Bytes", "Resources/s", "Status");
+    Q_FOREACH (const ServerProfiler::Result &result, results) {
+        printf("%-24s %10d %6lldms %12lld %12.1f %6d%s\n",
+               result.name.toUtf8().constData(), result.resources, result.elapsed, result.bytes,
+               result.resourcesPerSecond(), result.httpStatus,
+               result.succeeded ? "" : (result.throttled() ? " (throttled)" : " (failed)"));
+    }
+    if (m_serverProfiler->syncToken().isEmpty()) {
+        printf("The addressbook reports no sync token, sync-collection was not measured\n");
+    }
+    Q_FOREACH (const ServerProfiler::Result &result, results) {
+        if (!result.succeeded) {
+            printf("%s begin at: %s\n", result.throttled() ? "Throttling" : "Errors",
+                   result.name.toUtf8().constData());
+            break;
+        }
+    }
+
+    const int pageSize = m_serverProfiler->recommendedPageSize();
+    const int concurrency = m_serverProfiler->recommendedConcurrency();
+    if (pageSize == 0) {
+        handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("No multigets succeeded, unable to recommend settings")));
+        return;
+    }
+    printf("\nRecommended settings: multiget_page_size=%d multiget_concurrency=%d\n", pageSize, concurrency);
+    if (pageSize >= m_serverProfiler->resourceCount()) {
+        printf("The addressbook has only %d contacts, larger multigets may perform better\n",
+               m_serverProfiler->resourceCount());
+    }
+
+    if (m_storeSettings) {
+        if (!storeMultigetSettings(pageSize, concurrency)) {
+            handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Unable to store settings in the sync profile")));
+            return;
+        }
+        printf("Stored the settings in the sync profile of the account\n");
+    }
+    emit done();
+}
+
+// the plugin reads the settings from the per-account sync profile,
+// see createSyncProfiles().
+bool CDavToolWorker::storeMultigetSettings(int pageSize, int concurrency)
+{
+    m_account->selectService(m_carddavService);
+    const QStringList templates = m_account->value(QStringLiteral("sync_profile_templates")).toStringList();
+    bool stored = false;
+    Q_FOREACH (const QString &templateProfileName, templates) {
+        const QString profileName = m_account->value(QStringLiteral("%1/%2").arg(templateProfileName).arg(Buteo::KEY_PROFILE_ID)).toString();
+        Buteo::SyncProfile *profile = profileName.isEmpty() ? Q_NULLPTR : m_profileManager->syncProfile(profileName);
+        if (!profile) {
+            qWarning() << "no sync profile found for template" << templateProfileName;
+            continue;
+        }
+        profile->setKey(QStringLiteral("multiget_page_size"), QString::number(pageSize));
+        profile->setKey(QStringLiteral("multiget_concurrency"), QString::number(concurrency));
+        stored |= !m_profileManager->updateProfile(*profile).isEmpty();
+        delete profile;
+    }
+    return stored;
+}
+
 void CDavToolWorker::gotCredentials(const SignOn::SessionData &response)
 {
     m_username = response.toMap().value(QStringLiteral("UserName")).toString();
@@ -431,7 +603,8 @@ void CDavToolWorker::gotCredentials(const SignOn::SessionData &response)
 
         QStringList calendarPaths = m_account->value(QStringLiteral("calendars")).toStringList();
         gotCollectionsList(calendarPaths);
-    } else if (m_operationMode == CDavToolWorker::ClearAllRemoteAddressbooks) {
+    } else if (m_operationMode == CDavToolWorker::ClearAllRemoteAddressbooks
+            || m_operationMode == CDavToolWorker::ProfileServer) {
         if (m_carddavService.name().isEmpty()) {
             handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("No carddav service found!")));
             return;
@@ -465,6 +638,19 @@ void CDavToolWorker::handleCardDAVError(int code)
 
 void CDavToolWorker::gotCollectionsList(const QStringList &paths)
 {
+    if (m_operationMode == CDavToolWorker::ProfileServer) {
+        if (paths.isEmpty()) {
+            handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("No addressbooks to profile!")));
+            return;
+        }
+        printf("Profiling addressbook %s\n", paths.first().toUtf8().constData());
+        m_serverProfiler = new ServerProfiler(m_carddavSyncer, m_hostAddress, m_username, m_password, this);
+        connect(m_serverProfiler, &ServerProfiler::finished,
+                this, &CDavToolWorker::serverProfiled);
+        m_serverProfiler->profile(paths.first());
+        return;
+    }
+
     Q_FOREACH (const QString &cpath, paths) {
         QString requestStr = QStringLiteral(
             "<d:propfind xmlns:d=\"DAV:\">"
@@ -486,72 +672,118 @@ void CDavToolWorker::gotCollectionsList(const QStringList &paths)
 void CDavToolWorker::gotEtags()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    m_replies.removeOne(reply);
+    reply->deleteLater();
     if (reply->error() != QNetworkReply::NoError) {
         handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Error occurred when fetching etags: %1: %2").arg(reply->error()).arg(reply->errorString())));
         return;
     }
 
-    m_replies.removeOne(reply);
-    QXmlStreamReader reader(reply->readAll());
-    QVariantMap vmap = xmlToVMap(reader);
-    QVariantMap multistatusMap = vmap[QLatin1String("multistatus")].toMap();
-    QVariantList responses;
-    if (multistatusMap[QLatin1String("response")].type() == QVariant::List) {
-        // multiple updates in the delta.
-        responses = multistatusMap[QLatin1String("response")].toList();
-    } else {
-        // only one update in the delta.
-        QVariantMap response = multistatusMap[QLatin1String("response")].toMap();
-        responses << response;
-    }
-
-    Q_FOREACH (const QVariant &rv, responses) {
-        QVariantMap rmap = rv.toMap();
-        QString href = rmap.value("href").toMap().value("@text").toString();
-        QUrl uri = QUrl::fromPercentEncoding(href.toUtf8());
-        QString etag = rmap.value("propstat").toMap().value("prop").toMap().value("getetag").toMap().value("@text").toString();
-        QString status = rmap.value("propstat").toMap().value("status").toMap().value("@text").toString();
-        if (status.isEmpty()) {
-            status = rmap.value("status").toMap().value("@text").toString();
-        }
-        if (!href.endsWith(QStringLiteral(".vcf"), Qt::CaseInsensitive)
-                && !href.endsWith(QStringLiteral(".vcs"))
-                && !href.endsWith(QStringLiteral(".ics"))) {
+    const QList<ReplyParser::ResourceInformation> resources = ReplyParser::parseMultistatus(reply);
+    Q_FOREACH (const ReplyParser::ResourceInformation &resource, resources) {
+        if (!resource.href.endsWith(QStringLiteral(".vcf"), Qt::CaseInsensitive)
+                && !resource.href.endsWith(QStringLiteral(".vcs"))
+                && !resource.href.endsWith(QStringLiteral(".ics"))) {
             // this is probably a response for a collection resource,
             // rather than for a contact or event resource within the collection.
-            qWarning() << "ignoring probable collection resource:" << uri.toString() << etag << status;
+            qWarning() << "ignoring probable collection resource:" << resource.href << resource.etag << resource.status;
             continue;
-        } else {
-            qWarning() << "DELETING:" << m_hostAddress << href << etag;
-            QNetworkReply *deletionRequest = generateUpsyncRequest(m_hostAddress, href, etag, QString(),
-                                                                   QStringLiteral("DELETE"), QString());
-            connect(deletionRequest, &QNetworkReply::finished, this, &CDavToolWorker::finishedDeletion);
-            m_replies.append(deletionRequest);
         }
+
+        PendingDeletion deletion;
+        deletion.href = resource.href;
+        deletion.etag = resource.etag;
+        deletion.attempts = 0;
+        m_pendingDeletions.enqueue(deletion);
     }
 
-    if (m_replies.isEmpty()) {
-        // collections are already empty.
-        qWarning() << "All collections are empty?";
-        emit done();
+    printf("Queued %d resources for deletion\n", m_pendingDeletions.size());
+    if (!m_deletionTimer.isValid()) {
+        m_deletionTimer.start();
+    }
+    sendPendingDeletions();
+    checkDeletionsComplete();
+}
+
+void CDavToolWorker::sendPendingDeletions()
+{
+    // keep a bounded number of deletions in flight, rather than sending them all at once.
+    while (m_activeDeletions < MaxConcurrentDeletions && !m_pendingDeletions.isEmpty()) {
+        PendingDeletion deletion = m_pendingDeletions.dequeue();
+        if (m_verbose) {
+            qWarning() << "DELETING:" << m_hostAddress << deletion.href << deletion.etag;
+        }
+        // the href is percent-decoded, QUrl::setPath() will encode it again.
+        QNetworkReply *deletionRequest = generateUpsyncRequest(m_hostAddress, deletion.href, deletion.etag, QString(),
+                                                               QStringLiteral("DELETE"), QString());
+        deletionRequest->setProperty("href", deletion.href);
+        deletionRequest->setProperty("etag", deletion.etag);
+        deletionRequest->setProperty("attempts", deletion.attempts + 1);
+        connect(deletionRequest, &QNetworkReply::finished, this, &CDavToolWorker::finishedDeletion);
+        m_activeDeletions += 1;
     }
 }
 
 void CDavToolWorker::finishedDeletion()
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (reply->error() != QNetworkReply::NoError) {
-        handleError(SignOn::Error(SignOn::Error::Unknown, QStringLiteral("Error occurred when deleting event/contact: %1: %2").arg(reply->error()).arg(reply->errorString())));
+    reply->deleteLater();
+    m_activeDeletions -= 1;
+
+    const int httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() == QNetworkReply::NoError || httpError == 404) {
+        // a 404 means that the resource has already been removed.
+        m_completedDeletions += 1;
+        if (m_completedDeletions % DeletionProgressInterval == 0) {
+            const qint64 elapsed = qMax<qint64>(m_deletionTimer.elapsed(), 1);
+            printf("Deleted %d resources, %d remaining (%.1f/s)\n",
+                   m_completedDeletions, m_pendingDeletions.size() + m_activeDeletions,
+                   m_completedDeletions * 1000.0 / elapsed);
+        }
+    } else {
+        PendingDeletion deletion;
+        deletion.href = reply->property("href").toString();
+        deletion.etag = reply->property("etag").toString();
+        deletion.attempts = reply->property("attempts").toInt();
+        if (httpError == 412) {
+            // the resource was modified since we listed it; delete it regardless.
+            deletion.etag.clear();
+        }
+        if (deletion.attempts < MaxDeletionAttempts) {
+            qWarning() << "retrying deletion of" << deletion.href << "after error:" << reply->error() << httpError << reply->errorString();
+            m_pendingDeletions.enqueue(deletion);
+        } else {
+            qWarning() << "failed to delete" << deletion.href << "after" << deletion.attempts << "attempts:" << reply->error() << httpError << reply->errorString();
+            m_failedDeletions += 1;
+        }
+    }
+
+    sendPendingDeletions();
+    checkDeletionsComplete();
+}
+
+void CDavToolWorker::checkDeletionsComplete()
+{
+    if (!m_replies.isEmpty() || !m_pendingDeletions.isEmpty() || m_activeDeletions > 0) {
+        // still fetching etags for some collections, or deleting resources.
         return;
     }
 
-    m_replies.removeOne(reply);
-    if (m_replies.isEmpty()) {
-        // this last deletion is complete!
-        emit done();
+    if (m_completedDeletions == 0 && m_failedDeletions == 0) {
+        // collections are already empty.
+        qWarning() << "All collections are empty?";
+    } else {
+        const qint64 elapsed = qMax<qint64>(m_deletionTimer.elapsed(), 1);
+        printf("Deleted %d resources in %.1f seconds (%.1f/s), %d failed\n",
+               m_completedDeletions, elapsed / 1000.0,
+               m_completedDeletions * 1000.0 / elapsed, m_failedDeletions);
     }
-}
 
+    if (m_failedDeletions > 0) {
+        m_errorOccurred = true;
+    }
+    emit done();
+}
 
 QNetworkReply *CDavToolWorker::generateRequest(const QString &url,
                                                const QString &path,
@@ -628,9 +860,11 @@ QNetworkReply *CDavToolWorker::generateUpsyncRequest(const QString &url,
         req.setRawHeader("If-Match", ifMatch.toUtf8());
     }
 
-    qWarning() << "generateUpsyncRequest():" << reqUrl << ":" << requestData.length() << "bytes";
-    Q_FOREACH (const QByteArray &headerName, req.rawHeaderList()) {
-        qWarning() << "   " << headerName << "=" << req.rawHeader(headerName);
+    if (m_verbose) {
+        qWarning() << "generateUpsyncRequest():" << reqUrl << ":" << requestData.length() << "bytes";
+        Q_FOREACH (const QByteArray &headerName, req.rawHeaderList()) {
+            qWarning() << "   " << headerName << "=" << req.rawHeader(headerName);
+        }
     }
 
     if (!request.isEmpty()) {
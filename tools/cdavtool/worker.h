@@ -34,14 +34,17 @@
 #define CDAVTOOL_WORKER_H
 
 #include "helpers.h"
+#include "serverprofiler.h"
 
 #include "syncer_p.h"
 #include "carddav_p.h"
 
 #include <QNetworkAccessManager>
+#include <QElapsedTimer>
 #include <QTimer>
 #include <QObject>
 #include <QString>
+#include <QQueue>
 
 // accounts&sso
 #include <Accounts/Manager>
@@ -75,7 +78,11 @@ public:
         CreateAccount = 0,
         DeleteAccount,
         ClearAllRemoteCalendars,
-        ClearAllRemoteAddressbooks
+        ClearAllRemoteAddressbooks,
+        EstimateSync,
+        InspectState,
+        ProfileServer,
+        ReadSyncMetrics
     };
 
     CDavToolWorker(QObject *parent = Q_NULLPTR);
@@ -90,6 +97,10 @@ public:
     void deleteAccount(int accountId);
     void clearRemoteCalendars(int accountId);
     void clearRemoteAddressbooks(int accountId);
+    void estimateSync(int accountId);
+    void inspectState(int accountId, bool compact);
+    void profileServer(int accountId, bool storeSettings);
+    void readSyncMetrics(int accountId);
 
     bool errorOccurred() const { return m_errorOccurred; }
 
@@ -122,10 +133,24 @@ private Q_SLOTS:
     void gotCollectionsList(const QStringList &paths);
     void gotEtags();
     void finishedDeletion();
+    void gotSyncEstimate(const SyncCostEstimate &estimate);
+    void syncEstimateFailed();
+    void serverProfiled();
+
+private:
+    struct PendingDeletion {
+        QString href;
+        QString etag;
+        int attempts;
+    };
+    void sendPendingDeletions();
+    void checkDeletionsComplete();
+    bool storeMultigetSettings(int pageSize, int concurrency);
 
 private:
     Syncer *m_carddavSyncer;
     CardDav *m_carddavDiscovery;
+    ServerProfiler *m_serverProfiler;
     CalDAVDiscovery *m_caldavDiscovery;
     QNetworkAccessManager *m_networkManager;
     Buteo::ProfileManager *m_profileManager;
@@ -145,7 +170,15 @@ private:
     OperationMode m_operationMode;
     bool m_errorOccurred;
     bool m_verbose;
+    bool m_storeSettings;
     QList<QNetworkReply *> m_replies;
+
+    // remote clear state
+    QQueue<PendingDeletion> m_pendingDeletions;
+    int m_activeDeletions;
+    int m_completedDeletions;
+    int m_failedDeletions;
+    QElapsedTimer m_deletionTimer;
 };
 
 #endif // CDAVTOOL_WORKER_H